@@ -1,4 +1,6 @@
+#include <pthread.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "aes.h"
 
@@ -33,34 +35,8 @@ void initialize_aes_sbox(uint8_t sbox[256], uint8_t invsbox[256]) {
 	invsbox[0x63] = 0;
 }
 
-void add_round_key(uint8_t text[16], uint8_t key[16]) {
-    for (int i = 0; i < 16; i++) {
-        text[i] = text[i] ^ key[i];
-    }
-}
-
-void shift_rows(uint8_t text[16]) {
-    for (int i = 1; i < 4; i++) {
-    	uint8_t temp = text[4 * i];
-    	for (int j = 0; j < 3; j++) {
-    	    text[4 * i + j] = text[4 * i + j + 1];
-    	}
-    	text[4 * i + 3] = temp;
-    }
-}
-
-void shift_rows_inv(uint8_t text[16]) {
-    for (int i = 1; i < 4; i++) {
-    	uint8_t temp = text[4 * i + 3];
-    	for (int j = 3; j > 0; j--) {
-    	    text[4 * i + j] = text[4 * i + j - 1];
-    	}
-    	text[4 * i] = temp;
-    }
-}
-
 /* Adapted from https://en.wikipedia.org/wiki/Rijndael_MixColumns */
-uint8_t g_mul(uint8_t a, uint8_t b) { // Galois Field (256) Multiplication of two Bytes
+static uint8_t g_mul(uint8_t a, uint8_t b) { // Galois Field (256) Multiplication of two Bytes
     uint8_t p = 0;
 
     for (int counter = 0; counter < 8; counter++) {
@@ -79,156 +55,249 @@ uint8_t g_mul(uint8_t a, uint8_t b) { // Galois Field (256) Multiplication of tw
     return p;
 }
 
-void gmix_column(uint8_t column[4]) {
-    uint8_t column_t[4];
 
-    for (int i = 0; i < 4; i++) {
-        column_t[i] = column[i];
-    }
 
-    column[0] = g_mul(0x02, column_t[0]) ^ g_mul(0x03, column_t[1]) ^ column_t[2] ^ column_t[3];
-    column[1] = column_t[0] ^ g_mul(0x02, column_t[1]) ^ g_mul(0x03, column_t[2]) ^ column_t[3];
-    column[2] = column_t[0] ^ column_t[1] ^ g_mul(0x02, column_t[2]) ^ g_mul(0x03, column_t[3]);
-    column[3] = g_mul(0x03, column_t[0]) ^ column_t[1] ^ column_t[2] ^ g_mul(0x02, column_t[3]);
+/* The T-tables: for every byte, the column that SubBytes followed by
+ * MixColumns (Te*) or InvSubBytes followed by InvMixColumns (Td*) produces
+ * from it, rotated for each of the four rows. With these, a whole round is 16
+ * table lookups and 16 XORs. The tables are filled in once by
+ * 'init_aes_tables()' */
+static uint32_t Te0[256], Te1[256], Te2[256], Te3[256];
+static uint32_t Td0[256], Td1[256], Td2[256], Td3[256];
+static uint8_t sbox[256], invsbox[256];
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define GETU32(b) (((uint32_t) (b)[0] << 24) | ((uint32_t) (b)[1] << 16) \
+	| ((uint32_t) (b)[2] << 8) | (uint32_t) (b)[3])
+#define PUTU32(b, v) do { \
+	(b)[0] = (uint8_t) ((v) >> 24); (b)[1] = (uint8_t) ((v) >> 16); \
+	(b)[2] = (uint8_t) ((v) >> 8); (b)[3] = (uint8_t) (v); \
+} while (0)
+
+
+static void init_aes_tables(void) {
+	/* {{{ */
+	initialize_aes_sbox(sbox, invsbox);
+
+	for (int i = 0; i < 256; i++) {
+		uint8_t s = sbox[i];
+		uint8_t si = invsbox[i];
+		uint32_t te = ((uint32_t) g_mul(0x02, s) << 24) | ((uint32_t) s << 16) \
+			| ((uint32_t) s << 8) | g_mul(0x03, s);
+		uint32_t td = ((uint32_t) g_mul(0x0e, si) << 24) \
+			| ((uint32_t) g_mul(0x09, si) << 16) \
+			| ((uint32_t) g_mul(0x0d, si) << 8) | g_mul(0x0b, si);
+
+		Te0[i] = te;
+		Te1[i] = ROTR32(te, 8);
+		Te2[i] = ROTR32(te, 16);
+		Te3[i] = ROTR32(te, 24);
+		Td0[i] = td;
+		Td1[i] = ROTR32(td, 8);
+		Td2[i] = ROTR32(td, 16);
+		Td3[i] = ROTR32(td, 24);
+	}
+	/* }}} */
 }
 
-void gmix_column_inv(uint8_t column[4]) {
-    uint8_t column_t[4];
 
-    for (int i = 0; i < 4; i++) {
-        column_t[i] = column[i];
-    }
-
-    column[0] = g_mul(0x0e, column_t[0]) ^ g_mul(0x0b, column_t[1]) ^ g_mul(0x0d, column_t[2]) ^ g_mul(0x09, column_t[3]);
-    column[1] = g_mul(0x09, column_t[0]) ^ g_mul(0x0e, column_t[1]) ^ g_mul(0x0b, column_t[2]) ^ g_mul(0x0d, column_t[3]);
-    column[2] = g_mul(0x0d, column_t[0]) ^ g_mul(0x09, column_t[1]) ^ g_mul(0x0e, column_t[2]) ^ g_mul(0x0b, column_t[3]);
-    column[3] = g_mul(0x0b, column_t[0]) ^ g_mul(0x0d, column_t[1]) ^ g_mul(0x09, column_t[2]) ^ g_mul(0x0e, column_t[3]);
+/** Applies the S-box to each byte of the word 'w' */
+static uint32_t sub_word(uint32_t w) {
+	return ((uint32_t) sbox[w >> 24] << 24) | ((uint32_t) sbox[(w >> 16) & 0xff] << 16) \
+		| ((uint32_t) sbox[(w >> 8) & 0xff] << 8) | sbox[w & 0xff];
 }
 
-void mix_columns(uint8_t text[16]) {
-    uint8_t column[4];
-
-    for (int i = 0; i < 4; i++) {
-        for (int j = 0; j < 4; j++) {
-            column[j] = text[4 * j + i];
-        }
-
-        gmix_column(column);
 
-        for (int j = 0; j < 4; j++) {
-            text[4 * j + i] = column[j];
-        }
-    }
+/** Takes an AES key of 'key_len' bytes and expands it into the encryption
+ * and decryption round keys of '*k'. The decryption round keys are those of
+ * the equivalent inverse cipher (FIPS-197 section 5.3.5), so that decryption
+ * rounds can use the same table driven structure as encryption rounds.
+ *
+ * \param '*k' the struct aes_key to be filled in.
+ * \param '*key' the key.
+ * \param 'key_len' the length of the key in bytes: 16, 24 or 32.
+ * \return 0 on success, -1 if 'key_len' is not a valid AES key length.
+ */
+int aes_set_key(struct aes_key *k, const uint8_t *key, size_t key_len) {
+	/* {{{ */
+	const uint8_t rc[10] = {0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1B, 0x36};
+	int nk = key_len / 4;
+
+	if (key_len != 16 && key_len != 24 && key_len != 32) {
+		return -1;
+	}
+	pthread_once(&tables_once, init_aes_tables);
+
+	k->rounds = nk + 6;
+	int num_words = 4 * (k->rounds + 1);
+
+	/* Encryption round keys (FIPS-197 section 5.2) */
+	for (int i = 0; i < nk; i++) {
+		k->ek[i] = GETU32(&key[4 * i]);
+	}
+	for (int i = nk; i < num_words; i++) {
+		uint32_t temp = k->ek[i - 1];
+		if (i % nk == 0) {
+			temp = sub_word((temp << 8) | (temp >> 24)) ^ ((uint32_t) rc[i / nk - 1] << 24);
+		} else if (nk > 6 && i % nk == 4) {
+			temp = sub_word(temp);
+		}
+		k->ek[i] = k->ek[i - nk] ^ temp;
+	}
+
+	/* Decryption round keys: the encryption round keys in reverse order,
+	 * with InvMixColumns applied to all but the first and last */
+	for (int r = 0; r <= k->rounds; r++) {
+		for (int j = 0; j < 4; j++) {
+			uint32_t w = k->ek[4 * (k->rounds - r) + j];
+			if (r != 0 && r != k->rounds) {
+				w = Td0[sbox[w >> 24]] ^ Td1[sbox[(w >> 16) & 0xff]] \
+					^ Td2[sbox[(w >> 8) & 0xff]] ^ Td3[sbox[w & 0xff]];
+			}
+			k->dk[4 * r + j] = w;
+		}
+	}
+
+	return 0;
+	/* }}} */
 }
 
-void mix_columns_inv(uint8_t text[16]) {
-    uint8_t column[4];
-
-    for (int i = 0; i < 4; i++) {
-        for (int j = 0; j < 4; j++) {
-            column[j] = text[4 * j + i];
-        }
-
-        gmix_column_inv(column);
-
-        for (int j = 0; j < 4; j++) {
-            text[4 * j + i] = column[j];
-        }
-    }
-}
 
-void rot_word(uint8_t key[4]) {
-    uint8_t temp = key[0];
-    for (int i = 0; i < 3; i++) {
-        key[i] = key[i + 1];
-    }
-    key[3] = temp;
+/* One full encryption round 'r', taking the state in 'i0'..'i3' to
+ * 'o0'..'o3' */
+#define ENC_ROUND(o, i, r) \
+	o##0 = Te0[i##0 >> 24] ^ Te1[(i##1 >> 16) & 0xff] \
+		^ Te2[(i##2 >> 8) & 0xff] ^ Te3[i##3 & 0xff] ^ rk[4 * (r)]; \
+	o##1 = Te0[i##1 >> 24] ^ Te1[(i##2 >> 16) & 0xff] \
+		^ Te2[(i##3 >> 8) & 0xff] ^ Te3[i##0 & 0xff] ^ rk[4 * (r) + 1]; \
+	o##2 = Te0[i##2 >> 24] ^ Te1[(i##3 >> 16) & 0xff] \
+		^ Te2[(i##0 >> 8) & 0xff] ^ Te3[i##1 & 0xff] ^ rk[4 * (r) + 2]; \
+	o##3 = Te0[i##3 >> 24] ^ Te1[(i##0 >> 16) & 0xff] \
+		^ Te2[(i##1 >> 8) & 0xff] ^ Te3[i##2 & 0xff] ^ rk[4 * (r) + 3];
+
+/* One full decryption round 'r', taking the state in 'i0'..'i3' to
+ * 'o0'..'o3' */
+#define DEC_ROUND(o, i, r) \
+	o##0 = Td0[i##0 >> 24] ^ Td1[(i##3 >> 16) & 0xff] \
+		^ Td2[(i##2 >> 8) & 0xff] ^ Td3[i##1 & 0xff] ^ rk[4 * (r)]; \
+	o##1 = Td0[i##1 >> 24] ^ Td1[(i##0 >> 16) & 0xff] \
+		^ Td2[(i##3 >> 8) & 0xff] ^ Td3[i##2 & 0xff] ^ rk[4 * (r) + 1]; \
+	o##2 = Td0[i##2 >> 24] ^ Td1[(i##1 >> 16) & 0xff] \
+		^ Td2[(i##0 >> 8) & 0xff] ^ Td3[i##3 & 0xff] ^ rk[4 * (r) + 2]; \
+	o##3 = Td0[i##3 >> 24] ^ Td1[(i##2 >> 16) & 0xff] \
+		^ Td2[(i##1 >> 8) & 0xff] ^ Td3[i##0 & 0xff] ^ rk[4 * (r) + 3];
+
+/* The final round has no (Inv)MixColumns, so it uses the S-boxes directly.
+ * 'a', 'b', 'c', 'd' are the words the four bytes of the output word come
+ * from, which differ between encryption and decryption */
+#define FINAL_WORD(box, a, b, c, d, r, j) \
+	(((uint32_t) box[(a) >> 24] << 24) ^ ((uint32_t) box[((b) >> 16) & 0xff] << 16) \
+		^ ((uint32_t) box[((c) >> 8) & 0xff] << 8) ^ (uint32_t) box[(d) & 0xff] \
+		^ rk[4 * (r) + (j)])
+
+/* Every variant does an odd number (9, 11 or 13) of full rounds, so the
+ * state always ends up in 't0'..'t3' */
+#define ENC_ROUNDS_10 \
+	ENC_ROUND(t, s, 1) ENC_ROUND(s, t, 2) ENC_ROUND(t, s, 3) \
+	ENC_ROUND(s, t, 4) ENC_ROUND(t, s, 5) ENC_ROUND(s, t, 6) \
+	ENC_ROUND(t, s, 7) ENC_ROUND(s, t, 8) ENC_ROUND(t, s, 9)
+#define ENC_ROUNDS_12 ENC_ROUNDS_10 ENC_ROUND(s, t, 10) ENC_ROUND(t, s, 11)
+#define ENC_ROUNDS_14 ENC_ROUNDS_12 ENC_ROUND(s, t, 12) ENC_ROUND(t, s, 13)
+#define DEC_ROUNDS_10 \
+	DEC_ROUND(t, s, 1) DEC_ROUND(s, t, 2) DEC_ROUND(t, s, 3) \
+	DEC_ROUND(s, t, 4) DEC_ROUND(t, s, 5) DEC_ROUND(s, t, 6) \
+	DEC_ROUND(t, s, 7) DEC_ROUND(s, t, 8) DEC_ROUND(t, s, 9)
+#define DEC_ROUNDS_12 DEC_ROUNDS_10 DEC_ROUND(s, t, 10) DEC_ROUND(t, s, 11)
+#define DEC_ROUNDS_14 DEC_ROUNDS_12 DEC_ROUND(s, t, 12) DEC_ROUND(t, s, 13)
+
+
+/* Defines 'aes<bits>_encrypt_blocks()' and 'aes<bits>_decrypt_blocks()',
+ * which encrypt/decrypt 'num_blocks' consecutive blocks from '*in' to '*out'
+ * ('in' may equal 'out') with a key of 'bits' bits. Every round is unrolled
+ * with its round key index known at compile time, and the round keys are
+ * copied into a local array before the loop so that the compiler knows that
+ * writing '*out' can not change them, and keeps as many of them in registers
+ * as it can instead of reloading them for every block. */
+#define AES_DEFINE_VARIANT(bits, nr) \
+void aes##bits##_encrypt_blocks(const struct aes_key *key, const uint8_t *in, \
+	uint8_t *out, size_t num_blocks) { \
+	uint32_t rk[4 * (nr + 1)]; \
+	memcpy(rk, key->ek, sizeof(rk)); \
+	for (size_t n = 0; n < num_blocks; n++, in += AES_BLOCK_LEN, out += AES_BLOCK_LEN) { \
+		uint32_t s0, s1, s2, s3, t0, t1, t2, t3; \
+		s0 = GETU32(&in[0]) ^ rk[0]; \
+		s1 = GETU32(&in[4]) ^ rk[1]; \
+		s2 = GETU32(&in[8]) ^ rk[2]; \
+		s3 = GETU32(&in[12]) ^ rk[3]; \
+		ENC_ROUNDS_##nr \
+		s0 = FINAL_WORD(sbox, t0, t1, t2, t3, nr, 0); \
+		s1 = FINAL_WORD(sbox, t1, t2, t3, t0, nr, 1); \
+		s2 = FINAL_WORD(sbox, t2, t3, t0, t1, nr, 2); \
+		s3 = FINAL_WORD(sbox, t3, t0, t1, t2, nr, 3); \
+		PUTU32(&out[0], s0); \
+		PUTU32(&out[4], s1); \
+		PUTU32(&out[8], s2); \
+		PUTU32(&out[12], s3); \
+	} \
+} \
+\
+void aes##bits##_decrypt_blocks(const struct aes_key *key, const uint8_t *in, \
+	uint8_t *out, size_t num_blocks) { \
+	uint32_t rk[4 * (nr + 1)]; \
+	memcpy(rk, key->dk, sizeof(rk)); \
+	for (size_t n = 0; n < num_blocks; n++, in += AES_BLOCK_LEN, out += AES_BLOCK_LEN) { \
+		uint32_t s0, s1, s2, s3, t0, t1, t2, t3; \
+		s0 = GETU32(&in[0]) ^ rk[0]; \
+		s1 = GETU32(&in[4]) ^ rk[1]; \
+		s2 = GETU32(&in[8]) ^ rk[2]; \
+		s3 = GETU32(&in[12]) ^ rk[3]; \
+		DEC_ROUNDS_##nr \
+		s0 = FINAL_WORD(invsbox, t0, t3, t2, t1, nr, 0); \
+		s1 = FINAL_WORD(invsbox, t1, t0, t3, t2, nr, 1); \
+		s2 = FINAL_WORD(invsbox, t2, t1, t0, t3, nr, 2); \
+		s3 = FINAL_WORD(invsbox, t3, t2, t1, t0, nr, 3); \
+		PUTU32(&out[0], s0); \
+		PUTU32(&out[4], s1); \
+		PUTU32(&out[8], s2); \
+		PUTU32(&out[12], s3); \
+	} \
 }
 
-void split_word(uint8_t *to, uint32_t from) {
-    for (int i = 0; i < 4; i++) {
-        *(to + i) = (from >> (8 * i)) & 0xff;
-    }
+AES_DEFINE_VARIANT(128, 10)
+AES_DEFINE_VARIANT(192, 12)
+AES_DEFINE_VARIANT(256, 14)
+
+
+/** Encrypts 'num_blocks' consecutive blocks from '*in' to '*out' ('in' may
+ * equal 'out'), using the variant matching the length of the key.
+ *
+ * \param '*key' the expanded key, set up by 'aes_set_key()'.
+ * \param '*in' the blocks to encrypt.
+ * \param '*out' will be modified to contain the encrypted blocks.
+ * \param 'num_blocks' the number of 16 byte blocks at '*in'.
+ * \return void.
+ */
+void aes_encrypt_blocks(const struct aes_key *key, const uint8_t *in, \
+	uint8_t *out, size_t num_blocks) {
+
+	switch (key->rounds) {
+	case 10: aes128_encrypt_blocks(key, in, out, num_blocks); break;
+	case 12: aes192_encrypt_blocks(key, in, out, num_blocks); break;
+	case 14: aes256_encrypt_blocks(key, in, out, num_blocks); break;
+	}
 }
 
-void sub_text(uint8_t text[16], uint8_t sbox[256]) {
-    for (int j = 0; j < 16; j++) {
-        text[j] = sbox[text[j]];
-    }
-}
-
-void expkey(uint8_t rkeys[11][16], uint32_t key[4], uint8_t sbox[256]) {
-    uint8_t rc[10] = {0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1B, 0x36};
-    uint8_t rkeys_t[11 * 16];
-    uint8_t temp[4];
-
-    for (int i = 0; i < 4; i++) {
-        split_word(&(rkeys_t[4 * i]), key[i]);
-    }
-
-    for (int i = 4; i < 44; i++) {
-        int prev = 4 * (i - 1);
-        int prev_n = 4 * (i - 4);
-
-        if (i % 4 == 0) {
-            for (int j = 0; j < 4; j++) {
-                temp[j] = rkeys_t[prev + j];
-            }
-
-            rot_word(temp);
-
-            for (int j = 0; j < 4; j++) {
-                rkeys_t[4 * i + j] = rkeys_t[prev_n + j] ^ sbox[temp[j]] ^ rc[(i / 4) - 1];
-            }
-        } else {
-            for (int j = 0; j < 4; j++) {
-                rkeys_t[4 * i + j] = rkeys_t[prev_n + j] ^ rkeys_t[prev + j];
-            }
-        }
-    }
-
-    for (int i = 0; i < 11; i++) {
-        for (int j = 0; j < 16; j++) {
-            rkeys[i][j] = rkeys_t[16 * i + j];
-        }
-    }
-}
-
-void encrypt(uint8_t text[16], uint8_t rkeys[11][16], uint8_t sbox[256]) {
-    int rounds = 10;
-
-    add_round_key(text, rkeys[0]);
-
-    for (int i = 0; i < rounds - 1; i++) {
-        sub_text(text, sbox);
-        shift_rows(text);
-        mix_columns(text);
-        add_round_key(text, rkeys[i + 1]);
-    }
-
-    sub_text(text, sbox);
-
-    shift_rows(text);
-    add_round_key(text, rkeys[10]);
-}
-
-void decrypt(uint8_t text[16], uint8_t rkeys[11][16], uint8_t invsbox[256]) {
-    int rounds = 10;
-
-    add_round_key(text, rkeys[10]);
-
-    for (int i = 0; i < rounds - 1; i++) {
-        shift_rows_inv(text);
-
-        sub_text(text, invsbox);
-
-        add_round_key(text, rkeys[10 - i - 1]);
-        mix_columns_inv(text);
-    }
-
-    shift_rows_inv(text);
 
-    sub_text(text, invsbox);
+/** Decrypts 'num_blocks' consecutive blocks from '*in' to '*out' ('in' may
+ * equal 'out'), using the variant matching the length of the key. See
+ * 'aes_encrypt_blocks()' for the meaning of the parameters. */
+void aes_decrypt_blocks(const struct aes_key *key, const uint8_t *in, \
+	uint8_t *out, size_t num_blocks) {
 
-    add_round_key(text, rkeys[0]);
+	switch (key->rounds) {
+	case 10: aes128_decrypt_blocks(key, in, out, num_blocks); break;
+	case 12: aes192_decrypt_blocks(key, in, out, num_blocks); break;
+	case 14: aes256_decrypt_blocks(key, in, out, num_blocks); break;
+	}
 }
@@ -1,22 +1,44 @@
 #ifndef AES_HEADER
 #define AES_HEADER
+#include <stddef.h>
+#include <stdint.h>
+
+/* The number of bytes in an AES block */
+#define AES_BLOCK_LEN 16
+/* The number of rounds used by AES-256, the most of any key length */
+#define AES_MAX_ROUNDS 14
+
+
+/* Define a struct holding the expanded round keys of an AES key */
+struct aes_key {
+	/* The round keys used for encryption, as big-endian words */
+	uint32_t ek[4 * (AES_MAX_ROUNDS + 1)];
+	/* The round keys used for decryption, in the order the (equivalent)
+	 * inverse cipher uses them */
+	uint32_t dk[4 * (AES_MAX_ROUNDS + 1)];
+	/* 10, 12 or 14 for 128, 192 and 256-bit keys respectively */
+	int rounds;
+};
+
 
 void initialize_aes_sbox(uint8_t[256], uint8_t[256]);
 
-void shift_rows(uint8_t[16]);
+int aes_set_key(struct aes_key *, const uint8_t *, size_t);
+
+void aes128_encrypt_blocks(const struct aes_key *, const uint8_t *, uint8_t *, size_t);
 
-void shift_rows_inv(uint8_t[16]);
+void aes192_encrypt_blocks(const struct aes_key *, const uint8_t *, uint8_t *, size_t);
 
-void mix_columns(uint8_t[16]);
+void aes256_encrypt_blocks(const struct aes_key *, const uint8_t *, uint8_t *, size_t);
 
-void mix_columns_inv(uint8_t[16]);
+void aes128_decrypt_blocks(const struct aes_key *, const uint8_t *, uint8_t *, size_t);
 
-void sub_text(uint8_t[16], uint8_t[256]);
+void aes192_decrypt_blocks(const struct aes_key *, const uint8_t *, uint8_t *, size_t);
 
-void expkey(uint8_t[11][16], uint32_t[4], uint8_t[256]);
+void aes256_decrypt_blocks(const struct aes_key *, const uint8_t *, uint8_t *, size_t);
 
-void encrypt(uint8_t[16], uint8_t[11][16], uint8_t[256]);
+void aes_encrypt_blocks(const struct aes_key *, const uint8_t *, uint8_t *, size_t);
 
-void decrypt(uint8_t[16], uint8_t[11][16], uint8_t[256]);
+void aes_decrypt_blocks(const struct aes_key *, const uint8_t *, uint8_t *, size_t);
 
 #endif
@@ -0,0 +1,83 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../aes.h"
+
+
+/* The number of bytes encrypted/decrypted per measurement. Small enough to
+ * stay in cache, so that the cipher rather than memory is measured */
+#define BENCH_BUF_LEN 65536
+/* How many times each measurement is repeated. The fastest run is kept */
+#define BENCH_RUNS 5
+/* The number of bytes processed per run */
+#define BENCH_BYTES_PER_RUN (256 * 1024 * 1024)
+
+
+/* Benchmarks the throughput of the 128, 192 and 256-bit AES variants, each
+ * encrypting and decrypting the same in-cache buffer over and over. The cost
+ * of a block should only grow with the number of rounds, so besides the
+ * throughput of each variant, its cost relative to AES-128 is printed next
+ * to the ratio of the rounds (12/10 and 14/10).
+ *
+ * Usage: ./aesbench */
+
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/** Returns the best throughput (in MB/s) of 'BENCH_RUNS' runs of 'fn' over
+ * 'buf' with the key 'key' */
+static double bench(void (*fn)(const struct aes_key *, const uint8_t *, uint8_t *, size_t), \
+	struct aes_key *key, uint8_t *buf) {
+
+	double best = 0;
+
+	for (int run = 0; run < BENCH_RUNS; run++) {
+		double start = now();
+		for (long done = 0; done < BENCH_BYTES_PER_RUN; done += BENCH_BUF_LEN) {
+			fn(key, buf, buf, BENCH_BUF_LEN / AES_BLOCK_LEN);
+		}
+		double mbps = BENCH_BYTES_PER_RUN / (now() - start) / 1e6;
+		if (mbps > best) best = mbps;
+	}
+
+	return best;
+}
+
+
+int main() {
+	static uint8_t buf[BENCH_BUF_LEN];
+	uint8_t key_bytes[32];
+	struct aes_key key;
+	double enc_base = 0, dec_base = 0;
+
+	for (int i = 0; i < BENCH_BUF_LEN; i++) buf[i] = i;
+	for (int i = 0; i < 32; i++) key_bytes[i] = 3 * i + 1;
+
+	printf("%-8s %7s %12s %12s %10s %10s\n", "variant", "rounds", \
+		"enc (MB/s)", "dec (MB/s)", "enc cost", "dec cost");
+
+	for (int bits = 128; bits <= 256; bits += 64) {
+		aes_set_key(&key, key_bytes, bits / 8);
+		double enc = bench(aes_encrypt_blocks, &key, buf);
+		double dec = bench(aes_decrypt_blocks, &key, buf);
+		if (bits == 128) {
+			enc_base = enc;
+			dec_base = dec;
+		}
+		/* The cost relative to AES-128, and what the extra rounds alone
+		 * would cost */
+		printf("AES-%-4d %7d %12.1f %12.1f %5.2f/%.2f %5.2f/%.2f\n", bits, \
+			key.rounds, enc, dec, enc_base / enc, key.rounds / 10.0, \
+			dec_base / dec, key.rounds / 10.0);
+	}
+
+	return 0;
+}
@@ -0,0 +1,183 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "delayline.h"
+
+
+/* A chunk of bytes held by the delay line until 'due' */
+struct packet {
+	struct packet *next;
+	struct timespec due;
+	size_t len;
+	char data[];
+};
+
+/* One direction of the delay line: a reader thread queues what it reads
+ * from 'in_fd' and a writer thread writes it to 'out_fd' once it is due, so
+ * chunks that arrive while an earlier one is held are delayed by the same
+ * amount rather than queueing behind it */
+struct delay_dir {
+	int in_fd;
+	int out_fd;
+	long delay_ns;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct packet *head;
+	struct packet *tail;
+	int closed;
+};
+
+
+/** Returns the time on the monotonic clock, in seconds */
+double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/** Creates a socket listening on an ephemeral loopback port, storing its
+ * address in '*addr' */
+int listen_loopback(struct sockaddr_in *addr) {
+	socklen_t addr_len = sizeof(*addr);
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sin_family = AF_INET;
+	addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr->sin_port = 0;
+	if (fd < 0 || bind(fd, (struct sockaddr *) addr, sizeof(*addr)) != 0 \
+		|| listen(fd, 4) != 0 \
+		|| getsockname(fd, (struct sockaddr *) addr, &addr_len) != 0) {
+
+		fprintf(stderr, "ERROR: could not listen on the loopback interface\n");
+		return -1;
+	}
+
+	return fd;
+}
+
+
+static void *delay_reader(void *arg) {
+	struct delay_dir *dir = (struct delay_dir *) arg;
+	char *buf = malloc(DELAY_CHUNK_LEN);
+	ssize_t n;
+
+	while ((n = read(dir->in_fd, buf, DELAY_CHUNK_LEN)) > 0) {
+		struct packet *p = malloc(sizeof(struct packet) + n);
+		clock_gettime(CLOCK_MONOTONIC, &p->due);
+		p->due.tv_nsec += dir->delay_ns;
+		p->due.tv_sec += p->due.tv_nsec / 1000000000;
+		p->due.tv_nsec %= 1000000000;
+		p->len = n;
+		p->next = NULL;
+		memcpy(p->data, buf, n);
+
+		pthread_mutex_lock(&dir->lock);
+		if (dir->tail != NULL) dir->tail->next = p;
+		else dir->head = p;
+		dir->tail = p;
+		pthread_cond_signal(&dir->cond);
+		pthread_mutex_unlock(&dir->lock);
+	}
+	free(buf);
+
+	pthread_mutex_lock(&dir->lock);
+	dir->closed = 1;
+	pthread_cond_signal(&dir->cond);
+	pthread_mutex_unlock(&dir->lock);
+
+	return NULL;
+}
+
+
+static void *delay_writer(void *arg) {
+	struct delay_dir *dir = (struct delay_dir *) arg;
+
+	while (1) {
+		pthread_mutex_lock(&dir->lock);
+		while (dir->head == NULL && !dir->closed) {
+			pthread_cond_wait(&dir->cond, &dir->lock);
+		}
+		struct packet *p = dir->head;
+		if (p == NULL) {
+			pthread_mutex_unlock(&dir->lock);
+			break;
+		}
+		dir->head = p->next;
+		if (dir->head == NULL) dir->tail = NULL;
+		pthread_mutex_unlock(&dir->lock);
+
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &p->due, NULL);
+		for (size_t sent = 0; sent < p->len; ) {
+			ssize_t w = write(dir->out_fd, &p->data[sent], p->len - sent);
+			if (w <= 0) break;
+			sent += w;
+		}
+		free(p);
+	}
+
+	/* Pass the end of the stream on */
+	shutdown(dir->out_fd, SHUT_WR);
+
+	return NULL;
+}
+
+
+/** Accepts one connection, connects to the server and forwards everything
+ * between the two through a delay line in each direction until both
+ * directions are closed */
+void *proxy_one(void *arg) {
+	/* {{{ */
+	struct proxy_args *pargs = (struct proxy_args *) arg;
+	struct delay_dir dirs[2];
+	pthread_t threads[4];
+
+	int clientfd = accept(pargs->listenfd, NULL, NULL);
+	int serverfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (clientfd < 0 || serverfd < 0 || connect(serverfd, \
+		(struct sockaddr *) &pargs->server_addr, sizeof(pargs->server_addr)) != 0) {
+
+		fprintf(stderr, "ERROR: proxy could not connect to the server\n");
+		exit(1);
+	}
+	/* The proxy stands for a network path, which forwards what it is given
+	 * at once rather than holding it back for an acknowledgement */
+	int one = 1;
+	setsockopt(clientfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	setsockopt(serverfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	for (int i = 0; i < 2; i++) {
+		dirs[i].in_fd = (i == 0) ? clientfd : serverfd;
+		dirs[i].out_fd = (i == 0) ? serverfd : clientfd;
+		dirs[i].delay_ns = pargs->delay_ns;
+		pthread_mutex_init(&dirs[i].lock, NULL);
+		pthread_cond_init(&dirs[i].cond, NULL);
+		dirs[i].head = NULL;
+		dirs[i].tail = NULL;
+		dirs[i].closed = 0;
+		pthread_create(&threads[2 * i], NULL, delay_reader, &dirs[i]);
+		pthread_create(&threads[2 * i + 1], NULL, delay_writer, &dirs[i]);
+	}
+	for (int t = 0; t < 4; t++) {
+		pthread_join(threads[t], NULL);
+	}
+	for (int i = 0; i < 2; i++) {
+		pthread_mutex_destroy(&dirs[i].lock);
+		pthread_cond_destroy(&dirs[i].cond);
+	}
+
+	close(clientfd);
+	close(serverfd);
+
+	return NULL;
+	/* }}} */
+}
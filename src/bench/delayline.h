@@ -0,0 +1,26 @@
+#ifndef DELAYLINE_HEADER
+#define DELAYLINE_HEADER
+#include <netinet/in.h>
+
+/* A proxy for the benchmarks that stands for a slow network path: it holds
+ * every byte it forwards for a fixed delay, in each direction */
+
+/* The largest number of bytes forwarded at once by the delay line */
+#define DELAY_CHUNK_LEN 65536
+
+
+/* The listening socket and delay the proxy works with */
+struct proxy_args {
+	int listenfd;
+	struct sockaddr_in server_addr;
+	long delay_ns;
+};
+
+
+double now();
+
+int listen_loopback(struct sockaddr_in *addr);
+
+void *proxy_one(void *arg);
+
+#endif
@@ -0,0 +1,113 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../bignum.h"
+#include "../x25519.h"
+
+
+/* How long each group is measured for, in seconds */
+#define BENCH_SECONDS 2.0
+/* The number of bytes in a MODP private exponent, as used by the key
+ * exchange */
+#define BENCH_EXP_LEN 32
+
+
+/* Benchmarks the CPU cost of one end of a session key exchange in each of
+ * the groups the key exchange supports: generating a key pair and then
+ * computing the shared secret from the peer's public value. The result is
+ * given as handshakes per second on one core, which is how many new sessions
+ * a server can start per second for each core it has, along with the time
+ * each of the two steps takes.
+ *
+ * Usage: ./dhbench */
+
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static void random_bytes(uint8_t *buf, size_t len) {
+	for (size_t i = 0; i < len; i++) {
+		buf[i] = rand() & 0xff;
+	}
+}
+
+
+/** Runs one end of X25519 handshakes for 'BENCH_SECONDS' and stores the time
+ * spent per key pair and per shared secret in '*keypair' and '*shared' */
+static void bench_x25519(double *keypair, double *shared) {
+	uint8_t priv[X25519_KEY_LEN], pub[X25519_KEY_LEN];
+	uint8_t peer_priv[X25519_KEY_LEN], peer[X25519_KEY_LEN], secret[X25519_KEY_LEN];
+	double t_keypair = 0, t_shared = 0;
+	long runs = 0;
+
+	random_bytes(peer_priv, sizeof(peer_priv));
+	x25519_public_key(peer, peer_priv);
+
+	while (t_keypair + t_shared < BENCH_SECONDS) {
+		random_bytes(priv, sizeof(priv));
+		double start = now();
+		x25519_public_key(pub, priv);
+		double mid = now();
+		x25519(secret, priv, peer);
+		double end = now();
+		t_keypair += mid - start;
+		t_shared += end - mid;
+		runs++;
+	}
+
+	*keypair = t_keypair / runs;
+	*shared = t_shared / runs;
+}
+
+
+/** Like 'bench_x25519()', for the 2048-bit MODP group */
+static void bench_modp2048(double *keypair, double *shared) {
+	const struct bn_mont *mont = bn_modp2048();
+	const uint8_t generator = BN_MODP2048_GENERATOR;
+	uint8_t priv[BENCH_EXP_LEN], peer_priv[BENCH_EXP_LEN];
+	uint8_t pub[BN_MODP2048_LEN], peer[BN_MODP2048_LEN], secret[BN_MODP2048_LEN];
+	double t_keypair = 0, t_shared = 0;
+	long runs = 0;
+
+	random_bytes(peer_priv, sizeof(peer_priv));
+	bn_modexp(mont, peer, &generator, 1, peer_priv, sizeof(peer_priv));
+
+	while (t_keypair + t_shared < BENCH_SECONDS) {
+		random_bytes(priv, sizeof(priv));
+		double start = now();
+		bn_modexp(mont, pub, &generator, 1, priv, sizeof(priv));
+		double mid = now();
+		bn_modexp(mont, secret, peer, sizeof(peer), priv, sizeof(priv));
+		double end = now();
+		t_keypair += mid - start;
+		t_shared += end - mid;
+		runs++;
+	}
+
+	*keypair = t_keypair / runs;
+	*shared = t_shared / runs;
+}
+
+
+int main() {
+	double keypair, shared;
+
+	printf("%-10s %14s %14s %20s\n", "group", "keypair us", "shared us", "handshakes/s/core");
+
+	bench_x25519(&keypair, &shared);
+	printf("%-10s %14.1f %14.1f %20.0f\n", "x25519", keypair * 1e6, shared * 1e6, \
+		1 / (keypair + shared));
+
+	bench_modp2048(&keypair, &shared);
+	printf("%-10s %14.1f %14.1f %20.0f\n", "modp2048", keypair * 1e6, shared * 1e6, \
+		1 / (keypair + shared));
+
+	return 0;
+}
@@ -0,0 +1,191 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../ecftp.h"
+#include "../fileops.h"
+#include "delayline.h"
+
+
+/* The one-way delay added by default, in milliseconds: 40 ms each way is the
+ * 80 ms round trip of a transatlantic link */
+#define BENCH_DEFAULT_DELAY_MS 40
+/* The number of handshakes of each kind timed by default */
+#define BENCH_DEFAULT_ROUNDS 5
+
+
+/* Benchmarks the latency of the session key exchange over a loopback
+ * connection that goes through a proxy which holds every byte it forwards
+ * for a fixed delay, in each direction. Both the key exchange done by
+ * 'do_dh_client()'/'do_dh_server()', in each of its groups, and a stand-in
+ * for the previous one, which exchanged 'ENC_KEY_WORDS' 8-byte values one
+ * after the other, are timed from the moment the client's connection is up
+ * until the client has its key. The latency is also given in round trips,
+ * to show how many flights each exchange waits for. The keys computed by the
+ * two ends of a Diffie-Hellman exchange are compared, so the benchmark
+ * doubles as a check of the exchange.
+ *
+ * Usage: ./kexbench [one-way delay in ms] [handshakes] */
+
+
+/* What the server thread does for a handshake */
+struct server_args {
+	int listenfd;
+	int dh;
+	uint32_t key[ENC_KEY_WORDS];
+	int return_val;
+};
+
+
+/** The stand-in for the previous key exchange on the client's side:
+ * 'ENC_KEY_WORDS' 8-byte values, each sent only once the reply to the last
+ * one has arrived */
+static int sequential_client(int fd) {
+	uint64_t mine = 0, theirs;
+
+	for (int i = 0; i < ENC_KEY_WORDS; i++) {
+		if (write(fd, &mine, sizeof(mine)) != sizeof(mine)) return -1;
+		if (0 != read_bytes_fd(fd, &theirs, sizeof(theirs))) return -2;
+	}
+
+	return 0;
+}
+
+
+/** The server's side of 'sequential_client()' */
+static int sequential_server(int fd) {
+	uint64_t mine = 0, theirs;
+
+	for (int i = 0; i < ENC_KEY_WORDS; i++) {
+		if (0 != read_bytes_fd(fd, &theirs, sizeof(theirs))) return -1;
+		if (write(fd, &mine, sizeof(mine)) != sizeof(mine)) return -2;
+	}
+
+	return 0;
+}
+
+
+/** Accepts one connection and performs the server's side of a handshake */
+static void *server_one(void *arg) {
+	struct server_args *sargs = (struct server_args *) arg;
+	int fd = accept(sargs->listenfd, NULL, NULL);
+
+	if (fd < 0) {
+		sargs->return_val = -1;
+		return NULL;
+	}
+	if (sargs->dh) {
+		sargs->return_val = do_dh_server(fd, sargs->key);
+	} else {
+		sargs->return_val = sequential_server(fd);
+	}
+	close(fd);
+
+	return NULL;
+}
+
+
+/** Times 'rounds' handshakes through the proxy, of the Diffie-Hellman
+ * exchange in the group 'group' or, if 'group' is 0, of the sequential
+ * stand-in. Returns their mean latency in seconds, or a negative number if a
+ * handshake failed */
+static double bench(uint8_t group, int rounds, struct proxy_args *pargs, \
+	struct sockaddr_in *proxy_addr, int server_listenfd) {
+
+	/* {{{ */
+	double total = 0;
+
+	for (int r = 0; r < rounds; r++) {
+		struct server_args sargs;
+		uint32_t key[ENC_KEY_WORDS];
+		pthread_t proxy_thread, server_thread;
+		int ret;
+
+		sargs.listenfd = server_listenfd;
+		sargs.dh = (group != 0);
+		pthread_create(&server_thread, NULL, server_one, &sargs);
+		pthread_create(&proxy_thread, NULL, proxy_one, pargs);
+
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd < 0 || connect(fd, (struct sockaddr *) proxy_addr, sizeof(*proxy_addr)) != 0) {
+			fprintf(stderr, "ERROR: could not connect to the proxy\n");
+			return -1;
+		}
+
+		double start = now();
+		if (group != 0) {
+			set_kex_group(group);
+			ret = do_dh_client(fd, key);
+		} else {
+			ret = sequential_client(fd);
+		}
+		total += now() - start;
+
+		close(fd);
+		pthread_join(server_thread, NULL);
+		pthread_join(proxy_thread, NULL);
+
+		if (ret != 0 || sargs.return_val != 0) {
+			fprintf(stderr, "ERROR: handshake failed (client %d, server %d)\n", \
+				ret, sargs.return_val);
+			return -1;
+		}
+		if (group != 0 && memcmp(key, sargs.key, sizeof(key)) != 0) {
+			fprintf(stderr, "ERROR: client and server derived different keys\n");
+			return -1;
+		}
+	}
+
+	return total / rounds;
+	/* }}} */
+}
+
+
+int main(int argc, char **argv) {
+	int delay_ms = BENCH_DEFAULT_DELAY_MS;
+	int rounds = BENCH_DEFAULT_ROUNDS;
+	struct proxy_args pargs;
+	struct sockaddr_in proxy_addr;
+
+	if (argc > 1) delay_ms = atoi(argv[1]);
+	if (argc > 2) rounds = atoi(argv[2]);
+	if (delay_ms < 0 || delay_ms > 10000 || rounds < 1) {
+		fprintf(stderr, "Usage: %s [one-way delay in ms] [handshakes]\n", argv[0]);
+		return 1;
+	}
+
+	int server_listenfd = listen_loopback(&pargs.server_addr);
+	pargs.listenfd = listen_loopback(&proxy_addr);
+	pargs.delay_ns = delay_ms * 1000000L;
+	if (server_listenfd < 0 || pargs.listenfd < 0) return 1;
+
+	printf("one-way delay %d ms (%d ms round trip), %d handshakes each\n", \
+		delay_ms, 2 * delay_ms, rounds);
+	printf("%-28s %12s %12s\n", "exchange", "mean ms", "round trips");
+
+	const uint8_t groups[] = { 0, KEX_X25519, KEX_MODP2048 };
+	for (int g = 0; g < (int) sizeof(groups); g++) {
+		double mean = bench(groups[g], rounds, &pargs, &proxy_addr, server_listenfd);
+		if (mean < 0) return 1;
+
+		char name[64];
+		if (groups[g] == KEX_X25519) snprintf(name, sizeof(name), "x25519");
+		else if (groups[g] == KEX_MODP2048) snprintf(name, sizeof(name), "modp2048");
+		else snprintf(name, sizeof(name), "sequential (%d exchanges)", ENC_KEY_WORDS);
+
+		printf("%-28s %12.2f", name, mean * 1000);
+		if (delay_ms > 0) printf(" %12.2f\n", mean * 1000 / (2 * delay_ms));
+		else printf(" %12s\n", "-");
+	}
+
+	close(server_listenfd);
+	close(pargs.listenfd);
+
+	return 0;
+}
@@ -0,0 +1,260 @@
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "delayline.h"
+
+
+/* The number of files fetched by default */
+#define BENCH_DEFAULT_FILES 10000
+/* The one-way delay added by default, in milliseconds. Every round trip a
+ * file waits for is paid once per file, so even a LAN's worth of delay
+ * dominates the time taken */
+#define BENCH_DEFAULT_DELAY_MS 1
+/* The length of each file by default */
+#define BENCH_DEFAULT_SIZE 512
+
+
+/* Benchmarks fetching many small files, one after the other as a user (or a
+ * script) of the client would, over a control connection that goes through a
+ * proxy which holds every byte it forwards for a fixed delay, in each
+ * direction. The real server and client are run, the client multiplexing its
+ * data over the control connection so that every byte goes through the
+ * proxy, once with small files sent inline after the reply to their command
+ * and once with every file sent over a data connection ('-I'). The time each
+ * session takes beyond one that fetches nothing is divided among the files,
+ * and every fetched file is compared with the original.
+ *
+ * The server and client are looked for next to this program's directory, as
+ * `make` lays them out.
+ *
+ * Usage: ./smallbench [files] [one-way delay in ms] [file length] */
+
+
+/** Forks and runs 'argv' in the directory 'dir', with its standard input
+ * read from the file 'in' (or /dev/null if NULL) and its output thrown
+ * away. Returns the child's pid, or -1 upon failure */
+static pid_t spawn(char *const argv[], const char *dir, const char *in) {
+	pid_t pid = fork();
+
+	if (pid != 0) {
+		return pid;
+	}
+	int infd = open(in != NULL ? in : "/dev/null", O_RDONLY);
+	int nullfd = open("/dev/null", O_WRONLY);
+	if (infd < 0 || nullfd < 0 || chdir(dir) != 0) {
+		_exit(127);
+	}
+	dup2(infd, 0);
+	dup2(nullfd, 1);
+	dup2(nullfd, 2);
+	execv(argv[0], argv);
+	_exit(127);
+}
+
+
+/** Writes the 'i'th test file, of 'size' bytes, to 'path' if 'write' is set,
+ * or compares it with the one at 'path' if not. Returns 0 if it was written
+ * or matched, a negative int if not */
+static int test_file(const char *path, int i, size_t size, int write) {
+	/* {{{ */
+	char *want = malloc(size), *have = malloc(size + 1);
+	FILE *f;
+	int ret = 0;
+
+	/* Lines of text, as a small file often is, that differ between files */
+	for (size_t j = 0; j < size; j++) {
+		want[j] = (j % 64 == 63) ? '\n' : 'a' + (i * 7 + j / 64 + j) % 26;
+	}
+	if (!(f = fopen(path, write ? "wb" : "rb"))) {
+		ret = -1;
+	} else if (write) {
+		if (fwrite(want, 1, size, f) != size) ret = -2;
+		if (fclose(f) != 0) ret = -3;
+	} else {
+		if (fread(have, 1, size + 1, f) != size || memcmp(want, have, size) != 0) ret = -4;
+		fclose(f);
+	}
+
+	free(want);
+	free(have);
+
+	return ret;
+	/* }}} */
+}
+
+
+/** Runs one session of the client through the proxy, fetching the first
+ * 'files' test files from the server at 'port', and returns how long it took
+ * in seconds, or a negative number upon failure */
+static double run_session(const char *client, int port, int use_inline, int files, \
+	struct proxy_args *pargs, struct sockaddr_in *proxy_addr, const char *cli_dir) {
+
+	/* {{{ */
+	char cmds[PATH_MAX], port_str[16];
+	pthread_t proxy_thread;
+	int status;
+	FILE *f;
+
+	snprintf(cmds, sizeof(cmds), "%s/commands", cli_dir);
+	if (!(f = fopen(cmds, "w"))) {
+		return -1;
+	}
+	for (int i = 0; i < files; i++) {
+		fprintf(f, "get f%05d.txt\n", i);
+	}
+	fprintf(f, "quit\n");
+	fclose(f);
+
+	snprintf(port_str, sizeof(port_str), "%d", ntohs(proxy_addr->sin_port));
+	pargs->server_addr.sin_port = htons(port);
+	char *argv[] = { (char *) client, "-M", "-I", "127.0.0.1", port_str, NULL };
+	/* '-I' is left out for the inline session */
+	if (use_inline) {
+		argv[2] = argv[3];
+		argv[3] = argv[4];
+		argv[4] = NULL;
+	}
+
+	pthread_create(&proxy_thread, NULL, proxy_one, pargs);
+	double start = now();
+	pid_t pid = spawn(argv, cli_dir, cmds);
+	if (pid < 0 || waitpid(pid, &status, 0) != pid) {
+		return -1;
+	}
+	double elapsed = now() - start;
+	pthread_join(proxy_thread, NULL);
+	unlink(cmds);
+
+	return elapsed;
+	/* }}} */
+}
+
+
+int main(int argc, char **argv) {
+	/* {{{ */
+	int files = BENCH_DEFAULT_FILES;
+	int delay_ms = BENCH_DEFAULT_DELAY_MS;
+	long size = BENCH_DEFAULT_SIZE;
+	char self[PATH_MAX], server[PATH_MAX], client[PATH_MAX];
+	char srv_dir[] = "/tmp/smallbench-srv-XXXXXX", cli_dir[] = "/tmp/smallbench-cli-XXXXXX";
+	char path[PATH_MAX], port_str[16];
+	struct proxy_args pargs;
+	struct sockaddr_in proxy_addr, server_addr;
+
+	if (argc > 1) files = atoi(argv[1]);
+	if (argc > 2) delay_ms = atoi(argv[2]);
+	if (argc > 3) size = atol(argv[3]);
+	if (files < 1 || files > 99999 || delay_ms < 0 || delay_ms > 10000 \
+		|| size < 1 || size > 1 << 20) {
+
+		fprintf(stderr, "Usage: %s [files] [one-way delay in ms] [file length]\n", argv[0]);
+		return 1;
+	}
+
+	/* The binaries are in '../ecftpserver/' and '../ecftpclient/' from this
+	 * one's directory */
+	ssize_t n = readlink("/proc/self/exe", self, sizeof(self) - 1);
+	if (n <= 0) return 1;
+	self[n] = '\0';
+	*strrchr(self, '/') = '\0';
+	if (snprintf(server, sizeof(server), "%.3000s/../ecftpserver/ecftpserver", self) < 0 \
+		|| snprintf(client, sizeof(client), "%.3000s/../ecftpclient/ecftpclient", self) < 0 \
+		|| access(server, X_OK) != 0 || access(client, X_OK) != 0) {
+
+
+		fprintf(stderr, "ERROR: build the server and client first\n");
+		return 1;
+	}
+
+	/* The proxy may be left writing to a connection the other end closed */
+	signal(SIGPIPE, SIG_IGN);
+
+	if (!mkdtemp(srv_dir) || !mkdtemp(cli_dir)) {
+		fprintf(stderr, "ERROR: could not make the test directories\n");
+		return 1;
+	}
+	for (int i = 0; i < files; i++) {
+		snprintf(path, sizeof(path), "%s/f%05d.txt", srv_dir, i);
+		if (0 != test_file(path, i, size, 1)) {
+			fprintf(stderr, "ERROR: could not write the test files\n");
+			return 1;
+		}
+	}
+
+	/* A free port for the server, which listens on every address */
+	int probe = listen_loopback(&server_addr);
+	pargs.listenfd = listen_loopback(&proxy_addr);
+	pargs.server_addr = server_addr;
+	pargs.delay_ns = delay_ms * 1000000L;
+	if (probe < 0 || pargs.listenfd < 0) return 1;
+	int port = ntohs(server_addr.sin_port);
+	close(probe);
+
+	snprintf(port_str, sizeof(port_str), "%d", port);
+	char *srv_argv[] = { server, "-n", "1", port_str, NULL };
+	pid_t srv_pid = spawn(srv_argv, srv_dir, NULL);
+	for (int tries = 0; tries < 100; tries++) {
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+		int up = connect(fd, (struct sockaddr *) &server_addr, sizeof(server_addr)) == 0;
+		close(fd);
+		if (up) break;
+		usleep(50000);
+	}
+
+	printf("%d files of %ld bytes, one-way delay %d ms (%d ms round trip)\n", \
+		files, size, delay_ms, 2 * delay_ms);
+	printf("%-28s %12s %12s %12s\n", "fetch", "total s", "ms per file", "round trips");
+
+	int ret = 0;
+	for (int use_inline = 0; use_inline <= 1 && ret == 0; use_inline++) {
+		/* The key exchange and the commands that set the session up are the
+		 * same for every session, and are not counted */
+		double setup = run_session(client, port, use_inline, 0, &pargs, &proxy_addr, cli_dir);
+		double total = run_session(client, port, use_inline, files, &pargs, &proxy_addr, cli_dir);
+		if (setup < 0 || total < 0) {
+			fprintf(stderr, "ERROR: the client failed\n");
+			ret = 1;
+			break;
+		}
+
+		for (int i = 0; i < files; i++) {
+			snprintf(path, sizeof(path), "%s/f%05d.txt", cli_dir, i);
+			if (0 != test_file(path, i, size, 0)) {
+				fprintf(stderr, "ERROR: %s was not fetched intact\n", path);
+				ret = 1;
+			}
+			unlink(path);
+		}
+
+		double per_file = (total - setup) / files;
+		printf("%-28s %12.2f %12.3f", use_inline ? "inline (RETI)" : "data connection (RETR)", \
+			total - setup, per_file * 1000);
+		if (delay_ms > 0) printf(" %12.2f\n", per_file * 1000 / (2 * delay_ms));
+		else printf(" %12s\n", "-");
+	}
+
+	kill(srv_pid, SIGTERM);
+	waitpid(srv_pid, NULL, 0);
+	for (int i = 0; i < files; i++) {
+		snprintf(path, sizeof(path), "%s/f%05d.txt", srv_dir, i);
+		unlink(path);
+	}
+	rmdir(srv_dir);
+	rmdir(cli_dir);
+	close(pargs.listenfd);
+
+	return ret;
+	/* }}} */
+}
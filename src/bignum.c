@@ -0,0 +1,320 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "bignum.h"
+
+
+/* Modular exponentiation of big numbers for finite field Diffie-Hellman.
+ * Numbers are arrays of 64-bit limbs, least significant limb first, and all
+ * the multiplications of an exponentiation are Montgomery multiplications
+ * (CIOS method), which replace the division by the modulus with shifts. The
+ * exponent is consumed 'BN_WINDOW_BITS' bits at a time, and every window
+ * costs the same squarings and one multiplication by a table entry that is
+ * read with masks rather than indexed, so neither the time taken nor the
+ * memory touched depends on the (secret) exponent. */
+
+
+typedef unsigned __int128 uint128_t;
+
+
+/* The 2048-bit MODP group prime from RFC 3526 (group 14):
+ * 2^2048 - 2^1984 - 1 + 2^64 * ([2^1918 pi] + 124476), big-endian */
+static const uint8_t modp2048_prime[BN_MODP2048_LEN] = {
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xc9, 0x0f, 0xda, 0xa2,
+	0x21, 0x68, 0xc2, 0x34, 0xc4, 0xc6, 0x62, 0x8b, 0x80, 0xdc, 0x1c, 0xd1,
+	0x29, 0x02, 0x4e, 0x08, 0x8a, 0x67, 0xcc, 0x74, 0x02, 0x0b, 0xbe, 0xa6,
+	0x3b, 0x13, 0x9b, 0x22, 0x51, 0x4a, 0x08, 0x79, 0x8e, 0x34, 0x04, 0xdd,
+	0xef, 0x95, 0x19, 0xb3, 0xcd, 0x3a, 0x43, 0x1b, 0x30, 0x2b, 0x0a, 0x6d,
+	0xf2, 0x5f, 0x14, 0x37, 0x4f, 0xe1, 0x35, 0x6d, 0x6d, 0x51, 0xc2, 0x45,
+	0xe4, 0x85, 0xb5, 0x76, 0x62, 0x5e, 0x7e, 0xc6, 0xf4, 0x4c, 0x42, 0xe9,
+	0xa6, 0x37, 0xed, 0x6b, 0x0b, 0xff, 0x5c, 0xb6, 0xf4, 0x06, 0xb7, 0xed,
+	0xee, 0x38, 0x6b, 0xfb, 0x5a, 0x89, 0x9f, 0xa5, 0xae, 0x9f, 0x24, 0x11,
+	0x7c, 0x4b, 0x1f, 0xe6, 0x49, 0x28, 0x66, 0x51, 0xec, 0xe4, 0x5b, 0x3d,
+	0xc2, 0x00, 0x7c, 0xb8, 0xa1, 0x63, 0xbf, 0x05, 0x98, 0xda, 0x48, 0x36,
+	0x1c, 0x55, 0xd3, 0x9a, 0x69, 0x16, 0x3f, 0xa8, 0xfd, 0x24, 0xcf, 0x5f,
+	0x83, 0x65, 0x5d, 0x23, 0xdc, 0xa3, 0xad, 0x96, 0x1c, 0x62, 0xf3, 0x56,
+	0x20, 0x85, 0x52, 0xbb, 0x9e, 0xd5, 0x29, 0x07, 0x70, 0x96, 0x96, 0x6d,
+	0x67, 0x0c, 0x35, 0x4e, 0x4a, 0xbc, 0x98, 0x04, 0xf1, 0x74, 0x6c, 0x08,
+	0xca, 0x18, 0x21, 0x7c, 0x32, 0x90, 0x5e, 0x46, 0x2e, 0x36, 0xce, 0x3b,
+	0xe3, 0x9e, 0x77, 0x2c, 0x18, 0x0e, 0x86, 0x03, 0x9b, 0x27, 0x83, 0xa2,
+	0xec, 0x07, 0xa2, 0x8f, 0xb5, 0xc5, 0x5d, 0xf0, 0x6f, 0x4c, 0x52, 0xc9,
+	0xde, 0x2b, 0xcb, 0xf6, 0x95, 0x58, 0x17, 0x18, 0x39, 0x95, 0x49, 0x7c,
+	0xea, 0x95, 0x6a, 0xe5, 0x15, 0xd2, 0x26, 0x18, 0x98, 0xfa, 0x05, 0x10,
+	0x15, 0x72, 0x8e, 0x5a, 0x8a, 0xac, 0xaa, 0x68, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff
+};
+
+static struct bn_mont modp2048;
+static pthread_once_t modp2048_once = PTHREAD_ONCE_INIT;
+
+
+/** Unpacks 'len' big-endian bytes into 'limbs' limbs. The number must fit */
+static void from_bytes(uint64_t *a, size_t limbs, const uint8_t *b, size_t len) {
+	memset(a, 0, limbs * sizeof(uint64_t));
+	for (size_t i = 0; i < len; i++) {
+		size_t bit = 8 * (len - 1 - i);
+		a[bit / 64] |= (uint64_t) b[i] << (bit % 64);
+	}
+}
+
+
+/** Packs 'limbs' limbs into 'len' big-endian bytes */
+static void to_bytes(uint8_t *b, size_t len, const uint64_t *a) {
+	for (size_t i = 0; i < len; i++) {
+		size_t bit = 8 * (len - 1 - i);
+		b[i] = (a[bit / 64] >> (bit % 64)) & 0xff;
+	}
+}
+
+
+/** r = a - b over 'limbs' limbs, returning the borrow out (0 or 1) */
+static uint64_t sub_limbs(uint64_t *r, const uint64_t *a, const uint64_t *b, size_t limbs) {
+	uint64_t borrow = 0;
+	for (size_t i = 0; i < limbs; i++) {
+		uint128_t d = (uint128_t) a[i] - b[i] - borrow;
+		r[i] = (uint64_t) d;
+		borrow = (uint64_t) (d >> 64) & 1;
+	}
+	return borrow;
+}
+
+
+/** Sets 'r' to 'a' if 'take' is 1 and leaves it if 'take' is 0, without
+ * branching on 'take' */
+static void select_limbs(uint64_t *r, const uint64_t *a, uint64_t take, size_t limbs) {
+	uint64_t mask = 0 - take;
+	for (size_t i = 0; i < limbs; i++) {
+		r[i] = (r[i] & ~mask) | (a[i] & mask);
+	}
+}
+
+
+/** r = a * b * R^-1 mod m, for 'a' and 'b' below m. 'r' may alias 'a' or
+ * 'b'. */
+static void mont_mul(const struct bn_mont *mont, uint64_t *r, const uint64_t *a, \
+	const uint64_t *b) {
+
+	/* {{{ */
+	size_t n = mont->limbs;
+	uint64_t t[BN_MAX_LIMBS + 2];
+	uint64_t d[BN_MAX_LIMBS];
+
+	memset(t, 0, (n + 2) * sizeof(uint64_t));
+
+	for (size_t i = 0; i < n; i++) {
+		/* t += a * b[i] */
+		uint128_t c = 0;
+		for (size_t j = 0; j < n; j++) {
+			c = (uint128_t) a[j] * b[i] + t[j] + (uint64_t) (c >> 64);
+			t[j] = (uint64_t) c;
+		}
+		c = (uint128_t) t[n] + (uint64_t) (c >> 64);
+		t[n] = (uint64_t) c;
+		t[n + 1] = (uint64_t) (c >> 64);
+
+		/* t = (t + q * m) / 2^64, with q chosen so that the low limb is 0 */
+		uint64_t q = t[0] * mont->m0inv;
+		c = (uint128_t) q * mont->m[0] + t[0];
+		for (size_t j = 1; j < n; j++) {
+			c = (uint128_t) q * mont->m[j] + t[j] + (uint64_t) (c >> 64);
+			t[j - 1] = (uint64_t) c;
+		}
+		c = (uint128_t) t[n] + (uint64_t) (c >> 64);
+		t[n - 1] = (uint64_t) c;
+		t[n] = t[n + 1] + (uint64_t) (c >> 64);
+	}
+
+	/* t < 2m: subtract m unless that borrows out of the top limb */
+	uint64_t borrow = sub_limbs(d, t, mont->m, n);
+	memcpy(r, t, n * sizeof(uint64_t));
+	select_limbs(r, d, t[n] | (borrow ^ 1), n);
+	/* }}} */
+}
+
+
+/** Takes an odd modulus and fills in the struct bn_mont needed to
+ * exponentiate modulo it.
+ *
+ * \param '*mont' the struct bn_mont to fill in.
+ * \param '*mod' the modulus, as big-endian bytes.
+ * \param 'len' the number of bytes in '*mod'.
+ * \return 0 on success, -1 if the modulus is even or too large.
+ */
+int bn_mont_init(struct bn_mont *mont, const uint8_t *mod, size_t len) {
+	/* {{{ */
+	size_t n = (len + 7) / 8;
+	uint64_t x[BN_MAX_LIMBS + 1];
+	uint64_t d[BN_MAX_LIMBS + 1];
+	uint64_t m_ext[BN_MAX_LIMBS + 1];
+
+	if (n == 0 || n > BN_MAX_LIMBS || (mod[len - 1] & 1) == 0) {
+		return -1;
+	}
+
+	memset(mont, 0, sizeof(*mont));
+	mont->limbs = n;
+	mont->len = len;
+	from_bytes(mont->m, n, mod, len);
+
+	/* Newton's iteration doubles the number of correct low bits each time.
+	 * m * m = 1 (mod 8) for odd m, so m is its own inverse to 3 bits */
+	uint64_t inv = mont->m[0];
+	for (int i = 0; i < 5; i++) {
+		inv *= 2 - mont->m[0] * inv;
+	}
+	mont->m0inv = 0 - inv;
+
+	/* Double 1 modulo m 64 * n times to get R mod m, then as many times again
+	 * to get R^2 mod m. This is done once per modulus, so it need not be
+	 * fast. One limb more than the modulus holds the doubled value */
+	memcpy(m_ext, mont->m, n * sizeof(uint64_t));
+	m_ext[n] = 0;
+	memset(x, 0, sizeof(x));
+	x[0] = 1;
+	for (size_t i = 0; i < 2 * 64 * n; i++) {
+		uint64_t carry = 0;
+		for (size_t j = 0; j <= n; j++) {
+			uint64_t next = x[j] >> 63;
+			x[j] = (x[j] << 1) | carry;
+			carry = next;
+		}
+		uint64_t borrow = sub_limbs(d, x, m_ext, n + 1);
+		select_limbs(x, d, borrow ^ 1, n + 1);
+
+		if (i == 64 * n - 1) {
+			memcpy(mont->one, x, n * sizeof(uint64_t));
+		}
+	}
+	memcpy(mont->rr, x, n * sizeof(uint64_t));
+
+	return 0;
+	/* }}} */
+}
+
+
+static void init_modp2048() {
+	bn_mont_init(&modp2048, modp2048_prime, sizeof(modp2048_prime));
+}
+
+
+/** Returns the struct bn_mont of the 2048-bit MODP group of RFC 3526, set up
+ * on first use */
+const struct bn_mont * bn_modp2048() {
+	pthread_once(&modp2048_once, init_modp2048);
+	return &modp2048;
+}
+
+
+/** Takes a modulus and a number and checks that the number is strictly
+ * between 1 and m - 1, as a Diffie-Hellman public value must be (1 and
+ * m - 1 generate subgroups of order 1 and 2).
+ *
+ * \param '*mont' the modulus.
+ * \param '*y' the number, as big-endian bytes.
+ * \param 'len' the number of bytes in '*y', at most the length of the
+ *     modulus.
+ * \return 1 if 1 < y < m - 1, 0 otherwise.
+ */
+int bn_check_range(const struct bn_mont *mont, const uint8_t *y, size_t len) {
+	/* {{{ */
+	uint64_t a[BN_MAX_LIMBS];
+	uint64_t t[BN_MAX_LIMBS];
+	uint64_t small[BN_MAX_LIMBS];
+
+	if (len > mont->len) return 0;
+
+	from_bytes(a, mont->limbs, y, len);
+	memset(small, 0, sizeof(small));
+
+	/* y - 2 must not borrow, and y - (m - 1) must */
+	small[0] = 2;
+	if (sub_limbs(t, a, small, mont->limbs)) return 0;
+	small[0] = 1;
+	sub_limbs(t, mont->m, small, mont->limbs);
+	if (!sub_limbs(t, a, t, mont->limbs)) return 0;
+
+	return 1;
+	/* }}} */
+}
+
+
+/** Takes a modulus, a base and an exponent and computes base^exp mod m. The
+ * running time depends only on the lengths of the exponent and modulus.
+ *
+ * \param '*mont' the modulus, set up by 'bn_mont_init()'.
+ * \param '*out' will be modified to contain the result, as big-endian bytes.
+ *     It must have room for as many bytes as the modulus.
+ * \param '*base' the base, as big-endian bytes. It must be less than m.
+ * \param 'base_len' the number of bytes in '*base', at most the length of the
+ *     modulus.
+ * \param '*exp' the exponent, as big-endian bytes.
+ * \param 'exp_len' the number of bytes in '*exp'.
+ * \return 0 on success, -1 if the base is not less than the modulus.
+ */
+int bn_modexp(const struct bn_mont *mont, uint8_t *out, const uint8_t *base, \
+	size_t base_len, const uint8_t *exp, size_t exp_len) {
+
+	/* {{{ */
+	size_t n = mont->limbs;
+	uint64_t table[1 << BN_WINDOW_BITS][BN_MAX_LIMBS];
+	uint64_t acc[BN_MAX_LIMBS];
+	uint64_t entry[BN_MAX_LIMBS];
+	uint64_t tmp[BN_MAX_LIMBS];
+	size_t exp_bits = 8 * exp_len;
+
+	if (base_len > mont->len) return -1;
+	from_bytes(tmp, n, base, base_len);
+	if (!sub_limbs(entry, tmp, mont->m, n)) return -1;
+
+	/* table[i] = base^i, in Montgomery form */
+	memcpy(table[0], mont->one, n * sizeof(uint64_t));
+	mont_mul(mont, table[1], tmp, mont->rr);
+	for (int i = 2; i < (1 << BN_WINDOW_BITS); i++) {
+		mont_mul(mont, table[i], table[i - 1], table[1]);
+	}
+
+	/* Walk the exponent from its most significant window down. The top
+	 * window is narrower when the bit count is not a multiple of the window
+	 * size */
+	memcpy(acc, mont->one, n * sizeof(uint64_t));
+	size_t top = exp_bits % BN_WINDOW_BITS;
+	size_t pos = (exp_bits == 0) ? 0 : exp_bits - (top == 0 ? BN_WINDOW_BITS : top);
+	while (1) {
+		uint64_t window = 0;
+		for (int k = BN_WINDOW_BITS - 1; k >= 0; k--) {
+			size_t bit = pos + k;
+			window <<= 1;
+			if (bit < exp_bits) {
+				window |= (exp[exp_len - 1 - bit / 8] >> (bit % 8)) & 1;
+			}
+		}
+
+		for (int k = 0; k < BN_WINDOW_BITS; k++) {
+			mont_mul(mont, acc, acc, acc);
+		}
+
+		/* Read every entry, keeping the one the window selects */
+		memset(entry, 0, n * sizeof(uint64_t));
+		for (uint64_t i = 0; i < (1 << BN_WINDOW_BITS); i++) {
+			uint64_t diff = i ^ window;
+			select_limbs(entry, table[i], (diff - 1) >> 63, n);
+		}
+		mont_mul(mont, acc, acc, entry);
+
+		if (pos == 0) break;
+		pos -= BN_WINDOW_BITS;
+	}
+
+	/* Out of Montgomery form: multiply by 1 */
+	memset(tmp, 0, n * sizeof(uint64_t));
+	tmp[0] = 1;
+	mont_mul(mont, acc, acc, tmp);
+	to_bytes(out, mont->len, acc);
+
+	memset(table, 0, sizeof(table));
+	memset(acc, 0, sizeof(acc));
+	memset(entry, 0, sizeof(entry));
+	return 0;
+	/* }}} */
+}
@@ -0,0 +1,43 @@
+#ifndef BIGNUM_HEADER
+#define BIGNUM_HEADER
+#include <stddef.h>
+#include <stdint.h>
+
+/* The most 64-bit limbs a modulus can have: enough for a 3072-bit group */
+#define BN_MAX_LIMBS 48
+/* The number of exponent bits consumed per multiplication by 'bn_modexp()' */
+#define BN_WINDOW_BITS 5
+/* The number of bytes in an element of the 2048-bit MODP group */
+#define BN_MODP2048_LEN 256
+/* The generator of the 2048-bit MODP group */
+#define BN_MODP2048_GENERATOR 2
+
+
+/* Define a struct holding an odd modulus along with the values Montgomery
+ * multiplication modulo it needs, where R = 2^(64 * limbs) */
+struct bn_mont {
+	/* The number of 64-bit limbs in the modulus */
+	size_t limbs;
+	/* The number of bytes in the modulus */
+	size_t len;
+	/* The modulus, least significant limb first */
+	uint64_t m[BN_MAX_LIMBS];
+	/* -m^-1 mod 2^64 */
+	uint64_t m0inv;
+	/* R^2 mod m, used to bring numbers into Montgomery form */
+	uint64_t rr[BN_MAX_LIMBS];
+	/* R mod m, the number 1 in Montgomery form */
+	uint64_t one[BN_MAX_LIMBS];
+};
+
+
+int bn_mont_init(struct bn_mont *, const uint8_t *, size_t);
+
+const struct bn_mont * bn_modp2048();
+
+int bn_check_range(const struct bn_mont *, const uint8_t *, size_t);
+
+int bn_modexp(const struct bn_mont *, uint8_t *, const uint8_t *, size_t, \
+	const uint8_t *, size_t);
+
+#endif
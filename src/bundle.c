@@ -0,0 +1,574 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "bundle.h"
+#include "fileops.h"
+
+
+/* How many bytes of a file are copied at a time */
+#define BUNDLE_COPY_LEN (1 << 16)
+
+
+/* Define a struct for an entry of a bundle's manifest */
+struct bundle_entry {
+	char *path;
+	uint8_t type;
+	uint32_t mode;
+	uint64_t size;
+	/* Where the file's contents start in the bundle */
+	uint64_t offset;
+};
+
+/* Define a struct for the entries of a bundle */
+struct bundle_list {
+	struct bundle_entry *entries;
+	size_t len, cap;
+};
+
+/* Define a struct for passing arguments to the threads that write out the
+ * files of a bundle. Each thread takes the next file nobody has taken, so a
+ * thread that gets a large file does not hold the others up */
+struct unpack_args {
+	int fd;
+	struct bundle_list *list;
+	pthread_mutex_t lock;
+	size_t next;
+	/* Set once any thread has failed */
+	int failed;
+};
+
+
+/** Returns a malloc'd name for a new, empty temporary bundle file in the
+ * current directory, or NULL upon failure. The caller must free it */
+char * bundle_temp_name() {
+	return make_temp_file(BUNDLE_TEMP_NAME);
+}
+
+
+/** Returns 1 if 'path' may be the path of an entry: relative, and without
+ * an empty, "." or ".." component, so that unpacking it can not write
+ * outside the directory it is unpacked in. Returns 0 if not */
+static int path_ok(const char *path) {
+	size_t len = strlen(path);
+
+	if (len == 0 || len > BUNDLE_PATH_MAX || path[0] == '/') {
+		return 0;
+	}
+	while (*path != '\0') {
+		size_t n = strcspn(path, "/");
+		if (n == 0 || (n == 1 && path[0] == '.') \
+			|| (n == 2 && path[0] == '.' && path[1] == '.')) {
+
+			return 0;
+		}
+		path += n;
+		if (*path == '/') path++;
+	}
+
+	return 1;
+}
+
+
+static int list_add(struct bundle_list *list, const char *path, uint8_t type, \
+	uint32_t mode, uint64_t size) {
+
+	if (list->len == BUNDLE_MAX_ENTRIES) {
+		return -1;
+	}
+	if (list->len == list->cap) {
+		size_t cap = list->cap ? 2 * list->cap : 64;
+		struct bundle_entry *entries = realloc(list->entries, cap * sizeof(*entries));
+		if (entries == NULL) {
+			return -1;
+		}
+		list->entries = entries;
+		list->cap = cap;
+	}
+	if (!(list->entries[list->len].path = strdup(path))) {
+		return -1;
+	}
+	list->entries[list->len].type = type;
+	list->entries[list->len].mode = mode;
+	list->entries[list->len].size = size;
+	list->len++;
+
+	return 0;
+}
+
+
+static void list_free(struct bundle_list *list) {
+	for (size_t i = 0; i < list->len; i++) {
+		free(list->entries[i].path);
+	}
+	free(list->entries);
+}
+
+
+static int compare_names(const void *a, const void *b) {
+	return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+
+/** Takes a path and adds it to the list of entries, along with everything
+ * under it if it is a directory. The entries of a directory are added in the
+ * order of their names, so that files of a kind, which are often named
+ * alike, are near each other in the bundle. Symbolic links and special files
+ * are skipped.
+ *
+ * \return 0 upon success, a negative int upon failure.
+ */
+static int list_walk(struct bundle_list *list, const char *path) {
+	/* {{{ */
+	struct stat st;
+	struct dirent *de;
+	char **names = NULL;
+	size_t nnames = 0, cap = 0;
+	int ret = 0;
+	DIR *dir;
+
+	if (lstat(path, &st) != 0) {
+		fprintf(stderr, "ERROR: could not find '%s'\n", path);
+		return -1;
+	}
+	if (S_ISREG(st.st_mode)) {
+		return list_add(list, path, BUNDLE_FILE, st.st_mode & 07777, st.st_size);
+	}
+	if (!S_ISDIR(st.st_mode)) {
+		fprintf(stderr, "WARNING: skipping '%s', which is not a file or directory\n", path);
+		return 0;
+	}
+
+	if (0 != list_add(list, path, BUNDLE_DIR, st.st_mode & 07777, 0) \
+		|| !(dir = opendir(path))) {
+
+		return -1;
+	}
+	while ((de = readdir(dir)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+			continue;
+		}
+		if (nnames == cap) {
+			cap = cap ? 2 * cap : 64;
+			char **more = realloc(names, cap * sizeof(*names));
+			if (more == NULL) {
+				ret = -1;
+				break;
+			}
+			names = more;
+		}
+		size_t len = strlen(path) + 1 + strlen(de->d_name) + 1;
+		if (!(names[nnames] = malloc(len))) {
+			ret = -1;
+			break;
+		}
+		snprintf(names[nnames++], len, "%s/%s", path, de->d_name);
+	}
+	closedir(dir);
+
+	qsort(names, nnames, sizeof(*names), compare_names);
+	for (size_t i = 0; i < nnames; i++) {
+		if (ret == 0 && (strlen(names[i]) > BUNDLE_PATH_MAX || 0 != list_walk(list, names[i]))) {
+			ret = -1;
+		}
+		free(names[i]);
+	}
+	free(names);
+
+	return ret;
+	/* }}} */
+}
+
+
+/** Takes an open bundle file and appends the contents of the file at 'path',
+ * which must be 'size' bytes long as it was when the manifest was written.
+ *
+ * \return 0 upon success, a negative int upon failure.
+ */
+static int append_file(FILE *out, const char *path, uint64_t size, uint8_t *buf) {
+	FILE *in = fopen(path, "rb");
+	int ret = 0;
+
+	if (in == NULL) {
+		fprintf(stderr, "ERROR: could not open '%s'\n", path);
+		return -1;
+	}
+	while (size > 0) {
+		size_t n = size < BUNDLE_COPY_LEN ? size : BUNDLE_COPY_LEN;
+		if (0 != read_bytes(buf, n, in) || fwrite(buf, 1, n, out) != n) {
+			fprintf(stderr, "ERROR: '%s' changed while it was being bundled\n", path);
+			ret = -1;
+			break;
+		}
+		size -= n;
+	}
+	fclose(in);
+
+	return ret;
+}
+
+
+/** Takes the space-separated paths of files and directories and adds them,
+ * and everything under the directories, to the list of entries.
+ *
+ * \return 0 upon success, a negative int upon failure.
+ */
+static int list_paths(struct bundle_list *list, const char *paths) {
+	char *copy = strdup(paths), *save, *path;
+	int ret = 0;
+
+	if (copy == NULL) {
+		return -1;
+	}
+	for (path = strtok_r(copy, " ", &save); path != NULL && ret == 0; \
+		path = strtok_r(NULL, " ", &save)) {
+
+		/* A directory may be named with a trailing slash */
+		size_t len = strlen(path);
+		while (len > 1 && path[len - 1] == '/') path[--len] = '\0';
+
+		if (!path_ok(path)) {
+			fprintf(stderr, "ERROR: '%s' is not a relative path inside this directory\n", path);
+			ret = -1;
+		} else {
+			ret = list_walk(list, path);
+		}
+	}
+	free(copy);
+
+	return ret;
+}
+
+
+/** Takes a list of entries and writes the bundle of them to 'out'.
+ *
+ * \return 0 upon success, a negative int upon failure.
+ */
+static int write_bundle(FILE *out, struct bundle_list *list) {
+	/* {{{ */
+	uint8_t entry[BUNDLE_ENTRY_LEN];
+	uint8_t *buf = malloc(BUNDLE_COPY_LEN);
+	int ret = 0;
+
+	if (buf == NULL) {
+		return -1;
+	}
+
+	/* WB1: The magic number and the number of entries */
+	memcpy(buf, BUNDLE_MAGIC, BUNDLE_MAGIC_LEN);
+	put_be(&buf[BUNDLE_MAGIC_LEN], list->len, 4);
+	if (fwrite(buf, 1, BUNDLE_MAGIC_LEN + 4, out) != BUNDLE_MAGIC_LEN + 4) {
+		ret = -1;
+	}
+
+	/* WB2: The manifest */
+	for (size_t i = 0; i < list->len && ret == 0; i++) {
+		struct bundle_entry *e = &list->entries[i];
+		size_t len = strlen(e->path);
+
+		entry[0] = e->type;
+		put_be(&entry[1], e->mode, 4);
+		put_be(&entry[5], e->size, 8);
+		put_be(&entry[13], len, 2);
+		if (fwrite(entry, 1, sizeof(entry), out) != sizeof(entry) \
+			|| fwrite(e->path, 1, len, out) != len) {
+
+			ret = -1;
+		}
+	}
+
+	/* WB3: The contents of the files */
+	for (size_t i = 0; i < list->len && ret == 0; i++) {
+		if (list->entries[i].type == BUNDLE_FILE) {
+			ret = append_file(out, list->entries[i].path, list->entries[i].size, buf);
+		}
+	}
+	free(buf);
+
+	return ret;
+	/* }}} */
+}
+
+
+/** Takes the space-separated paths of files and directories and bundles
+ * them, and everything under the directories, into a new temporary file.
+ * The caller of this function must free '*(ret_bundle_fp)', and remove the
+ * file once done with it.
+ *
+ * \param '*paths' the paths, each relative and without a "." or ".."
+ *     component.
+ * \param '**ret_bundle_fp' a pointer which will be modified to contain a
+ *     pointer to the name of the bundle file.
+ * \return the number of entries bundled upon success, and a negative int
+ *     upon failure.
+ */
+int bundle_pack(const char *paths, char **ret_bundle_fp) {
+	/* {{{ */
+	struct bundle_list list = { NULL, 0, 0 };
+	char *bundle_fp = NULL;
+	FILE *out = NULL;
+	int ret = -1;
+
+	if (0 == list_paths(&list, paths) && list.len > 0 \
+		&& (bundle_fp = bundle_temp_name()) != NULL \
+		&& (out = fopen(bundle_fp, "wb")) != NULL) {
+
+		ret = write_bundle(out, &list);
+		if (fclose(out) != 0) ret = -1;
+	}
+
+	if (ret != 0) {
+		fprintf(stderr, "ERROR: could not bundle the files\n");
+		if (bundle_fp != NULL) {
+			remove(bundle_fp);
+			free(bundle_fp);
+		}
+		list_free(&list);
+		return -1;
+	}
+
+	*ret_bundle_fp = bundle_fp;
+	ret = list.len;
+	list_free(&list);
+
+	return ret;
+	/* }}} */
+}
+
+
+/** Takes a path and makes every directory above it that does not exist.
+ *
+ * \return 0 upon success, a negative int upon failure.
+ */
+static int make_parents(const char *path) {
+	char buf[BUNDLE_PATH_MAX + 1];
+	char *slash = buf;
+
+	snprintf(buf, sizeof(buf), "%s", path);
+	while ((slash = strchr(slash, '/')) != NULL) {
+		*slash = '\0';
+		if (mkdir(buf, 0777) != 0 && errno != EEXIST) {
+			fprintf(stderr, "ERROR: could not make directory '%s'\n", buf);
+			return -1;
+		}
+		*slash++ = '/';
+	}
+
+	return 0;
+}
+
+
+/** Takes an entry of a bundle and writes it out from the bundle open at
+ * 'fd'.
+ *
+ * \return 0 upon success, a negative int upon failure.
+ */
+static int unpack_file(int fd, struct bundle_entry *e, uint8_t *buf) {
+	uint64_t done = 0;
+	int out;
+
+	/* A link planted where the file goes is not followed */
+	if ((out = open(e->path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, e->mode & 0777)) < 0) {
+		fprintf(stderr, "ERROR: could not open file '%s' for writing\n", e->path);
+		return -1;
+	}
+	while (done < e->size) {
+		size_t n = e->size - done < BUNDLE_COPY_LEN ? e->size - done : BUNDLE_COPY_LEN;
+		ssize_t r = pread(fd, buf, n, e->offset + done);
+		if (r <= 0 || write(out, buf, r) != r) {
+			fprintf(stderr, "ERROR: could not write file '%s'\n", e->path);
+			close(out);
+			return -1;
+		}
+		done += r;
+	}
+
+	return close(out) == 0 ? 0 : -1;
+}
+
+
+static void *unpack_thread(void *arg) {
+	struct unpack_args *u = (struct unpack_args *) arg;
+	uint8_t *buf = malloc(BUNDLE_COPY_LEN);
+
+	while (buf != NULL) {
+		pthread_mutex_lock(&u->lock);
+		while (u->next < u->list->len && u->list->entries[u->next].type != BUNDLE_FILE) {
+			u->next++;
+		}
+		size_t i = u->next++;
+		int stop = u->failed || i >= u->list->len;
+		pthread_mutex_unlock(&u->lock);
+		if (stop) break;
+
+		if (0 != unpack_file(u->fd, &u->list->entries[i], buf)) {
+			pthread_mutex_lock(&u->lock);
+			u->failed = 1;
+			pthread_mutex_unlock(&u->lock);
+		}
+	}
+	if (buf == NULL) {
+		pthread_mutex_lock(&u->lock);
+		u->failed = 1;
+		pthread_mutex_unlock(&u->lock);
+	}
+	free(buf);
+
+	return NULL;
+}
+
+
+/** Takes a bundle file and reads its manifest into '*list', working out
+ * where each file's contents start and checking that the bundle holds all
+ * of them and nothing more.
+ *
+ * \return 0 upon success, a negative int if the bundle is malformed.
+ */
+static int read_manifest(const char *bundle_fp, struct bundle_list *list) {
+	/* {{{ */
+	uint8_t head[BUNDLE_MAGIC_LEN + 4], entry[BUNDLE_ENTRY_LEN];
+	char path[BUNDLE_PATH_MAX + 1];
+	struct stat st;
+	uint64_t offset;
+	FILE *in;
+	int ret = 0;
+
+	if (!(in = fopen(bundle_fp, "rb"))) {
+		return -1;
+	}
+	if (0 != read_bytes(head, sizeof(head), in) \
+		|| memcmp(head, BUNDLE_MAGIC, BUNDLE_MAGIC_LEN) != 0 \
+		|| get_be(&head[BUNDLE_MAGIC_LEN], 4) > BUNDLE_MAX_ENTRIES) {
+
+		fclose(in);
+		return -2;
+	}
+
+	uint64_t count = get_be(&head[BUNDLE_MAGIC_LEN], 4);
+	for (uint64_t i = 0; i < count && ret == 0; i++) {
+		size_t len;
+		if (0 != read_bytes(entry, sizeof(entry), in) \
+			|| (len = get_be(&entry[13], 2)) > BUNDLE_PATH_MAX \
+			|| 0 != read_bytes(path, len, in)) {
+
+			ret = -3;
+			break;
+		}
+		path[len] = '\0';
+		if ((entry[0] != BUNDLE_FILE && entry[0] != BUNDLE_DIR) || strlen(path) != len \
+			|| !path_ok(path)) {
+
+			fprintf(stderr, "ERROR: bundle has an unacceptable entry\n");
+			ret = -4;
+			break;
+		}
+		ret = list_add(list, path, entry[0], get_be(&entry[1], 4), get_be(&entry[5], 8));
+	}
+
+	/* The files' contents follow the manifest, in its order */
+	offset = ftell(in);
+	for (size_t i = 0; i < list->len && ret == 0; i++) {
+		list->entries[i].offset = offset;
+		if (list->entries[i].size > UINT64_MAX - offset) ret = -5;
+		offset += list->entries[i].size;
+	}
+	if (ret == 0 && (fstat(fileno(in), &st) != 0 || (uint64_t) st.st_size != offset)) {
+		ret = -6;
+	}
+	fclose(in);
+
+	return ret;
+	/* }}} */
+}
+
+
+/** Takes a bundle file and unpacks it into the current directory: the
+ * directories are made first, then the files are written out on several
+ * threads at once, each reading its files straight from the bundle.
+ *
+ * \param '*bundle_fp' the bundle file.
+ * \return the number of entries unpacked upon success, and a negative int
+ *     upon failure.
+ */
+int bundle_unpack(const char *bundle_fp) {
+	/* {{{ */
+	struct bundle_list list = { NULL, 0, 0 };
+	struct unpack_args u;
+	pthread_t threads[BUNDLE_MAX_THREADS];
+	long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	/* The directory the files before were in, which has been made */
+	char made[BUNDLE_PATH_MAX + 1];
+	size_t made_len = 0;
+	int ret;
+
+	if (0 != (ret = read_manifest(bundle_fp, &list))) {
+		fprintf(stderr, "ERROR: could not read the bundle (%d)\n", ret);
+		list_free(&list);
+		return -1;
+	}
+
+	/* UB1: Make the directories, and those above the files. Entries are
+	 * mostly in the directory of the one before, which is not made again */
+	for (size_t i = 0; i < list.len && ret == 0; i++) {
+		const char *path = list.entries[i].path;
+		size_t parent_len = strrchr(path, '/') ? (size_t) (strrchr(path, '/') - path) : 0;
+
+		if (parent_len > 0 && (parent_len != made_len || 0 != strncmp(path, made, made_len))) {
+			if (0 != make_parents(path)) {
+				ret = -1;
+				break;
+			}
+			memcpy(made, path, parent_len);
+			made_len = parent_len;
+		}
+		if (list.entries[i].type == BUNDLE_DIR && mkdir(list.entries[i].path, \
+			list.entries[i].mode & 0777) != 0 && errno != EEXIST) {
+
+			fprintf(stderr, "ERROR: could not make directory '%s'\n", list.entries[i].path);
+			ret = -1;
+		}
+	}
+
+	/* UB2: Write the files out */
+	if (nthreads < 1) nthreads = 1;
+	if (nthreads > BUNDLE_MAX_THREADS) nthreads = BUNDLE_MAX_THREADS;
+	if (nthreads > (long) list.len) nthreads = list.len;
+	u.list = &list;
+	u.next = 0;
+	u.failed = 0;
+	pthread_mutex_init(&u.lock, NULL);
+	if (ret == 0 && (u.fd = open(bundle_fp, O_RDONLY)) >= 0) {
+		long started = 0;
+		while (started < nthreads \
+			&& 0 == pthread_create(&threads[started], NULL, unpack_thread, &u)) {
+
+			started++;
+		}
+		/* With no thread, the files are written out on this one */
+		if (started == 0) {
+			unpack_thread(&u);
+		}
+		for (long t = 0; t < started; t++) {
+			pthread_join(threads[t], NULL);
+		}
+		close(u.fd);
+		ret = u.failed ? -1 : 0;
+	} else {
+		ret = -1;
+	}
+	pthread_mutex_destroy(&u.lock);
+
+	ret = ret == 0 ? (int) list.len : -1;
+	list_free(&list);
+
+	return ret;
+	/* }}} */
+}
@@ -0,0 +1,37 @@
+#ifndef BUNDLE_HEADER
+#define BUNDLE_HEADER
+#include <stdint.h>
+
+/* A bundle holds many files as one, so that they are compressed, encrypted
+ * and sent as one transfer: the magic number, the big-endian 4-byte number
+ * of entries and the manifest of entries, followed by the contents of every
+ * file entry one after the other, in manifest order. The files share the
+ * LZMA dictionary of the chunk they fall in, so many small files compress
+ * as well as one large one */
+#define BUNDLE_MAGIC "ECB1"
+#define BUNDLE_MAGIC_LEN 4
+/* An entry is its type (1 byte), the big-endian 4-byte permission bits, the
+ * big-endian 8-byte length of the file (0 for a directory) and the
+ * big-endian 2-byte length of its path, followed by the path. Paths are
+ * relative, and none of their components is "." or ".." */
+#define BUNDLE_ENTRY_LEN 15
+#define BUNDLE_FILE 1
+#define BUNDLE_DIR 2
+/* The longest path an entry may have */
+#define BUNDLE_PATH_MAX 4095
+/* The most entries a bundle may have */
+#define BUNDLE_MAX_ENTRIES 10000000
+/* The most threads the files of a bundle are written out on at once */
+#define BUNDLE_MAX_THREADS 8
+/* What the temporary bundle files made by 'bundle_temp_name()' are called,
+ * less the 'mkstemp()' digits */
+#define BUNDLE_TEMP_NAME "ecftp.bundle"
+
+
+char * bundle_temp_name();
+
+int bundle_pack(const char *paths, char **ret_bundle_fp);
+
+int bundle_unpack(const char *bundle_fp);
+
+#endif
@@ -0,0 +1,386 @@
+#include <stdint.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CHACHA_HAVE_AVX2 1
+#endif
+
+#include "chacha.h"
+
+
+/* ChaCha20 as described by D. J. Bernstein in "ChaCha, a variant of Salsa20"
+ * (with a 64-bit nonce and a 64-bit block counter), and Poly1305 as specified
+ * in RFC 8439. ChaCha20 needs no lookup tables and only adds, rotates and
+ * XORs, so it is fast on CPUs without AES instructions. When the CPU supports
+ * AVX2, 8 keystream blocks are computed at once, one per 32-bit lane. */
+
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QUARTERROUND(a, b, c, d) \
+	a += b; d ^= a; d = ROTL32(d, 16); \
+	c += d; b ^= c; b = ROTL32(b, 12); \
+	a += b; d ^= a; d = ROTL32(d, 8); \
+	c += d; b ^= c; b = ROTL32(b, 7);
+
+
+static uint32_t load_le32(const uint8_t *b) {
+	return (uint32_t) b[0] | ((uint32_t) b[1] << 8) \
+		| ((uint32_t) b[2] << 16) | ((uint32_t) b[3] << 24);
+}
+
+
+static void store_le32(uint8_t *b, uint32_t v) {
+	b[0] = v & 0xff;
+	b[1] = (v >> 8) & 0xff;
+	b[2] = (v >> 16) & 0xff;
+	b[3] = (v >> 24) & 0xff;
+}
+
+
+/** Takes a key of 16 or 32 bytes and a nonce and fills in the initial ChaCha20
+ * state, minus the block counter (words 12 and 13), which is set per block.
+ *
+ * \param 'state' the 16 word state to fill in.
+ * \param '*key' the key.
+ * \param 'key_len' the length of the key in bytes. Must be 16 or 32.
+ * \param 'nonce' the nonce.
+ * \return void.
+ */
+void chacha20_setup(uint32_t state[16], const uint8_t *key, size_t key_len, \
+	const uint8_t nonce[CHACHA_NONCE_LEN]) {
+
+	/* "expand 32-byte k" or "expand 16-byte k". A 16 byte key is used for
+	 * both halves of the key words */
+	const char *constant = (key_len == 32) ? "expand 32-byte k" : "expand 16-byte k";
+	const uint8_t *key_hi = (key_len == 32) ? &key[16] : &key[0];
+
+	for (int i = 0; i < 4; i++) {
+		state[i] = load_le32((const uint8_t *) &constant[4 * i]);
+		state[4 + i] = load_le32(&key[4 * i]);
+		state[8 + i] = load_le32(&key_hi[4 * i]);
+	}
+	state[12] = 0;
+	state[13] = 0;
+	state[14] = load_le32(&nonce[0]);
+	state[15] = load_le32(&nonce[4]);
+}
+
+
+/** Computes the keystream block for block 'counter' into 'out'. */
+static void chacha20_block(const uint32_t state[16], uint64_t counter, \
+	uint8_t out[CHACHA_BLOCK_LEN]) {
+	/* {{{ */
+	uint32_t x[16];
+	uint32_t in[16];
+
+	memcpy(in, state, sizeof(in));
+	in[12] = counter & 0xffffffff;
+	in[13] = counter >> 32;
+	memcpy(x, in, sizeof(x));
+
+	/* 20 rounds, as 10 double rounds (column round then diagonal round) */
+	for (int i = 0; i < 10; i++) {
+		QUARTERROUND(x[0], x[4], x[8], x[12])
+		QUARTERROUND(x[1], x[5], x[9], x[13])
+		QUARTERROUND(x[2], x[6], x[10], x[14])
+		QUARTERROUND(x[3], x[7], x[11], x[15])
+		QUARTERROUND(x[0], x[5], x[10], x[15])
+		QUARTERROUND(x[1], x[6], x[11], x[12])
+		QUARTERROUND(x[2], x[7], x[8], x[13])
+		QUARTERROUND(x[3], x[4], x[9], x[14])
+	}
+
+	for (int i = 0; i < 16; i++) {
+		store_le32(&out[4 * i], x[i] + in[i]);
+	}
+	/* }}} */
+}
+
+
+#ifdef CHACHA_HAVE_AVX2
+#define AVX2_ROTL(v, n) \
+	_mm256_or_si256(_mm256_slli_epi32(v, n), _mm256_srli_epi32(v, 32 - (n)))
+
+#define AVX2_QUARTERROUND(a, b, c, d) \
+	a = _mm256_add_epi32(a, b); d = _mm256_xor_si256(d, a); \
+	d = _mm256_shuffle_epi8(d, rot16); \
+	c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c); \
+	b = AVX2_ROTL(b, 12); \
+	a = _mm256_add_epi32(a, b); d = _mm256_xor_si256(d, a); \
+	d = _mm256_shuffle_epi8(d, rot8); \
+	c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c); \
+	b = AVX2_ROTL(b, 7);
+
+/** XORs 8 consecutive keystream blocks, starting at block 'counter', into the
+ * 512 bytes at '*buf'. Each of the 16 state words is held in one vector, with
+ * lane 'i' of every vector belonging to block 'counter + i'. */
+__attribute__((target("avx2")))
+static void chacha20_xor8_avx2(const uint32_t state[16], uint64_t counter, \
+	uint8_t *buf) {
+	/* {{{ */
+	const __m256i rot16 = _mm256_set_epi8( \
+		13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2, \
+		13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2);
+	const __m256i rot8 = _mm256_set_epi8( \
+		14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3, \
+		14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3);
+	uint32_t ctr_lo[8], ctr_hi[8];
+	__m256i in[16], x[16];
+	uint32_t words[16][8] __attribute__((aligned(32)));
+
+	for (int i = 0; i < 8; i++) {
+		ctr_lo[i] = (counter + i) & 0xffffffff;
+		ctr_hi[i] = (counter + i) >> 32;
+	}
+	for (int i = 0; i < 16; i++) {
+		in[i] = _mm256_set1_epi32(state[i]);
+	}
+	in[12] = _mm256_loadu_si256((const __m256i *) ctr_lo);
+	in[13] = _mm256_loadu_si256((const __m256i *) ctr_hi);
+	for (int i = 0; i < 16; i++) {
+		x[i] = in[i];
+	}
+
+	for (int i = 0; i < 10; i++) {
+		AVX2_QUARTERROUND(x[0], x[4], x[8], x[12])
+		AVX2_QUARTERROUND(x[1], x[5], x[9], x[13])
+		AVX2_QUARTERROUND(x[2], x[6], x[10], x[14])
+		AVX2_QUARTERROUND(x[3], x[7], x[11], x[15])
+		AVX2_QUARTERROUND(x[0], x[5], x[10], x[15])
+		AVX2_QUARTERROUND(x[1], x[6], x[11], x[12])
+		AVX2_QUARTERROUND(x[2], x[7], x[8], x[13])
+		AVX2_QUARTERROUND(x[3], x[4], x[9], x[14])
+	}
+
+	for (int i = 0; i < 16; i++) {
+		_mm256_store_si256((__m256i *) words[i], _mm256_add_epi32(x[i], in[i]));
+	}
+
+	/* Word 'w' of block 'b' is in lane 'b' of vector 'w' */
+	for (int b = 0; b < 8; b++) {
+		for (int w = 0; w < 16; w++) {
+			uint8_t *p = &buf[CHACHA_BLOCK_LEN * b + 4 * w];
+			store_le32(p, load_le32(p) ^ words[w][b]);
+		}
+	}
+	/* }}} */
+}
+#endif
+
+
+/** Takes a ChaCha20 state and XORs the keystream starting at the beginning of
+ * block 'counter' into the 'len' bytes at '*buf'. Encryption and decryption
+ * are the same operation.
+ *
+ * \param 'state' the state set up by 'chacha20_setup()'.
+ * \param 'counter' the index of the keystream block to start at.
+ * \param '*buf' the data to be encrypted/decrypted in place.
+ * \param 'len' the number of bytes at '*buf'.
+ * \return void.
+ */
+void chacha20_xor(const uint32_t state[16], uint64_t counter, uint8_t *buf, \
+	size_t len) {
+	/* {{{ */
+	uint8_t block[CHACHA_BLOCK_LEN];
+	size_t i = 0;
+
+#ifdef CHACHA_HAVE_AVX2
+	static int use_avx2 = -1;
+	if (use_avx2 == -1) {
+		use_avx2 = __builtin_cpu_supports("avx2");
+	}
+	if (use_avx2) {
+		for (; i + 8 * CHACHA_BLOCK_LEN <= len; i += 8 * CHACHA_BLOCK_LEN) {
+			chacha20_xor8_avx2(state, counter, &buf[i]);
+			counter += 8;
+		}
+	}
+#endif
+
+	for (; i < len; i += CHACHA_BLOCK_LEN) {
+		chacha20_block(state, counter++, block);
+		for (size_t j = 0; j < CHACHA_BLOCK_LEN && i + j < len; j++) {
+			buf[i + j] ^= block[j];
+		}
+	}
+	/* }}} */
+}
+
+
+/** Takes a one-time 32 byte key and sets up '*st' for computing a Poly1305
+ * tag with it. The key must never be used for more than one message.
+ *
+ * \param '*st' the struct poly1305_state to set up.
+ * \param 'key' the one-time key ('r' followed by 's').
+ * \return void.
+ */
+void poly1305_init(struct poly1305_state *st, const uint8_t key[POLY1305_KEY_LEN]) {
+	/* Clamp 'r' while splitting it into 26-bit limbs */
+	st->r[0] = (load_le32(&key[0])) & 0x3ffffff;
+	st->r[1] = (load_le32(&key[3]) >> 2) & 0x3ffff03;
+	st->r[2] = (load_le32(&key[6]) >> 4) & 0x3ffc0ff;
+	st->r[3] = (load_le32(&key[9]) >> 6) & 0x3f03fff;
+	st->r[4] = (load_le32(&key[12]) >> 8) & 0x00fffff;
+	for (int i = 0; i < 4; i++) {
+		st->s[i] = st->r[i + 1] * 5;
+		st->pad[i] = load_le32(&key[16 + 4 * i]);
+	}
+	memset(st->h, 0, sizeof(st->h));
+	st->leftover_len = 0;
+}
+
+
+/** Folds 'num_blocks' 16 byte blocks into the accumulator. 'hibit' is the
+ * bit appended above each block: 1 << 24 for whole blocks, 0 for the final
+ * partial block, which has its 1 appended in the data itself. */
+static void poly1305_blocks(struct poly1305_state *st, const uint8_t *m, \
+	size_t num_blocks, uint32_t hibit) {
+	/* {{{ */
+	const uint32_t r0 = st->r[0], r1 = st->r[1], r2 = st->r[2], \
+		r3 = st->r[3], r4 = st->r[4];
+	const uint32_t s1 = st->s[0], s2 = st->s[1], s3 = st->s[2], s4 = st->s[3];
+	uint32_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2], \
+		h3 = st->h[3], h4 = st->h[4];
+
+	for (size_t i = 0; i < num_blocks; i++, m += 16) {
+		uint64_t d0, d1, d2, d3, d4;
+		uint32_t c;
+
+		/* h += m */
+		h0 += (load_le32(&m[0])) & 0x3ffffff;
+		h1 += (load_le32(&m[3]) >> 2) & 0x3ffffff;
+		h2 += (load_le32(&m[6]) >> 4) & 0x3ffffff;
+		h3 += (load_le32(&m[9]) >> 6) & 0x3ffffff;
+		h4 += (load_le32(&m[12]) >> 8) | hibit;
+
+		/* h *= r (mod 2^130 - 5) */
+		d0 = (uint64_t) h0 * r0 + (uint64_t) h1 * s4 + (uint64_t) h2 * s3 \
+			+ (uint64_t) h3 * s2 + (uint64_t) h4 * s1;
+		d1 = (uint64_t) h0 * r1 + (uint64_t) h1 * r0 + (uint64_t) h2 * s4 \
+			+ (uint64_t) h3 * s3 + (uint64_t) h4 * s2;
+		d2 = (uint64_t) h0 * r2 + (uint64_t) h1 * r1 + (uint64_t) h2 * r0 \
+			+ (uint64_t) h3 * s4 + (uint64_t) h4 * s3;
+		d3 = (uint64_t) h0 * r3 + (uint64_t) h1 * r2 + (uint64_t) h2 * r1 \
+			+ (uint64_t) h3 * r0 + (uint64_t) h4 * s4;
+		d4 = (uint64_t) h0 * r4 + (uint64_t) h1 * r3 + (uint64_t) h2 * r2 \
+			+ (uint64_t) h3 * r1 + (uint64_t) h4 * r0;
+
+		/* Partially reduce */
+		c = d0 >> 26; h0 = d0 & 0x3ffffff;
+		d1 += c; c = d1 >> 26; h1 = d1 & 0x3ffffff;
+		d2 += c; c = d2 >> 26; h2 = d2 & 0x3ffffff;
+		d3 += c; c = d3 >> 26; h3 = d3 & 0x3ffffff;
+		d4 += c; c = d4 >> 26; h4 = d4 & 0x3ffffff;
+		h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+		h1 += c;
+	}
+
+	st->h[0] = h0; st->h[1] = h1; st->h[2] = h2; st->h[3] = h3; st->h[4] = h4;
+	/* }}} */
+}
+
+
+/** Folds 'len' bytes of message into the Poly1305 computation. The message
+ * can be passed in pieces of any size.
+ *
+ * \param '*st' the running struct poly1305_state.
+ * \param '*m' the message bytes.
+ * \param 'len' the number of bytes at '*m'.
+ * \return void.
+ */
+void poly1305_update(struct poly1305_state *st, const uint8_t *m, size_t len) {
+	/* {{{ */
+	/* Complete a partial block left over from the last update */
+	if (st->leftover_len != 0) {
+		size_t want = 16 - st->leftover_len;
+		if (want > len) want = len;
+		memcpy(&st->leftover[st->leftover_len], m, want);
+		st->leftover_len += want;
+		m += want;
+		len -= want;
+		if (st->leftover_len < 16) return;
+		poly1305_blocks(st, st->leftover, 1, 1 << 24);
+		st->leftover_len = 0;
+	}
+
+	if (len >= 16) {
+		poly1305_blocks(st, m, len / 16, 1 << 24);
+		m += len - (len % 16);
+		len %= 16;
+	}
+
+	if (len != 0) {
+		memcpy(st->leftover, m, len);
+		st->leftover_len = len;
+	}
+	/* }}} */
+}
+
+
+/** Finishes the Poly1305 computation, writing the tag to 'tag'.
+ *
+ * \param '*st' the running struct poly1305_state.
+ * \param 'tag' will be modified to contain the tag.
+ * \return void.
+ */
+void poly1305_finish(struct poly1305_state *st, uint8_t tag[POLY1305_TAG_LEN]) {
+	/* {{{ */
+	uint32_t h0, h1, h2, h3, h4, c;
+	uint32_t g0, g1, g2, g3, g4, mask;
+	uint64_t f;
+
+	/* Process the final partial block, padded with a 1 then zeros */
+	if (st->leftover_len != 0) {
+		st->leftover[st->leftover_len] = 1;
+		for (size_t i = st->leftover_len + 1; i < 16; i++) {
+			st->leftover[i] = 0;
+		}
+		poly1305_blocks(st, st->leftover, 1, 0);
+	}
+
+	h0 = st->h[0]; h1 = st->h[1]; h2 = st->h[2]; h3 = st->h[3]; h4 = st->h[4];
+
+	/* Fully carry h */
+	c = h1 >> 26; h1 &= 0x3ffffff;
+	h2 += c; c = h2 >> 26; h2 &= 0x3ffffff;
+	h3 += c; c = h3 >> 26; h3 &= 0x3ffffff;
+	h4 += c; c = h4 >> 26; h4 &= 0x3ffffff;
+	h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+	h1 += c;
+
+	/* Compute h - p = h + 5 - 2^130 */
+	g0 = h0 + 5; c = g0 >> 26; g0 &= 0x3ffffff;
+	g1 = h1 + c; c = g1 >> 26; g1 &= 0x3ffffff;
+	g2 = h2 + c; c = g2 >> 26; g2 &= 0x3ffffff;
+	g3 = h3 + c; c = g3 >> 26; g3 &= 0x3ffffff;
+	g4 = h4 + c - (1UL << 26);
+
+	/* Select h if h < p, or h - p if h >= p, without branching */
+	mask = (g4 >> 31) - 1;
+	g0 &= mask; g1 &= mask; g2 &= mask; g3 &= mask; g4 &= mask;
+	mask = ~mask;
+	h0 = (h0 & mask) | g0;
+	h1 = (h1 & mask) | g1;
+	h2 = (h2 & mask) | g2;
+	h3 = (h3 & mask) | g3;
+	h4 = (h4 & mask) | g4;
+
+	/* h = h % 2^128, as four 32-bit words */
+	h0 = (h0 | (h1 << 26)) & 0xffffffff;
+	h1 = ((h1 >> 6) | (h2 << 20)) & 0xffffffff;
+	h2 = ((h2 >> 12) | (h3 << 14)) & 0xffffffff;
+	h3 = ((h3 >> 18) | (h4 << 8)) & 0xffffffff;
+
+	/* tag = (h + s) % 2^128 */
+	f = (uint64_t) h0 + st->pad[0]; h0 = (uint32_t) f;
+	f = (uint64_t) h1 + st->pad[1] + (f >> 32); h1 = (uint32_t) f;
+	f = (uint64_t) h2 + st->pad[2] + (f >> 32); h2 = (uint32_t) f;
+	f = (uint64_t) h3 + st->pad[3] + (f >> 32); h3 = (uint32_t) f;
+
+	store_le32(&tag[0], h0);
+	store_le32(&tag[4], h1);
+	store_le32(&tag[8], h2);
+	store_le32(&tag[12], h3);
+	/* }}} */
+}
@@ -0,0 +1,41 @@
+#ifndef CHACHA_HEADER
+#define CHACHA_HEADER
+#include <stddef.h>
+#include <stdint.h>
+
+/* The number of bytes in a ChaCha20 keystream block */
+#define CHACHA_BLOCK_LEN 64
+/* The number of bytes in a ChaCha20 nonce (the original 64-bit nonce
+ * variant, which leaves a 64-bit block counter) */
+#define CHACHA_NONCE_LEN 8
+/* The number of bytes in a Poly1305 key and tag */
+#define POLY1305_KEY_LEN 32
+#define POLY1305_TAG_LEN 16
+
+
+/* Define a struct for the running state of a Poly1305 computation */
+struct poly1305_state {
+	/* The key 'r' and the precomputed 5 * r, in 26-bit limbs */
+	uint32_t r[5];
+	uint32_t s[4];
+	/* The accumulator, in 26-bit limbs */
+	uint32_t h[5];
+	/* The key 's' that is added to the accumulator at the end */
+	uint32_t pad[4];
+	/* Bytes of a partial block waiting for the rest of the block */
+	uint8_t leftover[16];
+	size_t leftover_len;
+};
+
+
+void chacha20_setup(uint32_t[16], const uint8_t *, size_t, const uint8_t[CHACHA_NONCE_LEN]);
+
+void chacha20_xor(const uint32_t[16], uint64_t, uint8_t *, size_t);
+
+void poly1305_init(struct poly1305_state *, const uint8_t[POLY1305_KEY_LEN]);
+
+void poly1305_update(struct poly1305_state *, const uint8_t *, size_t);
+
+void poly1305_finish(struct poly1305_state *, uint8_t[POLY1305_TAG_LEN]);
+
+#endif
@@ -13,7 +13,9 @@
 
 #include "lzma/LzmaLib.h"
 #include "comp.h"
+#include "cpugate.h"
 #include "fileops.h"
+#include "membudget.h"
 
 
 /** Takes pointer to a struct ec_header and an open file stream, and reads
@@ -158,8 +160,54 @@ typedef struct comp_thread_args {
 }CompThreadArgs;
 
 
+/** Returns the dictionary size to compress a chunk of 'len' bytes with: the
+ * smallest power of two that holds the whole chunk, up to 'COMP_DICT_SIZE'.
+ * A dictionary bigger than the chunk finds no more matches, but the
+ * encoder's match finder still takes 8 bytes for each byte of it */
+static unsigned comp_dict_size(size_t len) {
+	unsigned dict = COMP_MIN_DICT_SIZE;
+
+	while (dict < len && dict < COMP_DICT_SIZE) {
+		dict <<= 1;
+	}
+	return dict;
+}
+
+
+/** Returns roughly how many bytes compressing a chunk of 'len' bytes takes:
+ * its input, output and props buffers, and the tables of the LZMA encoder,
+ * whose binary tree and hash table are sized as in 'MatchFinder_Create()'
+ * for the 4-byte hash binary tree match finder 'COMP_LEVEL' selects */
+static size_t comp_chunk_mem(size_t len) {
+	/* {{{ */
+	size_t dict = comp_dict_size(len);
+	/* The hash table is sized for the smaller of the dictionary and the
+	 * chunk, rounded up to a power of two and halved */
+	uint32_t hs = len < dict ? len : dict;
+
+	if (hs != 0) hs--;
+	hs |= hs >> 1;
+	hs |= hs >> 2;
+	hs |= hs >> 4;
+	hs |= hs >> 8;
+	hs |= hs >> 16;
+	hs >>= 1;
+	if (hs >= (1 << 24)) hs >>= 1;
+	hs |= (1 << 16) - 1;
+
+	/* Two links per position of the dictionary, and the main hash table
+	 * followed by the fixed 2- and 3-byte ones */
+	size_t tables = 2 * (dict + 1) * sizeof(uint32_t) \
+		+ ((size_t) hs + 1 + (1 << 10) + (1 << 16)) * sizeof(uint32_t);
+
+	return len + (len + len / 3 + 128) + LZMA_PROPS_SIZE + tables \
+		+ COMP_ENCODER_STATE_MEM;
+	/* }}} */
+}
+
+
 /** Helper function for compressing a file through multiple threads */
-void *compress_chunk_of_file(void *arg) {
+static void *compress_chunk(void *arg) {
 	/* {{{ */
 #if DEBUG_LEVEL >= 2
 	fprintf(stderr, "(%d) STATUS: compression: thread %ld starting...\n", \
@@ -178,7 +226,7 @@ void *compress_chunk_of_file(void *arg) {
 	/* 2. Compress the data in 't->inbuf' and put in 't->outbuf' */
 	MY_STDAPI compret = LzmaCompress( \
 		&t->outbuf[0], &t->outbuf_len, &t->inbuf[0], t->ir_readlen, \
-		&t->props[0], &t->props_len, COMP_LEVEL, COMP_DICT_SIZE, 3, 0, 2, 32, 1);
+		&t->props[0], &t->props_len, COMP_LEVEL, comp_dict_size(t->ir_readlen), 3, 0, 2, 32, 1);
 	if (compret != SZ_OK) {
 		fprintf(stderr, "ERROR: compression call failed!\n");
 		t->return_val = -1;
@@ -212,7 +260,7 @@ void *compress_chunk_of_file(void *arg) {
 
 
 /** Helper function for uncompressing a file through multiple threads */
-void *uncompress_chunk_of_file(void *arg) {
+static void *uncompress_chunk(void *arg) {
 	/* {{{ */
 #if DEBUG_LEVEL >= 2
 	fprintf(stderr, "(%d) STATUS: uncompression: thread %ld starting...\n", \
@@ -266,250 +314,419 @@ void *uncompress_chunk_of_file(void *arg) {
 }
 
 
-/** Takes an input file path, compresses the file at that location, writing
- * the compressed result to the file at the output file path.
+/** Thread entry point for compressing a chunk: runs 'compress_chunk()' once
+ * the server's CPU gate lets the chunk through */
+void *compress_chunk_of_file(void *arg) {
+	cpu_gate_enter();
+	compress_chunk(arg);
+	cpu_gate_leave();
+	return NULL;
+}
+
+
+/** Thread entry point for uncompressing a chunk: runs 'uncompress_chunk()'
+ * once the server's CPU gate lets the chunk through */
+void *uncompress_chunk_of_file(void *arg) {
+	cpu_gate_enter();
+	uncompress_chunk(arg);
+	cpu_gate_leave();
+	return NULL;
+}
+
+
+/** Frees the buffers and closes the readers of the first 'num_threads' chunks
+ * of a batch, skipping those the batch did not get as far as setting up.
+ * An uncompressed chunk's 'outbuf' points to its 'inbuf', and is not freed
+ * twice */
+static void free_batch(CompThreadArgs * args, int num_threads) {
+	for (int t = 0; t < num_threads; t++) {
+		if (args[t].outbuf != args[t].inbuf) {
+			free(args[t].outbuf);
+		}
+		free(args[t].inbuf);
+		free(args[t].props);
+		if (args[t].input_reader != NULL) {
+			fclose(args[t].input_reader);
+		}
+	}
+}
+
+
+/** Marks every buffer and reader of a batch as not yet set up, so that
+ * 'free_batch()' can be called on it however far it got */
+static void clear_batch(CompThreadArgs * args, int num_threads) {
+	for (int t = 0; t < num_threads; t++) {
+		args[t].input_reader = NULL;
+		args[t].props = NULL;
+		args[t].inbuf = NULL;
+		args[t].outbuf = NULL;
+	}
+}
+
+
+/** Takes a batch of chunks of the file at 'input_fp', starting 'offset'
+ * bytes into the file, whose thread arguments have their read lengths set,
+ * compresses each chunk on its own thread, and appends the results to the
+ * output file.
+ *
+ * \param '*input_fp' the path to the input file.
+ * \param '*out_writer' the output file.
+ * \param '*args' the thread arguments of the chunks, with 'ir_readlen' set.
+ * \param 'num_threads' the number of chunks in the batch.
+ * \param 'offset' where the first chunk of the batch starts in the file.
+ * \return 0 upon success, and a negative int upon failure.
+ */
+static int compress_batch(char * input_fp, FILE * out_writer, \
+	CompThreadArgs * args, int num_threads, off_t offset) {
+	/* {{{ */
+
+	/* Once a chunk fails the batch goes no further, but every thread it
+	 * started is joined, and every buffer and reader it set up is freed,
+	 * before it returns */
+	int ret = 0;
+	clear_batch(args, num_threads);
+
+	/* STA: Set Thread Arguments */
+
+	/* STA1: Open up the input file with 'num_threads' readers, each at their
+	* starting location for the reading they have to do */
+	for (int thread_index = 0; thread_index < num_threads; thread_index++) {
+		args[thread_index].input_reader = fopen(input_fp, "rb");
+		if (args[thread_index].input_reader == NULL) {
+			perror("fopen (comp_file)");
+			ret = -1;
+			break;
+		}
+		/* STA2: Position the cursor of each reader such that it will
+		 * read at the part of the file it is responsible for reading */
+		fseek(args[thread_index].input_reader, \
+			offset + ((off_t) thread_index * COMP_THREAD_MAX_MEM), SEEK_SET);
+		/* STA3: Allocate space for the LZMA properties(?) */
+		args[thread_index].props_len = LZMA_PROPS_SIZE;
+		args[thread_index].props = malloc(LZMA_PROPS_SIZE);
+		if (args[thread_index].props == NULL) {
+			fprintf(stderr, "ERROR: could not allocate props "\
+				"(asked for %d bytes)\n", LZMA_PROPS_SIZE);
+			ret = -1;
+			break;
+		}
+
+		/* STA4: Allocate memory for reading the chunk from the file, set the
+		 * number of bytes in the out buffer ('outbuf_len'), and allocate
+		 * memory for the out buffer */
+		args[thread_index].inbuf = malloc(args[thread_index].ir_readlen);
+		if (args[thread_index].inbuf == NULL) {
+			fprintf(stderr, "ERROR: could not allocate input buffer "\
+				"(asked for %ld bytes)\n", args[thread_index].ir_readlen);
+			ret = -1;
+			break;
+		}
+		/* / 3 + 128 was some simple math recommended by LZMA SDK? */
+		args[thread_index].outbuf_len = args[thread_index].ir_readlen \
+			+ args[thread_index].ir_readlen / 3 + 128;
+		args[thread_index].outbuf = malloc(args[thread_index].outbuf_len);
+		if (args[thread_index].outbuf == NULL) {
+			fprintf(stderr, "ERROR: could not allocate output buffer "\
+				"(asked for %ld bytes)\n", args[thread_index].outbuf_len);
+			ret = -1;
+			break;
+		}
+	}
+
+	/* RT: Run Threads */
+	pthread_t thread_id[num_threads];
+	int created;
+	/* RT1: Create threads with their given tasks/arguments */
+	for (created = 0; ret == 0 && created < num_threads - 1; created++) {
+		if (0 != pthread_create(&thread_id[created], NULL, compress_chunk_of_file, \
+			&args[created])) {
+
+			fprintf(stderr, "ERROR: Could not create threads\n");
+			ret = -1;
+			break;
+		}
+	}
+	/* RT2: Have this "thread" compress as well since otherwise it would be
+	 * waiting idly */
+	if (ret == 0) {
+		compress_chunk_of_file(&args[num_threads - 1]);
+		if (args[num_threads - 1].return_val != 0) {
+			fprintf(stderr, "ERROR: thread failed to compress assigned chunk\n");
+			ret = -1;
+		}
+	}
+
+	/* RT3: Wait for all the threads to finish their compression */
+	for (int t = 0; t < created; t++) {
+		pthread_join(thread_id[t], NULL);
+		if (args[t].return_val != 0) {
+			fprintf(stderr, "ERROR: thread failed to compress assigned chunk\n");
+			ret = -1;
+		}
+	}
+
+	/* MUTW: Make use of the Threads' Work */
+	for (int t = 0; ret == 0 && t < num_threads; t++) {
+		/* MUTW1: Write the EC header of the current thread to the output file */
+		if (0 != write_ec_header(&args[t].echeader, out_writer)) {
+			fprintf(stderr, "ERROR: Could not write EC header to output file\n");
+			ret = -1;
+			break;
+		}
+
+		/* MUTW2: Write the (lzma props + the outbuf) or (the inbuf) to the
+		 * output file, writing 'inbuf' if the compressed data (+ its props)
+		 * takes up the same amount of space or more than the input data */
+		if (args[t].props_len + args[t].outbuf_len >= args[t].ir_readlen) {
+			/* The last chunk of a file ending on a chunk boundary is empty */
+			if (args[t].ir_readlen != 0 && 1 != \
+				fwrite(&args[t].inbuf[0], args[t].ir_readlen, 1, out_writer)) {
+
+				fprintf(stderr, "ERROR: Could not write data content to output file\n");
+				ret = -1;
+				break;
+			}
+		} else {
+			if (1 != \
+				fwrite(args[t].props, args[t].props_len, 1, out_writer)) {
+
+				fprintf(stderr, "ERROR: Could not write data content output file\n");
+				ret = -1;
+				break;
+			}
+
+			if (1 != \
+				fwrite(args[t].outbuf, args[t].outbuf_len, 1, out_writer)) {
+
+				fprintf(stderr, "ERROR: Could not write data content output file\n");
+				ret = -1;
+				break;
+			}
+		}
+	}
+
+	free_batch(args, num_threads);
+
+	return ret;
+	/* }}} */
+}
+
+
+/** Takes an input file path, compresses the file at that location from
+ * 'start' bytes in up to 'end' bytes in, writing the compressed result to
+ * the file at the output file path. Since every chunk is compressed on its
+ * own, the chunks of a file compressed from a chunk boundary are those of
+ * the whole file from that chunk on, and a range of the file is compressed
+ * as the whole chunks that cover it.
  *
  * \param '*input_fp' the path to the input file.
+ * \param 'start' where in the input file to start, a multiple of
+ *     'COMP_THREAD_MAX_MEM' no further than its end.
+ * \param 'end' where in the input file to stop, rounded up to a multiple of
+ *     'COMP_THREAD_MAX_MEM', or 0 for the end of the file.
  * \param '*output_fp' the path to the output file.
  * \return 0 upon success, and a negative int upon failure.
  */
-int comp_file(char * input_fp, char * output_fp) {
+int comp_file(char * input_fp, off_t start, off_t end, char * output_fp) {
 	/* {{{ */
 	struct stat s;
-	unsigned int num_batches = 1;
-	stat(input_fp, &s);
-	long max_bytes_per_batch = COMP_THREAD_MAX_MEM * COMP_MAX_THREADS;
+	if (0 != stat(input_fp, &s) || start > s.st_size || (end != 0 && end <= start)) {
+		fprintf(stderr, "ERROR: compression: cannot start %ld bytes into the file\n", \
+			(long) start);
+		return -1;
+	}
+	off_t stop = s.st_size;
+	if (end != 0 && end < s.st_size) {
+		stop = (end + COMP_THREAD_MAX_MEM - 1) / COMP_THREAD_MAX_MEM * COMP_THREAD_MAX_MEM;
+		stop = stop < s.st_size ? stop : s.st_size;
+	}
+	off_t size = stop - start;
+	/* The file is cut into chunks of 'COMP_THREAD_MAX_MEM' bytes, the last of
+	 * which holds whatever is left over (possibly nothing). A range that
+	 * stops short of the end of the file is whole chunks */
+	uint64_t num_chunks = size / COMP_THREAD_MAX_MEM + (stop == s.st_size ? 1 : 0);
 
 #if DEBUG_LEVEL >= 1
 	/* Print warning if the file will require more than one thread */
-	if (s.st_size > COMP_THREAD_MAX_MEM) {
+	if (size > COMP_THREAD_MAX_MEM) {
 		fprintf(stderr, "(%d) WARNING: compression: File size is bigger than " \
 			"the memory limit for one compression thread (%ld > %d bytes). " \
 			"The file will be compressed across multiple threads.\n", \
-			getpid(), s.st_size, COMP_THREAD_MAX_MEM);
+			getpid(), size, COMP_THREAD_MAX_MEM);
 	}
+	fprintf(stderr, "(%d) STATUS: compression: number of chunks needed " \
+		"= %lu\n", getpid(), num_chunks);
 #endif
 
-	/* If the size of the file is too large for all its data to be loaded into
-	 * memory and compressed in one batch of threads */
-	if (s.st_size > max_bytes_per_batch) {
-#if DEBUG_LEVEL >= 1
-	/* Print warning if the file will require more than one batch of threads */
-	fprintf(stderr, "(%d) WARNING: compression: File size is bigger than " \
-		"the memory limit for one threaded compression batch " \
-		"(%ld > %ld bytes). The file will be compressed over multiple " \
-		"multithreaded batches.\n", \
-		getpid(), s.st_size, max_bytes_per_batch);
-#endif
-		/* "Ceiled" division so that the number of jobs is always sufficient
-		 * to compress the whole file */
-		num_batches = (s.st_size / max_bytes_per_batch) + 1;
-	}
-
-#if DEBUG_LEVEL >= 1
-	fprintf(stderr, "(%d) STATUS: compression: number of batches needed " \
-		"= %d\n", getpid(), num_batches);
-#endif
-
-
 	FILE *out_writer = fopen(output_fp, "wb");
 	if (out_writer == NULL) {
 		perror("fopen (comp_file)");
 		return -1;
 	}
 
-	char num_threads = COMP_MAX_THREADS;
-	CompThreadArgs args[num_threads];
-	uint64_t batch_len;
-
-	/* Go through the input file in batches, breaking into threads for each
-	 * batch, each thread compressing an assigned part of the file before
-	 * pthread_join'ing back to the main thread, which will then loop through
-	 * the compressed data, writing it (or the raw data if it takes up less
-	 * space) to the output file. This all takes place in 3 broad stages:
-	 * STA: Set Thread Arguments
-	 * RT: Run Threads
-	 * MUTW: Make use of the Threads' Work */
-	for (unsigned int batch_index = 0; batch_index < num_batches; batch_index++) {
+	CompThreadArgs args[COMP_MAX_THREADS];
+	int num_threads;
+
+	/* Go through the input file in batches of up to 'COMP_MAX_THREADS'
+	 * chunks, breaking into a thread for each chunk of the batch, each thread
+	 * compressing its chunk before pthread_join'ing back to the main thread,
+	 * which then writes the compressed data (or the raw data if it takes up
+	 * less space) to the output file. The memory a batch takes is reserved
+	 * from the server's budget first: the batch waits for room for its first
+	 * chunk, then takes on as many more chunks as there is room for straight
+	 * away, so that a busy server compresses in narrower batches */
+	for (uint64_t chunk = 0; chunk < num_chunks; chunk += num_threads) {
+		off_t offset = start + chunk * COMP_THREAD_MAX_MEM;
+		size_t batch_mem = 0;
+
+		for (num_threads = 0; num_threads < COMP_MAX_THREADS \
+			&& chunk + num_threads < num_chunks; num_threads++) {
+
+			/* Every chunk but the last is a full one */
+			size_t len = COMP_THREAD_MAX_MEM;
+			if (chunk + num_threads == num_chunks - 1) {
+				len = size - (num_chunks - 1) * COMP_THREAD_MAX_MEM;
+			}
 
-		/* If this is not the last batch, read a batch of maximum length with
-		 * the maximum number of threads */
-		if (batch_index != num_batches - 1) {
-			batch_len = max_bytes_per_batch;
-			num_threads = COMP_MAX_THREADS;
-		} else {
-			/* Set the number of threads to how many 'COMP_THREAD_MAX_MEM' byte
-			 * chunks of the file are left */
-			batch_len = s.st_size - (batch_index * max_bytes_per_batch);
-			num_threads = (batch_len / COMP_THREAD_MAX_MEM) + 1;
+			size_t mem = comp_chunk_mem(len);
+			if (num_threads == 0) {
+				mem_budget_reserve(mem);
+			} else if (0 != mem_budget_try_reserve(mem)) {
+				break;
+			}
+			batch_mem += mem;
+			args[num_threads].ir_readlen = len;
 		}
 
 #if DEBUG_LEVEL >= 1
-	fprintf(stderr, "(%d) STATUS: compression: batch (%d/%d) has %d threads\n", \
-		getpid(), batch_index + 1, num_batches, num_threads);
+	fprintf(stderr, "(%d) STATUS: compression: batch at chunk %lu of %lu has " \
+		"%d threads\n", getpid(), chunk + 1, num_chunks, num_threads);
 #endif
 
-		/* STA: Set Thread Arguments */
+		/* The batch has joined its threads and freed its buffers by the time
+		 * it returns, so only then is their memory handed back */
+		int ret = compress_batch(input_fp, out_writer, args, num_threads, offset);
+		mem_budget_release(batch_mem);
+		if (ret != 0) {
+			fclose(out_writer);
+			return -1;
+		}
+	}
 
-		/* STA1: Open up the input file with 'num_batches' readers, each at their
-		* starting location for the reading they have to do */
-		for (int thread_index = 0; thread_index < num_threads; thread_index++) {
-			args[thread_index].input_reader = fopen(input_fp, "rb");
-			if (args[thread_index].input_reader == NULL) {
-				perror("fopen (comp_file)");
-				return -1;
-			}
-			/* STA2: Position the cursor of each reader such that it will
-			 * read at the part of the file it is responsible for reading */
-			fseek(args[thread_index].input_reader, \
-				(batch_index * max_bytes_per_batch) + (thread_index * COMP_THREAD_MAX_MEM), \
-				SEEK_SET);
-			/* STA3: Allocate space for the LZMA properties(?) */
-			args[thread_index].props_len = LZMA_PROPS_SIZE;
-			args[thread_index].props = malloc(LZMA_PROPS_SIZE);
-			if (args[thread_index].props == NULL) {
-				fprintf(stderr, "ERROR: could not allocate props "\
-					"(asked for %d bytes)\n", LZMA_PROPS_SIZE);
-				return -1;
-			}
+	fclose(out_writer);
 
-			/* STA4: Set the number of bytes (the read length) each input
-			 * reader must read ('ir_readlen'), allocate memory for reading
-			 * from the file, set the number of bytes in the out buffer
-			 * ('outbuf_len'), and allocate memory for the out buffer */
-			/* If this is the last thread in the last batch, do not blindly
-			 * read the maximum amount, but only what is left to read */
-			if (batch_index == num_batches - 1 && thread_index == num_threads - 1) {
-				args[thread_index].ir_readlen = \
-					s.st_size \
-					- (batch_index * max_bytes_per_batch) \
-					- (thread_index * COMP_THREAD_MAX_MEM); // If this is the last thread, read only the remaining bytes of the file
-				args[thread_index].inbuf = malloc(args[thread_index].ir_readlen);
-				if (args[thread_index].inbuf == NULL) {
-					fprintf(stderr, "ERROR: could not allocate input buffer "\
-						"(asked for %ld bytes)\n", args[thread_index].ir_readlen);
-					return -1;
-				}
-				/* / 3 + 128 was some simple math recommended by LZMA SDK? */
-				args[thread_index].outbuf_len = args[thread_index].ir_readlen + args[thread_index].ir_readlen / 3 + 128;
-				args[thread_index].outbuf = malloc(args[thread_index].outbuf_len);
-				if (args[thread_index].outbuf == NULL) {
-					fprintf(stderr, "ERROR: could not allocate output buffer "\
-						"(asked for %ld bytes)\n", args[thread_index].outbuf_len);
-					return -1;
-				}
-			} else {
-				args[thread_index].ir_readlen = COMP_THREAD_MAX_MEM;
-				args[thread_index].inbuf = malloc(COMP_THREAD_MAX_MEM);
-				if (args[thread_index].inbuf == NULL) {
-					fprintf(stderr, "ERROR: could not allocate input buffer "\
-						"(asked for %d bytes)\n", COMP_THREAD_MAX_MEM);
-					return -1;
-				}
-				/* / 3 + 128 was some simple math recommended by LZMA SDK? */
-				size_t max_outbuf_len = COMP_THREAD_MAX_MEM + COMP_THREAD_MAX_MEM / 3 + 128;
-				args[thread_index].outbuf_len = max_outbuf_len;
-				args[thread_index].outbuf = malloc(max_outbuf_len);
-				if (args[thread_index].outbuf == NULL) {
-					fprintf(stderr, "ERROR: could not allocate output buffer "\
-						"(asked for %ld bytes)\n", max_outbuf_len);
-					return -1;
-				}
-			}
-		}
+#if DEBUG_LEVEL >= 1
+	fprintf(stderr, "(%d) STATUS: compression: \"%s\" has been compressed. " \
+		"The result is stored at \"%s\"\n", getpid(), input_fp, \
+		output_fp);
+#endif
 
-		/* RT: Run Threads */
-		pthread_t thread_id[num_threads];
-		/* RT1: Create threads with their given tasks/arguments */
-		for (int t = 0; t < num_threads - 1; t++) {
-			if (0 != \
-				pthread_create(&thread_id[t], NULL, compress_chunk_of_file, &args[t])) {
+	return 0;
+	/* }}} */
+}
 
-				fprintf(stderr, "ERROR: Could not create threads\n");
-				return -1;
-			}
+
+/** Takes a batch of chunks of a compressed file whose thread arguments have
+ * been set, uncompresses each chunk on its own thread, and appends the
+ * results to the output file.
+ *
+ * \param '*out_writer' the output file.
+ * \param '*args' the thread arguments of the chunks.
+ * \param 'num_threads' the number of chunks in the batch.
+ * \return 0 upon success, and a negative int upon failure.
+ */
+static int uncompress_batch(FILE * out_writer, CompThreadArgs * args, int num_threads) {
+	/* {{{ */
+	/* As in 'compress_batch()', a failed chunk stops the batch only once all
+	 * of it is joined and freed */
+	int ret = 0;
+
+	/* RT: Run Threads */
+	pthread_t thread_id[num_threads];
+	int created;
+	/* RT1: Create threads with their given tasks/arguments */
+	for (created = 0; ret == 0 && created < num_threads - 1; created++) {
+		if (0 != pthread_create(&thread_id[created], NULL, uncompress_chunk_of_file, \
+			&args[created])) {
+
+			fprintf(stderr, "ERROR: Could not create threads\n");
+			ret = -1;
+			break;
 		}
-		/* RT2: Have this "thread" compress as well since otherwise it would be
-		 * waiting idly */
-		compress_chunk_of_file(&args[num_threads - 1]);
+	}
+	/* RT2: Have this "thread" uncompress as well since otherwise it would
+	 * be waiting idly */
+	if (ret == 0) {
+		uncompress_chunk_of_file(&args[num_threads - 1]);
 		if (args[num_threads - 1].return_val != 0) {
-			fprintf(stderr, "ERROR: thread failed to compress assigned chunk\n");
-			return -1;
+			fprintf(stderr, "ERROR: thread failed to uncompress assigned chunk\n");
+			ret = -1;
 		}
+	}
 
-		/* RT3: Wait for all the threads to finish their compression */
-		for (int t = 0; t < num_threads - 1; t++) {
-			pthread_join(thread_id[t], NULL);
-			if (args[t].return_val != 0) {
-				fprintf(stderr, "ERROR: thread failed to compress assigned chunk\n");
-				return -1;
-			}
+	/* RT3: Wait for all the threads to finish their compression */
+	for (int t = 0; t < created; t++) {
+		pthread_join(thread_id[t], NULL);
+		if (args[t].return_val != 0) {
+			fprintf(stderr, "ERROR: thread failed to uncompress assigned chunk\n");
+			ret = -1;
 		}
+	}
 
-		/* MUTW: Make use of the Threads' Work */
-		for (int t = 0; t < num_threads; t++) {
-			/* MUTW1: Write the EC header of the current thread to the output file */
-			if (0 != write_ec_header(&args[t].echeader, out_writer)) {
-				fprintf(stderr, "ERROR: Could not write EC header to output file\n");
-				return -1;
-			}
-
-			/* MUTW2: Write the (lzma props + the outbuf) or (the inbuf) to the
-			 * output file, writing 'inbuf' if the compressed data (+ its props)
-			 * takes up the same amount of space or more than the input data */
-			if (args[t].props_len + args[t].outbuf_len >= args[t].ir_readlen) {
-				if (1 != \
-					fwrite(&args[t].inbuf[0], args[t].ir_readlen, 1, out_writer)) {
+	/* MUTW: Make use of the Threads' Work */
+	for (int t = 0; ret == 0 && t < num_threads; t++) {
+		/* Write the outbuf to the output file */
+		if (args[t].outbuf_len != 0 && 1 != \
+			fwrite(args[t].outbuf, args[t].outbuf_len, 1, out_writer)) {
 
-					fprintf(stderr, "ERROR: Could not write data content to output file\n");
-					return -1;
-				}
-			} else {
-				if (1 != \
-					fwrite(args[t].props, args[t].props_len, 1, out_writer)) {
+			fprintf(stderr, "ERROR: Could not write data content output file\n");
+			ret = -1;
+			break;
+		}
+	}
 
-					fprintf(stderr, "ERROR: Could not write data content output file\n");
-					return -1;
-				}
+	free_batch(args, num_threads);
 
-				if (1 != \
-					fwrite(args[t].outbuf, args[t].outbuf_len, 1, out_writer)) {
+	return ret;
+	/* }}} */
+}
 
-					fprintf(stderr, "ERROR: Could not write data content output file\n");
-					return -1;
-				}
-			}
-			/* Free dynamically alloc'd buffers */
-			free(args[t].inbuf);
-			free(args[t].props);
-			free(args[t].outbuf);
-			/* Close open file streams */
-			fclose(args[t].input_reader);
-		}
-	}
 
-	fclose(out_writer);
+/** Takes an output file path and opens the file there for writing from
+ * 'offset' bytes in, keeping what comes before and dropping the rest. At
+ * offset 0 the file is created if need be */
+static FILE * open_output_at(char * output_fp, off_t offset) {
+	FILE * out_writer;
 
-#if DEBUG_LEVEL >= 1
-	fprintf(stderr, "(%d) STATUS: compression: \"%s\" has been compressed. " \
-		"The result is stored at \"%s\"\n", getpid(), input_fp, \
-		output_fp);
-#endif
+	if (offset == 0) {
+		return fopen(output_fp, "wb");
+	}
+	if ((out_writer = fopen(output_fp, "r+b")) == NULL) {
+		return NULL;
+	}
+	if (0 != ftruncate(fileno(out_writer), offset) \
+		|| 0 != fseeko(out_writer, offset, SEEK_SET)) {
 
-	return 0;
-	/* }}} */
+		fclose(out_writer);
+		return NULL;
+	}
+	return out_writer;
 }
 
 
 /** Takes an input file path, which points to a file compressed by
  * 'comp_file()' and uncompresses it, writing the uncompressed result to the
- * file at the output file path.
+ * file at the output file path from 'offset' bytes in. What the output file
+ * holds before that is kept, which is how a file compressed from part way
+ * in is put back together.
  *
  * \param '*input_fp' the path to the input file.
- * \param '*output_fp' the path to the output file.
+ * \param '*output_fp' the path to the output file, which must hold at least
+ *     'offset' bytes already.
+ * \param 'offset' where in the output file to start writing.
  * \return 0 upon success, and a negative int upon failure.
  */
-int uncomp_file(char * input_fp, char * output_fp) {
+int uncomp_file(char * input_fp, char * output_fp, off_t offset) {
 	/* {{{ */
 	struct stat s;
 	stat(input_fp, &s);
@@ -520,9 +737,10 @@ int uncomp_file(char * input_fp, char * output_fp) {
 		return -1;
 	}
 
-	FILE * out_writer = fopen(output_fp, "wb");
+	FILE * out_writer = open_output_at(output_fp, offset);
 	if (out_writer == NULL) {
 		perror("fopen (uncomp_file)");
+		fclose(in_file);
 		return -1;
 	}
 
@@ -574,6 +792,9 @@ int uncomp_file(char * input_fp, char * output_fp) {
 	while (bytes_left > 0) {
 
 		num_threads = COMP_MAX_THREADS;
+		size_t batch_mem = 0;
+		int failed = 0;
+		clear_batch(args, COMP_MAX_THREADS);
 
 		/* STA: Set Thread Arguments */
 		for (int thread_index = 0; thread_index < COMP_MAX_THREADS; thread_index++) {
@@ -587,9 +808,31 @@ int uncomp_file(char * input_fp, char * output_fp) {
 					break;
 				} else {
 					fprintf(stderr, "ERROR: couldn't read EC header from chunk\n");
-					return -1;
+					failed = 1;
+					break;
+				}
+			}
+
+			/* Reserve the chunk's buffers from the server's memory budget:
+			 * the batch waits for room for its first chunk, and stops short
+			 * at the first chunk after that there is no room for right away,
+			 * leaving its header to be read again by the next batch */
+			size_t mem = LZMA_PROPS_SIZE + args[thread_index].echeader.proc_size;
+			if (args[thread_index].echeader.compressed == EC_COMPRESSED) {
+				mem += args[thread_index].echeader.orig_size;
+			}
+			if (thread_index == 0) {
+				mem_budget_reserve(mem);
+			} else if (0 != mem_budget_try_reserve(mem)) {
+				if (0 != fseek(in_file, -(long) EC_HEADER_SIZE, SEEK_CUR)) {
+					perror("fseek (uncomp_file)");
+					failed = 1;
+					break;
 				}
+				num_threads = thread_index;
+				break;
 			}
+			batch_mem += mem;
 
 			bytes_left -= EC_HEADER_SIZE;
 			cur_pos += EC_HEADER_SIZE;
@@ -599,7 +842,8 @@ int uncomp_file(char * input_fp, char * output_fp) {
 			args[thread_index].input_reader = fopen(input_fp, "rb");
 			if (args[thread_index].input_reader == NULL) {
 				perror("fopen (uncomp_file)");
-				return -1;
+				failed = 1;
+				break;
 			}
 			/* Position the cursor of each reader */
 			fseek(args[thread_index].input_reader, cur_pos, SEEK_SET);
@@ -610,7 +854,8 @@ int uncomp_file(char * input_fp, char * output_fp) {
 			if (args[thread_index].props == NULL) {
 				fprintf(stderr, "ERROR: could not allocate props "\
 					"(asked for %d bytes)\n", LZMA_PROPS_SIZE);
-				return -1;
+				failed = 1;
+				break;
 			}
 			/* STA4: Set the read length and allocate space for the input buffer */
 			args[thread_index].ir_readlen = args[thread_index].echeader.proc_size;
@@ -618,7 +863,8 @@ int uncomp_file(char * input_fp, char * output_fp) {
 			if (args[thread_index].inbuf == NULL) {
 				fprintf(stderr, "ERROR: could not allocate input buffer "\
 					"(asked for %ld bytes)\n", args[thread_index].ir_readlen);
-				return -1;
+				failed = 1;
+				break;
 			}
 			/* STA5: If the processed data is compressed, allocate room for
 			 * uncompressed data */
@@ -628,7 +874,8 @@ int uncomp_file(char * input_fp, char * output_fp) {
 				if (args[thread_index].outbuf == NULL) {
 					fprintf(stderr, "ERROR: could not allocate output buffer "\
 						"(asked for %ld bytes)\n", args[thread_index].echeader.orig_size);
-					return -1;
+					failed = 1;
+					break;
 				}
 			}
 
@@ -652,7 +899,8 @@ int uncomp_file(char * input_fp, char * output_fp) {
 				SEEK_CUR)) {
 
 				perror("fseek (uncomp_file)");
-				return -1;
+				failed = 1;
+				break;
 			}
 
 			bytes_left -= args[thread_index].echeader.proc_size;
@@ -664,54 +912,24 @@ int uncomp_file(char * input_fp, char * output_fp) {
 		"%d threads\n", getpid(), batch_index + 1, num_threads);
 #endif
 
-		/* RT: Run Threads */
-		pthread_t thread_id[num_threads];
-		/* RT1: Create threads with their given tasks/arguments */
-		for (int t = 0; t < num_threads - 1; t++) {
-			if (0 != \
-				pthread_create(&thread_id[t], NULL, uncompress_chunk_of_file, &args[t])) {
-
-				fprintf(stderr, "ERROR: Could not create threads\n");
-				return -1;
-			}
-		}
-		/* RT2: Have this "thread" uncompress as well since otherwise it would
-		 * be waiting idly */
-		uncompress_chunk_of_file(&args[num_threads - 1]);
-		if (args[num_threads - 1].return_val != 0) {
-			fprintf(stderr, "ERROR: thread failed to uncompress assigned chunk\n");
+		/* Whatever the batch set up before it failed is freed before its
+		 * memory is handed back */
+		if (failed) {
+			free_batch(args, COMP_MAX_THREADS);
+			mem_budget_release(batch_mem);
+			fclose(in_file);
+			fclose(out_writer);
 			return -1;
 		}
 
-		/* RT3: Wait for all the threads to finish their compression */
-		for (int t = 0; t < num_threads - 1; t++) {
-			pthread_join(thread_id[t], NULL);
-			if (args[t].return_val != 0) {
-				fprintf(stderr, "ERROR: thread failed to uncompress assigned chunk\n");
-				return -1;
-			}
-		}
-
-		/* MUTW: Make use of the Threads' Work */
-		for (int t = 0; t < num_threads; t++) {
-			/* Write the outbuf to the output file */
-			if (1 != \
-				fwrite(args[t].outbuf, args[t].outbuf_len, 1, out_writer)) {
-
-				fprintf(stderr, "ERROR: Could not write data content output file\n");
-				return -1;
-			}
-			/* Free dynamically alloc'd buffers */
-			free(args[t].inbuf);
-			free(args[t].props);
-			/* 'outbuf' is set to point to 'inbuf' if the data was not
-			 * compressed. To avoid double freeing 'inbuf', check that the data
-			 * was compressed before freeing 'outbuf' */
-			if (args[t].echeader.compressed == EC_COMPRESSED) {
-				free(args[t].outbuf);
-			}
-			/* Close open file streams */
-			fclose(args[t].input_reader);
+		/* The batch has joined its threads and freed its buffers by the time
+		 * it returns, so only then is their memory handed back */
+		int ret = uncompress_batch(out_writer, args, num_threads);
+		mem_budget_release(batch_mem);
+		if (ret != 0) {
+			fclose(in_file);
+			fclose(out_writer);
+			return -1;
 		}
 
 #if DEBUG_LEVEL >= 1
@@ -719,8 +937,159 @@ int uncomp_file(char * input_fp, char * output_fp) {
 #endif
 	}
 
+	fclose(in_file);
 	fclose(out_writer);
 
 	return 0;
 	/* }}} */
 }
+
+
+/** Takes a buffer of at most 'COMP_THREAD_MAX_MEM' bytes and compresses it
+ * into the same layout as a file of one chunk compressed by 'comp_file()':
+ * its EC header, followed by the LZMA props and the compressed data, or by
+ * the data as it is if compressing it saves nothing. Nothing touches the
+ * disk, which is what makes sending a small file inline cheap.
+ *
+ * \param '*in' the data to compress.
+ * \param 'len' the number of bytes at 'in'.
+ * \param '*out' will be modified to contain the compressed data. It must
+ *     have room for 'comp_buf_bound(len)' bytes.
+ * \param '*out_len' will be modified to contain the number of bytes
+ *     written to 'out'.
+ * \return 0 upon success, and a negative int upon failure.
+ */
+int comp_buf(const uint8_t * in, size_t len, uint8_t * out, size_t * out_len) {
+	/* {{{ */
+	struct ec_header echeader;
+	uint8_t *props = &out[EC_HEADER_SIZE];
+	size_t props_len = LZMA_PROPS_SIZE;
+	/* Compressed data that would not be shorter than the input is not
+	 * kept, so it needs no more room than the input */
+	size_t comp_len = len > props_len ? len - props_len : 0;
+	size_t mem = comp_chunk_mem(len);
+	int ret = SZ_ERROR_OUTPUT_EOF;
+
+	if (len > COMP_THREAD_MAX_MEM) {
+		return -1;
+	}
+
+	if (comp_len > 0) {
+		mem_budget_reserve(mem);
+		cpu_gate_enter();
+		ret = LzmaCompress(&props[props_len], &comp_len, in, len, props, &props_len, \
+			COMP_LEVEL, comp_dict_size(len), 3, 0, 2, 32, 1);
+		cpu_gate_leave();
+		mem_budget_release(mem);
+	}
+
+	echeader.orig_size = len;
+	if (ret == SZ_OK && props_len + comp_len < len) {
+		echeader.compressed = EC_COMPRESSED;
+		echeader.proc_size = comp_len;
+		*out_len = EC_HEADER_SIZE + props_len + comp_len;
+	} else if (ret == SZ_OK || ret == SZ_ERROR_OUTPUT_EOF) {
+		echeader.compressed = EC_UNCOMPRESSED;
+		echeader.proc_size = len;
+		memcpy(&out[EC_HEADER_SIZE], in, len);
+		*out_len = EC_HEADER_SIZE + len;
+	} else {
+		fprintf(stderr, "ERROR: compression call failed!\n");
+		return -1;
+	}
+
+	/* Laid out field by field, as 'write_ec_header()' writes it */
+	out[0] = echeader.compressed;
+	memcpy(&out[1], &echeader.orig_size, sizeof(size_t));
+	memcpy(&out[1 + sizeof(size_t)], &echeader.proc_size, sizeof(size_t));
+
+	return 0;
+	/* }}} */
+}
+
+
+/** Returns the most bytes 'comp_buf()' writes for 'len' bytes of input */
+size_t comp_buf_bound(size_t len) {
+	return EC_HEADER_SIZE + len;
+}
+
+
+/** Takes the start of a stream of chunks written by 'comp_file()' and says
+ * how long its first chunk is, header included.
+ *
+ * \param '*in' the stream.
+ * \param 'len' the number of bytes at 'in'.
+ * \return the length of the first chunk, 0 if 'len' bytes are too few to
+ *     hold its header, or a negative int if the header is malformed.
+ */
+ssize_t ec_chunk_len(const uint8_t * in, size_t len) {
+	struct ec_header echeader;
+
+	if (len < EC_HEADER_SIZE) {
+		return 0;
+	}
+	echeader.compressed = in[0];
+	memcpy(&echeader.orig_size, &in[1], sizeof(size_t));
+	memcpy(&echeader.proc_size, &in[1 + sizeof(size_t)], sizeof(size_t));
+	if (echeader.orig_size > COMP_THREAD_MAX_MEM || echeader.proc_size > COMP_THREAD_MAX_MEM \
+		|| (echeader.compressed != EC_COMPRESSED && echeader.compressed != EC_UNCOMPRESSED)) {
+
+		return -1;
+	}
+
+	return EC_HEADER_SIZE + echeader.proc_size \
+		+ (echeader.compressed == EC_COMPRESSED ? LZMA_PROPS_SIZE : 0);
+}
+
+
+/** Takes the output of 'comp_buf()' and uncompresses it.
+ *
+ * \param '*in' the compressed data.
+ * \param 'len' the number of bytes at 'in'.
+ * \param '*out' will be modified to contain the uncompressed data.
+ * \param '*out_len' the room at 'out', which will be modified to contain
+ *     the number of bytes written to it.
+ * \return 0 upon success, and a negative int if the data is malformed or
+ *     does not fit.
+ */
+int uncomp_buf(const uint8_t * in, size_t len, uint8_t * out, size_t * out_len) {
+	/* {{{ */
+	struct ec_header echeader;
+
+	if (len < EC_HEADER_SIZE) {
+		return -1;
+	}
+	echeader.compressed = in[0];
+	memcpy(&echeader.orig_size, &in[1], sizeof(size_t));
+	memcpy(&echeader.proc_size, &in[1 + sizeof(size_t)], sizeof(size_t));
+	in += EC_HEADER_SIZE;
+	len -= EC_HEADER_SIZE;
+	if (echeader.orig_size > *out_len) {
+		return -2;
+	}
+
+	if (echeader.compressed == EC_UNCOMPRESSED) {
+		if (echeader.proc_size != len || echeader.orig_size != len) {
+			return -3;
+		}
+		memcpy(out, in, len);
+		*out_len = len;
+		return 0;
+	}
+
+	size_t src_len = len - LZMA_PROPS_SIZE;
+	size_t dest_len = echeader.orig_size;
+	if (echeader.compressed != EC_COMPRESSED || len < LZMA_PROPS_SIZE \
+		|| echeader.proc_size != src_len \
+		|| SZ_OK != LzmaUncompress(out, &dest_len, &in[LZMA_PROPS_SIZE], &src_len, \
+			in, LZMA_PROPS_SIZE) \
+		|| dest_len != echeader.orig_size) {
+
+		fprintf(stderr, "ERROR: uncompression call failed!\n");
+		return -4;
+	}
+	*out_len = dest_len;
+
+	return 0;
+	/* }}} */
+}
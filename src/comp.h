@@ -1,5 +1,6 @@
 #include <stdint.h>
 #include <stdio.h>
+#include <sys/types.h>
 
 #define COMP_EXT ".comp"
 /* How many bytes each thread involved in compression/uncompression is allowed
@@ -16,6 +17,12 @@
  *      128 MB = (1 << 27) bytes (maximum value for 32-bit version)
  *       16 MB = (1 << 24) bytes (default) */
 static const size_t COMP_DICT_SIZE = (1 << 24);
+/* The smallest dictionary the LZMA encoder takes. Chunks smaller than
+ * 'COMP_DICT_SIZE' are compressed with a dictionary just big enough for them */
+#define COMP_MIN_DICT_SIZE (1 << 12)
+/* Roughly what the LZMA encoder allocates besides its match finder: its
+ * state, price tables and output buffer */
+#define COMP_ENCODER_STATE_MEM (1 << 20)
 /* An integer from 1-9, 5 is the default, higher number = greater compression
  * ratio */
 static const size_t COMP_LEVEL = 9;
@@ -53,6 +60,14 @@ char * compression_name(char * filename);
 
 char * temp_compression_name(char * filename);
 
-int comp_file(char * inputfilepath, char * outputfilepath);
+int comp_file(char * inputfilepath, off_t start, off_t end, char * outputfilepath);
 
-int uncomp_file(char * inputfilepath, char * outputfilepath);
+int uncomp_file(char * inputfilepath, char * outputfilepath, off_t offset);
+
+int comp_buf(const uint8_t * in, size_t len, uint8_t * out, size_t * out_len);
+
+size_t comp_buf_bound(size_t len);
+
+int uncomp_buf(const uint8_t * in, size_t len, uint8_t * out, size_t * out_len);
+
+ssize_t ec_chunk_len(const uint8_t * in, size_t len);
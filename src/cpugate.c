@@ -0,0 +1,192 @@
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "cpugate.h"
+
+
+/* The chunks of every file being compressed or encrypted by any process of
+ * the server pass through one gate, which lets a fixed number of them (one
+ * per CPU by default) run at once and holds the rest back in the order they
+ * arrived, so that a session with a large file cannot starve the others and
+ * the server as a whole never has more chunks running than it has CPUs.
+ *
+ * Each chunk takes a numbered ticket, and ticket 't' may run once
+ * 't < released + tokens', where 'released' counts the chunks that have
+ * finished: whichever chunks finish, the number running is 'tokens' for as
+ * long as there are chunks waiting. Waiting is a futex on 'released', which a
+ * process that dies while waiting leaves nothing behind in. The supervisor
+ * gives back whatever tickets a dead worker process still held. */
+
+
+/* Define a struct holding the state of the gate, in memory shared by the
+ * server and every worker process it forks */
+struct cpu_gate {
+	/* Guards 'next_ticket', 'held' and changes to 'released'. A process that
+	 * dies while holding it does not leave it locked */
+	pthread_mutex_t lock;
+	uint32_t tokens;
+	/* The number of tickets ever handed out */
+	uint32_t next_ticket;
+	/* The number of tickets ever given back. Read without the lock by the
+	 * chunks waiting on it */
+	uint32_t released;
+	int nslots;
+	/* The tickets each worker process has taken and not given back */
+	uint32_t held[];
+};
+
+
+/* The gate this process draws tickets from, and the slot it draws them as.
+ * A process that has not joined a gate (the client) is never held back */
+static struct cpu_gate *joined = NULL;
+static int joined_slot = 0;
+
+
+static void gate_lock(struct cpu_gate *gate) {
+	/* The previous holder died: it may have taken a ticket without counting
+	 * it as held, which only costs the gate a token until restart */
+	if (pthread_mutex_lock(&gate->lock) == EOWNERDEAD) {
+		pthread_mutex_consistent(&gate->lock);
+	}
+}
+
+
+static void gate_wake(struct cpu_gate *gate) {
+	syscall(SYS_futex, &gate->released, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+
+/** Creates a gate that lets 'tokens' chunks run at once, shared by up to
+ * 'nslots' processes, in memory that is shared with any process forked
+ * afterwards.
+ *
+ * \param 'tokens' the most chunks that may run at once.
+ * \param 'nslots' the number of processes that will join the gate.
+ * \return a pointer to the gate, or NULL upon failure.
+ */
+struct cpu_gate * cpu_gate_create(int tokens, int nslots) {
+	/* {{{ */
+	pthread_mutexattr_t attr;
+	struct cpu_gate *gate;
+
+	if (tokens < 1 || nslots < 1) {
+		return NULL;
+	}
+
+	size_t size = sizeof(struct cpu_gate) + nslots * sizeof(uint32_t);
+	gate = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (gate == MAP_FAILED) {
+		return NULL;
+	}
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&gate->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	/* 'mmap()' hands back zeroed memory */
+	gate->tokens = tokens;
+	gate->nslots = nslots;
+
+	return gate;
+	/* }}} */
+}
+
+
+/** Takes a gate and makes every chunk this process compresses or encrypts
+ * from now on pass through it, with the tickets counted against 'slot'.
+ *
+ * \param '*gate' the gate.
+ * \param 'slot' the number of the process, from 0 to 'nslots' - 1.
+ * \return void.
+ */
+void cpu_gate_join(struct cpu_gate *gate, int slot) {
+	if (slot < 0 || slot >= gate->nslots) {
+		return;
+	}
+	joined = gate;
+	joined_slot = slot;
+}
+
+
+/** Waits until the chunk about to be worked on by the calling thread may
+ * run. Must be followed by 'cpu_gate_leave()' once the chunk is done. Returns
+ * straight away if this process has not joined a gate */
+void cpu_gate_enter(void) {
+	/* {{{ */
+	struct cpu_gate *gate = joined;
+	uint32_t ticket, released;
+
+	if (gate == NULL) {
+		return;
+	}
+
+	gate_lock(gate);
+	ticket = gate->next_ticket++;
+	gate->held[joined_slot]++;
+	pthread_mutex_unlock(&gate->lock);
+
+	/* Every chunk that finishes wakes all the waiting ones, but only the one
+	 * whose turn it is goes through */
+	while (released = __atomic_load_n(&gate->released, __ATOMIC_ACQUIRE), \
+		ticket - released >= gate->tokens) {
+
+		syscall(SYS_futex, &gate->released, FUTEX_WAIT, released, NULL, NULL, 0);
+	}
+	/* }}} */
+}
+
+
+/** Gives back the ticket taken by the matching 'cpu_gate_enter()', letting
+ * the next waiting chunk run */
+void cpu_gate_leave(void) {
+	struct cpu_gate *gate = joined;
+
+	if (gate == NULL) {
+		return;
+	}
+
+	gate_lock(gate);
+	gate->held[joined_slot]--;
+	__atomic_store_n(&gate->released, gate->released + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&gate->lock);
+	gate_wake(gate);
+}
+
+
+/** Takes a gate and gives back every ticket still held by the process that
+ * joined it as 'slot', which must have exited. Whether those tickets were
+ * running or still waiting, the chunks behind them may then go ahead. A
+ * ticket that was still waiting is counted as run before its turn, so one
+ * more chunk than usual runs until its turn comes round.
+ *
+ * \param '*gate' the gate.
+ * \param 'slot' the slot of the process that exited.
+ * \return void.
+ */
+void cpu_gate_reclaim(struct cpu_gate *gate, int slot) {
+	if (slot < 0 || slot >= gate->nslots) {
+		return;
+	}
+
+	gate_lock(gate);
+	if (gate->held[slot] > 0) {
+#if DEBUG_LEVEL >= 1
+		fprintf(stderr, "(%d) STATUS: giving back %u CPU tokens of worker process %d\n", \
+			getpid(), gate->held[slot], slot);
+#endif
+		__atomic_store_n(&gate->released, gate->released + gate->held[slot], \
+			__ATOMIC_RELEASE);
+		gate->held[slot] = 0;
+	}
+	pthread_mutex_unlock(&gate->lock);
+	gate_wake(gate);
+}
@@ -0,0 +1,18 @@
+#ifndef CPUGATE_HEADER
+#define CPUGATE_HEADER
+
+
+struct cpu_gate;
+
+
+struct cpu_gate * cpu_gate_create(int tokens, int nslots);
+
+void cpu_gate_join(struct cpu_gate *gate, int slot);
+
+void cpu_gate_enter(void);
+
+void cpu_gate_leave(void);
+
+void cpu_gate_reclaim(struct cpu_gate *gate, int slot);
+
+#endif
@@ -0,0 +1,458 @@
+/* For splice() and F_SETPIPE_SZ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "dataconn.h"
+#include "fileops.h"
+
+
+/* The most blocks 'data_write()' hands to the kernel in one call */
+#define BLOCK_WRITE_BATCH 32
+/* The size asked for the pipe plain transfers are received through, which is
+ * the most one 'data_recv_file()' call moves */
+#define RAW_PIPE_LEN (1 << 20)
+/* The buffer plain transfers are copied through when the kernel cannot move
+ * them between the socket and the file itself */
+#define RAW_COPY_LEN (1 << 16)
+
+
+/** Takes a data connection and sets it up to carry data over the connected
+ * socket 'fd' in the transmission mode 'mode'.
+ *
+ * \param '*conn' the data connection to set up.
+ * \param 'fd' the connected socket.
+ * \param 'mode' 'MODE_STREAM' or 'MODE_BLOCK'.
+ * \return void.
+ */
+void data_conn_init(struct data_conn *conn, int fd, char mode) {
+	conn->fd = fd;
+	conn->mode = mode;
+	conn->desc = 0;
+	conn->hdr_have = 0;
+	conn->left = 0;
+	conn->calls = 0;
+}
+
+
+/** Writes every byte described by the 'n' entries of 'iov' to the data
+ * connection 'conn', retrying on short writes. A peer that has gone away
+ * makes this fail rather than raise SIGPIPE. 'iov' is modified. Returns 0 on
+ * success, -1 on failure */
+static int send_iov(struct data_conn *conn, struct iovec *iov, int n) {
+	struct msghdr msg;
+
+	while (n > 0) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = n;
+
+		ssize_t w = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+		conn->calls++;
+		if (w <= 0) return -1;
+
+		/* Skip the entries that were written in full and advance into the
+		 * one that was written in part */
+		while (n > 0 && (size_t) w >= iov->iov_len) {
+			w -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if (n > 0) {
+			iov->iov_base = (uint8_t *) iov->iov_base + w;
+			iov->iov_len -= w;
+		}
+	}
+
+	return 0;
+}
+
+
+/** Takes a data connection and writes 'len' bytes from 'buf' to it. In block
+ * mode the bytes are cut into blocks of at most 'BLOCK_MAX_COUNT' bytes, and
+ * the headers and data of up to 'BLOCK_WRITE_BATCH' blocks are written with a
+ * single system call.
+ *
+ * \param '*conn' the data connection.
+ * \param '*buf' the bytes to write.
+ * \param 'len' the number of bytes to write.
+ * \return 0 on success, a negative int upon failure.
+ */
+int data_write(struct data_conn *conn, const void *buf, size_t len) {
+	/* {{{ */
+	const uint8_t *p = (const uint8_t *) buf;
+	struct iovec iov[2 * BLOCK_WRITE_BATCH];
+	uint8_t headers[BLOCK_WRITE_BATCH][BLOCK_HEADER_LEN];
+
+	if (conn->mode == MODE_STREAM) {
+		iov[0].iov_base = (void *) p;
+		iov[0].iov_len = len;
+		return send_iov(conn, iov, 1);
+	}
+
+	while (len > 0) {
+		int n = 0;
+		for (int b = 0; b < BLOCK_WRITE_BATCH && len > 0; b++) {
+			size_t count = len < BLOCK_MAX_COUNT ? len : BLOCK_MAX_COUNT;
+
+			headers[b][0] = 0;
+			put_be(&headers[b][1], count, 2);
+			iov[n].iov_base = headers[b];
+			iov[n++].iov_len = BLOCK_HEADER_LEN;
+			iov[n].iov_base = (void *) p;
+			iov[n++].iov_len = count;
+
+			p += count;
+			len -= count;
+		}
+		if (0 != send_iov(conn, iov, n)) {
+			return -1;
+		}
+	}
+
+	return 0;
+	/* }}} */
+}
+
+
+/** Takes a data connection and tells the other end that this end has no
+ * more data to send for the current transfer: in stream mode by closing the
+ * connection for writing, and in block mode by sending an empty block marked
+ * EOF, which leaves the connection open for the next transfer.
+ *
+ * \param '*conn' the data connection.
+ * \return 0 on success, a negative int upon failure.
+ */
+int data_end(struct data_conn *conn) {
+	uint8_t header[BLOCK_HEADER_LEN] = { BLOCK_DESC_EOF, 0, 0 };
+	struct iovec iov;
+
+	if (conn->mode == MODE_STREAM) {
+		conn->calls++;
+		return shutdown(conn->fd, SHUT_WR);
+	}
+
+	iov.iov_base = header;
+	iov.iov_len = sizeof(header);
+	return send_iov(conn, &iov, 1);
+}
+
+
+/** Returns the most data bytes a segment started with
+ * 'data_segment_header()' can hold on the data connection 'conn': a block in
+ * block mode, and any number of bytes in stream mode */
+size_t data_segment_max(const struct data_conn *conn) {
+	return conn->mode == MODE_BLOCK ? BLOCK_MAX_COUNT : SIZE_MAX;
+}
+
+
+/** Takes a data connection and writes the header that must come before the
+ * next 'count' data bytes sent over it, for callers that lay data out in
+ * their own buffers rather than going through 'data_write()'.
+ *
+ * \param '*conn' the data connection.
+ * \param '*dst' will be modified to contain the header.
+ * \param 'count' the number of data bytes that follow the header, at most
+ *     'data_segment_max(conn)'.
+ * \return the number of bytes written to 'dst': 'BLOCK_HEADER_LEN' in block
+ *     mode, and 0 in stream mode.
+ */
+size_t data_segment_header(const struct data_conn *conn, uint8_t *dst, size_t count) {
+	if (conn->mode != MODE_BLOCK) {
+		return 0;
+	}
+
+	dst[0] = 0;
+	put_be(&dst[1], count, 2);
+
+	return BLOCK_HEADER_LEN;
+}
+
+
+/** Returns the number of bytes 'len' data bytes take up on the data
+ * connection 'conn' once they are cut into segments of
+ * 'data_segment_max(conn)' bytes */
+size_t data_encoded_len(const struct data_conn *conn, size_t len) {
+	if (conn->mode != MODE_BLOCK) {
+		return len;
+	}
+	return len + (len + BLOCK_MAX_COUNT - 1) / BLOCK_MAX_COUNT * BLOCK_HEADER_LEN;
+}
+
+
+/** Takes a data connection and reads up to 'len' bytes of the current
+ * transfer's data from it into 'buf'. On a non-blocking connection this
+ * stops as soon as there is nothing to read, even in the middle of a block
+ * header, and picks up from there on the next call. In block mode the header
+ * of the next block is read with the same system call as the end of the
+ * block before it, unless that block ends the transfer.
+ *
+ * \param '*conn' the data connection.
+ * \param '*buf' will be modified to contain the bytes read.
+ * \param 'len' the most bytes to read.
+ * \return the number of bytes read, 0 once the other end has ended the
+ *     transfer's data, 'DATA_AGAIN' if the connection is non-blocking and
+ *     has nothing to read yet, or another negative int upon failure. In block
+ *     mode the connection closing before the EOF block is a failure.
+ */
+ssize_t data_read(struct data_conn *conn, void *buf, size_t len) {
+	/* {{{ */
+	struct iovec iov[2];
+	ssize_t r;
+
+	if (conn->mode == MODE_STREAM) {
+		conn->calls++;
+		r = read(conn->fd, buf, len);
+		if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return DATA_AGAIN;
+		}
+		return r < 0 ? -1 : r;
+	}
+
+	while (conn->left == 0) {
+		/* The data of the EOF block (if any) has been read: the transfer is
+		 * over, and the next read starts on the next transfer's blocks */
+		if (conn->desc & BLOCK_DESC_EOF) {
+			conn->desc = 0;
+			return 0;
+		}
+		while (conn->hdr_have < BLOCK_HEADER_LEN) {
+			conn->calls++;
+			r = read(conn->fd, &conn->hdr[conn->hdr_have], \
+				BLOCK_HEADER_LEN - conn->hdr_have);
+			if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				return DATA_AGAIN;
+			}
+			if (r <= 0) {
+				return -1;
+			}
+			conn->hdr_have += r;
+		}
+		conn->hdr_have = 0;
+		/* Restart markers and suspected-error blocks are never sent by this
+		 * implementation */
+		if (conn->hdr[0] & ~(BLOCK_DESC_EOF | BLOCK_DESC_EOR)) {
+			fprintf(stderr, "ERROR: unsupported block descriptor 0x%02x\n", conn->hdr[0]);
+			return -3;
+		}
+		conn->desc = conn->hdr[0];
+		conn->left = get_be(&conn->hdr[1], 2);
+	}
+
+	if (len > conn->left) len = conn->left;
+	iov[0].iov_base = buf;
+	iov[0].iov_len = len;
+	/* Whatever follows a block that does not end the transfer is the header
+	 * of the transfer's next block */
+	iov[1].iov_base = conn->hdr;
+	iov[1].iov_len = BLOCK_HEADER_LEN;
+	conn->calls++;
+	r = readv(conn->fd, iov, len == conn->left && !(conn->desc & BLOCK_DESC_EOF) ? 2 : 1);
+	if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return DATA_AGAIN;
+	}
+	if (r <= 0) {
+		return -1;
+	}
+	if ((size_t) r > len) {
+		conn->hdr_have = r - len;
+		r = len;
+	}
+	conn->left -= r;
+
+	return r;
+	/* }}} */
+}
+
+
+/** Takes a data connection and reads exactly 'len' bytes of the current
+ * transfer's data from it into 'buf'.
+ *
+ * \param '*conn' the data connection.
+ * \param '*buf' will be modified to contain the bytes read.
+ * \param 'len' the number of bytes to read.
+ * \return 0 on success, or a negative int upon failure (including the
+ *     transfer's data ending early).
+ */
+int data_read_full(struct data_conn *conn, void *buf, size_t len) {
+	size_t nread = 0;
+
+	while (nread < len) {
+		ssize_t r = data_read(conn, (uint8_t *) buf + nread, len - nread);
+		if (r <= 0) {
+			return -1;
+		}
+		nread += r;
+	}
+
+	return 0;
+}
+
+
+/** Takes a data connection and reads and discards the rest of the current
+ * transfer's data, so that a receiver that gave up on a transfer does not
+ * leave the sender blocked, and, in block mode, so that the connection is at
+ * the start of the next transfer's blocks.
+ *
+ * \param '*conn' the data connection.
+ * \return 0 once the other end ended the transfer's data, or a negative int
+ *     if the connection failed first.
+ */
+int data_drain(struct data_conn *conn) {
+	uint8_t buf[4096];
+	ssize_t r;
+
+	while ((r = data_read(conn, buf, sizeof(buf))) > 0);
+
+	return r == 0 ? 0 : -1;
+}
+
+
+/** Takes a data connection in stream mode and sends up to 'len' bytes of the
+ * file 'fd' from '*offset' over it without copying them through user space,
+ * for transfers that send a file as it is. Where 'sendfile()' does not work
+ * with the file, the bytes are read and sent instead.
+ *
+ * \param '*conn' the data connection.
+ * \param 'fd' the file to send from.
+ * \param '*offset' the offset in the file to send from, which will be
+ *     modified to be past the bytes sent.
+ * \param 'len' the most bytes to send.
+ * \return the number of bytes sent, 0 if the file ends at '*offset',
+ *     'DATA_AGAIN' if the connection is non-blocking and its buffer is full,
+ *     or another negative int upon failure.
+ */
+ssize_t data_send_file(struct data_conn *conn, int fd, off_t *offset, size_t len) {
+	/* {{{ */
+	uint8_t buf[RAW_COPY_LEN];
+	ssize_t r, w;
+
+	if (conn->mode != MODE_STREAM) {
+		return -1;
+	}
+
+	conn->calls++;
+	r = sendfile(conn->fd, fd, offset, len);
+	if (r >= 0) {
+		return r;
+	}
+	if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		return DATA_AGAIN;
+	}
+	if (errno != EINVAL && errno != ENOSYS) {
+		return -1;
+	}
+
+	if (len > sizeof(buf)) len = sizeof(buf);
+	if ((r = pread(fd, buf, len, *offset)) <= 0) {
+		return r;
+	}
+	/* Whatever does not fit in the socket's buffer is read again next
+	 * time */
+	conn->calls++;
+	w = send(conn->fd, buf, r, MSG_NOSIGNAL);
+	if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return DATA_AGAIN;
+	}
+	if (w <= 0) {
+		return -1;
+	}
+	*offset += w;
+
+	return w;
+	/* }}} */
+}
+
+
+/** Takes a pipe and makes it ready for 'data_recv_file()': non-blocking and
+ * as large as the system lets it be, up to 'RAW_PIPE_LEN' bytes.
+ *
+ * \param 'pipefd' will be modified to contain the read and write ends of the
+ *     pipe.
+ * \return 0 on success, a negative int upon failure.
+ */
+int data_pipe_open(int pipefd[2]) {
+	if (pipe2(pipefd, O_NONBLOCK | O_CLOEXEC) < 0) {
+		return -1;
+	}
+	/* A smaller pipe only means more system calls */
+	fcntl(pipefd[1], F_SETPIPE_SZ, RAW_PIPE_LEN);
+
+	return 0;
+}
+
+
+/** Takes a data connection in stream mode and moves what has arrived of the
+ * transfer's data to the end of the file 'fd' through the pipe 'pipefd', so
+ * the bytes never enter user space. Where 'splice()' does not work with the
+ * file, the bytes are read and written instead.
+ *
+ * \param '*conn' the data connection.
+ * \param 'fd' the file to write to.
+ * \param 'pipefd' an empty pipe from 'data_pipe_open()'. It is empty again
+ *     when this returns, unless it returns a failure.
+ * \return the number of bytes written to the file, 0 once the other end has
+ *     closed the connection, 'DATA_AGAIN' if the connection is non-blocking
+ *     and has nothing to read yet, or another negative int upon failure.
+ */
+ssize_t data_recv_file(struct data_conn *conn, int fd, int pipefd[2]) {
+	/* {{{ */
+	uint8_t buf[RAW_COPY_LEN];
+	ssize_t r, w;
+	size_t left;
+
+	if (conn->mode != MODE_STREAM) {
+		return -1;
+	}
+
+	conn->calls++;
+	r = splice(conn->fd, NULL, pipefd[1], NULL, RAW_PIPE_LEN, \
+		SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return DATA_AGAIN;
+	}
+	if (r <= 0) {
+		return r;
+	}
+
+	for (left = r; left > 0; left -= w) {
+		w = splice(pipefd[0], NULL, fd, NULL, left, SPLICE_F_MOVE);
+		if (w > 0) continue;
+		if (w == 0 || (errno != EINVAL && errno != ENOSYS)) {
+			return -1;
+		}
+		/* The file cannot be spliced to: the bytes in the pipe are copied
+		 * out of it */
+		w = read(pipefd[0], buf, left < sizeof(buf) ? left : sizeof(buf));
+		if (w <= 0 || write(fd, buf, w) != w) {
+			return -1;
+		}
+	}
+
+	return r;
+	/* }}} */
+}
+
+
+/** Takes an array of data connections and the number of them that are open,
+ * closes all of them, and sets '*nconns' to 0.
+ *
+ * \param '*conns' the data connections.
+ * \param '*nconns' the number of open data connections.
+ * \return void.
+ */
+void data_close_all(struct data_conn *conns, int *nconns) {
+	for (int i = 0; i < *nconns; i++) {
+		close(conns[i].fd);
+	}
+	*nconns = 0;
+}
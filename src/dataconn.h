@@ -0,0 +1,74 @@
+#ifndef DATACONN_HEADER
+#define DATACONN_HEADER
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* The transmission modes (RFC 959 section 3.4) a data connection can be in */
+#define MODE_STREAM 'S'
+#define MODE_BLOCK 'B'
+/* A block starts with a descriptor byte followed by the big-endian 16-bit
+ * count of the data bytes in the block */
+#define BLOCK_HEADER_LEN 3
+#define BLOCK_MAX_COUNT 0xffff
+/* The descriptor bits of the block that ends the data of a transfer, and of
+ * one that ends a record, which carries nothing special for file data */
+#define BLOCK_DESC_EOF 0x40
+#define BLOCK_DESC_EOR 0x80
+/* Returned by 'data_read()' when a non-blocking connection has nothing to
+ * read yet */
+#define DATA_AGAIN -2
+
+
+/* Define a struct representing one end of a data connection. In stream mode
+ * the end of a transfer's data is signalled by closing the connection, so a
+ * connection carries one transfer. In block mode the data is sent in blocks
+ * and the last block of a transfer is marked EOF, so the connection stays
+ * open for the next transfer */
+struct data_conn {
+	int fd;
+	/* 'MODE_STREAM' or 'MODE_BLOCK' */
+	char mode;
+	/* Block mode: the descriptor of the block being read */
+	uint8_t desc;
+	/* Block mode: the header of the next block, of which 'hdr_have' bytes
+	 * have been read. Kept here so that a non-blocking read can stop in the
+	 * middle of a header */
+	uint8_t hdr[BLOCK_HEADER_LEN];
+	uint8_t hdr_have;
+	/* Block mode: the data bytes of the block being read that have not been
+	 * read yet */
+	uint32_t left;
+	/* The system calls made on the connection since this was last set to
+	 * 0, for the statistics of a transfer */
+	uint64_t calls;
+};
+
+
+void data_conn_init(struct data_conn *conn, int fd, char mode);
+
+int data_write(struct data_conn *conn, const void *buf, size_t len);
+
+int data_end(struct data_conn *conn);
+
+size_t data_segment_max(const struct data_conn *conn);
+
+size_t data_segment_header(const struct data_conn *conn, uint8_t *dst, size_t count);
+
+size_t data_encoded_len(const struct data_conn *conn, size_t len);
+
+ssize_t data_read(struct data_conn *conn, void *buf, size_t len);
+
+int data_read_full(struct data_conn *conn, void *buf, size_t len);
+
+int data_drain(struct data_conn *conn);
+
+ssize_t data_send_file(struct data_conn *conn, int fd, off_t *offset, size_t len);
+
+int data_pipe_open(int pipefd[2]);
+
+ssize_t data_recv_file(struct data_conn *conn, int fd, int pipefd[2]);
+
+void data_close_all(struct data_conn *conns, int *nconns);
+
+#endif
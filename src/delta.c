@@ -0,0 +1,739 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "chacha.h"
+#include "cpugate.h"
+#include "delta.h"
+#include "enc.h"
+#include "fileops.h"
+#include "membudget.h"
+
+
+/* How many bytes of a file are copied at a time */
+#define DELTA_COPY_LEN (1 << 20)
+/* Marks the end of a chain of the signature table, and a block not found */
+#define DELTA_NO_BLOCK UINT32_MAX
+
+
+/* Define a struct for the signatures of the old version of a file, and the
+ * table they are looked up in by their weak hash: 'heads' holds the first
+ * block of each chain, and 'next' the block after each block in its chain */
+struct sig_table {
+	uint8_t key[POLY1305_KEY_LEN];
+	uint32_t block_len;
+	uint64_t base_len;
+	uint32_t nblocks;
+	uint8_t *sigs;
+	uint32_t *heads;
+	uint32_t *next;
+	uint32_t mask;
+};
+
+/* Define a struct for passing arguments to the threads that sign or match a
+ * segment of a file, and for what the threads make of it */
+struct segment_args {
+	int fd;
+	uint64_t offset;
+	size_t len;
+	/* Signing: the key of the strong hash and the length of a block.
+	 * Matching: the signatures of the old version */
+	const uint8_t *key;
+	uint32_t block_len;
+	const struct sig_table *table;
+	uint8_t *out;
+	size_t out_len;
+	int return_val;
+};
+
+
+/** Returns a malloc'd name for a new, empty temporary file in the current
+ * directory for a signature, a delta or a file put together from one, or
+ * NULL upon failure. The caller must free it */
+char * delta_temp_name() {
+	return make_temp_file(DELTA_TEMP_NAME);
+}
+
+
+/** Reads 'len' bytes of the file open at 'fd' from 'offset' bytes in.
+ *
+ * \return 0 upon success, a negative int if the file ends first or can not
+ *     be read.
+ */
+static int pread_full(int fd, uint8_t *buf, size_t len, uint64_t offset) {
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t r = pread(fd, &buf[done], len - done, offset + done);
+		if (r < 0 && errno == EINTR) continue;
+		if (r <= 0) return -1;
+		done += r;
+	}
+
+	return 0;
+}
+
+
+/** Takes the length of the old version of a file and returns the length of
+ * the blocks it is cut into: the power of two at or above its square root,
+ * so that both the number of signatures and the bytes sent for a changed
+ * block grow with the square root of the file */
+static uint32_t block_len_for(uint64_t len) {
+	uint64_t block_len = DELTA_MIN_BLOCK_LEN;
+
+	while (block_len < DELTA_MAX_BLOCK_LEN && block_len * block_len < len) {
+		block_len <<= 1;
+	}
+
+	return block_len;
+}
+
+
+/** rsync's rolling checksum of a block: the sum of its bytes, and the sum of
+ * those sums after each byte, each kept to 16 bits. '*a' and '*b' are set
+ * to the two sums, for 'roll()' to move along */
+static uint32_t weak_sum(const uint8_t *block, size_t len, uint32_t *a, uint32_t *b) {
+	uint32_t sa = 0, sb = 0;
+
+	for (size_t i = 0; i < len; i++) {
+		sa += block[i];
+		sb += (uint32_t) (len - i) * block[i];
+	}
+	*a = sa;
+	*b = sb;
+
+	return (sa & 0xffff) | (sb << 16);
+}
+
+
+/** Moves the sums of a block of 'len' bytes along by one byte, dropping
+ * 'out' from the front and taking 'in' on at the back, and returns the
+ * block's new weak hash */
+static inline uint32_t roll(uint32_t *a, uint32_t *b, size_t len, uint8_t out, uint8_t in) {
+	*a += in - out;
+	*b += *a - (uint32_t) len * out;
+
+	return (*a & 0xffff) | (*b << 16);
+}
+
+
+static void strong_sum(const uint8_t *key, const uint8_t *block, size_t len, \
+	uint8_t out[DELTA_STRONG_LEN]) {
+
+	struct poly1305_state st;
+
+	poly1305_init(&st, key);
+	poly1305_update(&st, block, len);
+	poly1305_finish(&st, out);
+}
+
+
+/** Runs 'fn' on the 'n' segments of a batch, each on its own thread but the
+ * last, which runs on this one. A segment whose thread could not be started
+ * runs on this one too.
+ *
+ * \return 0 if every segment succeeded, a negative int otherwise.
+ */
+static int run_segments(struct segment_args *args, int n, void *(*fn)(void *)) {
+	pthread_t threads[DELTA_MAX_THREADS];
+	int started[DELTA_MAX_THREADS];
+	int ret = 0;
+
+	for (int t = 0; t < n - 1; t++) {
+		started[t] = (0 == pthread_create(&threads[t], NULL, fn, &args[t]));
+		if (!started[t]) {
+			fn(&args[t]);
+		}
+	}
+	fn(&args[n - 1]);
+	for (int t = 0; t < n - 1; t++) {
+		if (started[t]) {
+			pthread_join(threads[t], NULL);
+		}
+	}
+	for (int t = 0; t < n; t++) {
+		if (args[t].return_val != 0) {
+			ret = -1;
+		}
+	}
+
+	return ret;
+}
+
+
+/** Returns how many segments of a file to work on at once: one per CPU, up
+ * to 'DELTA_MAX_THREADS' */
+static int batch_width() {
+	long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (nthreads < 1) nthreads = 1;
+	if (nthreads > DELTA_MAX_THREADS) nthreads = DELTA_MAX_THREADS;
+
+	return nthreads;
+}
+
+
+/** Thread entry point for signing a segment of the old version of a file,
+ * a whole number of blocks long but for the last, whose short last block
+ * has no signature */
+static void *sign_segment(void *arg) {
+	/* {{{ */
+	struct segment_args *t = (struct segment_args *) arg;
+	size_t nblocks = t->len / t->block_len;
+	size_t mem = t->len + nblocks * DELTA_SIG_LEN;
+	uint8_t *buf;
+	uint32_t a, b;
+
+	t->return_val = -1;
+	t->out = NULL;
+	mem_budget_reserve(mem);
+	buf = malloc(t->len);
+	t->out = malloc(nblocks * DELTA_SIG_LEN + 1);
+	if (buf == NULL || t->out == NULL || 0 != pread_full(t->fd, buf, t->len, t->offset)) {
+		free(buf);
+		mem_budget_release(mem);
+		return NULL;
+	}
+
+	cpu_gate_enter();
+	for (size_t i = 0; i < nblocks; i++) {
+		const uint8_t *block = &buf[i * t->block_len];
+		uint8_t *sig = &t->out[i * DELTA_SIG_LEN];
+
+		put_be(sig, weak_sum(block, t->block_len, &a, &b), DELTA_WEAK_LEN);
+		strong_sum(t->key, block, t->block_len, &sig[DELTA_WEAK_LEN]);
+	}
+	cpu_gate_leave();
+	t->out_len = nblocks * DELTA_SIG_LEN;
+
+	free(buf);
+	mem_budget_release(mem);
+	t->return_val = 0;
+	return NULL;
+	/* }}} */
+}
+
+
+/** Takes the old version of a file and writes the signatures of its blocks
+ * to a new temporary file, signing a batch of segments at a time, each on
+ * its own thread. The caller must remove and free '*ret_sig_fp'.
+ *
+ * \param '*fp' the old version of the file.
+ * \param '**ret_sig_fp' set to the name of the signature file.
+ * \return 0 upon success, a negative int upon failure.
+ */
+int delta_sign(const char *fp, char **ret_sig_fp) {
+	/* {{{ */
+	uint8_t head[DELTA_SIG_HEADER_LEN];
+	struct segment_args args[DELTA_MAX_THREADS];
+	struct stat st;
+	FILE *out;
+	int fd, ret = 0;
+
+	if ((fd = open(fp, O_RDONLY)) < 0 || 0 != fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+		fprintf(stderr, "ERROR: could not open '%s' to sign it\n", fp);
+		if (fd >= 0) close(fd);
+		return -1;
+	}
+	if ((*ret_sig_fp = delta_temp_name()) == NULL || !(out = fopen(*ret_sig_fp, "wb"))) {
+		fprintf(stderr, "ERROR: could not make a signature file\n");
+		if (*ret_sig_fp != NULL) {
+			remove(*ret_sig_fp);
+			free(*ret_sig_fp);
+		}
+		close(fd);
+		return -1;
+	}
+
+	/* SI1: Write the header, with a fresh key for the strong hashes */
+	uint64_t len = st.st_size;
+	uint32_t block_len = block_len_for(len);
+	uint64_t segment_len = DELTA_SEGMENT_LEN / block_len * block_len;
+	memcpy(head, DELTA_SIG_MAGIC, DELTA_MAGIC_LEN);
+	if (0 != enc_random_bytes(&head[DELTA_MAGIC_LEN], POLY1305_KEY_LEN)) {
+		ret = -1;
+	}
+	put_be(&head[DELTA_MAGIC_LEN + POLY1305_KEY_LEN], block_len, 4);
+	put_be(&head[DELTA_MAGIC_LEN + POLY1305_KEY_LEN + 4], len, 8);
+	if (ret == 0 && 1 != fwrite(head, sizeof(head), 1, out)) {
+		ret = -1;
+	}
+
+	/* SI2: Sign the file a batch of segments at a time, writing out each
+	 * batch's signatures in order */
+	int width = batch_width();
+	for (uint64_t offset = 0; ret == 0 && offset < len; ) {
+		int n = 0;
+		for (; n < width && offset < len; n++) {
+			args[n].fd = fd;
+			args[n].offset = offset;
+			args[n].len = len - offset < segment_len ? len - offset : segment_len;
+			args[n].key = &head[DELTA_MAGIC_LEN];
+			args[n].block_len = block_len;
+			offset += args[n].len;
+		}
+		ret = run_segments(args, n, sign_segment);
+		for (int t = 0; t < n; t++) {
+			if (ret == 0 && args[t].out_len > 0 \
+				&& 1 != fwrite(args[t].out, args[t].out_len, 1, out)) {
+
+				ret = -1;
+			}
+			free(args[t].out);
+		}
+	}
+
+	close(fd);
+	if (0 != fclose(out) || ret != 0) {
+		fprintf(stderr, "ERROR: could not sign '%s'\n", fp);
+		remove(*ret_sig_fp);
+		free(*ret_sig_fp);
+		return -1;
+	}
+
+	return 0;
+	/* }}} */
+}
+
+
+/** Takes a signature file and reads it into '*tab', building the table its
+ * blocks are looked up in. A block the same as one already in the table is
+ * left out, so that a file of many blocks alike (a disk image full of zeros)
+ * does not make for a long chain.
+ *
+ * \return 0 upon success, a negative int if the signatures are malformed.
+ */
+static int read_sigs(const char *sig_fp, struct sig_table *tab) {
+	/* {{{ */
+	uint8_t head[DELTA_SIG_HEADER_LEN];
+	struct stat st;
+	FILE *in;
+	int ret = 0;
+
+	memset(tab, 0, sizeof(*tab));
+	if (!(in = fopen(sig_fp, "rb"))) {
+		return -1;
+	}
+	if (0 != read_bytes(head, sizeof(head), in) \
+		|| memcmp(head, DELTA_SIG_MAGIC, DELTA_MAGIC_LEN) != 0 \
+		|| 0 != fstat(fileno(in), &st)) {
+
+		fclose(in);
+		return -2;
+	}
+	memcpy(tab->key, &head[DELTA_MAGIC_LEN], POLY1305_KEY_LEN);
+	tab->block_len = get_be(&head[DELTA_MAGIC_LEN + POLY1305_KEY_LEN], 4);
+	tab->base_len = get_be(&head[DELTA_MAGIC_LEN + POLY1305_KEY_LEN + 4], 8);
+	if (tab->block_len < DELTA_MIN_BLOCK_LEN || tab->block_len > DELTA_MAX_BLOCK_LEN \
+		|| tab->base_len / tab->block_len >= DELTA_NO_BLOCK \
+		|| (uint64_t) st.st_size != DELTA_SIG_HEADER_LEN \
+			+ tab->base_len / tab->block_len * DELTA_SIG_LEN) {
+
+		fclose(in);
+		return -3;
+	}
+	tab->nblocks = tab->base_len / tab->block_len;
+
+	/* The table has at least as many chains as there are blocks */
+	tab->mask = 1023;
+	while (tab->mask < tab->nblocks) {
+		tab->mask = tab->mask << 1 | 1;
+	}
+	tab->sigs = malloc((size_t) tab->nblocks * DELTA_SIG_LEN + 1);
+	tab->heads = malloc(((size_t) tab->mask + 1) * sizeof(uint32_t));
+	tab->next = malloc(((size_t) tab->nblocks + 1) * sizeof(uint32_t));
+	if (tab->sigs == NULL || tab->heads == NULL || tab->next == NULL \
+		|| 0 != read_bytes(tab->sigs, (size_t) tab->nblocks * DELTA_SIG_LEN, in)) {
+
+		ret = -4;
+	}
+	fclose(in);
+	if (ret != 0) {
+		return ret;
+	}
+
+	memset(tab->heads, 0xff, ((size_t) tab->mask + 1) * sizeof(uint32_t));
+	for (uint32_t i = 0; i < tab->nblocks; i++) {
+		const uint8_t *sig = &tab->sigs[(size_t) i * DELTA_SIG_LEN];
+		uint32_t *head_of = &tab->heads[get_be(sig, DELTA_WEAK_LEN) & tab->mask];
+		uint32_t j = *head_of;
+
+		while (j != DELTA_NO_BLOCK \
+			&& memcmp(&tab->sigs[(size_t) j * DELTA_SIG_LEN], sig, DELTA_SIG_LEN) != 0) {
+
+			j = tab->next[j];
+		}
+		if (j == DELTA_NO_BLOCK) {
+			tab->next[i] = *head_of;
+			*head_of = i;
+		}
+	}
+
+	return 0;
+	/* }}} */
+}
+
+
+static void free_sigs(struct sig_table *tab) {
+	free(tab->sigs);
+	free(tab->heads);
+	free(tab->next);
+}
+
+
+/** Looks for the block at 'block', whose weak hash is 'weak', among the
+ * blocks of the old version. The block after the one matched last,
+ * 'expect', is tried first, so that a run of blocks alike is matched as
+ * one run of the old version.
+ *
+ * \return the number of the block, or 'DELTA_NO_BLOCK' if there is none.
+ */
+static uint32_t find_block(const struct sig_table *tab, uint32_t weak, const uint8_t *block, \
+	uint32_t expect) {
+
+	uint8_t strong[DELTA_STRONG_LEN];
+	int have_strong = 0;
+	const uint8_t *sig;
+
+	if (expect < tab->nblocks) {
+		sig = &tab->sigs[(size_t) expect * DELTA_SIG_LEN];
+		if (get_be(sig, DELTA_WEAK_LEN) == weak) {
+			strong_sum(tab->key, block, tab->block_len, strong);
+			have_strong = 1;
+			if (memcmp(&sig[DELTA_WEAK_LEN], strong, DELTA_STRONG_LEN) == 0) {
+				return expect;
+			}
+		}
+	}
+	for (uint32_t i = tab->heads[weak & tab->mask]; i != DELTA_NO_BLOCK; i = tab->next[i]) {
+		sig = &tab->sigs[(size_t) i * DELTA_SIG_LEN];
+		if (get_be(sig, DELTA_WEAK_LEN) != weak) {
+			continue;
+		}
+		if (!have_strong) {
+			strong_sum(tab->key, block, tab->block_len, strong);
+			have_strong = 1;
+		}
+		if (memcmp(&sig[DELTA_WEAK_LEN], strong, DELTA_STRONG_LEN) == 0) {
+			return i;
+		}
+	}
+
+	return DELTA_NO_BLOCK;
+}
+
+
+static uint8_t *put_copy(uint8_t *out, uint64_t offset, uint64_t len) {
+	out[0] = DELTA_COPY;
+	put_be(&out[1], offset, 8);
+	put_be(&out[9], len, 8);
+
+	return &out[DELTA_COPY_OP_LEN];
+}
+
+
+static uint8_t *put_literal(uint8_t *out, const uint8_t *data, size_t len) {
+	out[0] = DELTA_LITERAL;
+	put_be(&out[1], len, 4);
+	memcpy(&out[DELTA_LITERAL_OP_LEN], data, len);
+
+	return &out[DELTA_LITERAL_OP_LEN + len];
+}
+
+
+/** Returns the most bytes the operations for a segment of 'len' bytes take:
+ * at worst a copy of one block and a literal of one byte, in turn */
+static size_t segment_out_cap(size_t len, uint32_t block_len) {
+	return len + (2 * (len / block_len) + 2) * DELTA_COPY_OP_LEN;
+}
+
+
+/** Thread entry point for matching a segment of the new version of a file:
+ * the rolling checksum moves along the segment a byte at a time, and
+ * wherever it finds a block of the old version, what came before the block
+ * goes out as a literal and the block as a copy. Copies of blocks that
+ * follow each other in the old version are joined into one */
+static void *match_segment(void *arg) {
+	/* {{{ */
+	struct segment_args *t = (struct segment_args *) arg;
+	const struct sig_table *tab = t->table;
+	size_t block_len = tab->block_len, n = t->len;
+	size_t mem = n + segment_out_cap(n, block_len);
+	uint8_t *buf, *o;
+	/* The run of the old version to copy that has not gone out yet */
+	uint64_t copy_off = 0, copy_len = 0;
+	uint32_t expect = DELTA_NO_BLOCK, weak = 0, a = 0, b = 0;
+	/* Where the bytes not yet gone out start, and whether the sums have to
+	 * be worked out afresh at 'pos' */
+	size_t pos = 0, lit = 0;
+	int fresh = 1;
+
+	t->return_val = -1;
+	t->out = NULL;
+	mem_budget_reserve(mem);
+	buf = malloc(n);
+	t->out = malloc(segment_out_cap(n, block_len));
+	if (buf == NULL || t->out == NULL || 0 != pread_full(t->fd, buf, n, t->offset)) {
+		free(buf);
+		mem_budget_release(mem);
+		return NULL;
+	}
+	o = t->out;
+
+	cpu_gate_enter();
+	while (tab->nblocks > 0 && pos + block_len <= n) {
+		if (fresh) {
+			weak = weak_sum(&buf[pos], block_len, &a, &b);
+			fresh = 0;
+		}
+		uint32_t i = find_block(tab, weak, &buf[pos], expect);
+		if (i != DELTA_NO_BLOCK) {
+			uint64_t offset = (uint64_t) i * block_len;
+			if (pos > lit || (copy_len != 0 && copy_off + copy_len != offset)) {
+				if (copy_len != 0) o = put_copy(o, copy_off, copy_len);
+				if (pos > lit) o = put_literal(o, &buf[lit], pos - lit);
+				copy_len = 0;
+			}
+			if (copy_len == 0) copy_off = offset;
+			copy_len += block_len;
+			expect = i + 1;
+			pos += block_len;
+			lit = pos;
+			fresh = 1;
+			continue;
+		}
+		if (pos + block_len < n) {
+			weak = roll(&a, &b, block_len, buf[pos], buf[pos + block_len]);
+		}
+		pos++;
+	}
+	if (copy_len != 0) o = put_copy(o, copy_off, copy_len);
+	if (n > lit) o = put_literal(o, &buf[lit], n - lit);
+	cpu_gate_leave();
+	t->out_len = o - t->out;
+
+	free(buf);
+	mem_budget_release(mem);
+	t->return_val = 0;
+	return NULL;
+	/* }}} */
+}
+
+
+/** Takes the new version of a file and the signatures of the old version,
+ * and writes the delta that makes the new version out of the old one to a
+ * new temporary file, matching a batch of segments at a time, each on its
+ * own thread. The caller must remove and free '*ret_delta_fp'.
+ *
+ * \param '*fp' the new version of the file.
+ * \param '*sig_fp' the signatures of the old version.
+ * \param '**ret_delta_fp' set to the name of the delta file.
+ * \return 0 upon success, a negative int upon failure.
+ */
+int delta_make(const char *fp, const char *sig_fp, char **ret_delta_fp) {
+	/* {{{ */
+	uint8_t head[DELTA_HEADER_LEN];
+	struct segment_args args[DELTA_MAX_THREADS];
+	struct sig_table tab;
+	struct stat st;
+	FILE *out;
+	int fd, ret;
+
+	if (0 != (ret = read_sigs(sig_fp, &tab))) {
+		fprintf(stderr, "ERROR: could not read the signatures (%d)\n", ret);
+		free_sigs(&tab);
+		return -1;
+	}
+	if ((fd = open(fp, O_RDONLY)) < 0 || 0 != fstat(fd, &st)) {
+		fprintf(stderr, "ERROR: could not open '%s'\n", fp);
+		if (fd >= 0) close(fd);
+		free_sigs(&tab);
+		return -1;
+	}
+	if ((*ret_delta_fp = delta_temp_name()) == NULL || !(out = fopen(*ret_delta_fp, "wb"))) {
+		fprintf(stderr, "ERROR: could not make a delta file\n");
+		if (*ret_delta_fp != NULL) {
+			remove(*ret_delta_fp);
+			free(*ret_delta_fp);
+		}
+		close(fd);
+		free_sigs(&tab);
+		return -1;
+	}
+
+	/* DM1: Write the header */
+	uint64_t len = st.st_size;
+	memcpy(head, DELTA_MAGIC, DELTA_MAGIC_LEN);
+	put_be(&head[DELTA_MAGIC_LEN], tab.base_len, 8);
+	put_be(&head[DELTA_MAGIC_LEN + 8], len, 8);
+	if (1 != fwrite(head, sizeof(head), 1, out)) {
+		ret = -1;
+	}
+
+	/* DM2: Match the file a batch of segments at a time, writing out each
+	 * batch's operations in order */
+	int width = batch_width();
+	for (uint64_t offset = 0; ret == 0 && offset < len; ) {
+		int n = 0;
+		for (; n < width && offset < len; n++) {
+			args[n].fd = fd;
+			args[n].offset = offset;
+			args[n].len = len - offset < DELTA_SEGMENT_LEN ? len - offset : DELTA_SEGMENT_LEN;
+			args[n].table = &tab;
+			offset += args[n].len;
+		}
+		ret = run_segments(args, n, match_segment);
+		for (int t = 0; t < n; t++) {
+			if (ret == 0 && 1 != fwrite(args[t].out, args[t].out_len, 1, out)) {
+				ret = -1;
+			}
+			free(args[t].out);
+		}
+	}
+
+	close(fd);
+	free_sigs(&tab);
+	if (0 != fclose(out) || ret != 0) {
+		fprintf(stderr, "ERROR: could not make the delta of '%s'\n", fp);
+		remove(*ret_delta_fp);
+		free(*ret_delta_fp);
+		return -1;
+	}
+
+	return 0;
+	/* }}} */
+}
+
+
+/** Copies 'len' bytes of the file open at 'in_fd' from 'in_off' bytes in to
+ * the file open at 'out_fd' at 'out_off' bytes in, within the kernel where
+ * it can (sharing the blocks outright on a file system that can), and
+ * through 'buf' where it can not.
+ *
+ * \return 0 upon success, a negative int upon failure.
+ */
+static int copy_range(int in_fd, uint64_t in_off, int out_fd, uint64_t out_off, uint64_t len, \
+	uint8_t *buf) {
+
+	loff_t in_pos = in_off, out_pos = out_off;
+
+	while (len > 0) {
+		ssize_t r = copy_file_range(in_fd, &in_pos, out_fd, &out_pos, len, 0);
+		if (r <= 0) break;
+		len -= r;
+	}
+	while (len > 0) {
+		size_t n = len < DELTA_COPY_LEN ? len : DELTA_COPY_LEN;
+		if (0 != pread_full(in_fd, buf, n, in_pos) \
+			|| pwrite(out_fd, buf, n, out_pos) != (ssize_t) n) {
+
+			return -1;
+		}
+		in_pos += n;
+		out_pos += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+
+/** Takes the old version of a file and a delta against it, and writes the
+ * new version the delta makes to 'out_fp', with the old version's
+ * permission bits. The runs of the old version are copied within the
+ * kernel, so putting together a large file that barely changed costs
+ * little more than the change.
+ *
+ * \param '*base_fp' the old version of the file, which must be as long as
+ *     it was when it was signed.
+ * \param '*delta_fp' the delta.
+ * \param '*out_fp' where the new version goes.
+ * \return 0 upon success, a negative int upon failure.
+ */
+int delta_apply(const char *base_fp, const char *delta_fp, const char *out_fp) {
+	/* {{{ */
+	uint8_t head[DELTA_HEADER_LEN], op[DELTA_COPY_OP_LEN];
+	struct stat st;
+	uint64_t done = 0;
+	uint8_t *buf = malloc(DELTA_COPY_LEN);
+	FILE *in = fopen(delta_fp, "rb");
+	int base_fd = open(base_fp, O_RDONLY);
+	int out_fd = open(out_fp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	int ret = 0;
+
+	if (buf == NULL || in == NULL || base_fd < 0 || out_fd < 0 || 0 != fstat(base_fd, &st) \
+		|| 0 != read_bytes(head, sizeof(head), in) \
+		|| memcmp(head, DELTA_MAGIC, DELTA_MAGIC_LEN) != 0 \
+		|| get_be(&head[DELTA_MAGIC_LEN], 8) != (uint64_t) st.st_size) {
+
+		fprintf(stderr, "ERROR: the delta does not fit '%s'\n", base_fp);
+		ret = -1;
+	}
+	uint64_t len = ret == 0 ? get_be(&head[DELTA_MAGIC_LEN + 8], 8) : 0;
+
+	/* AP1: Carry out the operations in turn, up to the end of the delta */
+	while (ret == 0 && 1 == fread(op, 1, 1, in)) {
+		if (op[0] == DELTA_COPY) {
+			if (0 != read_bytes(&op[1], DELTA_COPY_OP_LEN - 1, in)) {
+				ret = -2;
+				break;
+			}
+			uint64_t offset = get_be(&op[1], 8), n = get_be(&op[9], 8);
+			if (offset > (uint64_t) st.st_size || n > (uint64_t) st.st_size - offset \
+				|| n > len - done || 0 != copy_range(base_fd, offset, out_fd, done, n, buf)) {
+
+				ret = -3;
+				break;
+			}
+			done += n;
+		} else if (op[0] == DELTA_LITERAL) {
+			if (0 != read_bytes(&op[1], DELTA_LITERAL_OP_LEN - 1, in)) {
+				ret = -2;
+				break;
+			}
+			uint64_t n = get_be(&op[1], 4);
+			if (n > DELTA_SEGMENT_LEN || n > len - done) {
+				ret = -3;
+				break;
+			}
+			while (n > 0) {
+				size_t m = n < DELTA_COPY_LEN ? n : DELTA_COPY_LEN;
+				if (0 != read_bytes(buf, m, in) || pwrite(out_fd, buf, m, done) != (ssize_t) m) {
+					ret = -4;
+					break;
+				}
+				done += m;
+				n -= m;
+			}
+		} else {
+			ret = -2;
+		}
+	}
+
+	/* AP2: The delta has to make the whole new version */
+	if (ret == 0 && (!feof(in) || done != len \
+		|| 0 != fchmod(out_fd, st.st_mode & 0777))) {
+
+		ret = -5;
+	}
+	if (out_fd >= 0 && 0 != close(out_fd) && ret == 0) {
+		ret = -6;
+	}
+	if (ret != 0) {
+		fprintf(stderr, "ERROR: could not apply the delta to '%s' (%d)\n", base_fp, ret);
+	}
+	if (in != NULL) fclose(in);
+	if (base_fd >= 0) close(base_fd);
+	free(buf);
+
+	return ret == 0 ? 0 : -1;
+	/* }}} */
+}
@@ -0,0 +1,59 @@
+#ifndef DELTA_HEADER
+#define DELTA_HEADER
+#include <stdint.h>
+
+#include "chacha.h"
+
+/* A delta puts a new version of a file together out of the blocks of an old
+ * version that the receiver already has, as rsync does. The receiver cuts
+ * its old version into blocks and sends their signatures: the magic number,
+ * the key of the strong hash, the big-endian 4-byte length of a block and the
+ * big-endian 8-byte length of the old version, followed by the weak and the
+ * strong hash of every whole block in turn */
+#define DELTA_SIG_MAGIC "ECS1"
+#define DELTA_MAGIC_LEN 4
+#define DELTA_SIG_HEADER_LEN (DELTA_MAGIC_LEN + POLY1305_KEY_LEN + 4 + 8)
+/* The weak hash is rsync's rolling checksum, which moves along the new
+ * version a byte at a time for the cost of a few additions. The strong hash
+ * is a Poly1305 tag under a key the receiver picks afresh for every set of
+ * signatures, so no block can be made ahead of time to collide with
+ * another */
+#define DELTA_WEAK_LEN 4
+#define DELTA_STRONG_LEN POLY1305_TAG_LEN
+#define DELTA_SIG_LEN (DELTA_WEAK_LEN + DELTA_STRONG_LEN)
+/* A block is the power of two at or above the square root of the old
+ * version's length, within these bounds */
+#define DELTA_MIN_BLOCK_LEN 1024
+#define DELTA_MAX_BLOCK_LEN (1 << 17)
+/* The sender finds the blocks in its new version and sends the delta: the
+ * magic number and the big-endian 8-byte lengths of the old and the new
+ * version, followed by the operations that make the new version, each a
+ * type byte and its arguments. A copy takes the big-endian 8-byte offset and
+ * length of a run of the old version, and a literal takes the big-endian
+ * 4-byte length of the bytes that follow it, which are taken as they are */
+#define DELTA_MAGIC "ECD1"
+#define DELTA_HEADER_LEN (DELTA_MAGIC_LEN + 8 + 8)
+#define DELTA_COPY 1
+#define DELTA_LITERAL 2
+#define DELTA_COPY_OP_LEN 17
+#define DELTA_LITERAL_OP_LEN 5
+/* Both versions are worked through in segments of about this many bytes,
+ * each on a thread of its own, and the new version's blocks are only looked
+ * for within a segment */
+#define DELTA_SEGMENT_LEN (16 << 20)
+/* The most threads a file is signed or matched on at once */
+#define DELTA_MAX_THREADS 8
+/* What the temporary signature, delta and output files made by
+ * 'delta_temp_name()' are called, less the 'mkstemp()' digits */
+#define DELTA_TEMP_NAME "ecftp.delta"
+
+
+char * delta_temp_name();
+
+int delta_sign(const char *fp, char **ret_sig_fp);
+
+int delta_make(const char *fp, const char *sig_fp, char **ret_delta_fp);
+
+int delta_apply(const char *base_fp, const char *delta_fp, const char *out_fp);
+
+#endif
@@ -1,18 +1,25 @@
 #include <arpa/inet.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #if DEBUG_LEVEL >= 2
 #include <time.h>
 #endif
 
+#include "bignum.h"
 #include "comp.h"
 #include "enc.h"
 #include "ecftp.h"
+#include "fileops.h"
+#include "x25519.h"
 
 
 #if DEBUG_LEVEL >= 2
@@ -73,6 +80,142 @@ void trim(char *str) {
 }
 
 
+/** Takes a line reader and empties it */
+void line_reader_init(struct line_reader *lr) {
+	lr->start = lr->end = 0;
+	lr->skipping = 0;
+}
+
+
+/** Takes a line reader and takes the first whole line out of what has been
+ * read, without its line ending.
+ *
+ * \param '*lr' the line reader.
+ * \param '*line' will be modified to contain the line, NUL-terminated.
+ * \param 'len' the size of 'line'.
+ * \return 1 if a line was taken, 0 if no whole line has been read yet, or
+ *     -1 if a line too long for 'line' was thrown away.
+ */
+int line_take(struct line_reader *lr, char *line, size_t len) {
+	/* {{{ */
+	char *begin = &lr->buf[lr->start];
+	char *nl = memchr(begin, '\n', lr->end - lr->start);
+
+	if (nl == NULL) {
+		/* A line that fills the whole buffer can never be taken, so it is
+		 * thrown away as it arrives */
+		if (lr->start == 0 && lr->end == LINE_BUF_LEN) {
+			lr->end = 0;
+			lr->skipping = 1;
+		}
+		return 0;
+	}
+
+	size_t n = nl - begin;
+	lr->start += n + 1;
+	if (n > 0 && begin[n - 1] == '\r') n--;
+	if (lr->skipping || n >= len) {
+		lr->skipping = 0;
+		return -1;
+	}
+	memcpy(line, begin, n);
+	line[n] = '\0';
+
+	return 1;
+	/* }}} */
+}
+
+
+/** Takes a line reader and reads once from 'fd' into it, making room for
+ * the rest of a line that has only partly arrived.
+ *
+ * \param '*lr' the line reader.
+ * \param 'fd' the control connection.
+ * \return the number of bytes read, 0 if the connection has ended, or a
+ *     negative int with 'errno' set upon failure (including 'EAGAIN' on a
+ *     non-blocking connection with nothing to read).
+ */
+ssize_t line_fill(struct line_reader *lr, int fd) {
+	if (lr->start == lr->end) {
+		lr->start = lr->end = 0;
+	} else if (lr->start > 0 && lr->end == LINE_BUF_LEN) {
+		memmove(lr->buf, &lr->buf[lr->start], lr->end - lr->start);
+		lr->end -= lr->start;
+		lr->start = 0;
+	}
+
+	ssize_t r = read(fd, &lr->buf[lr->end], LINE_BUF_LEN - lr->end);
+	if (r > 0) {
+		lr->end += r;
+	}
+
+	return r;
+}
+
+
+/** Returns the number of bytes a line reader holds that have not been taken
+ * as lines yet */
+size_t line_buffered(const struct line_reader *lr) {
+	return lr->end - lr->start;
+}
+
+
+/** Takes a line reader and reads the 'len' bytes that follow the last line
+ * taken from it into 'buf': first the ones already read ahead, then the
+ * rest from 'fd'. This is how bytes that are not a line, such as the file
+ * sent inline after a reply, are read from a control connection.
+ *
+ * \param '*lr' the line reader.
+ * \param 'fd' the descriptor the line reader reads from, which blocks.
+ * \param '*buf' will be modified to contain the bytes.
+ * \param 'len' the number of bytes to read.
+ * \return 0 upon success, a negative int if the connection ended first.
+ */
+int line_read_bytes(struct line_reader *lr, int fd, void *buf, size_t len) {
+	size_t have = line_buffered(lr) < len ? line_buffered(lr) : len;
+
+	memcpy(buf, &lr->buf[lr->start], have);
+	lr->start += have;
+	while (have < len) {
+		ssize_t r = read(fd, (uint8_t *) buf + have, len - have);
+		if (r < 0 && errno == EINTR) continue;
+		if (r <= 0) return -1;
+		have += r;
+	}
+
+	return 0;
+}
+
+
+/** Writes the 'len' bytes at 'in' to 'out' as 2 lowercase hex digits each,
+ * followed by a '\0' */
+void hex_encode(const uint8_t *in, size_t len, char *out) {
+	static const char digits[] = "0123456789abcdef";
+
+	for (size_t i = 0; i < len; i++) {
+		out[2 * i] = digits[in[i] >> 4];
+		out[2 * i + 1] = digits[in[i] & 0x0f];
+	}
+	out[2 * len] = '\0';
+}
+
+
+/** Reads 'len' bytes written as hex digits at 'in' into 'out'. Returns 0
+ * upon success, a negative int if 'in' holds anything but 2 * 'len' hex
+ * digits before its first space or '\0' */
+int hex_decode(const char *in, uint8_t *out, size_t len) {
+	for (size_t i = 0; i < 2 * len; i++) {
+		int c = tolower((unsigned char) in[i]);
+		int v = isdigit(c) ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+		if (v < 0) return -1;
+		if (i % 2 == 0) out[i / 2] = v << 4;
+		else out[i / 2] |= v;
+	}
+
+	return in[2 * len] == ' ' || in[2 * len] == '\0' ? 0 : -1;
+}
+
+
 /* Modifies 'port' to contain the port of the socket represented by 'fd'.
  *
  * \param 'fd' a file descriptor representing a socket.
@@ -142,21 +285,47 @@ char * temp_recv_name(char * filename) {
 }
 
 
+/** Takes a file name and returns a malloc'd string containing the name the
+ * part of the file kept from a failed transfer goes by ( '<filename>' +
+ * 'PART_EXT' ). The returned string must be freed by the caller of this
+ * function.
+ *
+ * \param '*filename' the name of the file being transferred.
+ * \return a pointer to the name string on success, and NULL on failure.
+ */
+char * part_name(const char * filename) {
+	char *part_fp = malloc(strlen(filename) + strlen(PART_EXT) + 1);
+
+	if (part_fp != NULL) {
+		sprintf(part_fp, "%s%s", filename, PART_EXT);
+	}
+	return part_fp;
+}
+
+
 /** Takes a string 'filename' representing an input file path, a key used to
  * encrypt the file, and pointer to a pointer serving as a return variable, and
- * encrypts and compresses the file, storing the result at
- * '*(ret_prepared_fp)'. The caller of this function must free
+ * encrypts and compresses the file from 'offset' bytes in, storing the result
+ * at '*(ret_prepared_fp)'. The caller of this function must free
  * '*(ret_prepared_fp)'.
  *
  * \param '*filename' a string representing a filepath to the file to be
  *     compressed and encrypted.
- * \param 'key' a key used for the decryption part of this process.
+ * \param 'offset' where in the file to start, a multiple of
+ *     'COMP_THREAD_MAX_MEM': the chunks before it are neither compressed nor
+ *     sent.
+ * \param 'end' where in the file to stop, or 0 for the end of the file: the
+ *     chunks after the one it falls in are neither compressed nor sent.
+ * \param '*params' the negotiated parameters (key, cipher mode, nonce) used
+ *     for the encryption part of this process.
  * \param '**ret_prepared_fp' a pointer which will be modified to contain
  *     a pointer to the filename of the temporary prepared file generated by
  *     this function.
  * \return 0 upon success, a negative int upon failure.
  */
-int prepare_file(char * filename, uint32_t key[4], char ** ret_prepared_fp) {
+int prepare_file(char * filename, uint64_t offset, uint64_t end, \
+	struct enc_params * params, char ** ret_prepared_fp) {
+
 	char * c_out_fp;
 	char * c_out_fp_pure;
 	char * e_out_fp;
@@ -177,7 +346,7 @@ int prepare_file(char * filename, uint32_t key[4], char ** ret_prepared_fp) {
 #endif
 	/* Compress content of file at 'filename' writing output to file at
 	 * 'c_out_fp' */
-	if (0 != comp_file(filename, c_out_fp)) {
+	if (0 != comp_file(filename, offset, end, c_out_fp)) {
 		fprintf(stderr, "ERROR: could not compress file!\n");
 		return -1;
 	}
@@ -208,7 +377,7 @@ int prepare_file(char * filename, uint32_t key[4], char ** ret_prepared_fp) {
 #endif
 	/* Encrypt content of file at 'filename' writing output to file at
 	 * 'e_out_fp' */
-	if (0 != enc_file(c_out_fp, e_out_fp, key)) {
+	if (0 != enc_file(c_out_fp, e_out_fp, params)) {
 		fprintf(stderr, "ERROR: could not encrypt file!\n");
 		return -1;
 	}
@@ -237,16 +406,21 @@ int prepare_file(char * filename, uint32_t key[4], char ** ret_prepared_fp) {
 /** Takes a string 'filename' representing an output file path, a string
  * representing a path to a received file 'recv_fp', and a key used to decrypt
  * the file and decrypts and decompresses the file, storing the result at
- * 'filename'.
+ * 'filename' from 'offset' bytes in.
  *
  * \param '*filename' a string representing a filepath where the decrypted and
  *     decompressed file will be written.
+ * \param 'offset' where in the output file the received file starts. What
+ *     the output file holds before it is kept.
  * \param '*recv_fp' a string representing a filepath to a received file which
  *     will be compressed and encrypted.
- * \param 'key' a key used for the decryption part of this process.
+ * \param '*params' the negotiated parameters (key, cipher mode, nonce) used
+ *     for the decryption part of this process.
  * \return 0 upon success, a negative int upon failure.
  */
-int process_received_file(char * filename, char * recv_fp, uint32_t key[4]) {
+int process_received_file(char * filename, uint64_t offset, char * recv_fp, \
+	struct enc_params * params) {
+
 	char * dec_out_fp;
 	/* Make temporary name for decryted (but not yet decompressed) file
 	 * ( '<filename>.comp-XXXXXX' ) */
@@ -265,7 +439,7 @@ int process_received_file(char * filename, char * recv_fp, uint32_t key[4]) {
 #endif
 	/* Decrypt content of file at 'recv_fp' writing output to file at
 	 * 'dec_out_fp' */
-	if (0 != dec_file(recv_fp, dec_out_fp, key)) {
+	if (0 != dec_file(recv_fp, dec_out_fp, params)) {
 		fprintf(stderr, "ERROR: could not decrypt file!\n");
 		return -1;
 	}
@@ -288,7 +462,7 @@ int process_received_file(char * filename, char * recv_fp, uint32_t key[4]) {
 #endif
 	/* Uncompress content of file at 'dec_out_fp' writing output to file at
 	 * 'filename' */
-	if (0 != uncomp_file(dec_out_fp, filename)) {
+	if (0 != uncomp_file(dec_out_fp, filename, offset)) {
 		fprintf(stderr, "ERROR: could not uncompress file!\n");
 		return -1;
 	}
@@ -312,62 +486,680 @@ int process_received_file(char * filename, char * recv_fp, uint32_t key[4]) {
 }
 
 
-/* CSCD58 Addition - Encryption */
-int do_dh_client(int controlfd, int datafd, uint32_t key[4]) {
-	uint64_t dh_p = 1;
-	dh_p = (dh_p << 32) - 99;
-	uint64_t dh_g = 5;
-	uint64_t dh_a, dh_ka, dh_kb, dh_k;
-	fd_set readfds;
-	FD_ZERO(&readfds);
+/** Takes the file received by a transfer that failed part way, of which the
+ * first 'kept' bytes were all written, and decrypts and decompresses as many
+ * whole chunks of the start of it as it can, checking each one, and writes
+ * them to 'filename' from 'offset' bytes in. Only chunks of a full
+ * 'COMP_THREAD_MAX_MEM' bytes are kept, so the transfer can be restarted
+ * from where they end.
+ *
+ * \param '*filename' the file to write what is kept to, which is locked
+ *     with 'flock()' while it is written. Anything it holds past 'offset'
+ *     bytes is dropped.
+ * \param 'offset' where in the file the received file starts.
+ * \param '*recv_fp' the received file.
+ * \param 'kept' how many bytes at the start of the received file were
+ *     written.
+ * \param '*params' the negotiated parameters of the transfer.
+ * \return how many bytes 'filename' holds that the transfer can be
+ *     restarted after, or a negative int upon failure.
+ */
+int64_t keep_received_prefix(char * filename, uint64_t offset, char * recv_fp, \
+	uint64_t kept, struct enc_params * params) {
+
+	/* {{{ */
+	struct enc_aes_vars avars;
+	/* A whole chunk of the received file, and the decrypted stream of
+	 * compressed chunks not yet uncompressed, which is never more than a
+	 * whole compressed chunk */
+	size_t chunk_len = ENC_THREAD_MAX_MEM + (ENC_MODE_IS_AEAD(params->mode) ? ENC_TAG_LEN : 0);
+	size_t comp_cap = comp_buf_bound(COMP_THREAD_MAX_MEM) + ENC_THREAD_MAX_MEM;
+	size_t comp_len = 0;
+	uint64_t done = offset;
+	int ok = 1;
+
+	if (0 != init_aes_vars(&avars, params)) {
+		return -1;
+	}
+	FILE *in = fopen(recv_fp, "rb");
+	if (in == NULL) {
+		return -1;
+	}
+	/* The file is locked until it is done with, so that a transfer
+	 * restarted after it waits for it */
+	FILE *out = fopen(filename, offset == 0 ? "wb" : "r+b");
+	if (out == NULL || 0 != flock(fileno(out), LOCK_EX) \
+		|| 0 != ftruncate(fileno(out), offset) || 0 != fseeko(out, offset, SEEK_SET)) {
 
-	for (int i = 0; i < 4; i++) {
-		dh_a = (rand() % (dh_p - 2)) + 2;
-		dh_ka = sq_mp(dh_g, dh_a, dh_p);
-		FD_SET(datafd, &readfds);
+		fprintf(stderr, "ERROR: could not keep the part of the file received\n");
+		if (out != NULL) fclose(out);
+		fclose(in);
+		return -1;
+	}
+	uint8_t *chunk = malloc(chunk_len);
+	uint8_t *comp = malloc(comp_cap);
+	uint8_t *data = malloc(COMP_THREAD_MAX_MEM);
+	if (chunk == NULL || comp == NULL || data == NULL) {
+		ok = 0;
+	}
+
+	/* Every chunk is taken for one in the middle of the stream. That only
+	 * fails the last one, if the whole stream was received, which ends with
+	 * the file's short last chunk anyway */
+	for (uint64_t index = 0; ok && (index + 1) * chunk_len <= kept; index++) {
+		if (0 != read_bytes(chunk, chunk_len, in) || 0 != dec_chunk(chunk, index, &avars)) {
+			break;
+		}
+		memcpy(&comp[comp_len], chunk, ENC_THREAD_MAX_MEM);
+		comp_len += ENC_THREAD_MAX_MEM;
 
-		write(datafd, (char *)&dh_ka, sizeof(dh_ka));
+		/* Uncompress every compressed chunk that is there in whole */
+		size_t used = 0;
+		while (ok) {
+			ssize_t n = ec_chunk_len(&comp[used], comp_len - used);
+			size_t data_len = COMP_THREAD_MAX_MEM;
 
-		select(datafd + 1, &readfds, NULL, NULL, NULL);
-		read(datafd, (char *)&dh_kb, sizeof(dh_kb));
+			if (n == 0 || used + n > comp_len) break;
+			if (n < 0 || 0 != uncomp_buf(&comp[used], n, data, &data_len) \
+				|| data_len != COMP_THREAD_MAX_MEM \
+				|| 1 != fwrite(data, data_len, 1, out)) {
 
-		dh_k = sq_mp(dh_kb, dh_a, dh_p);
-		key[i] = dh_k & 0xffffffff;
+				ok = 0;
+				break;
+			}
+			done += data_len;
+			used += n;
+		}
+		memmove(comp, &comp[used], comp_len - used);
+		comp_len -= used;
 	}
 
+	free(chunk);
+	free(comp);
+	free(data);
+	fclose(in);
+	/* A failed write may have left part of a chunk behind */
+	if (0 != fflush(out) || 0 != ftruncate(fileno(out), done)) {
+		fclose(out);
+		return -1;
+	}
+	fclose(out);
+
+#if DEBUG_LEVEL >= 1
+	fprintf(stderr, "(%d) STATUS: kept %lu bytes of the file to restart from\n", \
+		getpid(), (unsigned long) done);
+#endif
+
+	return done;
+	/* }}} */
+}
+
+
+/** Takes a file and keeps only the 'len' bytes of it from 'skip' bytes in,
+ * or as many of them as it holds, moving them down to the start of the file.
+ * A ranged RETR receives the whole chunks that cover the range, and the
+ * range is cut back out of them.
+ *
+ * \param '*filename' the file.
+ * \param 'skip' how many bytes at the start of the file to drop.
+ * \param 'len' how many bytes after them to keep.
+ * \return how many bytes the file holds afterwards, or a negative int upon
+ *     failure.
+ */
+int64_t cut_file_range(char * filename, uint64_t skip, uint64_t len) {
+	struct stat file_stat;
+	uint8_t *buf = NULL;
+	uint64_t done = 0;
+
+	int fd = open(filename, O_RDWR);
+	if (fd < 0) {
+		return -1;
+	}
+	if (0 != fstat(fd, &file_stat)) {
+		close(fd);
+		return -1;
+	}
+	if ((uint64_t) file_stat.st_size <= skip) {
+		len = 0;
+	} else if (len > (uint64_t) file_stat.st_size - skip) {
+		len = file_stat.st_size - skip;
+	}
+
+	if (skip == 0) {
+		done = len;
+	} else if (len != 0 && (buf = malloc(RANGE_COPY_LEN)) != NULL) {
+		/* The bytes only ever move down, so each block is read before
+		 * anything is written over it */
+		while (done < len) {
+			size_t n = len - done < RANGE_COPY_LEN ? len - done : RANGE_COPY_LEN;
+
+			if (pread(fd, buf, n, skip + done) != (ssize_t) n \
+				|| pwrite(fd, buf, n, done) != (ssize_t) n) {
+
+				break;
+			}
+			done += n;
+		}
+		free(buf);
+	}
+
+	if (done != len || 0 != ftruncate(fd, len)) {
+		fprintf(stderr, "ERROR: could not cut the range out of the file\n");
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	return len;
+}
+
+
+/* The key exchange group the client asks for. The server takes whichever
+ * group the client asks for */
+static uint8_t kex_group = KEX_X25519;
+
+
+/** Sets the key exchange group the client asks for when starting a session.
+ *
+ * \param 'group' 'KEX_X25519' or 'KEX_MODP2048'.
+ * \return 0 on success, -1 if 'group' is not a supported group.
+ */
+int set_kex_group(uint8_t group) {
+	if (group != KEX_X25519 && group != KEX_MODP2048) {
+		return -1;
+	}
+	kex_group = group;
+	return 0;
+}
+
+
+/** Returns the number of bytes in a public value of the key exchange group
+ * 'group', or 0 if the group is not supported */
+size_t kex_public_len(uint8_t group) {
+	switch (group) {
+	case KEX_X25519: return X25519_KEY_LEN;
+	case KEX_MODP2048: return BN_MODP2048_LEN;
+	default: return 0;
+	}
+}
+
+
+/** Takes the shared secret of a key exchange and turns it into the key
+ * words. The raw shared secret is not uniformly distributed, so it is not
+ * used as is: each 32 bytes of it, XORed into the key so far, key ChaCha20
+ * in the same way a session secret does in 'enc_derive_transfer_key()', with
+ * the position of the 32 bytes as the counter. An X25519 secret is a single
+ * block, so it uses the counter 0, which no transfer uses.
+ *
+ * \param '*shared' the shared secret.
+ * \param 'len' the number of bytes in '*shared', a multiple of 32.
+ * \param 'key' will be modified to contain the agreed on key.
+ * \return void.
+ */
+static void shared_to_key(const uint8_t *shared, size_t len, uint32_t key[ENC_KEY_WORDS]) {
+	/* {{{ */
+	uint32_t folded[ENC_KEY_WORDS];
+	struct enc_session raw;
+
+	memset(folded, 0, sizeof(folded));
+	for (size_t off = 0; off < len; off += 4 * ENC_KEY_WORDS) {
+		const uint8_t *block = &shared[off];
+		for (int i = 0; i < ENC_KEY_WORDS; i++) {
+			raw.secret[i] = folded[i] ^ ((uint32_t) block[4 * i] \
+				| ((uint32_t) block[4 * i + 1] << 8) \
+				| ((uint32_t) block[4 * i + 2] << 16) \
+				| ((uint32_t) block[4 * i + 3] << 24));
+		}
+		enc_derive_transfer_key(&raw, off / (4 * ENC_KEY_WORDS), folded);
+	}
+
+	memcpy(key, folded, sizeof(folded));
+	memset(folded, 0, sizeof(folded));
+	memset(&raw, 0, sizeof(raw));
+	/* }}} */
+}
+
+
+/** Generates a fresh private key for the key exchange group 'group' and
+ * computes the matching public value.
+ *
+ * \param 'group' the key exchange group.
+ * \param 'priv' will be modified to contain the private key: an X25519
+ *     scalar, or a 256-bit exponent for the MODP group.
+ * \param '*pub' will be modified to contain the public value. It must have
+ *     room for 'kex_public_len(group)' bytes.
+ * \return 0 on success, a negative int upon failure.
+ */
+static int kex_keypair(uint8_t group, uint8_t priv[KEX_PRIV_LEN], uint8_t *pub) {
+	const uint8_t generator = BN_MODP2048_GENERATOR;
+
+	if (0 != enc_random_bytes(priv, KEX_PRIV_LEN)) {
+		return -1;
+	}
+
+	switch (group) {
+	case KEX_X25519:
+		x25519_public_key(pub, priv);
+		return 0;
+	case KEX_MODP2048:
+		return bn_modexp(bn_modp2048(), pub, &generator, 1, priv, KEX_PRIV_LEN);
+	default:
+		return -1;
+	}
+}
+
+
+/** Takes this end's private key and the peer's public value and turns the
+ * shared secret they give into the key words.
+ *
+ * \param 'group' the key exchange group.
+ * \param 'priv' this end's private key.
+ * \param '*peer' the public value received from the other end.
+ * \param 'key' will be modified to contain the agreed on key.
+ * \return 0 upon success, a negative int if the peer's public value is one
+ *     that would give a predictable shared secret: an X25519 point of small
+ *     order, or a MODP value outside 1 < y < p - 1.
+ */
+static int kex_finish(uint8_t group, const uint8_t priv[KEX_PRIV_LEN], \
+	const uint8_t *peer, uint32_t key[ENC_KEY_WORDS]) {
+
+	/* {{{ */
+	uint8_t shared[KEX_MAX_PUBLIC_LEN];
+	size_t shared_len = kex_public_len(group);
+	uint8_t any_set = 0;
+
+	if (group == KEX_X25519) {
+		x25519(shared, priv, peer);
+
+		/* Check for the all-zero output without branching on the secret
+		 * bytes */
+		for (int i = 0; i < X25519_KEY_LEN; i++) {
+			any_set |= shared[i];
+		}
+		if (any_set == 0) {
+			fprintf(stderr, "ERROR: peer sent an X25519 public key of small order\n");
+			return -1;
+		}
+	} else if (group == KEX_MODP2048) {
+		const struct bn_mont *mont = bn_modp2048();
+
+		if (!bn_check_range(mont, peer, BN_MODP2048_LEN) \
+			|| 0 != bn_modexp(mont, shared, peer, BN_MODP2048_LEN, priv, KEX_PRIV_LEN)) {
+
+			fprintf(stderr, "ERROR: peer sent an invalid MODP public value\n");
+			return -1;
+		}
+	} else {
+		return -2;
+	}
+
+	shared_to_key(shared, shared_len, key);
+	memset(shared, 0, sizeof(shared));
+
+	return 0;
+	/* }}} */
+}
+
+
+/* CSCD58 Addition - Encryption */
+/** Takes a connection to the server and performs a Diffie-Hellman key
+ * exchange over it in the group set by 'set_kex_group()' (X25519 by
+ * default). The group is sent along with the client's public value, and the
+ * server answers with its own, so the exchange takes one flight in each
+ * direction: a single round trip.
+ *
+ * \param 'fd' a file descriptor representing the connection to the server.
+ * \param 'key' will be modified to contain the agreed on key.
+ * \return 0 upon success, a negative int upon failure.
+ */
+int do_dh_client(int fd, uint32_t key[ENC_KEY_WORDS]) {
+	uint8_t priv[KEX_PRIV_LEN];
+	uint8_t msg[1 + KEX_MAX_PUBLIC_LEN];
+	uint8_t peer[KEX_MAX_PUBLIC_LEN];
+	uint8_t group = kex_group;
+	size_t pub_len = kex_public_len(group);
+	int ret;
+
+	msg[0] = group;
+	if (0 != kex_keypair(group, priv, &msg[1])) {
+		return -1;
+	}
+
+	/* One write, so that the group and the public value leave together */
+	if (write(fd, msg, 1 + pub_len) != (ssize_t) (1 + pub_len)) {
+		return -1;
+	}
+	if (0 != read_bytes_fd(fd, peer, pub_len)) {
+		return -2;
+	}
+
+	ret = kex_finish(group, priv, peer, key);
+	memset(priv, 0, sizeof(priv));
+	if (ret != 0) return -3;
+
 	return 0;
 }
 /* End CSCD58 Addition - Encryption */
 
 
+/** Takes the client's half of a key exchange, the group byte followed by
+ * the client's public value, and computes the server's half: a fresh key
+ * pair in the same group, whose public value is sent back to the client, and
+ * the agreed on key.
+ *
+ * \param '*msg' the group byte followed by 'kex_public_len()' bytes of the
+ *     client's public value.
+ * \param '*pub' will be modified to contain the server's public value. It
+ *     must have room for 'KEX_MAX_PUBLIC_LEN' bytes.
+ * \param '*pub_len' will be modified to contain the length of '*pub'.
+ * \param 'key' will be modified to contain the agreed on key.
+ * \return 0 upon success, a negative int upon failure.
+ */
+int kex_server_respond(const uint8_t *msg, uint8_t *pub, size_t *pub_len, \
+	uint32_t key[ENC_KEY_WORDS]) {
+
+	uint8_t priv[KEX_PRIV_LEN];
+	uint8_t group = msg[0];
+	int ret;
+
+	*pub_len = kex_public_len(group);
+	if (*pub_len == 0) {
+		fprintf(stderr, "ERROR: client asked for unsupported key exchange group %d\n", group);
+		return -1;
+	}
+	if (0 != kex_keypair(group, priv, pub)) {
+		return -1;
+	}
+
+	ret = kex_finish(group, priv, &msg[1], key);
+	memset(priv, 0, sizeof(priv));
+	if (ret != 0) return -3;
+
+	return 0;
+}
+
+
 /* CSCD58 addition - Encryption */
-int do_dh_server(int controlfd, int datafd, uint32_t key[4]) {
-	uint64_t dh_p = 1;
-	dh_p = (dh_p << 32) - 99;
-	uint64_t dh_g = 5;
-	uint64_t dh_b, dh_ka, dh_kb, dh_k;
-	// TODO: are readfds ever used properly in this function? we call select on
-	// them, but no fd other than datafd is ever accessed and I don't think we
-	// do anything with the fd_set readfds (i.e. we never check if any of the
-	// fds in the set are set and never do anything particular to a given fd in
-	// the set)
-	fd_set readfds;
-	FD_ZERO(&readfds);
-
-	for (int i = 0; i < 4; i++) {
-		dh_b = (rand() % (dh_p - 2)) + 2;
-		dh_kb = sq_mp(dh_g, dh_b, dh_p);
-		FD_SET(datafd, &readfds);
-
-		select(datafd + 1, &readfds, NULL, NULL, NULL);
-		read(datafd, (char *)&dh_ka, sizeof(dh_ka));
-
-		write(datafd, (char *)&dh_kb, sizeof(dh_kb));
-
-		dh_k = sq_mp(dh_ka, dh_b, dh_p);
-		key[i] = dh_k & 0xffffffff;
-	}
-	
+/** Takes a connection to a client and performs the server's side of the
+ * Diffie-Hellman key exchange done by 'do_dh_client()', in whichever group
+ * the client asked for. The client sends its group and public value in one
+ * flight, so the server reads both before answering.
+ *
+ * \param 'fd' a file descriptor representing the connection to the client.
+ * \param 'key' will be modified to contain the agreed on key.
+ * \return 0 upon success, a negative int upon failure.
+ */
+int do_dh_server(int fd, uint32_t key[ENC_KEY_WORDS]) {
+	uint8_t msg[1 + KEX_MAX_PUBLIC_LEN];
+	uint8_t pub[KEX_MAX_PUBLIC_LEN];
+	size_t pub_len;
+
+	if (0 != read_bytes_fd(fd, &msg[0], 1)) {
+		return -1;
+	}
+	pub_len = kex_public_len(msg[0]);
+	if (pub_len == 0) {
+		fprintf(stderr, "ERROR: client asked for unsupported key exchange group %d\n", msg[0]);
+		return -1;
+	}
+	if (0 != read_bytes_fd(fd, &msg[1], pub_len)) {
+		return -2;
+	}
+
+	if (0 != kex_server_respond(msg, pub, &pub_len, key)) {
+		return -3;
+	}
+	if (write(fd, pub, pub_len) != (ssize_t) pub_len) {
+		return -1;
+	}
+
 	return 0;
 }
 /* CSCD58 end of addition - Encryption */
+
+
+/** Takes the control connection of a new session and agrees with the server
+ * on the session's secret, from which the key of every transfer of the
+ * session is derived. This is the only key exchange of the session.
+ *
+ * \param 'controlfd' a file descriptor representing the control connection.
+ * \param '*session' the session, which will have its secret set and its
+ *     transfer counter reset.
+ * \return 0 upon success, a negative int upon failure.
+ */
+int start_session_client(int controlfd, struct enc_session * session) {
+	session->transfer_counter = 0;
+	return do_dh_client(controlfd, session->secret);
+}
+
+
+/** Takes the control connection of a new session and agrees with the client
+ * on the session's secret. See 'start_session_client()'.
+ *
+ * \param 'controlfd' a file descriptor representing the control connection.
+ * \param '*session' the session, which will have its secret set and its
+ *     transfer counter reset.
+ * \return 0 upon success, a negative int upon failure.
+ */
+int start_session_server(int controlfd, struct enc_session * session) {
+	session->transfer_counter = 0;
+	return do_dh_server(controlfd, session->secret);
+}
+
+
+/** Takes the session a transfer belongs to and makes the client's offer for
+ * it: every cipher mode this build supports, most preferred first, along
+ * with a freshly generated nonce, the AES key length asked for, the number of
+ * this transfer in the session and the most data connections the client
+ * will stripe the transfer over. The number is used up whether or not the
+ * server takes the offer.
+ *
+ * \param '*session' the session the transfer belongs to.
+ * \param 'offer' will be modified to contain the offer.
+ * \return 0 upon success, a negative int if no nonce could be made, in which
+ *     case the offer must not be sent.
+ */
+int make_transfer_offer(struct enc_session * session, uint8_t offer[TRANSFER_OFFER_LEN]) {
+	/* The offer is the nonce followed by the modes we support in order of
+	 * preference, padded with zeros to ENC_NUM_MODES bytes, the key length,
+	 * the big-endian transfer number and the most data connections */
+	uint64_t counter = ++session->transfer_counter;
+
+	if (0 != enc_random_bytes(&offer[0], ENC_NONCE_LEN)) {
+		return -1;
+	}
+	enc_mode_preference(&offer[ENC_NONCE_LEN]);
+	offer[OFFER_KEY_LEN_AT] = enc_get_key_len();
+	put_be(&offer[OFFER_COUNTER_AT], counter, 8);
+	offer[OFFER_STREAMS_AT] = stripe_get_max_streams();
+
+	return 0;
+}
+
+
+/** Takes the client's offer for a transfer and the server's reply to it,
+ * and checks that the server picked one of the modes offered and a key
+ * length no shorter than the one asked for. On success, every field of
+ * '*params' is set for the transfer, including the key, which is derived
+ * from the session's secret and the transfer number.
+ *
+ * \param '*session' the session the transfer belongs to.
+ * \param 'offer' the offer made by 'make_transfer_offer()'.
+ * \param 'chosen' the server's reply: the chosen mode followed by the chosen
+ *     key length and the server's most data connections.
+ * \param '*params' the parameters of the transfer, which will be filled in.
+ * \return 0 upon success, a negative int upon failure.
+ */
+int accept_transfer_reply(struct enc_session * session, \
+	const uint8_t offer[TRANSFER_OFFER_LEN], const uint8_t chosen[TRANSFER_REPLY_LEN], \
+	struct transfer_params * params) {
+
+	uint64_t counter;
+
+	/* The server must pick exactly one of the modes we offered */
+	if ((chosen[0] & ENC_MODES_SUPPORTED) == 0 \
+		|| (chosen[0] & (chosen[0] - 1)) != 0) {
+
+		fprintf(stderr, "ERROR: server chose an unsupported cipher mode!\n");
+		return -3;
+	}
+	/* The server may raise the key length, but never lower it */
+	if (chosen[1] < enc_get_key_len() \
+		|| (chosen[1] != 16 && chosen[1] != 24 && chosen[1] != 32)) {
+
+		fprintf(stderr, "ERROR: server chose an unacceptable key length!\n");
+		return -4;
+	}
+
+	counter = get_be(&offer[OFFER_COUNTER_AT], 8);
+	params->enc.mode = chosen[0];
+	params->enc.key_len = chosen[1];
+	memcpy(params->enc.nonce, &offer[0], ENC_NONCE_LEN);
+	enc_derive_transfer_key(session, counter, params->enc.key);
+
+	params->streams = stripe_get_max_streams();
+	if (chosen[2] >= 1 && chosen[2] < params->streams) {
+		params->streams = chosen[2];
+	}
+
+	return 0;
+}
+
+
+/** Takes a data connection, the session it belongs to and a struct of
+ * transfer parameters, sends the client's offer for the transfer and waits
+ * for the server to pick one of the modes, the key length and its own limit
+ * on data connections.
+ *
+ * \param '*conn' the first data connection of the transfer.
+ * \param '*session' the session the transfer belongs to.
+ * \param '*params' the parameters of the transfer, which will be filled in.
+ * \return 0 upon success, a negative int upon failure.
+ */
+int negotiate_transfer_client(struct data_conn * conn, struct enc_session * session, \
+	struct transfer_params * params) {
+
+	uint8_t offer[TRANSFER_OFFER_LEN];
+	uint8_t chosen[TRANSFER_REPLY_LEN];
+
+	if (0 != make_transfer_offer(session, offer)) {
+		return -1;
+	}
+	if (0 != data_write(conn, offer, sizeof(offer))) {
+		return -2;
+	}
+	if (0 != data_read_full(conn, chosen, sizeof(chosen))) {
+		return -3;
+	}
+
+	return accept_transfer_reply(session, offer, chosen, params);
+}
+
+
+/** Takes the client's offer for a transfer, the session it belongs to and a
+ * struct of transfer parameters, and picks the mode both ends support that
+ * is best ranked by both ends together. Each end ranks the modes by whether
+ * they authenticate the data and by how fast they are on that end's
+ * hardware, so the mode with the lowest sum of the two ranks is used, with
+ * ties going to the server's preference. The key length is the longer of the
+ * one the client asked for and the one set on the server, and the most data
+ * connections the transfer may use is the lower of the two ends' limits.
+ * The transfer number must be higher than that of any earlier transfer of
+ * the session, so that no two transfers share a key. On success, every field
+ * of '*params' is set for the transfer.
+ *
+ * \param 'offer' the client's offer, as sent by
+ *     'negotiate_transfer_client()'.
+ * \param '*session' the session the transfer belongs to.
+ * \param '*params' the parameters of the transfer, which will be filled in.
+ * \param 'chosen' will be modified to contain the reply to send the client.
+ * \return 0 upon success, a negative int upon failure.
+ */
+int choose_transfer_params(const uint8_t offer[TRANSFER_OFFER_LEN], \
+	struct enc_session * session, struct transfer_params * params, \
+	uint8_t chosen[TRANSFER_REPLY_LEN]) {
+
+	/* {{{ */
+	uint64_t counter;
+	const uint8_t *client_pref = &offer[ENC_NONCE_LEN];
+	uint8_t server_pref[ENC_NUM_MODES];
+	int best_rank = 2 * ENC_NUM_MODES;
+
+	memset(chosen, 0, TRANSFER_REPLY_LEN);
+	enc_mode_preference(server_pref);
+
+	for (int s = 0; s < ENC_NUM_MODES; s++) {
+		for (int c = 0; c < ENC_NUM_MODES; c++) {
+			if (client_pref[c] == server_pref[s] && s + c < best_rank) {
+				chosen[0] = server_pref[s];
+				best_rank = s + c;
+			}
+		}
+	}
+	if (chosen[0] == 0) {
+		fprintf(stderr, "ERROR: client offered no supported cipher mode!\n");
+		return -2;
+	}
+
+	chosen[1] = offer[OFFER_KEY_LEN_AT];
+	if (chosen[1] != 16 && chosen[1] != 24 && chosen[1] != 32) {
+		fprintf(stderr, "ERROR: client asked for an invalid key length!\n");
+		return -3;
+	}
+	if (chosen[1] < enc_get_key_len()) {
+		chosen[1] = enc_get_key_len();
+	}
+
+	counter = get_be(&offer[OFFER_COUNTER_AT], 8);
+	if (counter <= session->transfer_counter) {
+		fprintf(stderr, "ERROR: client reused a transfer number!\n");
+		return -5;
+	}
+
+	chosen[2] = stripe_get_max_streams();
+	params->streams = chosen[2];
+	uint8_t client_streams = offer[OFFER_STREAMS_AT];
+	if (client_streams >= 1 && client_streams < params->streams) {
+		params->streams = client_streams;
+	}
+
+	params->enc.mode = chosen[0];
+	params->enc.key_len = chosen[1];
+	memcpy(params->enc.nonce, &offer[0], ENC_NONCE_LEN);
+	session->transfer_counter = counter;
+	enc_derive_transfer_key(session, counter, params->enc.key);
+
+	return 0;
+	/* }}} */
+}
+
+
+/** Takes a data connection, the session it belongs to and a struct of
+ * transfer parameters, reads the client's offer, picks the transfer's
+ * parameters with 'choose_transfer_params()' and tells the client which
+ * were picked.
+ *
+ * \param '*conn' the first data connection of the transfer.
+ * \param '*session' the session the transfer belongs to.
+ * \param '*params' the parameters of the transfer, which will be filled in.
+ * \return 0 upon success, a negative int upon failure.
+ */
+int negotiate_transfer_server(struct data_conn * conn, struct enc_session * session, \
+	struct transfer_params * params) {
+
+	uint8_t offer[TRANSFER_OFFER_LEN];
+	uint8_t chosen[TRANSFER_REPLY_LEN];
+	int ret;
+
+	if (0 != data_read_full(conn, offer, sizeof(offer))) {
+		return -1;
+	}
+	if (0 != (ret = choose_transfer_params(offer, session, params, chosen))) {
+		return ret;
+	}
+	if (0 != data_write(conn, chosen, sizeof(chosen))) {
+		return -4;
+	}
+
+	return 0;
+}
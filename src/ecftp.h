@@ -3,34 +3,156 @@
 
 #include <arpa/inet.h>
 #include <stdint.h>
+#include <sys/types.h>
+
+#include "dataconn.h"
+#include "enc.h"
+#include "stripe.h"
 
 #define KEEP_TEMP_ENC_FILES 0
 #define KEEP_TEMP_COMP_FILES 0
 #define MAXLINE 4096
+/* The most bytes of a control connection read ahead of the line being
+ * handled */
+#define LINE_BUF_LEN (2 * MAXLINE)
 #define LISTENQ 1024
 #define NDATAFD 4
+/* How long the server waits for the client to open a data connection to its
+ * passive port, in milliseconds */
+#define PASV_TIMEOUT_MS 30000
 #define TRUE 1
 #define FALSE 0
 #define CMD_LS 1
 #define CMD_GET 2
 #define CMD_PUT 3
 #define CMD_QUIT 4
+#define CMD_STAT 5
+/* Many files and directories, bundled into one transfer */
+#define CMD_MGET 6
+#define CMD_MPUT 7
+/* A range of the bytes of a file */
+#define CMD_RGET 8
+/* The signatures of a file, and a delta against them */
+#define CMD_SIGN 9
+#define CMD_DELT 10
+/* The key exchange groups the session's secret can be agreed on in */
+#define KEX_X25519 0x01
+#define KEX_MODP2048 0x02
+/* The number of bytes in a key exchange private key: an X25519 scalar, or the
+ * exponent used in the MODP group */
+#define KEX_PRIV_LEN 32
+/* The number of bytes in the largest public value, a MODP group element */
+#define KEX_MAX_PUBLIC_LEN 256
+/* The client's offer for a transfer is the nonce, the modes it supports in
+ * order of preference, the key length, the big-endian 8-byte transfer number
+ * and the most data connections. The server's reply is the chosen mode, key
+ * length and its most data connections */
+#define OFFER_KEY_LEN_AT (ENC_NONCE_LEN + ENC_NUM_MODES)
+#define OFFER_COUNTER_AT (OFFER_KEY_LEN_AT + 1)
+#define OFFER_STREAMS_AT (OFFER_COUNTER_AT + 8)
+#define TRANSFER_OFFER_LEN (OFFER_STREAMS_AT + 1)
+#define TRANSFER_REPLY_LEN 3
+/* The largest file a RETR may be answered with inline, after its reply on
+ * the control connection, rather than over a data connection */
+#define INLINE_MAX_LEN (16 * 1024)
+/* The most bytes a file of 'INLINE_MAX_LEN' bytes is sent inline as, once
+ * compressed (with its header) and encrypted (with a tag or padding) */
+#define INLINE_MAX_PAYLOAD (INLINE_MAX_LEN + 64)
+/* What the part of a file kept from a failed transfer is called, after the
+ * file: the whole chunks at its start that arrived and were checked. A REST
+ * offset is a multiple of the chunk size, 'COMP_THREAD_MAX_MEM', and the
+ * transfer after it only compresses and sends the chunks from there on */
+#define PART_EXT ".ecftp-part"
+/* How many bytes at a time 'cut_file_range()' moves the range of a file down
+ * to its start */
+#define RANGE_COPY_LEN (1 << 20)
+
+
+/* Define a struct holding everything the two ends of a transfer agree on
+ * before any of the file is sent */
+struct transfer_params {
+	/* The cipher mode, key and nonce the transfer is encrypted with */
+	struct enc_params enc;
+	/* The most data connections the transfer may be striped over */
+	uint8_t streams;
+};
+
+/* Define a struct holding what has been read from a control connection and
+ * not yet taken as a line: the commands (or replies) the other end sent
+ * without waiting for the answer to the one before, and the start of one
+ * that has not all arrived. Commands and replies each end in CRLF */
+struct line_reader {
+	char buf[LINE_BUF_LEN];
+	size_t start, end;
+	/* Set while the rest of a line too long to take is thrown away */
+	int skipping;
+};
 
 
 void trim(char *str);
 
+void line_reader_init(struct line_reader *lr);
+
+int line_take(struct line_reader *lr, char *line, size_t len);
+
+ssize_t line_fill(struct line_reader *lr, int fd);
+
+size_t line_buffered(const struct line_reader *lr);
+
+int line_read_bytes(struct line_reader *lr, int fd, void *buf, size_t len);
+
+void hex_encode(const uint8_t *in, size_t len, char *out);
+
+int hex_decode(const char *in, uint8_t *out, size_t len);
+
 int get_port(int fd, uint16_t *port);
 
 int get_ip_port(int fd, char *ip, uint16_t *port);
 
 char * temp_recv_name(char * filename);
 
-int prepare_file(char * filename, uint32_t key[4], char ** ret_prepared_fp);
+char * part_name(const char * filename);
+
+int prepare_file(char * filename, uint64_t offset, uint64_t end, \
+	struct enc_params * params, char ** ret_prepared_fp);
+
+int process_received_file(char * filename, uint64_t offset, char * recv_fp, \
+	struct enc_params * params);
+
+int64_t keep_received_prefix(char * filename, uint64_t offset, char * recv_fp, \
+	uint64_t kept, struct enc_params * params);
+
+int64_t cut_file_range(char * filename, uint64_t skip, uint64_t len);
+
+int set_kex_group(uint8_t group);
+
+size_t kex_public_len(uint8_t group);
+
+int kex_server_respond(const uint8_t *msg, uint8_t *pub, size_t *pub_len, \
+	uint32_t key[ENC_KEY_WORDS]);
+
+int do_dh_client(int fd, uint32_t key[ENC_KEY_WORDS]);
+
+int do_dh_server(int fd, uint32_t key[ENC_KEY_WORDS]);
+
+int start_session_client(int controlfd, struct enc_session * session);
+
+int start_session_server(int controlfd, struct enc_session * session);
+
+int make_transfer_offer(struct enc_session * session, uint8_t offer[TRANSFER_OFFER_LEN]);
+
+int accept_transfer_reply(struct enc_session * session, \
+	const uint8_t offer[TRANSFER_OFFER_LEN], const uint8_t chosen[TRANSFER_REPLY_LEN], \
+	struct transfer_params * params);
 
-int process_received_file(char * filename, char * recv_fp, uint32_t key[4]);
+int negotiate_transfer_client(struct data_conn * conn, struct enc_session * session, \
+	struct transfer_params * params);
 
-int do_dh_client(int controlfd, int datafd, uint32_t key[4]);
+int choose_transfer_params(const uint8_t offer[TRANSFER_OFFER_LEN], \
+	struct enc_session * session, struct transfer_params * params, \
+	uint8_t chosen[TRANSFER_REPLY_LEN]);
 
-int do_dh_server(int controlfd, int datafd, uint32_t key[4]);
+int negotiate_transfer_server(struct data_conn * conn, struct enc_session * session, \
+	struct transfer_params * params);
 
 #endif
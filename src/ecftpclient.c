@@ -1,8 +1,10 @@
 #include <arpa/inet.h>
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -15,7 +17,118 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "bundle.h"
+#include "comp.h"
+#include "delta.h"
 #include "ecftp.h"
+#include "mux.h"
+
+
+/* The most bytes of a directory listing read from the data connection at
+ * once */
+#define LIST_BUF_LEN (1 << 16)
+/* What the checkpoint of a put that failed part way is called, after the
+ * file: the size and modification time the file had, so that the put is
+ * only restarted after the part the server kept if the file is unchanged */
+#define CHECKPOINT_EXT ".ecftp-put"
+/* What the checkpoint of a get that failed part way is called, after the
+ * file: the size and modification time the server's copy of the file had,
+ * so that the get is only restarted after the part kept if the server's file
+ * is unchanged */
+#define GET_CHECKPOINT_EXT ".ecftp-get"
+/* What the signatures of the server's copy of a file that a delta put gets
+ * are called, after the file */
+#define SIG_EXT ".ecftp-sig"
+
+/* What a get or put carries: a file, a bundle of files (an mget or mput), or
+ * for a put sent as a delta, the signatures of the server's copy of the
+ * file and then the delta against them */
+#define XFER_FILE 0
+#define XFER_BUNDLE 1
+#define XFER_DELTA 2
+
+
+/* Define a struct holding how the client's data connections are opened */
+struct data_source {
+	/* Whether the client connects to the server's passive port rather than
+	 * accepting connections from the server */
+	int passive;
+	/* Active mode: the socket the server opens data connections to */
+	int listenfd;
+	/* Passive mode: the address of the server's passive port */
+	struct sockaddr_in pasv_addr;
+	/* The multiplexer of the control connection, whose channels stand in
+	 * for data connections, or NULL */
+	struct mux *mux;
+};
+
+
+/* Define a struct holding what the server says of its copy of a file that is
+ * got: its size and its modification time as MDTM gives it, or an empty
+ * string if the server did not say */
+struct file_stamp {
+	unsigned long long size;
+	char mtime[32];
+};
+
+
+/* What has been read of the server's replies */
+static struct line_reader replies;
+
+
+/** Sends the command 'cmd' on the control connection 'controlfd', ended
+ * with CRLF. Returns 0 upon success, a negative int upon failure */
+int send_command(int controlfd, const char *cmd) {
+	char line[MAXLINE + 3];
+	size_t len = strlen(cmd);
+
+	if (len > MAXLINE) {
+		return -1;
+	}
+	memcpy(line, cmd, len);
+	memcpy(&line[len], "\r\n", 2);
+
+	return write(controlfd, line, len + 2) == (ssize_t) (len + 2) ? 0 : -1;
+}
+
+
+/** Reads the server's reply to the current command from the control
+ * connection into 'resp' and prints it.
+ *
+ * \param 'controlfd' a file descriptor representing the control connection.
+ * \param '*resp' will be modified to contain the reply.
+ * \param 'len' the size of 'resp'.
+ * \return the reply code, or a negative int if no reply could be read.
+ */
+int read_reply_text(int controlfd, char *resp, size_t len) {
+	int ret;
+
+	/* A reply may arrive in pieces */
+	while ((ret = line_take(&replies, resp, len)) == 0) {
+		if (line_fill(&replies, controlfd) <= 0 && errno != EINTR) {
+			return -1;
+		}
+	}
+	if (ret < 0) {
+		return -1;
+	}
+	printf("Server Response: %s\n", resp);
+
+	return atoi(resp);
+}
+
+
+/** Reads the server's reply to the current command from the control
+ * connection and prints it.
+ *
+ * \param 'controlfd' a file descriptor representing the control connection.
+ * \return the reply code, or a negative int if no reply could be read.
+ */
+int read_reply(int controlfd) {
+	char serv_resp[1024];
+
+	return read_reply_text(controlfd, serv_resp, sizeof(serv_resp));
+}
 
 
 int get_user_input(char * buffer){
@@ -157,7 +270,10 @@ int get_command(char *command){
 		trim(command);
 		strcpy(copy, command);
 
-		if (check_command(copy) < 0) {
+		/* Only mget, mput and rget take more than one argument */
+		if (strncmp(copy, "mget ", 5) != 0 && strncmp(copy, "mput ", 5) != 0 \
+			&& strncmp(copy, "rget ", 5) != 0 && check_command(copy) < 0) {
+
 			printf("Invalid Format...\nPlease Try Again...\n");
 			bzero(command, (int)sizeof(command));
 			bzero(copy, (int)sizeof(copy));
@@ -170,7 +286,9 @@ int get_command(char *command){
 		/* If that token is a valid FTP command */
 		// TODO: these should be strncmp
 		if ((strcmp(str, "ls") == 0) || (strcmp(str, "get") == 0) \
-			|| (strcmp(str, "put") == 0) || (strcmp(str, "quit") == 0)) {
+			|| (strcmp(str, "put") == 0) || (strcmp(str, "quit") == 0) \
+			|| (strcmp(str, "stat") == 0) || (strcmp(str, "mget") == 0) \
+			|| (strcmp(str, "mput") == 0) || (strcmp(str, "rget") == 0)) {
 
 			check = 1;
 
@@ -180,6 +298,10 @@ int get_command(char *command){
 			else if(strcmp(str, "get") == 0){value = 2;}
 			else if(strcmp(str, "put") == 0){value = 3;}
 			else if(strcmp(str, "quit") == 0){value = 4;}
+			else if(strcmp(str, "stat") == 0){value = CMD_STAT;}
+			else if(strcmp(str, "mget") == 0){value = CMD_MGET;}
+			else if(strcmp(str, "mput") == 0){value = CMD_MPUT;}
+			else if(strcmp(str, "rget") == 0){value = CMD_RGET;}
 		}else{
 			printf("Incorrect Command Entered...\nPlease Try Again...\n");
 			bzero(command, strlen(command));
@@ -217,34 +339,42 @@ int get_filename(char *input, char *fileptr){
  * \return 0 upon success, a negative int upon failure.
  */
 int do_quit(int controlfd) {
-	char quit[1024];
-	sprintf(quit, "QUIT");
-	int quit_len = strlen(quit);
-
-	ssize_t nbytes = write(controlfd, quit, quit_len);
-	if ((long long) nbytes < (long long) quit_len) {
+	if (send_command(controlfd, "QUIT") < 0 || read_reply(controlfd) < 0) {
 		return -1;
 	}
 
-	bzero(quit, (int)sizeof(quit));
-	// TODO: check for errors on read?
-	read(controlfd, quit, 1024);
-	printf("Server Response: %s\n", quit);
+	return 0;
+}
+
+
+/** Perform the necessary operations to enact the STAT FTP service command,
+ * printing the status the server sends back.
+ *
+ * \param 'controlfd' a file descriptor representing the control connection
+ *     of the FTP.
+ * \return 0 upon success, a negative int upon failure.
+ */
+int do_stat(int controlfd) {
+	if (send_command(controlfd, "STAT") < 0 || read_reply(controlfd) < 0) {
+		return -1;
+	}
 
 	return 0;
 }
 
 
 // TODO: possibly break up this function, add brief documentation
-int do_ls(int controlfd, int datafd, char *input){
+int do_ls(int controlfd, struct data_conn *conn, char *input){
 
-    char filelist[256], str[MAXLINE+1], recvline[MAXLINE+1], *temp;
+    char filelist[256], str[MAXLINE+1], recvline[MAXLINE+1];
+    char listing[LIST_BUF_LEN];
     bzero(filelist, (int)sizeof(filelist));
     bzero(recvline, (int)sizeof(recvline));
     bzero(str, (int)sizeof(str));
 
     fd_set rdset;
-    int maxfd, data_finished = FALSE, control_finished = FALSE;
+    int maxfd, datafd = conn->fd, ret = 1;
+    int data_finished = FALSE, control_finished = FALSE;
 
     if(get_filename(input, filelist) < 0){
 #if DEBUG_LEVEL >= 1
@@ -267,7 +397,7 @@ int do_ls(int controlfd, int datafd, char *input){
         maxfd = datafd + 1;
     }
 
-    write(controlfd, str, strlen(str));
+    send_command(controlfd, str);
 
     while(1){
         if(control_finished == FALSE){FD_SET(controlfd, &rdset);}
@@ -275,12 +405,9 @@ int do_ls(int controlfd, int datafd, char *input){
         select(maxfd, &rdset, NULL, NULL, NULL);
 
         if(FD_ISSET(controlfd, &rdset)){
-            read(controlfd, recvline, MAXLINE);
-			// TODO: I think this always prints the like, http code e.g. "200 Command OK"
-			printf("Server Response: %s\n", recvline);
-            temp = strtok(recvline, " ");
-            if(atoi(temp) != 200){
+            if(read_reply_text(controlfd, recvline, sizeof(recvline)) != 200){
                 printf("Exiting...\n");
+                ret = -1;
                 break;
             }
             control_finished = TRUE;
@@ -292,9 +419,11 @@ int do_ls(int controlfd, int datafd, char *input){
 #if DEBUG_LEVEL >= 1
 	fprintf(stdout, "Server Data Response:\n");
 #endif
-            while(read(datafd, recvline, MAXLINE) > 0){
-                printf("%s", recvline);
-                bzero(recvline, (int)sizeof(recvline));
+            /* The listing is printed as it arrives, however many bytes at a
+             * time that is */
+            ssize_t r;
+            while((r = data_read(conn, listing, sizeof(listing))) > 0){
+                fwrite(listing, 1, r, stdout);
             }
 
             data_finished = TRUE;
@@ -309,102 +438,688 @@ int do_ls(int controlfd, int datafd, char *input){
     bzero(filelist, (int)sizeof(filelist));
     bzero(recvline, (int)sizeof(recvline));
     bzero(str, (int)sizeof(str));
-    return 1;
+    return ret;
+}
+
+
+/** Perform the necessary operations to enact the MODE FTP service command,
+ * which sets the transmission mode of the data connections opened from then
+ * on.
+ *
+ * \param 'controlfd' a file descriptor representing the control connection.
+ * \param 'mode' 'MODE_STREAM' or 'MODE_BLOCK'.
+ * \return 0 if the server accepted the mode, a negative int otherwise.
+ */
+int do_mode(int controlfd, char mode) {
+	char cmd[16];
+	sprintf(cmd, "MODE %c", mode);
+
+	if (send_command(controlfd, cmd) < 0) {
+		return -1;
+	}
+
+	return read_reply(controlfd) == 200 ? 0 : -2;
+}
+
+
+/** Perform the necessary operations to enact the TYPE I FTP service command,
+ * which has the server send and store files as they are, neither compressed
+ * nor encrypted.
+ *
+ * \param 'controlfd' a file descriptor representing the control connection.
+ * \return 0 if the server accepted the type, a negative int otherwise.
+ */
+int do_type(int controlfd) {
+	const char *cmd = "TYPE I";
+
+	if (send_command(controlfd, cmd) < 0) {
+		return -1;
+	}
+
+	return read_reply(controlfd) == 200 ? 0 : -2;
+}
+
+
+/** Asks the server to carry the rest of the session over the control
+ * connection, and has a thread of the client move the frames of its channels
+ * from then on.
+ *
+ * \param '*controlfd' a file descriptor representing the control connection,
+ *     which will be modified to be the channel of the commands and replies.
+ * \param '*src' the client's data source, which will be modified to open
+ *     data connections as channels.
+ * \return 0 if the server agreed, a negative int otherwise.
+ */
+int do_mux(int *controlfd, struct data_source *src) {
+	/* {{{ */
+	const char *cmd = "MUX";
+	pthread_t thread;
+	int fd;
+
+	if (send_command(*controlfd, cmd) < 0) {
+		return -1;
+	}
+	if (read_reply(*controlfd) != 200) {
+		return -2;
+	}
+
+	/* The server sends frames from now on, so there is no going back */
+	if ((src->mux = mux_create(*controlfd, 0, &fd)) == NULL) {
+		fprintf(stderr, "ERROR: could not multiplex the control connection\n");
+		exit(-1);
+	}
+	if (0 != pthread_create(&thread, NULL, mux_run, src->mux)) {
+		fprintf(stderr, "ERROR: could not start the multiplexer\n");
+		exit(-1);
+	}
+	pthread_detach(thread);
+	*controlfd = fd;
+	src->passive = 1;
+
+	return 0;
+	/* }}} */
+}
+
+
+/** Asks the server for a passive port with EPSV (RFC 2428) or, if the server
+ * does not know EPSV, with PASV, and stores the address to open data
+ * connections to in the data source. Either way the server's address is the
+ * one the control connection goes to: the address in a PASV reply is wrong
+ * behind NAT, and trusting it would let a server point the client anywhere.
+ *
+ * \param 'controlfd' a file descriptor representing the control connection.
+ * \param '*src' the client's data source.
+ * \param '*serv_addr' the address of the control connection's server.
+ * \return 0 upon success, a negative int upon failure.
+ */
+int do_pasv(int controlfd, struct data_source *src, struct sockaddr_in *serv_addr) {
+	/* {{{ */
+	char resp[1024];
+	char *paren;
+	int h[4], p[2], port = -1;
+
+	send_command(controlfd, "EPSV");
+	if (read_reply_text(controlfd, resp, sizeof(resp)) == 229) {
+		/* "229 Entering Extended Passive Mode (|||<port>|)" */
+		if ((paren = strstr(resp, "(|||")) != NULL) {
+			port = atoi(paren + 4);
+		}
+	} else {
+		send_command(controlfd, "PASV");
+		/* "227 Entering Passive Mode (h1,h2,h3,h4,p1,p2)" */
+		if (read_reply_text(controlfd, resp, sizeof(resp)) == 227 \
+			&& (paren = strchr(resp, '(')) != NULL \
+			&& sscanf(paren, "(%d,%d,%d,%d,%d,%d)", &h[0], &h[1], &h[2], &h[3], \
+				&p[0], &p[1]) == 6) {
+
+			port = (p[0] << 8) + p[1];
+		}
+	}
+
+	if (port < 1 || port > 65535) {
+		return -1;
+	}
+
+	src->pasv_addr = *serv_addr;
+	src->pasv_addr.sin_port = htons(port);
+
+	return 0;
+	/* }}} */
+}
+
+
+/** Opens a data connection the way the client's data source says: by
+ * connecting to the server's passive port, by accepting the server's
+ * connection, or by opening a channel of the control connection.
+ *
+ * \param '*fd' will be modified to contain the data connection.
+ * \param '*src' the client's data source.
+ * \return 0 upon success, a negative int upon failure.
+ */
+int open_data_conn(int *fd, struct data_source *src) {
+	if (src->mux != NULL) {
+		return ((*fd) = mux_open(src->mux)) < 0 ? -1 : 0;
+	}
+	if (!src->passive) {
+		return ((*fd) = accept(src->listenfd, (struct sockaddr *) NULL, NULL)) < 0 ? -1 : 0;
+	}
+
+	if (((*fd) = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		return -1;
+	}
+	if (connect(*fd, (struct sockaddr *) &src->pasv_addr, sizeof(src->pasv_addr)) < 0) {
+		close(*fd);
+		return -2;
+	}
+
+	return 0;
+}
+
+
+/** Takes the data connections of a striped transfer, of which the first
+ * '*nconns' are already open, and opens the rest the same way as the first.
+ * In block mode the connections opened for earlier transfers are still
+ * open, so only as many are opened as the transfer needs on top of those.
+ *
+ * \param '*conns' the data connections. 'conns[0]' must already be open,
+ *     and the new connections are added after the open ones.
+ * \param '*nconns' the number of open data connections, which will be
+ *     modified to include the new connections.
+ * \param 'streams' the number of data connections the transfer uses.
+ * \param '*src' the client's data source.
+ * \return 0 upon success, a negative int upon failure.
+ */
+int open_stripe_conns(struct data_conn *conns, int *nconns, int streams, \
+	struct data_source *src) {
+
+	int fd;
+
+	for (int i = *nconns; i < streams; i++) {
+		if (open_data_conn(&fd, src) < 0) {
+			return -1;
+		}
+		data_conn_init(&conns[i], fd, conns[0].mode);
+		*nconns = i + 1;
+	}
+
+	return 0;
 }
 
 
-// TODO: break up this function, add brief documentation
-int do_get(int controlfd, int datafd, char *input) {
-	char filename[256], serv_cmd[MAXLINE+1], recvline[MAXLINE+1];
+/** Retrieves a small file from the server in one round trip: sends RETI with
+ * the offer for the transfer, and reads the file, compressed and encrypted,
+ * from the control connection after the reply. A server that finds the file
+ * too large for that says so, and the file is retrieved with RETR instead.
+ *
+ * \param 'controlfd' a file descriptor representing the control connection.
+ * \param '*session' the session the transfer belongs to.
+ * \param '*input' the command the user entered.
+ * \return 1 upon success, 0 if the file has to be retrieved with RETR, or a
+ *     negative int upon failure.
+ */
+int do_get_inline(int controlfd, struct enc_session *session, char *input) {
+	/* {{{ */
+	char filename[256], serv_cmd[MAXLINE+1], resp[MAXLINE+1];
+	char offer_hex[2 * TRANSFER_OFFER_LEN + 1], chosen_hex[2 * TRANSFER_REPLY_LEN + 1];
+	uint8_t offer[TRANSFER_OFFER_LEN], chosen[TRANSFER_REPLY_LEN];
+	uint8_t payload[INLINE_MAX_PAYLOAD], data[INLINE_MAX_LEN];
+	size_t payload_len, len = sizeof(data);
+	struct transfer_params params;
+	char *recv_fp;
+	FILE *out;
+	int code;
+
+	/* RETR says what is wrong with the command */
+	bzero(filename, sizeof(filename));
+	if (get_filename(input, filename) < 0) {
+		return 0;
+	}
+
+	if (0 != make_transfer_offer(session, offer)) {
+		return -1;
+	}
+	hex_encode(offer, sizeof(offer), offer_hex);
+	snprintf(serv_cmd, sizeof(serv_cmd), "RETI %s %s", offer_hex, filename);
+	if (0 != send_command(controlfd, serv_cmd)) {
+		return -1;
+	}
+
+	code = read_reply_text(controlfd, resp, sizeof(resp));
+	if (code == 504) {
+		return 0;
+	}
+	if (code != 213) {
+		return -1;
+	}
+	if (sscanf(resp, "213 %6s %zu", chosen_hex, &payload_len) != 2 \
+		|| 0 != hex_decode(chosen_hex, chosen, sizeof(chosen)) \
+		|| payload_len > sizeof(payload)) {
+
+		fprintf(stderr, "ERROR: malformed reply to RETI\n");
+		return -1;
+	}
+	/* The file follows the reply, and has to be read before anything else
+	 * can be */
+	if (0 != line_read_bytes(&replies, controlfd, payload, payload_len)) {
+		return -1;
+	}
+
+	if (0 != accept_transfer_reply(session, offer, chosen, &params) \
+		|| 0 != dec_buf(payload, payload_len, &params.enc, &payload_len) \
+		|| 0 != uncomp_buf(payload, payload_len, data, &len)) {
+
+		fprintf(stderr, "ERROR: failed to process received file!\n");
+		return -1;
+	}
+
+	/* Written aside and then put in place, so that a failed write leaves
+	 * any file of the same name as it was */
+	if ((recv_fp = temp_recv_name(filename)) == NULL) {
+		return -1;
+	}
+	if (!(out = fopen(recv_fp, "wb"))) {
+		fprintf(stderr, "ERROR: could not open file '%s' for writing\n", recv_fp);
+		free(recv_fp);
+		return -1;
+	}
+	if (fwrite(data, 1, len, out) != len) {
+		fprintf(stderr, "ERROR: could not write file '%s'\n", filename);
+		fclose(out);
+		remove(recv_fp);
+		free(recv_fp);
+		return -1;
+	}
+	if (0 != fclose(out) || 0 != rename(recv_fp, filename)) {
+		fprintf(stderr, "ERROR: could not write file '%s'\n", filename);
+		remove(recv_fp);
+		free(recv_fp);
+		return -1;
+	}
+	free(recv_fp);
+
+	return 1;
+	/* }}} */
+}
+
+
+/** Asks the server to start the next RETR or STOR 'offset' bytes into the
+ * file. Returns 'offset' if the server agreed, or 0 if it did not (or
+ * 'offset' is 0), in which case the transfer starts from the beginning */
+static uint64_t send_rest(int controlfd, uint64_t offset) {
+	char serv_cmd[MAXLINE+1];
+
+	if (offset == 0) {
+		return 0;
+	}
+	snprintf(serv_cmd, sizeof(serv_cmd), "REST %llu", (unsigned long long) offset);
+	if (0 != send_command(controlfd, serv_cmd) || read_reply(controlfd) != 350) {
+		return 0;
+	}
+
+	return offset;
+}
+
+
+/** Asks the server for the size and modification time of its copy of a file
+ * with SIZE and MDTM. A file of less than a chunk leaves no part to restart
+ * from, so its modification time is not asked for.
+ *
+ * \param 'controlfd' a file descriptor representing the control connection.
+ * \param '*filename' the file being got.
+ * \param '*stamp' will be modified to contain what the server said. Its
+ *     'mtime' is left empty if the server did not say.
+ * \return void.
+ */
+static void get_file_stamp(int controlfd, const char *filename, struct file_stamp *stamp) {
+	char serv_cmd[MAXLINE+1], resp[MAXLINE+1];
+
+	stamp->size = 0;
+	stamp->mtime[0] = '\0';
+
+	snprintf(serv_cmd, sizeof(serv_cmd), "SIZE %s", filename);
+	if (0 != send_command(controlfd, serv_cmd) \
+		|| read_reply_text(controlfd, resp, sizeof(resp)) != 213 \
+		|| sscanf(resp, "213 %llu", &stamp->size) != 1 \
+		|| stamp->size < COMP_THREAD_MAX_MEM) {
+
+		return;
+	}
+	snprintf(serv_cmd, sizeof(serv_cmd), "MDTM %s", filename);
+	if (0 != send_command(controlfd, serv_cmd) \
+		|| read_reply_text(controlfd, resp, sizeof(resp)) != 213 \
+		|| sscanf(resp, "213 %31s", stamp->mtime) != 1) {
+
+		stamp->mtime[0] = '\0';
+	}
+}
+
+
+/** Takes the part of a file kept from a get that failed part way, if there
+ * is one, and if the server's copy of the file is as it was then, has the
+ * server restart the RETR of the file after it. A part of a file that has
+ * changed since is removed, with its checkpoint.
+ *
+ * \param 'controlfd' a file descriptor representing the control connection.
+ * \param '*part_fp' the path to the part of the file.
+ * \param '*ckpt_fp' the path to the part's checkpoint.
+ * \param '*stamp' the size and modification time of the server's copy of
+ *     the file now.
+ * \return where the RETR starts, a multiple of 'COMP_THREAD_MAX_MEM'.
+ */
+static uint64_t restart_get(int controlfd, const char *part_fp, const char *ckpt_fp, \
+	const struct file_stamp *stamp) {
+
+	/* {{{ */
+	struct stat part_stat;
+	unsigned long long size;
+	char mtime[sizeof(stamp->mtime)];
+	FILE *f;
+	int same = 0;
+
+	if (0 != stat(part_fp, &part_stat)) {
+		remove(ckpt_fp);
+		return 0;
+	}
+	if (stamp->mtime[0] != '\0' && (f = fopen(ckpt_fp, "r")) != NULL) {
+		same = (fscanf(f, "%llu %31s", &size, mtime) == 2 \
+			&& size == stamp->size && strcmp(mtime, stamp->mtime) == 0);
+		fclose(f);
+	}
+	if (!same) {
+		printf("The file changed since %s was kept, getting all of it\n", part_fp);
+		remove(part_fp);
+		remove(ckpt_fp);
+		return 0;
+	}
+
+	return send_rest(controlfd, part_stat.st_size - part_stat.st_size % COMP_THREAD_MAX_MEM);
+	/* }}} */
+}
+
+
+/** Takes the checkpoint of a get and records in it the size and modification
+ * time of the server's copy of the file, for the get to be restarted after
+ * the part kept of the file, or removes the checkpoint if no part was kept or
+ * the server did not say when the file was modified */
+static void update_get_checkpoint(const char *ckpt_fp, const struct file_stamp *stamp, int kept) {
+	FILE *f;
+
+	if (!kept || stamp->mtime[0] == '\0') {
+		remove(ckpt_fp);
+		return;
+	}
+	if ((f = fopen(ckpt_fp, "w")) == NULL) {
+		return;
+	}
+	fprintf(f, "%llu %s\n", stamp->size, stamp->mtime);
+	fclose(f);
+}
+
+
+/** Takes the checkpoint of a put that failed part way, if there is one, and
+ * if the file is as it was then, has the server restart the STOR of the file
+ * after the part of it the server kept.
+ *
+ * \param 'controlfd' a file descriptor representing the control connection.
+ * \param '*filename' the file being put.
+ * \param '*ckpt_fp' the path to the checkpoint.
+ * \param '*source_stat' the file's status.
+ * \return where the STOR starts, a multiple of 'COMP_THREAD_MAX_MEM'.
+ */
+static uint64_t restart_put(int controlfd, const char *filename, const char *ckpt_fp, \
+	const struct stat *source_stat) {
+
+	/* {{{ */
+	char serv_cmd[MAXLINE+1], resp[MAXLINE+1];
+	unsigned long long size, kept;
+	long long sec;
+	long nsec;
+	FILE *f;
+	int same;
+
+	if ((f = fopen(ckpt_fp, "r")) == NULL) {
+		return 0;
+	}
+	same = (fscanf(f, "%llu %lld %ld", &size, &sec, &nsec) == 3 \
+		&& size == (unsigned long long) source_stat->st_size \
+		&& sec == source_stat->st_mtim.tv_sec && nsec == source_stat->st_mtim.tv_nsec);
+	fclose(f);
+	if (!same) {
+		remove(ckpt_fp);
+		return 0;
+	}
+
+	/* The server says how much it kept */
+	snprintf(serv_cmd, sizeof(serv_cmd), "SIZE %s%s", filename, PART_EXT);
+	if (0 != send_command(controlfd, serv_cmd) \
+		|| read_reply_text(controlfd, resp, sizeof(resp)) != 213 \
+		|| sscanf(resp, "213 %llu", &kept) != 1) {
+
+		return 0;
+	}
+	if (kept > size) {
+		kept = size;
+	}
+
+	return send_rest(controlfd, kept - kept % COMP_THREAD_MAX_MEM);
+	/* }}} */
+}
+
+
+/** Takes the file of a put and records its size and modification time in
+ * its checkpoint, for the put to be restarted if it failed, or removes the
+ * checkpoint if it succeeded. A file of less than a chunk has nothing to
+ * restart from */
+static void update_checkpoint(const char *ckpt_fp, const struct stat *source_stat, int done) {
+	FILE *f;
+
+	if (done || source_stat->st_size < COMP_THREAD_MAX_MEM) {
+		remove(ckpt_fp);
+		return;
+	}
+	if ((f = fopen(ckpt_fp, "w")) == NULL) {
+		return;
+	}
+	fprintf(f, "%llu %lld %ld\n", (unsigned long long) source_stat->st_size, \
+		(long long) source_stat->st_mtim.tv_sec, (long) source_stat->st_mtim.tv_nsec);
+	if (0 == fclose(f)) {
+		printf("Put the file again to restart after the part the server kept\n");
+	}
+}
+
+
+/** Takes the temporary file a get or put was made of, the bundle of an mget
+ * or mput or the delta of a delta put, removes it and frees its name. Does
+ * nothing if the command made none ('temp' is not set) */
+static void remove_temp(char *temp_fp, int temp) {
+	if (temp) {
+		remove(temp_fp);
+		free(temp_fp);
+	}
+}
+
+
+// TODO: break up this function
+/** Retrieves a file from the server: sends RETR, agrees on the transfer's
+ * parameters, receives the prepared file striped over the data connections
+ * and decrypts and decompresses it. For an 'XFER_BUNDLE', sends MGET for every
+ * path the user entered instead, and unpacks the bundle of files that comes
+ * back. A RETR that fails part way keeps the whole chunks at the start of
+ * what arrived in '<filename>' + 'PART_EXT', and the next get of the file
+ * restarts after them. An rget sends RANG before the RETR, and the range is
+ * cut out of the chunks that come back to make the file. For an
+ * 'XFER_DELTA', sends SIGN and leaves the signatures of the server's copy of
+ * the file in '<filename>' + 'SIG_EXT', for a delta put of the file.
+ *
+ * \param 'controlfd' a file descriptor representing the control connection.
+ * \param '*conns' the open data connections, the first of which carries
+ *     the command's data.
+ * \param '*nconns' the number of open data connections, which grows if the
+ *     transfer needs more than are open.
+ * \param '*src' how the rest of the data connections are opened.
+ * \param '*session' the session the transfer belongs to.
+ * \param '*input' the command the user entered.
+ * \param 'kind' what the get carries, 'XFER_FILE', 'XFER_BUNDLE' or
+ *     'XFER_DELTA'.
+ * \return 1 upon success, a negative int upon failure.
+ */
+int do_get(int controlfd, struct data_conn *conns, int *nconns, struct data_source *src, \
+	struct enc_session *session, char *input, int kind) {
+
+	char filename[256], serv_cmd[MAXLINE+1];
+	char part_fp[sizeof(filename) + sizeof(PART_EXT)];
+	char ckpt_fp[sizeof(filename) + sizeof(GET_CHECKPOINT_EXT)];
+	struct file_stamp stamp;
+	char sig_fp[sizeof(filename) + sizeof(SIG_EXT)];
+	int bundle = (kind == XFER_BUNDLE);
+	/* Where the transfer's file goes: the file asked for, or the bundle of
+	 * files */
+	char *target = filename;
 	// TODO:do we have to bzero the whole string, for any of these strings? Can
 	// we not just make the 0th element = \0?
 	bzero(filename, (int)sizeof(filename));
-	bzero(recvline, (int)sizeof(recvline));
 	bzero(serv_cmd, (int)sizeof(serv_cmd));
 	int err = 0;
+	/* Where in the file the transfer starts, and how much of the start of
+	 * the received file was written if it fails */
+	uint64_t offset = 0, kept = 0;
+	/* The first byte and the number of bytes of an rget's range */
+	int ranged = kind == XFER_FILE && strncmp(input, "rget ", 5) == 0;
+	unsigned long long first = 0, count = 0;
+	/* Only a whole file is kept part of to restart from */
+	int resumable = kind == XFER_FILE && !ranged;
 
 	if (get_filename(input, filename) < 0) {
 		printf("No filename Detected...\n");
-		char send[1024];
-		sprintf(send, "SKIP");
-		write(controlfd, send, strlen(send));
-		bzero(send, (int)sizeof(send));
-		read(controlfd, send, 1000);
-		printf("Server Response: %s\n", send);
+		send_command(controlfd, "SKIP");
+		read_reply(controlfd);
+		return -1;
+	}
+	if (ranged && (sscanf(input, "rget %*s %llu %llu", &first, &count) != 2 \
+		|| count == 0 || first + count < first)) {
+
+		printf("Usage: rget <filename> <offset> <length>\n");
+		send_command(controlfd, "SKIP");
+		read_reply(controlfd);
 		return -1;
 	}
 
 	/* Construct FTP service command and send it over the control connection */
-	sprintf(serv_cmd, "RETR %s", filename);
-	write(controlfd, serv_cmd, strlen(serv_cmd));
+	if (bundle) {
+		if ((target = bundle_temp_name()) == NULL) {
+			fprintf(stderr, "ERROR: failed to receive file!\n");
+			send_command(controlfd, "SKIP");
+			read_reply(controlfd);
+			return -1;
+		}
+		snprintf(serv_cmd, sizeof(serv_cmd), "MGET %s", &input[5]);
+	} else if (kind == XFER_DELTA) {
+		snprintf(sig_fp, sizeof(sig_fp), "%s%s", filename, SIG_EXT);
+		target = sig_fp;
+		sprintf(serv_cmd, "SIGN %s", filename);
+	} else if (ranged) {
+		snprintf(serv_cmd, sizeof(serv_cmd), "RANG %llu %llu", first, first + count - 1);
+		if (0 != send_command(controlfd, serv_cmd) || read_reply(controlfd) != 350) {
+			fprintf(stderr, "ERROR: server refused the range\n");
+			send_command(controlfd, "SKIP");
+			read_reply(controlfd);
+			return -1;
+		}
+		sprintf(serv_cmd, "RETR %s", filename);
+	} else {
+		snprintf(part_fp, sizeof(part_fp), "%s%s", filename, PART_EXT);
+		snprintf(ckpt_fp, sizeof(ckpt_fp), "%s%s", filename, GET_CHECKPOINT_EXT);
+		get_file_stamp(controlfd, filename, &stamp);
+		offset = restart_get(controlfd, part_fp, ckpt_fp, &stamp);
+		sprintf(serv_cmd, "RETR %s", filename);
+	}
+	send_command(controlfd, serv_cmd);
+
+	/* Agree with the server on the cipher mode, nonce and number of data
+	 * connections for this transfer, and derive its key from the session's
+	 * secret */
+	struct transfer_params params;
+	if (0 != negotiate_transfer_client(&conns[0], session, &params)) {
+		fprintf(stderr, "ERROR: could not negotiate a cipher mode!\n");
+		/* The server waits for the offer until the data connection closes */
+		data_close_all(conns, nconns);
+		read_reply(controlfd);
+		remove_temp(target, bundle);
+		return -1;
+	}
 
-	/* CSCD58 addition - Encryption */
-	uint32_t key[4];
-	do_dh_client(controlfd, datafd, key);
-	/* CSCD58 end of addition - Encryption */
+	/* The server says how many data connections it stripes the file over
+	 * and how long the file is. If it could not send the file, it closes the
+	 * data connection instead and says why on the control connection */
+	int streams;
+	uint64_t len;
+
+	if (0 != stripe_read_header(&conns[0], params.streams, &streams, &len)) {
+		/* The file is shorter than the part kept of it, so it has changed
+		 * since */
+		if (read_reply(controlfd) == 554 && offset != 0) {
+			remove(part_fp);
+			remove(ckpt_fp);
+		}
+		remove_temp(target, bundle);
+		return -1;
+	}
 
 	/* CSCD58 addition - Compression */
 	/* Make temporary name for receiving file
 	 * ( '<filename>.comp.enc-XXXXXX' ) */
 	char * recv_fp;
-	if ( (recv_fp = temp_recv_name(filename)) == NULL) {
+	if ( (recv_fp = temp_recv_name(target)) == NULL) {
 		fprintf(stderr, "ERROR: failed to receive file!\n");
+		remove_temp(target, bundle);
 		return -1;
 	}
 	/* CSCD58 end of addition - Compression */
 
-	FILE *recv_file_stream;
-
-	if ((recv_file_stream = fopen(recv_fp, "w")) == NULL) {
-		perror("file error");
-		return -1;
-	}
-
-	int read_len = 0;
-
 	/* Receive data from the server, writing it to the receive file */
-	while (1) {
-		read_len = read(datafd, recvline, MAXLINE);
-		/* If there was an error */
-		if (read_len < 0) {
-			err = 1;
-			break;
-		/* If something was read, write it to the receiving file */
-		} else if (read_len > 0) {
-			fwrite(recvline, 1, read_len, recv_file_stream);
-			bzero(recvline, (int)sizeof(recvline));
-		/* If nothing was read, stop receiving */
-		} else {
-			break;
-		}
+	if (0 != open_stripe_conns(conns, nconns, streams, src) \
+		|| 0 != stripe_recv_file(conns, streams, recv_fp, len, &kept)) {
+
+		err = 1;
 	}
-	fclose(recv_file_stream);
 	printf("File received\n"); // TODO: remove
 
 	/* Read server response - did the server successfully send the file? */
-	char serv_resp[1024];
-	bzero(serv_resp, (int)sizeof(serv_resp));
-	// TODO: check for errors on read?
-	read(controlfd, serv_resp, 1024);
-	printf("Server Response: %s\n", serv_resp);
+	if (read_reply(controlfd) != 200) {
+		err = 1;
+	}
 
-	/* If there was an error receiving the file, delete the temp file it was to
-	 * be written to */
+	/* If there was an error receiving the file, keep the whole chunks at the
+	 * start of what arrived to restart from, and delete the temp file it was
+	 * to be written to */
 	if (err) {
+		if (resumable) {
+			int64_t part_len = keep_received_prefix(part_fp, offset, recv_fp, kept, &params.enc);
+			if (part_len > 0) {
+				printf("%lld bytes kept in %s, get the file again to restart after them\n", \
+					(long long) part_len, part_fp);
+			} else if (part_len == 0) {
+				remove(part_fp);
+			}
+			update_get_checkpoint(ckpt_fp, &stamp, part_len > 0);
+		}
 		if (0 != remove(recv_fp)) {
 			fprintf(stderr, "WARNING: could not remove temporary file following an error!\n");
 		}
+		free(recv_fp);
+		remove_temp(target, bundle);
 		return -1;
 	}
 
 	/* CSCD58 addition - Compression + Encryption */
-	/* Decrypt (using key 'key') and decompress received file stored at the
-	 * filepath 'recv_fp', outputting the result to the file at path
-	 * 'filename' */
-	if (process_received_file(filename, recv_fp, key) != 0) {
+	/* Decrypt (using the negotiated 'params') and decompress received file
+	 * stored at the filepath 'recv_fp', outputting the result to the file at
+	 * path 'target' */
+	if (process_received_file(offset == 0 ? target : part_fp, offset, recv_fp, \
+		&params.enc) != 0) {
+
 		fprintf(stderr, "ERROR: failed to process received file!\n");
+		if (kind == XFER_DELTA) {
+			remove(sig_fp);
+		}
+		free(recv_fp);
+		remove_temp(target, bundle);
 		return -1;
 	}
+	/* A restarted file is put together in its part, which is then put in
+	 * place. Any part kept from before is no longer needed */
+	if (resumable) {
+		remove(ckpt_fp);
+		if (offset == 0) {
+			remove(part_fp);
+		} else if (0 != rename(part_fp, target)) {
+			perror("rename (do_get)");
+			fprintf(stderr, "ERROR: could not put the file in place, all of it is in %s\n", \
+				part_fp);
+			free(recv_fp);
+			return -1;
+		}
+	}
 
 	/* Free dynamically allocated memory */
 	free(recv_fp);
@@ -412,126 +1127,168 @@ int do_get(int controlfd, int datafd, char *input) {
 
 	printf("File processed\n"); // TODO: remove
 
+	/* The range starts part way into the first chunk that came back, and
+	 * may end short of the file */
+	if (ranged) {
+		int64_t range_len = cut_file_range(target, first % COMP_THREAD_MAX_MEM, count);
+		if (range_len < 0) {
+			return -1;
+		}
+		printf("%lld bytes from byte %llu written to %s\n", (long long) range_len, \
+			first, target);
+	}
+
+	/* The files of an mget are written out from the bundle */
+	if (bundle) {
+		int entries = bundle_unpack(target);
+		remove_temp(target, bundle);
+		if (entries < 0) {
+			fprintf(stderr, "ERROR: failed to unpack the files!\n");
+			return -1;
+		}
+		printf("%d files and directories unpacked\n", entries);
+	}
+
 	return 1;
 }
 
 
-// TODO: break up this function, add brief documentation
-int do_put(int controlfd, int datafd, char *input) {
+// TODO: break up this function
+/** Stores a file on the server: sends STOR, agrees on the transfer's
+ * parameters, compresses and encrypts the file and sends it striped over the
+ * data connections. For an 'XFER_BUNDLE', bundles every path the user entered
+ * and everything under them, and sends the bundle with MPUT instead. For an
+ * 'XFER_DELTA', sends DELT with the delta of the file against the signatures
+ * a get of the same kind left in '<filename>' + 'SIG_EXT' instead. A STOR
+ * that fails part way leaves a checkpoint in '<filename>' +
+ * 'CHECKPOINT_EXT', and the next put of the file restarts after the whole
+ * chunks the server kept, if the file has not changed since.
+ *
+ * \param 'controlfd' a file descriptor representing the control connection.
+ * \param '*conns' the open data connections, the first of which carries
+ *     the command's data.
+ * \param '*nconns' the number of open data connections, which grows if the
+ *     transfer needs more than are open.
+ * \param '*src' how the rest of the data connections are opened.
+ * \param '*session' the session the transfer belongs to.
+ * \param '*input' the command the user entered.
+ * \param 'kind' what the put carries, 'XFER_FILE', 'XFER_BUNDLE' or
+ *     'XFER_DELTA'.
+ * \return 1 upon success, a negative int upon failure.
+ */
+int do_put(int controlfd, struct data_conn *conns, int *nconns, struct data_source *src, \
+	struct enc_session *session, char *input, int kind) {
+
 	char filename[256];
-	char str[MAXLINE+1];
-	char recvline[MAXLINE+1];
-	char sendline[MAXLINE+1];
+	/* The file sent: the file given, the bundle of files or the delta */
+	char *source = filename;
 	char serv_cmd[MAXLINE+1];
-	char *temp;
+	char ckpt_fp[sizeof(filename) + sizeof(CHECKPOINT_EXT)];
+	char sig_fp[sizeof(filename) + sizeof(SIG_EXT)];
+	struct stat source_stat;
+	/* Whether 'source' is a temporary file made for the put */
+	int temp = (kind != XFER_FILE);
 	bzero(filename, (int)sizeof(filename));
-	bzero(recvline, (int)sizeof(recvline));
-	bzero(str, (int)sizeof(str));
-
-	fd_set wrset, rdset;
-	int maxfd;
-	int data_finished = FALSE;
-	int control_finished = FALSE;
+	int err = 0;
+	/* Where in the file the transfer starts */
+	uint64_t offset = 0;
 
 	if (get_filename(input, filename) < 0) {
 		printf("No filename Detected...\n");
-		char send[1024];
-		sprintf(send, "SKIP");
-		write(controlfd, send, strlen(send));
-		bzero(send, (int)sizeof(send));
-		read(controlfd, send, 1000);
-		printf("Server Control Response: %s\n", send);
+		send_command(controlfd, "SKIP");
+		read_reply(controlfd);
 		return -1;
 	}
 
 	/* Prepare STOR and send the command */
-	sprintf(serv_cmd, "STOR %s", filename);
-	write(controlfd, serv_cmd, strlen(serv_cmd));
-
-	/* select() initialization */
-	FD_ZERO(&wrset);
-	FD_SET(datafd, &wrset);
-	FD_ZERO(&rdset);
-	FD_SET(controlfd, &rdset);
-	fd_set wrset_stable = wrset; // Make a backup of each set since
-	fd_set rdset_stable = rdset; // select() is destructive
-
-	/* Get the max file descripter number for select() */
-	if(controlfd > datafd){
-		maxfd = controlfd + 1;
-	}else{
-		maxfd = datafd + 1;
+	if (kind == XFER_BUNDLE) {
+		if (bundle_pack(&input[5], &source) < 0) {
+			send_command(controlfd, "SKIP");
+			read_reply(controlfd);
+			return -1;
+		}
+		snprintf(serv_cmd, sizeof(serv_cmd), "MPUT %s", &input[5]);
+	} else if (kind == XFER_DELTA) {
+		snprintf(sig_fp, sizeof(sig_fp), "%s%s", filename, SIG_EXT);
+		int made = delta_make(filename, sig_fp, &source);
+		remove(sig_fp);
+		if (made < 0) {
+			send_command(controlfd, "SKIP");
+			read_reply(controlfd);
+			return -1;
+		}
+		struct stat delta_stat;
+		if (0 == stat(source, &delta_stat)) {
+			printf("Sending a delta of %lld bytes\n", (long long) delta_stat.st_size);
+		}
+		sprintf(serv_cmd, "DELT %s", filename);
+	} else {
+		snprintf(ckpt_fp, sizeof(ckpt_fp), "%s%s", filename, CHECKPOINT_EXT);
+		if (0 != stat(filename, &source_stat)) {
+			bzero(&source_stat, sizeof(source_stat));
+		}
+		offset = restart_put(controlfd, filename, ckpt_fp, &source_stat);
+		sprintf(serv_cmd, "STOR %s", filename);
+	}
+	send_command(controlfd, serv_cmd);
+
+	/* Agree with the server on the cipher mode, nonce and number of data
+	 * connections for this transfer, and derive its key from the session's
+	 * secret */
+	struct transfer_params params;
+	if (0 != negotiate_transfer_client(&conns[0], session, &params)) {
+		fprintf(stderr, "ERROR: could not negotiate a cipher mode!\n");
+		/* The server waits for the offer until the data connection closes */
+		data_close_all(conns, nconns);
+		read_reply(controlfd);
+		remove_temp(source, temp);
+		return -1;
 	}
-
-	/* CSCD58 addition - Encryption */
-	uint32_t key[4];
-	do_dh_client(controlfd, datafd, key);
-	/* CSCD58 end of addition - Encryption */
 
 	/* CSCD58 addition - Compression + Encryption */
 	char * prepared_fp;
 
-	/* Encrypt (using key 'key') and compress the file stored at the
-	 * filepath 'filename', outputting the result to the file at path
-	 * 'prepared_fp' */
-	if (0 != prepare_file(filename, key, &prepared_fp)) {
+	/* Encrypt (using the negotiated 'params') and compress the file stored at
+	 * the filepath 'filename', outputting the result to the file at path
+	 * 'prepared_fp'. If that fails, ending the transfer's data before the
+	 * stripe header is sent tells the server to give up on the transfer */
+	int prepared = prepare_file(source, offset, 0, &params.enc, &prepared_fp);
+	remove_temp(source, temp);
+	if (0 != prepared) {
 		fprintf(stderr, "ERROR: could not prepare file!\n");
-		char send[1024];
-		sprintf(serv_cmd, "SKIP");
-		write(controlfd, serv_cmd, strlen(serv_cmd));
-		bzero(send, (int)sizeof(send));
-		read(controlfd, send, 1000);
-		printf("Server Control Response: %s\n", send);
+		data_end(&conns[0]);
+		read_reply(controlfd);
 		return -1;
 	}
 	/* CSCD58 end of addition - Compression + Encryption */
 
-	FILE *in;
+	/* Stripe the prepared file over as many data connections as were agreed
+	 * on, or fewer if it is too small to keep them all busy */
+	struct stat prepared_stat;
+	int streams;
 
-	if ((in = fopen(prepared_fp, "rb")) == NULL) {
+	if (0 != stat(prepared_fp, &prepared_stat)) {
 		fprintf(stderr, "ERROR: could not read file that is to be sent!\n");
-		return -1;
-	}
-
-	while (1) {
-		/* Recreate the FD sets */
-		wrset = wrset_stable;
-		rdset = rdset_stable;
-
-		select(maxfd, &rdset, &wrset, NULL, NULL);
-
-		if (FD_ISSET(controlfd, &rdset)) {
-			bzero(recvline, (int)sizeof(recvline));
-			read(controlfd, recvline, MAXLINE);
-			printf("Server Control Response: %s\n", recvline);
-			temp = strtok(recvline, " ");
-			if (atoi(temp) != 200) {
-				printf("File Error...\nExiting...\n");
-				break;
-			}
-			control_finished = TRUE;
-			bzero(recvline, (int)sizeof(recvline));
-			FD_CLR(controlfd, &rdset);
-		}
-
-		if (FD_ISSET(datafd, &wrset)) {
-			bzero(sendline, (int)sizeof(sendline));
-			/* CSCD58 addition */
-			size_t nmem_read = 0;
-			while (0 != (nmem_read = fread(sendline, 1, sizeof(sendline), in)) ) {
-				write(datafd, sendline, nmem_read);
-				bzero(sendline, (size_t)sizeof(sendline));
-			}
-			/* CSCD58 end of addition */
+		data_end(&conns[0]);
+		err = 1;
+	} else {
+		streams = stripe_count(prepared_stat.st_size, params.streams);
+		if (0 != stripe_write_header(&conns[0], streams, prepared_stat.st_size) \
+			|| 0 != open_stripe_conns(conns, nconns, streams, src) \
+			|| 0 != stripe_send_file(conns, streams, prepared_fp)) {
 
-			data_finished = TRUE;
-			FD_CLR(datafd, &wrset);
-			close(datafd);
-		}
-		if ((control_finished == TRUE) && (data_finished == TRUE)) {
-			break;
+			err = 1;
 		}
 	}
+
+	if (read_reply(controlfd) != 200) {
+		printf("File Error...\n");
+		err = 1;
+	}
+	if (kind == XFER_FILE) {
+		update_checkpoint(ckpt_fp, &source_stat, !err);
+	}
+
 	/* CSCD58 addition - Compression */
 	if (KEEP_TEMP_ENC_FILES != 1) {
 		if (0 != remove(prepared_fp)) {
@@ -542,13 +1299,159 @@ int do_put(int controlfd, int datafd, char *input) {
 	/* Note that equivalent "KEEP" check for the temporary compressed
 	 * file is performed in prepare_file() */
 
-	/* Close open files */
-	fclose(in);
 	/* Free dynamically allocated memory */
 	free(prepared_fp);
 	/* CSCD58 end of addition - Compression */
 
+	return err ? -1 : 1;
+}
+
+
+/** Takes the data connections of a plain transfer that failed part way and
+ * resets them rather than closing them, so that the server cannot take the
+ * end of the connection for the end of the file, and does not wait for the
+ * client to read the rest of it. The next command opens new ones */
+void abort_data_conns(struct data_conn *conns, int *nconns) {
+	struct linger lin = { 1, 0 };
+
+	for (int i = 0; i < *nconns; i++) {
+		setsockopt(conns[i].fd, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin));
+	}
+	data_close_all(conns, nconns);
+}
+
+
+/** Retrieves a file from the server as it is, neither compressed nor
+ * encrypted: the file is moved from the data connection to a temporary file
+ * without passing through user space, and put in place once the server says
+ * it was all sent.
+ *
+ * \param 'controlfd' a file descriptor representing the control connection.
+ * \param '*conns' the open data connections, the first of which carries the
+ *     file, in stream mode.
+ * \param '*nconns' the number of open data connections, set to 0 if they
+ *     are reset.
+ * \param '*input' the command the user entered.
+ * \return 1 upon success, a negative int upon failure.
+ */
+int do_get_raw(int controlfd, struct data_conn *conns, int *nconns, char *input) {
+	/* {{{ */
+	char filename[256], serv_cmd[MAXLINE+1];
+	int fd, pipefd[2], err = 0;
+	ssize_t r;
+	char *recv_fp;
+
+	bzero(filename, (int)sizeof(filename));
+	if (get_filename(input, filename) < 0) {
+		printf("No filename Detected...\n");
+		return -1;
+	}
+	if ( (recv_fp = temp_recv_name(filename)) == NULL) {
+		fprintf(stderr, "ERROR: failed to receive file!\n");
+		return -1;
+	}
+	if ((fd = open(recv_fp, O_WRONLY | O_CREAT | O_EXCL, 0644)) < 0) {
+		fprintf(stderr, "ERROR: failed to receive file!\n");
+		free(recv_fp);
+		return -1;
+	}
+	if (0 != data_pipe_open(pipefd)) {
+		fprintf(stderr, "ERROR: failed to receive file!\n");
+		close(fd);
+		remove(recv_fp);
+		free(recv_fp);
+		return -1;
+	}
+
+	sprintf(serv_cmd, "RETR %s", filename);
+	send_command(controlfd, serv_cmd);
+
+	/* The server closes the data connection once it has sent the whole
+	 * file, or straight away if it cannot send it. If the file cannot be
+	 * written, the connection is reset so that the server stops sending */
+	while ((r = data_recv_file(&conns[0], fd, pipefd)) > 0);
+	if (r < 0) {
+		abort_data_conns(conns, nconns);
+		err = 1;
+	}
+	close(pipefd[0]);
+	close(pipefd[1]);
+	if (0 != close(fd)) {
+		err = 1;
+	}
+
+	if (read_reply(controlfd) != 200) {
+		err = 1;
+	}
+	if (err || 0 != rename(recv_fp, filename)) {
+		if (0 != remove(recv_fp)) {
+			fprintf(stderr, "WARNING: could not remove temporary file following an error!\n");
+		}
+		free(recv_fp);
+		return -1;
+	}
+	free(recv_fp);
+
 	return 1;
+	/* }}} */
+}
+
+
+/** Stores a file on the server as it is, neither compressed nor encrypted:
+ * the file is sent from the page cache straight to the data connection, which
+ * is then closed to mark the end of the file.
+ *
+ * \param 'controlfd' a file descriptor representing the control connection.
+ * \param '*conns' the open data connections, the first of which carries the
+ *     file, in stream mode.
+ * \param '*nconns' the number of open data connections, set to 0 if they
+ *     are reset.
+ * \param '*input' the command the user entered.
+ * \return 1 upon success, a negative int upon failure.
+ */
+int do_put_raw(int controlfd, struct data_conn *conns, int *nconns, char *input) {
+	/* {{{ */
+	char filename[256], serv_cmd[MAXLINE+1];
+	struct stat file_stat;
+	off_t offset = 0;
+	int fd, err = 0;
+
+	bzero(filename, (int)sizeof(filename));
+	if (get_filename(input, filename) < 0) {
+		printf("No filename Detected...\n");
+		return -1;
+	}
+	if ((fd = open(filename, O_RDONLY)) < 0 || fstat(fd, &file_stat) != 0) {
+		fprintf(stderr, "ERROR: could not read file that is to be sent!\n");
+		if (fd >= 0) close(fd);
+		return -1;
+	}
+
+	sprintf(serv_cmd, "STOR %s", filename);
+	send_command(controlfd, serv_cmd);
+
+	while (offset < file_stat.st_size) {
+		if (data_send_file(&conns[0], fd, &offset, file_stat.st_size - offset) <= 0) {
+			fprintf(stderr, "ERROR: could not send file!\n");
+			err = 1;
+			break;
+		}
+	}
+	close(fd);
+	/* A file that was not all sent must not be stored */
+	if (err) {
+		abort_data_conns(conns, nconns);
+	} else {
+		data_end(&conns[0]);
+	}
+
+	if (read_reply(controlfd) != 200) {
+		printf("File Error...\n");
+		err = 1;
+	}
+
+	return err ? -1 : 1;
+	/* }}} */
 }
 
 
@@ -609,27 +1512,188 @@ int setup_data_conn(int * listenfd, struct sockaddr_in * data_addr, \
 }
 
 
+/** Opens the first data connection of a command, if none is open: a channel
+ * of the multiplexed control connection, a connection to the server's
+ * passive port, or one the server opens to the port of 'port_command'.
+ *
+ * \param 'controlfd' a file descriptor representing the control connection.
+ * \param '*conns' the open data connections.
+ * \param '*nconns' the number of open data connections.
+ * \param '*src' how data connections are opened.
+ * \param '*serv_addr' the address of the server.
+ * \param '*port_command' the PORT command naming the client's data port.
+ * \param 'mode' the transmission mode of the data connections.
+ * \return 0 upon success, a negative int upon failure.
+ */
+static int open_first_conn(int controlfd, struct data_conn *conns, int *nconns, \
+	struct data_source *src, struct sockaddr_in *serv_addr, char *port_command, char mode) {
+
+	int datafd;
+
+	if (*nconns != 0) {
+		return 0;
+	}
+	if (src->mux != NULL) {
+		/* The channel is opened below, and needs no command */
+	} else if (src->passive) {
+		/* Ask the server which port to open the data connection to */
+		if (do_pasv(controlfd, src, serv_addr) < 0) {
+			fprintf(stderr, "ERROR: server did not enter passive mode\n");
+			return -1;
+		}
+	} else {
+		/* Send the port command that was constructed earlier */
+		send_command(controlfd, port_command);
+	}
+	/* Establish data connection by connecting to the server's passive port,
+	 * or by listening for the server who is attempting to connect() */
+	if (open_data_conn(&datafd, src) < 0) {
+		perror("data connection error");
+		return -1;
+	}
+	data_conn_init(&conns[0], datafd, mode);
+	*nconns = 1;
+
+#if DEBUG_LEVEL >= 1
+	fprintf(stdout, "Data connection established. Ready to receive data!\n");
+#endif
+
+	return 0;
+}
+
+
 int main(int argc, char **argv) {
-	int server_port, controlfd, listenfd, datafd, cmd;
+	int server_port, controlfd, listenfd, cmd, ret;
 	struct sockaddr_in serv_addr, data_addr;
 	char command[1024], ip[INET_ADDRSTRLEN], port_command[MAXLINE+1];
 
-	if (argc != 3) {
+	int opt, key_bits;
+	/* The transmission mode of the data connections */
+	char mode = MODE_BLOCK;
+	/* Whether files are sent as they are rather than compressed and
+	 * encrypted */
+	int raw = 0;
+	struct data_source src;
+	src.passive = 0;
+	src.mux = NULL;
+	/* Whether to carry the data over the control connection */
+	int mux = 0;
+	/* Whether to ask for small files to be sent after the reply to their
+	 * command */
+	int use_inline = 1;
+	/* Whether to put a file the server has a copy of as a delta against
+	 * that copy */
+	int delta = 0;
+
+	/* Parse options from commandline args */
+	while ((opt = getopt(argc, argv, "di:Ik:m:Mprs:x:")) != -1) {
+		switch (opt) {
+		case 'd':
+			/* Put the changes to a file rather than the whole file */
+			delta = 1;
+			break;
+		case 'i':
+			/* How the file of a transfer is read and written */
+			if (0 == strcmp(optarg, "uring")) {
+				stripe_set_uring(1);
+			} else if (0 == strcmp(optarg, "sync")) {
+				stripe_set_uring(0);
+			} else {
+				fprintf(stderr, "ERROR: I/O engine must be uring or sync\n");
+				exit(-1);
+			}
+			break;
+		case 'I':
+			/* Retrieve every file over a data connection */
+			use_inline = 0;
+			break;
+		case 'k':
+			/* The AES key length to ask the server for */
+			key_bits = atoi(optarg);
+			if (0 != enc_set_key_len(key_bits / 8) || key_bits % 8 != 0) {
+				fprintf(stderr, "ERROR: key length must be 128, 192 or 256 bits\n");
+				exit(-1);
+			}
+			break;
+		case 'm':
+			/* Whether a data connection carries one transfer or many */
+			if (0 == strcmp(optarg, "stream")) {
+				mode = MODE_STREAM;
+			} else if (0 == strcmp(optarg, "block")) {
+				mode = MODE_BLOCK;
+			} else {
+				fprintf(stderr, "ERROR: mode must be stream or block\n");
+				exit(-1);
+			}
+			break;
+		case 'M':
+			/* Open no connection but the control connection, as needed
+			 * behind a firewall that lets only one through */
+			mux = 1;
+			break;
+		case 'p':
+			/* Open data connections to the server, as needed behind NAT */
+			src.passive = 1;
+			break;
+		case 'r':
+			/* Send files as they are, which needs stream mode */
+			raw = 1;
+			break;
+		case 's':
+			/* The most data connections to stripe a transfer over */
+			if (0 != stripe_set_max_streams(atoi(optarg))) {
+				fprintf(stderr, "ERROR: data connections must be between 1 and %d\n", \
+					STRIPE_MAX_STREAMS);
+				exit(-1);
+			}
+			break;
+		case 'x':
+			/* The group to agree on the session's secret in */
+			if (0 == strcmp(optarg, "x25519")) {
+				set_kex_group(KEX_X25519);
+			} else if (0 == strcmp(optarg, "modp2048")) {
+				set_kex_group(KEX_MODP2048);
+			} else {
+				fprintf(stderr, "ERROR: key exchange must be x25519 or modp2048\n");
+				exit(-1);
+			}
+			break;
+		default:
+			exit(-1);
+		}
+	}
+
+	if (argc - optind != 2) {
 		printf("Invalid Number of Arguments...\n");
-		printf("Usage: ./ecftpclient <server-ip> <server-listen-port>\n");
+		printf("Usage: ./ecftpclient [-d] [-i <uring|sync>] [-I] [-k <128|192|256>] [-m <stream|block>] [-M] [-p] [-r] [-s <streams>] [-x <x25519|modp2048>] <server-ip> <server-listen-port>\n");
 		exit(-1);
 	}
 
 	/* Parse server address and port from commandline args */
-	strncpy(ip, argv[1], INET_ADDRSTRLEN);
-	sscanf(argv[2], "%d", &server_port);
+	strncpy(ip, argv[optind], INET_ADDRSTRLEN);
+	sscanf(argv[optind + 1], "%d", &server_port);
+
+	/* A server that gives up on a plain STOR closes the connection the file
+	 * is being sent on, which must fail the send rather than kill the
+	 * client */
+	signal(SIGPIPE, SIG_IGN);
 
 	/* Setup control and data connections, as required by the FTP at page 8 of:
 	 * https://www.ietf.org/rfc/rfc959.txt */
-	if (setup_control_conn(&controlfd, &serv_addr, argv[1], server_port) < 0) {
+	if (setup_control_conn(&controlfd, &serv_addr, argv[optind], server_port) < 0) {
 		perror("control connection setup error");
 		exit(-1);
 	}
+	/* Agree with the server on the session's secret, from which the key of
+	 * every transfer is derived */
+	struct enc_session session;
+	if (start_session_client(controlfd, &session) < 0) {
+		fprintf(stderr, "ERROR: key exchange with the server failed\n");
+		exit(-1);
+	}
+	if (mux && do_mux(&controlfd, &src) < 0) {
+		fprintf(stderr, "WARNING: server refused to multiplex, opening data connections\n");
+	}
 	// TODO: should the port be 0?
 	if (setup_data_conn(&listenfd, &data_addr, 0) < 0) {
 		perror("data connection setup error");
@@ -643,10 +1707,34 @@ int main(int argc, char **argv) {
 		exit(-1);
 	}
 	printf("IP: %s, Port: %d\n", ip, client_conn_port);
+	src.listenfd = listenfd;
 	/* Produce the port command of structure: "PORT h1,h2,h3,h4,p1,p2" */
 	bzero(port_command, (int) sizeof(port_command));
 	generate_port_command(port_command, ip, client_conn_port);
 
+	/* A plain transfer ends when its data connection closes */
+	if (raw) {
+		mode = MODE_STREAM;
+	}
+	/* Stream mode is the FTP default, so block mode must be asked for. A
+	 * server that refuses it gets stream mode */
+	if (mode == MODE_BLOCK && do_mode(controlfd, MODE_BLOCK) < 0) {
+		fprintf(stderr, "WARNING: server refused block mode, using stream mode\n");
+		mode = MODE_STREAM;
+	}
+	/* A server that does not allow plain transfers still compresses and
+	 * encrypts them */
+	if (raw && do_type(controlfd) < 0) {
+		fprintf(stderr, "WARNING: server refused plain transfers, compressing and encrypting\n");
+		raw = 0;
+	}
+
+	/* The data connections open to the server. In stream mode they are
+	 * closed after every command, in block mode they are kept for the next
+	 * one */
+	struct data_conn conns[STRIPE_MAX_STREAMS];
+	int nconns = 0;
+
 	while (1) {
 		bzero(command, strlen(command));
 		//get command from user
@@ -658,42 +1746,81 @@ int main(int argc, char **argv) {
 
 		/* If the user entered the "quit" command at the prompt */
 		if (cmd == CMD_QUIT){
-			// TODO: double check this if statement. What is it checking for?
-			// In which (if any) circumstances should the program then
-			if (do_quit(controlfd) < 0) {
-				close(datafd);
-			}
+			do_quit(controlfd);
 			break;
 		}
 
-		/* Send the port command that was constructed earlier */
-		write(controlfd, port_command, strlen(port_command));
-		/* Establish data connection by listening for the server who is
-		 * attempting to connect() */
-		datafd = accept(listenfd, (struct sockaddr *) NULL, NULL);
+		/* The status comes back over the control connection alone */
+		if (cmd == CMD_STAT) {
+			do_stat(controlfd);
+			continue;
+		}
 
-#if DEBUG_LEVEL >= 1
-	fprintf(stdout, "Data connection established. Ready to receive data!\n");
-#endif
+		/* A bundle of files is only ever compressed and encrypted as a
+		 * whole */
+		if ((cmd == CMD_MGET || cmd == CMD_MPUT) && raw) {
+			fprintf(stderr, "ERROR: mget and mput can not be used with plain transfers\n");
+			continue;
+		}
+		/* Only a compressed file is cut into chunks a range can be sent in */
+		if (cmd == CMD_RGET && raw) {
+			fprintf(stderr, "ERROR: rget can not be used with plain transfers\n");
+			continue;
+		}
+
+		/* A small file needs no data connection, and one that turns out not
+		 * to be small is retrieved below */
+		if (cmd == CMD_GET && !raw && use_inline \
+			&& (ret = do_get_inline(controlfd, &session, command)) != 0) {
 
+			continue;
+		}
+
+		if (0 != open_first_conn(controlfd, conns, &nconns, &src, &serv_addr, \
+			port_command, mode)) {
+
+			continue;
+		}
+
+		ret = 1;
 		if (cmd == CMD_LS) {
-			if (do_ls(controlfd, datafd, command) < 0) {
-				close(datafd);
-				continue;
+			ret = do_ls(controlfd, &conns[0], command);
+		} else if (cmd == CMD_GET && raw) {
+			ret = do_get_raw(controlfd, conns, &nconns, command);
+		} else if (cmd == CMD_PUT && raw) {
+			ret = do_put_raw(controlfd, conns, &nconns, command);
+		} else if (cmd == CMD_GET || cmd == CMD_RGET) {
+			ret = do_get(controlfd, conns, &nconns, &src, &session, command, XFER_FILE);
+		} else if (cmd == CMD_PUT && delta) {
+			/* The server sends the signatures of its copy of the file, and
+			 * gets the delta against them. A server without a copy gets the
+			 * whole file */
+			ret = do_get(controlfd, conns, &nconns, &src, &session, command, XFER_DELTA);
+			if (mode == MODE_STREAM || ret < 0) {
+				data_close_all(conns, &nconns);
 			}
-		} else if (cmd == CMD_GET) {
-			if (do_get(controlfd, datafd, command) < 0) {
-				close(datafd);
+			if (0 != open_first_conn(controlfd, conns, &nconns, &src, &serv_addr, \
+				port_command, mode)) {
+
 				continue;
 			}
+			ret = do_put(controlfd, conns, &nconns, &src, &session, command, \
+				ret > 0 ? XFER_DELTA : XFER_FILE);
 		} else if(cmd == CMD_PUT) {
-			if (do_put(controlfd, datafd, command) < 0) {
-				close(datafd);
-				continue;
-			}
+			ret = do_put(controlfd, conns, &nconns, &src, &session, command, XFER_FILE);
+		} else if (cmd == CMD_MGET || cmd == CMD_MPUT) {
+			ret = (cmd == CMD_MGET ? do_get : do_put)(controlfd, conns, &nconns, &src, \
+				&session, command, XFER_BUNDLE);
+		}
+
+		/* A failed command may leave data on the connections that no one
+		 * will read, so they are closed and the next command sends a new
+		 * PORT or EPSV command, which makes the server drop its end too */
+		if (mode == MODE_STREAM || ret < 0) {
+			data_close_all(conns, &nconns);
 		}
-		close(datafd);
 	}
+	data_close_all(conns, &nconns);
 	close(controlfd);
 	return TRUE;
 }
@@ -1,502 +1,2844 @@
+/* For accept4() */
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/file.h>
+#include <sys/prctl.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "bundle.h"
+#include "delta.h"
+#include "comp.h"
+#include "cpugate.h"
 #include "ecftp.h"
-
-
-int read_port_command(char *str, char *client_ip, uint16_t *client_port) {
+#include "membudget.h"
+#include "mux.h"
+#include "portalloc.h"
+#include "workpool.h"
+
+
+/* The server forks a fixed set of worker processes at startup, each with its
+ * own listening socket on the server's port (the kernel spreads new
+ * connections over them), and restarts any that exits. Each worker runs all
+ * of its sessions from a single event loop. All of its sockets are
+ * non-blocking and watched with epoll, and each session is a state machine
+ * that moves as far as it can whenever one of its sockets is ready, then
+ * waits for the next event. Anything that takes real CPU time (the key
+ * exchange, compressing and encrypting a file, listing a directory) is handed
+ * to the worker's fixed pool of threads, so thousands of sessions can be open
+ * at once without one session's work holding up the sockets of the others. */
+
+
+/* The most events taken from epoll per wakeup */
+#define MAX_EVENTS 256
+/* How often the event loop looks for sessions that have waited too long for
+ * a data connection, in milliseconds */
+#define TIMEOUT_CHECK_MS 1000
+/* The most unused stripe buffers a worker process keeps for later transfers */
+#define BUF_CACHE_MAX 64
+/* The exit status of a worker process that could not start serving, which
+ * tells the supervisor not to restart it */
+#define WORKER_SETUP_FAILED 2
+
+/* What an epoll event was registered for */
+#define EV_LISTEN 1
+#define EV_WORKERS 2
+#define EV_CONTROL 3
+#define EV_PASV 4
+#define EV_DATA 5
+#define EV_MUX 6
+
+/* What a session is waiting for */
+/* The client's half of the key exchange */
+#define ST_KEX 1
+/* The worker pool to compute the server's half of the key exchange */
+#define ST_KEX_WORK 2
+/* The next command */
+#define ST_IDLE 3
+/* The data connection of a PORT or PASV command to be opened */
+#define ST_DATA_OPEN 4
+/* The worker pool to list a directory */
+#define ST_LIST_WORK 5
+/* Data queued on the first data connection to be sent */
+#define ST_FLUSH 6
+/* The client's offer for a transfer */
+#define ST_NEGOTIATE 7
+/* The worker pool to compress and encrypt the file of a RETR */
+#define ST_PREPARE 8
+/* The stripe header of a STOR */
+#define ST_HEADER 9
+/* The rest of the data connections of a striped transfer to be opened */
+#define ST_STRIPE_OPEN 10
+/* The stripes of a RETR to be sent */
+#define ST_SEND 11
+/* The stripes of a STOR to be received */
+#define ST_RECV 12
+/* The worker pool to decrypt and decompress the file of a STOR */
+#define ST_PROCESS 13
+/* The file of a plain RETR to be sent */
+#define ST_RAW_SEND 14
+/* The file of a plain STOR to be received */
+#define ST_RAW_RECV 15
+/* The worker pool to compress and encrypt the file of a RETI */
+#define ST_INLINE_WORK 16
+/* The worker pool to keep the whole chunks at the start of what a failed
+ * STOR received */
+#define ST_KEEP_WORK 17
+
+/* What a step of a session's state machine returns: whether the session
+ * moved to another state and can go on, or has to wait for an event */
+#define STEP_WAIT 0
+#define STEP_PROGRESS 1
+
+
+struct session;
+
+/* Define a struct representing a file descriptor watched by the event loop,
+ * which is what each epoll event points to */
+struct ev_handle {
+	/* -1 while nothing is open */
+	int fd;
+	/* One of the 'EV_*' values */
+	int kind;
+	/* 'EV_DATA': the index of the data connection */
+	int index;
+	/* Whether 'fd' is registered with epoll, and the events it is watched
+	 * for */
+	int added;
+	uint32_t events;
+	/* The session the descriptor belongs to, if any */
+	struct session *s;
+};
+
+/* Define a struct holding how the data connections of a session are opened:
+ * to the address the client gave in its PORT command, by accepting them on
+ * the session's passive port, or by accepting the channels the client opens
+ * on a multiplexed control connection */
+struct data_target {
+	/* The address and port the client gave in its PORT command. In passive
+	 * mode, the address of the client, which every data connection must come
+	 * from */
+	char client_ip[INET_ADDRSTRLEN];
+	uint16_t client_port;
+	/* Whether data connections are accepted on 'pasv_fd' rather than opened
+	 * to the client */
+	int passive;
+	/* The socket listening on the session's passive port, or -1 if the
+	 * session has not asked for one */
+	int pasv_fd;
+	uint16_t pasv_port;
+	/* The multiplexer the session's commands and data go over once the
+	 * client has asked for MUX, or NULL. Its data connections are then
+	 * accepted as in passive mode, from the multiplexer */
+	struct mux *mux;
+};
+
+/* Define a struct holding everything about one client's session */
+struct session {
+	/* {{{ */
+	/* A number for the session's log lines */
+	int id;
+	char client_addr[INET_ADDRSTRLEN];
+	uint16_t client_port;
+	/* One of the 'ST_*' values */
+	int state;
+	/* When the session gives up on the data connections it is waiting for,
+	 * in milliseconds of the monotonic clock */
+	int64_t deadline;
+
+	struct ev_handle control;
+	struct ev_handle pasv;
+	struct ev_handle mux;
+	struct ev_handle data[STRIPE_MAX_STREAMS];
+
+	struct data_target target;
+	/* The data connections open to the client, including any still
+	 * connecting. In stream mode they are closed after every command, in
+	 * block mode they are kept for the next one */
+	struct data_conn conns[STRIPE_MAX_STREAMS];
+	int nconns;
+	char mode;
+	/* Whether the client asked for TYPE I, which has files sent as they
+	 * are rather than compressed and encrypted */
+	int raw;
+	/* One bit per data connection whose connect() is still in progress */
+	uint32_t connecting;
+
+	/* The key exchange: the client's group byte and public value, of which
+	 * 'kex_have' bytes have been read, and the server's public value */
+	uint8_t kex_msg[1 + KEX_MAX_PUBLIC_LEN];
+	size_t kex_have;
+	uint8_t kex_pub[KEX_MAX_PUBLIC_LEN];
+	size_t kex_pub_len;
+	struct enc_session session;
+
+	/* What has been read of the client's commands, which may have sent
+	 * several without waiting for the replies */
+	struct line_reader control_in;
+	/* Replies waiting for room on the control connection, of which the
+	 * first 'reply_off' bytes have been sent. There is room for a file sent
+	 * inline after its reply */
+	char replies[LINE_BUF_LEN + INLINE_MAX_PAYLOAD];
+	size_t reply_len, reply_off;
+
+	/* The command being handled */
+	char command[MAXLINE+1];
+	int cmd;
+	char filename[1024];
+	int have_filename;
+	/* Whether the RETR or STOR carries a bundle of files, as MGET and MPUT
+	 * do, and for an MGET the paths to bundle */
+	int bundle;
+	char bundle_paths[MAXLINE+1];
+	/* Whether the RETR carries the signatures of the file, as SIGN does,
+	 * or the STOR a delta against them, as DELT does */
+	int delta;
+	/* The offset the last command, if it was a REST or RANG, gave for the
+	 * next one, and the offset the RETR or STOR being handled starts at.
+	 * Once a failed STOR has been kept, 'offset' is where the client can
+	 * restart it */
+	uint64_t rest;
+	uint64_t offset;
+	/* Where the range the last command, if it was a RANG, gave for the next
+	 * one ends, and where the range of the RETR being handled ends: the
+	 * offset after its last byte, or 0 for the end of the file */
+	uint64_t rest_end;
+	uint64_t end;
+
+	/* Data queued to be sent on the first data connection, of which
+	 * 'out_off' bytes have been sent, and whether the transfer's data ends
+	 * once it has all been sent. Once it has, 'after_flush' is called with
+	 * whether it all went out */
+	uint8_t *out;
+	size_t out_len, out_off, out_cap;
+	int out_end;
+	int (*after_flush)(struct session *, int);
+
+	/* Fixed-length messages read from the first data connection: the
+	 * client's offer for a transfer and the stripe header of a STOR, of
+	 * which 'in_have' bytes have been read */
+	uint8_t offer[TRANSFER_OFFER_LEN];
+	uint8_t header[STRIPE_HEADER_LEN];
+	size_t in_have;
+
+	/* The transfer being run */
+	struct transfer_params params;
+	int streams;
+	uint64_t len;
+	/* The prepared file of a RETR or the received file of a STOR */
+	char *path;
+	struct stripe_xfer xfer;
+	int xfer_open;
+	struct stripe_conn sc[STRIPE_MAX_STREAMS];
+	int nsc;
+	/* The number of data connections done with the transfer, and one bit
+	 * per connection whose unusable data is being read and thrown away */
+	int ndone;
+	uint32_t draining;
+	/* A plain transfer: the file being sent or received (-1 if none), how
+	 * far into it a RETR has got and how long it is, and the pipe a STOR is
+	 * received through */
+	int raw_fd;
+	off_t raw_off;
+	uint64_t raw_len;
+	int pipefd[2];
+
+	/* RETI: the parameters chosen for the transfer, in hex, and the file,
+	 * compressed and encrypted, to be sent after the reply */
+	char inline_chosen[2 * TRANSFER_REPLY_LEN + 1];
+	uint8_t *inline_buf;
+	size_t inline_len;
+
+	/* LIST: the command run, and what it printed */
+	char list_cmd[MAXLINE+1];
+	char *list_buf;
+	size_t list_len;
+
+	/* The job the session has in the worker pool, if 'job_busy' is set, and
+	 * what it returned */
+	struct work_job job;
+	int job_busy;
+	int job_result;
+
+	/* Set once the session has ended. It is freed once its job, if any, is
+	 * back from the worker pool */
+	int closing;
+	struct session *prev, *next;
+	/* }}} */
+};
+
+
+/* The ports passive data connections are accepted on, shared by every
+ * session */
+static struct port_pool *pasv_pool;
+
+/* Caps the number of file chunks being compressed or encrypted at once
+ * across every worker process */
+static struct cpu_gate *cpu_gate;
+
+/* Bounds the memory taken by the buffers files are compressed and encrypted
+ * in, across every worker process */
+static struct mem_budget *mem_budget;
+
+/* Whether sessions may ask for plain transfers, which are neither
+ * compressed nor encrypted */
+static int raw_allowed = 0;
+
+/* The event loop's epoll instance and worker pool */
+static int epfd;
+static struct work_pool *workers;
+
+/* Every open session, for the timeout check, and the sessions that have
+ * ended and can be freed once the current batch of events is handled */
+static struct session *sessions;
+static struct session *dead;
+/* Session numbers are unique across the worker processes: each process
+ * counts up from its own index in steps of the number of processes */
+static int next_session_id = 1;
+static int session_id_step = 1;
+
+/* Stripe buffers no transfer is using, kept so that a transfer does not have
+ * to map and fault in fresh megabyte buffers for each data connection */
+static uint8_t *free_bufs[BUF_CACHE_MAX];
+static int nfree_bufs;
+
+
+/** Takes a PORT command and reads the address and port it gives.
+ *
+ * \param '*str' the command, "PORT h1,h2,h3,h4,p1,p2".
+ * \param '*client_ip' will be modified to contain the address, of at most
+ *     'INET_ADDRSTRLEN' bytes.
+ * \param '*client_port' will be modified to contain the port.
+ * \return 0 upon success, a negative int if the command is malformed.
+ */
+int read_port_command(const char *str, char *client_ip, uint16_t *client_port) {
 	/* Read the port command, as specified at page 28 of:
 	 * https://www.ietf.org/rfc/rfc959.txt */
+	unsigned int h[4], p[2];
 
-	char *h1, *h2, *h3, *h4, *p1, *p2;
-	uint16_t p1_i, p2_i;
-
-	strtok(str, " ");
-	h1 = strtok(NULL, ",");
-	h2 = strtok(NULL, ",");
-	h3 = strtok(NULL, ",");
-	h4 = strtok(NULL, ",");
-	p1 = strtok(NULL, ",");
-	p2 = strtok(NULL, ",");
+	if (sscanf(str, "PORT %u,%u,%u,%u,%u,%u", &h[0], &h[1], &h[2], &h[3], \
+		&p[0], &p[1]) != 6 || h[0] > 255 || h[1] > 255 || h[2] > 255 || h[3] > 255 \
+		|| p[0] > 255 || p[1] > 255) {
 
-	sprintf(client_ip, "%s.%s.%s.%s", h1, h2, h3, h4);
+		return -1;
+	}
 
+	snprintf(client_ip, INET_ADDRSTRLEN, "%u.%u.%u.%u", h[0], h[1], h[2], h[3]);
 	/* Reconstruct the port number from the 2 char inputs */
-	p1_i = atoi(p1);
-	p2_i = atoi(p2);
-	(*client_port) = (p1_i << 8) + p2_i;
+	(*client_port) = (p[0] << 8) + p[1];
 
 	return 0;
 }
 
 
-int setup_data_connection(int *fd, char *client_ip, int client_port, int server_port) {
-
-	struct sockaddr_in client_addr, temp_addr;
-
-	if ( ( (*fd) = socket(AF_INET, SOCK_STREAM, 0)) < 0){
-		perror("socket error");
-		return -1;
-	}
-
-	//bind port for data connection to be server port - 1 by using a temporary
-	//struct sockaddr_in
-	bzero(&temp_addr, sizeof(temp_addr));
-	temp_addr.sin_family = AF_INET;
-	temp_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-	/* Setup data connection to have a port that is the control connection
-	 * port - 1, as specified at page 18 of:
-	 * https://www.ietf.org/rfc/rfc959.txt */
-	temp_addr.sin_port = htons(server_port - 1);
-
-	while (bind( (*fd), (struct sockaddr*) &temp_addr, sizeof(temp_addr)) < 0) {
-		server_port--;
-		temp_addr.sin_port = htons(server_port);
-	}
-
-	/* Initiate data connection with client */
-	bzero(&client_addr, sizeof(client_addr));
-	client_addr.sin_family = AF_INET;
-	client_addr.sin_port = htons(client_port);
-	if (inet_pton(AF_INET, client_ip, &client_addr.sin_addr) <= 0) {
-		perror("inet_pton error");
-		return -1;
-	}
-
-	if (connect(*fd, (struct sockaddr *) &client_addr, sizeof(client_addr)) < 0) {
-		perror("connect error");
+/** Takes a command and copies its first argument (the word after the verb)
+ * into 'fileptr', leaving the command as it is.
+ *
+ * \param '*input' the command.
+ * \param '*fileptr' will be modified to contain the argument.
+ * \param 'len' the size of 'fileptr'.
+ * \return 1 upon success, a negative int if the command has no argument or
+ *     one too long for 'fileptr'.
+ */
+int get_filename(const char *input, char *fileptr, size_t len) {
+	const char *begin = input + strcspn(input, " ");
+	size_t n;
+
+	begin += strspn(begin, " ");
+	n = strcspn(begin, " ");
+	if (n == 0 || n >= len) {
 		return -1;
 	}
+	memcpy(fileptr, begin, n);
+	fileptr[n] = '\0';
 
 	return 1;
 }
 
 
-int get_filename(char *input, char *fileptr) {
-
-	char *filename = NULL;
-	filename = strtok(input, " ");
-	filename = strtok(NULL, " ");
-
-	if (filename == NULL) {
-		return -1;
-	} else {
-		strncpy(fileptr, filename, strlen(filename));
-		return 1;
-	}
-}
-
-
 int get_command(char *command) {
 	char cpy[1024];
-	strcpy(cpy, command);
+	snprintf(cpy, sizeof(cpy), "%s", command);
 	char *str = strtok(cpy, " ");
 	int value = 0;
 
+	/* A command of nothing but spaces would otherwise take down every
+	 * session in the process */
+	if (str == NULL) {
+		return 0;
+	}
+
 	//populated value variable to indicate back to main which input was entered
     if(strcmp(str, "LIST") == 0){value = CMD_LS;}
     else if(strcmp(str, "RETR") == 0){value = CMD_GET;}
     else if(strcmp(str, "STOR") == 0){value = CMD_PUT;}
     else if(strcmp(str, "SKIP") == 0){value = 4;}
     else if(strcmp(str, "ABOR") == 0){value = 5;}
+    else if(strcmp(str, "MGET") == 0){value = CMD_MGET;}
+    else if(strcmp(str, "MPUT") == 0){value = CMD_MPUT;}
+    else if(strcmp(str, "SIGN") == 0){value = CMD_SIGN;}
+    else if(strcmp(str, "DELT") == 0){value = CMD_DELT;}
 
     return value;
 }
 
 
-int do_list(int controlfd, int datafd, char *input){
-	char filelist[1024], sendline[MAXLINE+1], str[MAXLINE+1];
-	bzero(filelist, (int)sizeof(filelist));
+/** Returns a stripe buffer of 'STRIPE_BUF_LEN' bytes, reusing one a
+ * finished transfer gave back if there is one, or NULL upon failure */
+static uint8_t * buf_get() {
+	if (nfree_bufs > 0) {
+		return free_bufs[--nfree_bufs];
+	}
+	return stripe_buf_alloc();
+}
 
-	if(get_filename(input, filelist) > 0){
-		// TODO: what does it mean to have a filelist detected? did the user
-		// specify a subdirectory?
-		printf("(%d) Filelist Detected\n", getpid());
-		sprintf(str, "ls %s", filelist);
-		printf("(%d) Filelist: %s\n", getpid(), filelist);
-		trim(filelist);
-		//verify that given input is valid
-		/*struct stat statbuf;
-		stat(filelist, &statbuf);
-		if(!(S_ISDIR(statbuf.st_mode))) {
-			sprintf(sendline, "550 No Such File or Directory\n");
-    		write(controlfd, sendline, strlen(sendline));
-    		return -1;
-		}*/
-		// TODO: does this opendir() solution work? would stat() not be better?
-    	DIR *dir = opendir(filelist);
-    	if(!dir){
-    		sprintf(sendline, "550 No Such File or Directory\n");
-    		write(controlfd, sendline, strlen(sendline));
-    		return -1;
-		} else {
-			closedir(dir);
-		}
+
+/** Takes a stripe buffer from 'buf_get()' that is no longer used and keeps
+ * it for the next transfer, or frees it if enough are kept already */
+static void buf_put(uint8_t *buf) {
+	if (nfree_bufs < BUF_CACHE_MAX) {
+		free_bufs[nfree_bufs++] = buf;
 	} else {
-		sprintf(str, "ls");
+		free(buf);
 	}
+}
 
-	FILE *in;
 
-	if (!(in = popen(str, "r"))) {
-		sprintf(sendline, "451 Requested action aborted. Local error in processing.\n");
-		write(controlfd, sendline, strlen(sendline));
-		return -1;
+/** Allocates 'n' stripe buffers for the cache and touches every page of
+ * them, so that the first transfers do not pay for page faults */
+static void buf_preallocate(int n) {
+	for (int i = 0; i < n && nfree_bufs < BUF_CACHE_MAX; i++) {
+		uint8_t *buf = stripe_buf_alloc();
+		if (buf == NULL) return;
+		memset(buf, 0, STRIPE_BUF_LEN);
+		buf_put(buf);
 	}
+}
 
-	while (fgets(sendline, MAXLINE, in) != NULL) {
-		write(datafd, sendline, strlen(sendline));
-		bzero(sendline, (int)sizeof(sendline));
-	}
 
-	sprintf(sendline, "200 Command OK");
-	write(controlfd, sendline, strlen(sendline));
-	pclose(in);
+/** Returns the time on the monotonic clock in milliseconds */
+static int64_t now_ms() {
+	struct timespec ts;
 
-	return 1;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
 
-int do_retr(int controlfd, int datafd, char *input) {
-	char filename[1024], sendline[MAXLINE+1];
-	bzero(filename, (int)sizeof(filename));
-	bzero(sendline, (int)sizeof(sendline));
-	int err = 0;
+/** Takes a handle and makes epoll watch its descriptor for 'events', adding
+ * or removing the descriptor as needed */
+static void watch(struct ev_handle *h, uint32_t events) {
+	struct epoll_event ev;
+
+	if (h->fd < 0 || (h->added && h->events == events)) {
+		return;
+	}
+
+	ev.events = events;
+	ev.data.ptr = h;
+	if (!h->added) {
+		if (events == 0) return;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, h->fd, &ev) < 0) {
+			perror("epoll_ctl error");
+			return;
+		}
+		h->added = 1;
+	} else if (epoll_ctl(epfd, EPOLL_CTL_MOD, h->fd, &ev) < 0) {
+		perror("epoll_ctl error");
+	}
+	h->events = events;
+}
+
 
-	/* CSCD58 addition - Encryption */
-	uint32_t key[4];
-	do_dh_server(controlfd, datafd, key);
-	/* CSCD58 end of addition - Encryption */
+/** Takes a handle and stops watching its descriptor, which is then
+ * forgotten. The caller closes it */
+static void unwatch(struct ev_handle *h) {
+	if (h->fd >= 0 && h->added) {
+		epoll_ctl(epfd, EPOLL_CTL_DEL, h->fd, NULL);
+	}
+	h->fd = -1;
+	h->added = 0;
+	h->events = 0;
+}
 
-	if (get_filename(input, filename) > 0){
-		if (access(filename, F_OK) != 0) {
-			sprintf(sendline, "550 No Such File or Directory\n");
-			write(controlfd, sendline, strlen(sendline));
+
+/** Takes a session and sends the replies it has queued until the control
+ * connection is full.
+ *
+ * \return 0 once every reply has been sent, 1 if some are waiting for room,
+ *     or a negative int if the connection failed.
+ */
+static int flush_replies(struct session *s) {
+	while (s->reply_off < s->reply_len) {
+		ssize_t w = write(s->control.fd, &s->replies[s->reply_off], \
+			s->reply_len - s->reply_off);
+		if (w < 0 && errno == EINTR) continue;
+		if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 1;
+		if (w <= 0) {
+			s->reply_off = s->reply_len = 0;
 			return -1;
 		}
-	} else {
-		printf("Filename Not Detected\n");
-		sprintf(sendline, "450 Requested file action not taken.\nFilename Not Detected\n");
-		write(controlfd, sendline, strlen(sendline));
-		return -1;
+		s->reply_off += w;
 	}
+	s->reply_off = s->reply_len = 0;
 
-	/* CSCD58 addition - Compression */
-	char * prepared_fp;
-
-	/* Encrypt (using key 'key') and compress the file stored at the
-	 * filepath 'filename', outputting the result to the file at path
-	 * 'prepared_fp' */
-	if (0 != prepare_file(filename, key, &prepared_fp)) {
-		fprintf(stderr, "ERROR: could not prepare the file!\n");
-		sprintf(sendline, "451 Requested action aborted. Local error in processing\n");
-		write(controlfd, sendline, strlen(sendline));
-		return -1;
+	return 0;
+}
+
+
+/** Takes a session and sends 'text' to the client as a reply line, followed
+ * by the 'len' bytes at 'data', if any. A reply the control connection has
+ * no room for waits, and the session takes no more commands until it has
+ * gone out: a client that sends commands without reading the replies is
+ * held to the pace it reads them at, and loses none */
+static void reply_data(struct session *s, const char *text, const void *data, size_t len) {
+	size_t text_len = strlen(text);
+
+	if (s->reply_off > 0) {
+		memmove(s->replies, &s->replies[s->reply_off], s->reply_len - s->reply_off);
+		s->reply_len -= s->reply_off;
+		s->reply_off = 0;
 	}
-	/* CSCD58 end of addition - Compression */
-	
-	FILE *in;
+	if (s->reply_len + text_len + 2 + len > sizeof(s->replies)) {
+		fprintf(stderr, "(%d) WARNING: could not send a reply\n", s->id);
+		return;
+	}
+	memcpy(&s->replies[s->reply_len], text, text_len);
+	memcpy(&s->replies[s->reply_len + text_len], "\r\n", 2);
+	s->reply_len += text_len + 2;
+	if (len > 0) {
+		memcpy(&s->replies[s->reply_len], data, len);
+		s->reply_len += len;
+	}
+	flush_replies(s);
+}
 
-	if (!(in = fopen(prepared_fp, "rb"))) {
-		sprintf(sendline, "451 Requested action aborted. Local error in processing\n");
-		write(controlfd, sendline, strlen(sendline));
-		return -1;
+
+static void reply(struct session *s, const char *text) {
+	reply_data(s, text, NULL, 0);
+}
+
+
+/** Takes a session and closes all of its data connections */
+static void drop_conns(struct session *s) {
+	for (int i = 0; i < s->nconns; i++) {
+		unwatch(&s->data[i]);
 	}
+	data_close_all(s->conns, &s->nconns);
+	s->connecting = 0;
+	s->draining = 0;
+}
 
-	uint16_t nmem_read = 0;
-	
-	while (0 != (nmem_read = fread(&sendline, 1, MAXLINE, in)) ) {
-		size_t written = 0;
-		
-		/* Write until all bytes in 'sendline' have been sent */
-		while (written < nmem_read) {
-			size_t nmem_written = write(datafd, &sendline[written], nmem_read - written);
 
-			if (nmem_written < 0) {
-				err = 1;
-				break;
-			} else {
-				written += nmem_written;
-			}
-		}
+/** Takes a session and a newly opened data connection and makes it the
+ * session's 'i'th data connection */
+static void add_conn(struct session *s, int i, int fd) {
+	data_conn_init(&s->conns[i], fd, s->mode);
+	s->data[i].fd = fd;
+	s->nconns = i + 1;
+}
+
+
+/** Takes a session whose command is finished and gets it ready for the next
+ * one. A failed command may leave data on the connections that no one will
+ * read, so they are closed; the client does the same and sends a new PORT
+ * command. */
+static void finish_command(struct session *s, int ret) {
+	if (s->mode == MODE_STREAM || ret < 0) {
+		drop_conns(s);
 	}
+	s->state = ST_IDLE;
+}
 
-	fclose(in);
 
-	/* If there was an error receiving/processing the file */
-	if (err != 0) {
-		if (0 != remove(prepared_fp)) {
-			fprintf(stderr, "WARNING: could not remove temporary processed file!\n");
-		} 
-		/* Send error message to server */
-		sprintf(sendline, "451 Requested action aborted. Local error in processing\n");
-		write(controlfd, sendline, strlen(sendline));
-		return -1;
+static void submit_job(struct session *s, void (*run)(struct work_job *), int state) {
+	s->job.run = run;
+	s->job.arg = s;
+	s->job_busy = 1;
+	s->state = state;
+	work_pool_submit(workers, &s->job);
+}
+
+
+/** Takes a session and frees everything held for its transfer, removing the
+ * transfer's temporary file if 'remove_file' is set */
+static void transfer_cleanup(struct session *s, int remove_file) {
+	for (int i = 0; i < s->nsc; i++) {
+		buf_put(s->sc[i].buf);
+	}
+	s->nsc = 0;
+	if (s->xfer_open) {
+		stripe_xfer_close(&s->xfer);
+		s->xfer_open = 0;
+	}
+	if (s->raw_fd >= 0) {
+		close(s->raw_fd);
+		s->raw_fd = -1;
 	}
+	if (s->pipefd[0] >= 0) {
+		close(s->pipefd[0]);
+		close(s->pipefd[1]);
+		s->pipefd[0] = s->pipefd[1] = -1;
+	}
+	if (s->path != NULL) {
+		if (remove_file) remove(s->path);
+		free(s->path);
+		s->path = NULL;
+	}
+}
 
-	/* Send success message to client */
-	sprintf(sendline, "200 Command OK");
-	write(controlfd, sendline, strlen(sendline));
 
-	/* CSCD58 addition - Compression */
-	if (KEEP_TEMP_ENC_FILES != 1) {
-		if (0 != remove(prepared_fp)) {
-			fprintf(stderr, "WARNING: could not remove temporary prepared file!\n");
-		} 
+static int fail_transfer(struct session *s) {
+	transfer_cleanup(s, 1);
+	reply(s, "451 Requested action aborted. Local error in processing");
+	finish_command(s, -1);
+	return STEP_PROGRESS;
+}
+
+
+static void job_keep(struct work_job *job);
+
+
+/** Takes a session and ends it, closing all of its descriptors. It is freed
+ * once the current batch of events has been handled and it has no job left
+ * in the worker pool */
+static void session_close(struct session *s) {
+	/* {{{ */
+	if (s->closing) {
+		return;
+	}
+	s->closing = 1;
+
+	drop_conns(s);
+	if (s->target.pasv_fd >= 0) {
+		unwatch(&s->pasv);
+		close(s->target.pasv_fd);
+		port_pool_release(pasv_pool, s->target.pasv_port);
+		s->target.pasv_fd = -1;
+	}
+	int fd = s->control.fd;
+	unwatch(&s->control);
+	close(fd);
+	if (s->target.mux != NULL) {
+		/* Send what is left of the last reply, if the connection has room */
+		mux_pump(s->target.mux);
+		unwatch(&s->mux);
+		mux_destroy(s->target.mux);
+		s->target.mux = NULL;
 	}
 
-	/* Note that equivalent "KEEP" check for the temporary compressed
-	 * file is performed in prepare_file() */
+	if (s->prev != NULL) s->prev->next = s->next;
+	else sessions = s->next;
+	if (s->next != NULL) s->next->prev = s->prev;
 
-	/* Free dynamically allocated memory */
-	free(prepared_fp);
-	/* CSCD58 end of addition - Compression */
+	fprintf(stderr, "(%d) ------------------------------\n" \
+					"(%d) STATUS: Finished with client: %s:%d.\n" \
+					"(%d) ******************************\n", \
+					s->id, s->id, s->client_addr, s->client_port, s->id);
 
-	return 1;
+	/* What a STOR had received when the client went away is kept, so that
+	 * the client can restart it in a later session */
+	if (s->state == ST_RECV && !s->bundle && !s->delta) {
+		for (int i = 0; i < s->nsc; i++) {
+			buf_put(s->sc[i].buf);
+		}
+		s->nsc = 0;
+		stripe_xfer_close(&s->xfer);
+		s->xfer_open = 0;
+		submit_job(s, job_keep, ST_KEEP_WORK);
+	}
+
+	/* A job still in the worker pool may be using the session */
+	if (!s->job_busy) {
+		s->next = dead;
+		dead = s;
+	}
+	/* }}} */
 }
 
 
-int do_stor(int controlfd, int datafd, char *input) {
-	char filename[1024], sendline[MAXLINE+1], recvline[MAXLINE+1], str[MAXLINE+1];
-	bzero(filename, (int)sizeof(filename));
-	bzero(sendline, (int)sizeof(sendline));
-	bzero(recvline, (int)sizeof(recvline));
-	bzero(str, (int)sizeof(str));
+static void session_free(struct session *s) {
+	transfer_cleanup(s, 1);
+	free(s->out);
+	free(s->list_buf);
+	free(s->inline_buf);
+	free(s);
+}
+
 
-	/* CSCD58 addition - Encryption */
-	uint32_t key[4];
-	do_dh_server(controlfd, datafd, key);
-	/* CSCD58 end of addition - Encryption */
+/* ================================================== */
+/* Data connections */
+/* ================================================== */
 
-	if (get_filename(input, filename) > 0) {
-		sprintf(str, "%s", filename);
-	}else{
-		printf("Filename Not Detected\n");
-		sprintf(sendline, "450 Requested file action not taken.\n");
-		write(controlfd, sendline, strlen(sendline));
+
+/** Takes a session and starts opening its 'i'th data connection to the
+ * address the client gave in its PORT command. The connection is done once
+ * 'check_connect()' says so.
+ *
+ * \return 0 if the connection is under way, a negative int upon failure.
+ */
+static int start_connect(struct session *s, int i) {
+	/* {{{ */
+	struct sockaddr_in client_addr;
+	int fd;
+
+	if ( (fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+		perror("socket error");
 		return -1;
 	}
 
-	/* CSCD58 addition - Compression */
-	/* Make temporary name for receiving file
-	 * ( '<filename>.comp.enc-XXXXXX' ) */
-	char * recv_fp;
-	if ( (recv_fp = temp_recv_name(filename)) == NULL) {
-		fprintf(stderr, "ERROR: failed to receive file!\n");
+	/* RFC 959 has the server open data connections from the port below its
+	 * control port, but with many sessions (and stripes) connecting at once
+	 * that port is nearly always taken, so the kernel picks the local port
+	 * instead */
+
+	bzero(&client_addr, sizeof(client_addr));
+	client_addr.sin_family = AF_INET;
+	client_addr.sin_port = htons(s->target.client_port);
+	if (inet_pton(AF_INET, s->target.client_ip, &client_addr.sin_addr) <= 0) {
+		perror("inet_pton error");
+		close(fd);
 		return -1;
 	}
-	/* CSCD58 end of addition - Compression*/
 
-	FILE *fp;
+	if (connect(fd, (struct sockaddr *) &client_addr, sizeof(client_addr)) < 0 \
+		&& errno != EINPROGRESS) {
 
-	if ((fp = fopen(recv_fp, "w")) == NULL) {
-		perror("file error");
+		perror("connect error");
+		close(fd);
 		return -1;
 	}
 
-	int read_len = 0;
+	add_conn(s, i, fd);
+	s->connecting |= 1u << i;
+
+	return 0;
+	/* }}} */
+}
+
+
+/** Takes a session and finishes the connect() of each of its data
+ * connections that has finished connecting.
+ *
+ * \return 0 once none are still connecting, 1 if some are, or a negative
+ *     int if one of them failed.
+ */
+static int check_connect(struct session *s) {
+	for (int i = 0; i < s->nconns; i++) {
+		if (!(s->connecting & (1u << i))) continue;
 
-	while ( (read_len = read(datafd, recvline, MAXLINE)) > 0) {
-		fwrite(recvline, 1, read_len, fp);
-		bzero(recvline, (int)sizeof(recvline));
+		struct pollfd pfd = { .fd = s->conns[i].fd, .events = POLLOUT };
+		int err = 0;
+		socklen_t len = sizeof(err);
+
+		if (poll(&pfd, 1, 0) == 0) continue;
+		if (getsockopt(pfd.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+			fprintf(stderr, "(%d) connect error: %s\n", s->id, strerror(err ? err : errno));
+			return -1;
+		}
+		s->connecting &= ~(1u << i);
 	}
 
-	sprintf(sendline, "200 Command OK");
-	write(controlfd, sendline, strlen(sendline));
-	fclose(fp);
+	return s->connecting ? 1 : 0;
+}
+
+
+/** Takes a session in passive mode and accepts the client's connections on
+ * its passive port (or the channels it opens on a multiplexed session) until
+ * it has 'want' data connections. Connections from any address but the
+ * client's are turned away, so no one else can take the data of a transfer.
+ *
+ * \return 0 once the session has 'want' data connections, 1 if it is still
+ *     waiting for some, or a negative int upon failure.
+ */
+static int accept_conns(struct session *s, int want) {
+	/* {{{ */
+	struct sockaddr_in peer_addr;
+	struct in_addr client_addr;
+	socklen_t len;
+	int fd;
+
+	/* A channel can only have come from the client */
+	if (s->target.mux != NULL) {
+		while (s->nconns < want) {
+			if ((fd = mux_accept(s->target.mux)) < 0) {
+				return 1;
+			}
+			add_conn(s, s->nconns, fd);
+		}
+		return 0;
+	}
 
-	/* CSCD58 addition - Compression + Encryption */
-	/* Decrypt (using key 'key') and decompress received file stored at the
-	 * filepath 'recv_fp', outputting the result to the file at path
-	 * 'filename' */
-	if (process_received_file(filename, recv_fp, key) != 0) {
-		fprintf(stderr, "ERROR: failed to process received file!\n");
+	if (inet_pton(AF_INET, s->target.client_ip, &client_addr) <= 0) {
 		return -1;
 	}
 
-	/* Free dynamically allocated memory */
-	free(recv_fp);
-	/* CSCD58 end of addition - Compression + Encryption */
+	while (s->nconns < want) {
+		len = sizeof(peer_addr);
+		fd = accept4(s->target.pasv_fd, (struct sockaddr *) &peer_addr, &len, \
+			SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR \
+				|| errno == ECONNABORTED) {
 
-	return 1;
+				return 1;
+			}
+			perror("accept error");
+			return -1;
+		}
+		if (peer_addr.sin_addr.s_addr != client_addr.s_addr) {
+			fprintf(stderr, "(%d) WARNING: turned away a data connection from %s\n", \
+				s->id, inet_ntoa(peer_addr.sin_addr));
+			close(fd);
+			continue;
+		}
+		add_conn(s, s->nconns, fd);
+	}
+
+	return 0;
+	/* }}} */
 }
 
 
-int main(int argc, char **argv) {
-	int listenfd, client_fd, port;
-	struct sockaddr_in servaddr;
-	pid_t pid;
+/** Takes a session and queues 'len' bytes from 'buf' to be sent on its first
+ * data connection, laid out in the connection's transmission mode */
+static int queue_data(struct session *s, const void *buf, size_t len) {
+	/* {{{ */
+	const uint8_t *p = (const uint8_t *) buf;
+	size_t need = s->out_len + data_encoded_len(&s->conns[0], len) + BLOCK_HEADER_LEN;
 
-	if (argc != 2) {
-		printf("Invalid Number of Arguments...\n");
-		printf("Usage: ./ecftpserver <listen-port>\n");
-		exit(-1);
+	if (need > s->out_cap) {
+		uint8_t *out = realloc(s->out, need);
+		if (out == NULL) return -1;
+		s->out = out;
+		s->out_cap = need;
 	}
 
-	/* Parse server port from commandline args */
-	sscanf(argv[1], "%d", &port);
+	while (len > 0) {
+		size_t max = data_segment_max(&s->conns[0]);
+		size_t count = len < max ? len : max;
 
-	if ( (listenfd = socket(AF_INET, SOCK_STREAM, 0)) < 0){
-		perror("socket error");
-		exit(-1);
+		s->out_len += data_segment_header(&s->conns[0], &s->out[s->out_len], count);
+		memcpy(&s->out[s->out_len], p, count);
+		s->out_len += count;
+		p += count;
+		len -= count;
 	}
 
-	bzero(&servaddr, sizeof(servaddr));
-	servaddr.sin_family = AF_INET;
-	servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
-	servaddr.sin_port = htons(port);
+	return 0;
+	/* }}} */
+}
 
-	if (bind(listenfd, (struct sockaddr*) &servaddr, sizeof(servaddr)) < 0) {
-		perror("bind error");
-		exit(-1);
+
+/** Takes a session and queues the end of the transfer's data on its first
+ * data connection */
+static int queue_end(struct session *s) {
+	if (s->conns[0].mode == MODE_BLOCK) {
+		if (0 != queue_data(s, NULL, 0)) return -1;
+		s->out[s->out_len++] = BLOCK_DESC_EOF;
+		s->out[s->out_len++] = 0;
+		s->out[s->out_len++] = 0;
+	} else {
+		s->out_end = 1;
+	}
+	return 0;
+}
+
+
+/** Takes a session and sends what is queued on its first data connection
+ * until the socket is full.
+ *
+ * \return 0 once everything has been sent, 1 if some is still queued, or a
+ *     negative int if the connection failed.
+ */
+static int flush_out(struct session *s) {
+	while (s->out_off < s->out_len) {
+		ssize_t w = send(s->conns[0].fd, &s->out[s->out_off], s->out_len - s->out_off, \
+			MSG_NOSIGNAL);
+		if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 1;
+		if (w < 0 && errno == EINTR) continue;
+		if (w <= 0) return -1;
+		s->out_off += w;
 	}
 
-	if (listen(listenfd, LISTENQ) < 0) {
-		perror("listen error");
-		exit(-1);
+	if (s->out_end) {
+		shutdown(s->conns[0].fd, SHUT_WR);
 	}
+	s->out_len = 0;
+	s->out_off = 0;
+	s->out_end = 0;
 
-	struct sockaddr_in address;
-	socklen_t addrlen = sizeof(address);
+	return 0;
+}
+
+
+/** Takes a session and reads from its first data connection into 'buf'
+ * until 'len' bytes have been read, counting them in 'in_have'.
+ *
+ * \return 0 once 'len' bytes have been read, 1 if there is nothing more to
+ *     read yet, or a negative int if the connection failed or the
+ *     transfer's data ended first.
+ */
+static int read_in(struct session *s, uint8_t *buf, size_t len) {
+	while (s->in_have < len) {
+		ssize_t r = data_read(&s->conns[0], &buf[s->in_have], len - s->in_have);
+		if (r == DATA_AGAIN) return 1;
+		if (r <= 0) return -1;
+		s->in_have += r;
+	}
+	return 0;
+}
+
+
+/** Takes a data connection and reads and throws away what has arrived of the
+ * rest of the current transfer's data.
+ *
+ * \return 0 once the transfer's data has ended or the connection failed, or
+ *     1 if there is nothing more to read yet.
+ */
+static int drain_some(struct data_conn *conn) {
+	uint8_t buf[4096];
+	ssize_t r;
+
+	while ((r = data_read(conn, buf, sizeof(buf))) > 0);
+
+	return r == DATA_AGAIN ? 1 : 0;
+}
+
+
+/* ================================================== */
+/* Worker pool jobs */
+/* ================================================== */
+
+
+static void job_kex(struct work_job *job) {
+	struct session *s = (struct session *) job->arg;
+
+	s->session.transfer_counter = 0;
+	s->job_result = kex_server_respond(s->kex_msg, s->kex_pub, &s->kex_pub_len, \
+		s->session.secret);
+}
+
+
+static void job_list(struct work_job *job) {
+	/* {{{ */
+	struct session *s = (struct session *) job->arg;
+	size_t cap = 0;
+	FILE *in;
+
+	s->job_result = -1;
+	s->list_len = 0;
+	if (!(in = popen(s->list_cmd, "r"))) {
+		return;
+	}
 
 	while (1) {
-		if ( (client_fd = accept(listenfd, (struct sockaddr *) &address, &addrlen)) < 0) {
-			/* New client did NOT connect successfully */
-			perror("accept error");
-		/* New client connected successfully */
-		} else {
-			pid = fork();
-			if (pid < 0) {
-				perror("fork error");
-			/* If child process... */
-			//child process---------------------------------------------------------------
-			} else if (pid == 0) {
-				close(listenfd);
-
-				// TODO: not sure this prints the right address/port
-				fprintf(stderr, "(%d) ******************************\n" \
-								"(%d) STATUS: Received a new client %s:%d!\n" \
-								"(%d) ------------------------------\n",
-								getpid(), getpid(), \
-								inet_ntoa(address.sin_addr), \
-								ntohs(address.sin_port), getpid());
-
-				int datafd, cmd, x = 0;
-				uint16_t client_port = 0;
-				char recvline[MAXLINE+1];
-				char client_ip[INET_ADDRSTRLEN], command[4096];
-
-				while (1) {
-					bzero(recvline, (int)sizeof(recvline));
-					bzero(command, (int)sizeof(command));
-
-					/* Read a service(?) command from the client. The client is
-					 * supposed to send a PORT service command first... */
-					if ((x = read(client_fd, recvline, MAXLINE)) < 0){
-						break;
-					}
+		if (cap - s->list_len < MAXLINE) {
+			char *buf = realloc(s->list_buf, cap + 16 * MAXLINE);
+			if (buf == NULL) {
+				pclose(in);
+				return;
+			}
+			s->list_buf = buf;
+			cap += 16 * MAXLINE;
+		}
+		size_t r = fread(&s->list_buf[s->list_len], 1, cap - s->list_len, in);
+		if (r == 0) break;
+		s->list_len += r;
+	}
+	pclose(in);
 
-					/* Print received FTP command */
-					fprintf(stderr, "(%d) %s\n", getpid(), recvline);
-
-					/* ... but they could send a QUIT command first so check
-					 * for that. */
-					if (strncmp(recvline, "QUIT", 4) == 0) {
-						char msg[32];
-						sprintf(msg,"221 Goodbye");
-						write(client_fd, msg, strlen(msg));
-						close(client_fd);
-						break;
-					}
+	s->job_result = 0;
+	/* }}} */
+}
 
-					/* If the command was not to quit, then assume it is a PORT
-					 * command */
-					read_port_command(recvline, &client_ip[0], &client_port);
-#if DEBUG_LEVEL >= 2
-	fprintf(stderr, "(%d) STATUS: client_ip: %s client_port: %d\n", \
-		getpid(), client_ip, client_port);
-#endif
 
-					/* Setup the data connection */
-					if (setup_data_connection(&datafd, client_ip, client_port, port) < 0) {
-						break;
-					}
+static void job_prepare(struct work_job *job) {
+	/* {{{ */
+	struct session *s = (struct session *) job->arg;
+	char *bundle_fp, *sig_fp;
 
-					/* After receiving the PORT command, we must handle a range
-					 * of possible commands */
-					if ((x = read(client_fd, command, MAXLINE)) < 0) {
-						break;
-					}
+	/* The signatures of the file are prepared like a file */
+	if (s->delta) {
+		s->job_result = -1;
+		if (delta_sign(s->filename, &sig_fp) < 0) {
+			return;
+		}
+		s->job_result = prepare_file(sig_fp, 0, 0, &s->params.enc, &s->path);
+		remove(sig_fp);
+		free(sig_fp);
+		return;
+	}
 
-					/* Print received FTP command */
-					fprintf(stderr, "(%d) %s\n", getpid(), command);
+	if (!s->bundle) {
+		/* Encrypt (using the negotiated 'params') and compress the file
+		 * stored at the filepath 'filename', outputting the result to the
+		 * file at path 's->path'. A range is sent as the chunks that cover
+		 * it */
+		s->job_result = prepare_file(s->filename, s->offset - s->offset % COMP_THREAD_MAX_MEM, \
+			s->end, &s->params.enc, &s->path);
+		return;
+	}
 
-					cmd = get_command(command);
-					if (cmd == CMD_LS) {
-#if DEBUG_LEVEL >= 2
-						fprintf(stderr, "(%d) STATUS: beginning handling " \
-							"for client LIST request\n", getpid());
-#endif
-						do_list(client_fd, datafd, command);
-#if DEBUG_LEVEL >= 2
-						fprintf(stderr, "(%d) STATUS: finished handling " \
-							"client LIST request\n", getpid());
-#endif
-					} else if (cmd == CMD_GET) {
-#if DEBUG_LEVEL >= 2
-						fprintf(stderr, "(%d) STATUS: beginning handling " \
-							"for client RETR request\n", getpid());
-#endif
-						do_retr(client_fd, datafd, command);
-#if DEBUG_LEVEL >= 2
-						fprintf(stderr, "(%d) STATUS: finished handling " \
-							"client RETR request\n", getpid());
-#endif
-					} else if (cmd == CMD_PUT) {
-#if DEBUG_LEVEL >= 2
-						fprintf(stderr, "(%d) STATUS: beginning handling " \
-							"for client STOR request\n", getpid());
-#endif
-						do_stor(client_fd, datafd, command);
-#if DEBUG_LEVEL >= 2
-						fprintf(stderr, "(%d) STATUS: finished handling " \
-							"client STOR request\n", getpid());
-#endif
-					// TODO: what's going on with this last 'else if'?
-					}else if(cmd == 4){
-						char reply[1024];
-						sprintf(reply, "550 Filename Does Not Exist");
-						write(client_fd, reply, strlen(reply));
-					}
-					close(datafd);
-				}
-				close(client_fd);
-
-				fprintf(stderr, "(%d) ------------------------------\n" \
-								"(%d) STATUS: Finished with client: %s:%d.\n" \
-								"(%d) ******************************\n", \
-								getpid(), getpid(), inet_ntoa(address.sin_addr), \
-								ntohs(address.sin_port), getpid());
-				exit(0);
+	/* Bundle the files of an MGET, then prepare the bundle like a file */
+	s->job_result = -1;
+	if (bundle_pack(s->bundle_paths, &bundle_fp) < 0) {
+		return;
+	}
+	s->job_result = prepare_file(bundle_fp, 0, 0, &s->params.enc, &s->path);
+	remove(bundle_fp);
+	free(bundle_fp);
+	/* }}} */
+}
+
+
+static void job_process(struct work_job *job) {
+	/* {{{ */
+	struct session *s = (struct session *) job->arg;
+	char *bundle_fp, *delta_fp, *out_fp;
+
+	/* The received file of a DELT is a delta against the file, which puts
+	 * the new version of the file together next to it, then in its place */
+	if (s->delta) {
+		s->job_result = -1;
+		delta_fp = delta_temp_name();
+		out_fp = delta_temp_name();
+		if (delta_fp != NULL && out_fp != NULL \
+			&& 0 == process_received_file(delta_fp, 0, s->path, &s->params.enc) \
+			&& 0 == delta_apply(s->filename, delta_fp, out_fp) \
+			&& 0 == rename(out_fp, s->filename)) {
+
+			s->job_result = 0;
+		}
+		if (delta_fp != NULL) remove(delta_fp);
+		if (out_fp != NULL && s->job_result != 0) remove(out_fp);
+		free(delta_fp);
+		free(out_fp);
+		return;
+	}
+
+	if (!s->bundle) {
+		char *part_fp = part_name(s->filename);
+		if (part_fp == NULL) {
+			s->job_result = -1;
+			return;
+		}
+		/* Decrypt (using the negotiated 'params') and decompress received
+		 * file stored at the filepath 's->path', outputting the result to
+		 * the file at path 'filename'. A restarted STOR puts the rest of the
+		 * file after the part kept from before, then puts it in place */
+		if (s->offset == 0) {
+			s->job_result = process_received_file(s->filename, 0, s->path, &s->params.enc);
+			remove(part_fp);
+		} else {
+			/* The part may still be being kept from the STOR before, if
+			 * that one's client went away and came straight back */
+			int fd = open(part_fp, O_RDONLY | O_CLOEXEC);
+			s->job_result = -1;
+			if (fd >= 0 && 0 == flock(fd, LOCK_EX) \
+				&& 0 == process_received_file(part_fp, s->offset, s->path, &s->params.enc) \
+				&& 0 == rename(part_fp, s->filename)) {
+
+				s->job_result = 0;
 			}
-			//end child process-------------------------------------------------------------
-			close(client_fd);
+			if (fd >= 0) close(fd);
+		}
+		free(part_fp);
+		return;
+	}
+
+	/* The received file of an MPUT is a bundle, which is unpacked */
+	s->job_result = -1;
+	if ((bundle_fp = bundle_temp_name()) == NULL) {
+		return;
+	}
+	if (0 == process_received_file(bundle_fp, 0, s->path, &s->params.enc) \
+		&& bundle_unpack(bundle_fp) >= 0) {
+
+		s->job_result = 0;
+	}
+	remove(bundle_fp);
+	free(bundle_fp);
+	/* }}} */
+}
+
+
+/** Keeps the whole chunks at the start of what a failed STOR received, after
+ * what was kept from before if the STOR was a restarted one, so that the
+ * client can restart the STOR after them. 's->offset' is set to where it can
+ * restart */
+static void job_keep(struct work_job *job) {
+	struct session *s = (struct session *) job->arg;
+	char *part_fp = part_name(s->filename);
+	int64_t kept = -1;
+
+	if (part_fp != NULL) {
+		kept = keep_received_prefix(part_fp, s->offset, s->path, s->xfer.kept, \
+			&s->params.enc);
+		/* Nothing is left behind if there is nothing to restart from */
+		if (kept == 0) {
+			remove(part_fp);
 		}
+		free(part_fp);
+	}
+	s->job_result = kept < 0 ? -1 : 0;
+	s->offset = kept < 0 ? 0 : kept;
+}
+
+
+/** Reads the whole of a small file, then compresses and encrypts it in
+ * memory to be sent inline after the reply to its RETI */
+static void job_inline(struct work_job *job) {
+	/* {{{ */
+	struct session *s = (struct session *) job->arg;
+	uint8_t data[INLINE_MAX_LEN + 1];
+	size_t len = 0;
+	ssize_t r = 0;
+	int fd;
+
+	s->job_result = -1;
+	if (s->inline_buf == NULL && !(s->inline_buf = malloc(INLINE_MAX_PAYLOAD))) {
+		return;
+	}
+	if ((fd = open(s->filename, O_RDONLY)) < 0) {
+		return;
 	}
+	/* The file may have grown since it was looked at */
+	while (len < sizeof(data) && (r = read(fd, &data[len], sizeof(data) - len)) != 0) {
+		if (r < 0 && errno == EINTR) continue;
+		if (r < 0) break;
+		len += r;
+	}
+	close(fd);
+	if (r < 0 || len > INLINE_MAX_LEN) {
+		return;
+	}
+
+	if (0 != comp_buf(data, len, s->inline_buf, &s->inline_len) \
+		|| 0 != enc_buf(s->inline_buf, s->inline_len, &s->params.enc, &s->inline_len)) {
+
+		return;
+	}
+	s->job_result = 0;
+	/* }}} */
+}
+
+
+/* ================================================== */
+/* Commands */
+/* ================================================== */
+
+
+/** Perform the necessary operations to enact the MODE FTP service command,
+ * which sets the transmission mode of the data connections opened from then
+ * on. Any open data connections are closed, so that no connection carries
+ * data in two modes.
+ *
+ * \param '*s' the session.
+ * \return 1 upon success, a negative int if the mode is not supported.
+ */
+int do_mode(struct session *s) {
+	char new_mode = 0;
+
+	if (strlen(s->command) >= 6) {
+		new_mode = toupper((unsigned char) s->command[5]);
+	}
+	if (new_mode != MODE_STREAM && new_mode != MODE_BLOCK) {
+		reply(s, "504 Command not implemented for that parameter");
+		return -1;
+	}
+
+	drop_conns(s);
+	s->mode = new_mode;
+	/* A plain transfer ends when its data connection closes */
+	if (new_mode != MODE_STREAM) {
+		s->raw = 0;
+	}
+	reply(s, "200 Command OK");
+
+	return 1;
+}
+
+
+/** Perform the necessary operations to enact the TYPE FTP service command.
+ * Only TYPE I is supported, which has the session's files sent as they are,
+ * and then only in stream mode and if the server allows plain transfers:
+ * without compression and encryption a file is sent straight from the page
+ * cache to the socket, but anyone on the network path can read it.
+ *
+ * \param '*s' the session.
+ * \return 1 upon success, a negative int if the type is not supported.
+ */
+int do_type(struct session *s) {
+	char type = 0;
+
+	if (strlen(s->command) >= 6) {
+		type = toupper((unsigned char) s->command[5]);
+	}
+	/* A channel cannot be reset the way a connection is, so a plain STOR the
+	 * client gives up on would look complete */
+	if (type != 'I' || !raw_allowed || s->mode != MODE_STREAM || s->target.mux != NULL) {
+		reply(s, "504 Command not implemented for that parameter");
+		return -1;
+	}
+
+	s->raw = 1;
+	reply(s, "200 Command OK");
+
+	return 1;
+}
+
+
+/** Perform the necessary operations to enact the REST FTP service command
+ * (RFC 3659): the RETR or STOR that follows starts the given number of bytes
+ * into the file. The offset must be a multiple of the compression chunk
+ * size, 'COMP_THREAD_MAX_MEM', so the file is only compressed and sent from
+ * that chunk on. A STOR restarts after the part of the file kept from the
+ * failed STOR before it.
+ *
+ * \param '*s' the session.
+ * \return 1 upon success, a negative int if the offset is not usable.
+ */
+int do_rest(struct session *s) {
+	char sendline[MAXLINE + 1];
+	char *end;
+
+	errno = 0;
+	unsigned long long offset = strtoull(&s->command[4], &end, 10);
+	if (end == &s->command[4] || *end != '\0' || errno != 0 \
+		|| offset % COMP_THREAD_MAX_MEM != 0) {
+
+		reply(s, "501 Syntax error in parameters or arguments");
+		return -1;
+	}
+
+	s->rest = offset;
+	snprintf(sendline, sizeof(sendline), "350 Restarting at %llu", offset);
+	reply(s, sendline);
+
+	return 1;
+}
+
+
+/** Perform the necessary operations to enact the RANG FTP service command
+ * (draft-bryan-ftp-range): the RETR that follows sends only the bytes from
+ * the first offset given up to and including the second. The file is
+ * compressed and sent as the whole chunks of 'COMP_THREAD_MAX_MEM' bytes
+ * that cover the range, out of which the client cuts the range.
+ *
+ * \param '*s' the session.
+ * \return 1 upon success, a negative int if the range is not usable.
+ */
+int do_rang(struct session *s) {
+	char sendline[MAXLINE + 1];
+	char *end;
+
+	errno = 0;
+	unsigned long long first = strtoull(&s->command[4], &end, 10);
+	char *last_start = end;
+	unsigned long long last = strtoull(last_start, &end, 10);
+	if (last_start == &s->command[4] || end == last_start || *end != '\0' \
+		|| errno != 0 || first > last || last == ULLONG_MAX) {
+
+		reply(s, "501 Syntax error in parameters or arguments");
+		return -1;
+	}
+
+	s->rest = first;
+	s->rest_end = last + 1;
+	snprintf(sendline, sizeof(sendline), "350 Restarting at %llu. Ending byte at %llu", \
+		first, last);
+	reply(s, sendline);
+
+	return 1;
+}
+
+
+/** Perform the necessary operations to enact the SIZE FTP service command
+ * (RFC 3659): tell the client how long a file is. A client restarting a
+ * STOR asks for the size of the part of the file the server kept.
+ *
+ * \param '*s' the session.
+ * \return 1 upon success, a negative int if there is no such file.
+ */
+int do_size(struct session *s) {
+	char sendline[MAXLINE + 1];
+	struct stat file_stat;
+
+	bzero(s->filename, sizeof(s->filename));
+	if (get_filename(s->command, s->filename, sizeof(s->filename)) <= 0) {
+		reply(s, "501 Syntax error in parameters or arguments");
+		return -1;
+	}
+	if (stat(s->filename, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+		reply(s, "550 No Such File or Directory");
+		return -1;
+	}
+
+	snprintf(sendline, sizeof(sendline), "213 %lld", (long long) file_stat.st_size);
+	reply(s, sendline);
+
+	return 1;
+}
+
+
+/** Perform the necessary operations to enact the MDTM FTP service command
+ * (RFC 3659): tell the client when a file was last modified, in UTC and to
+ * the nanosecond. A client restarting a RETR asks for it with the file's
+ * size, to tell whether the file changed since the part it kept.
+ *
+ * \param '*s' the session.
+ * \return 1 upon success, a negative int if there is no such file.
+ */
+int do_mdtm(struct session *s) {
+	char sendline[MAXLINE + 1], stamp[32];
+	struct stat file_stat;
+	struct tm mtime;
+
+	bzero(s->filename, sizeof(s->filename));
+	if (get_filename(s->command, s->filename, sizeof(s->filename)) <= 0) {
+		reply(s, "501 Syntax error in parameters or arguments");
+		return -1;
+	}
+	if (stat(s->filename, &file_stat) != 0 || !S_ISREG(file_stat.st_mode) \
+		|| gmtime_r(&file_stat.st_mtim.tv_sec, &mtime) == NULL) {
+
+		reply(s, "550 No Such File or Directory");
+		return -1;
+	}
+
+	strftime(stamp, sizeof(stamp), "%Y%m%d%H%M%S", &mtime);
+	snprintf(sendline, sizeof(sendline), "213 %s.%09ld", stamp, (long) file_stat.st_mtim.tv_nsec);
+	reply(s, sendline);
+
+	return 1;
+}
+
+
+/** Perform the necessary operations to enact the STAT FTP service command
+ * without an argument, which asks for the status of the server: here, how
+ * much of the server-wide memory budget for compressing and encrypting files
+ * is in use, and the most that has been in use at once.
+ *
+ * \param '*s' the session.
+ * \return void.
+ */
+void do_stat(struct session *s) {
+	char sendline[MAXLINE + 1];
+	size_t current, peak, limit;
+
+	mem_budget_usage(mem_budget, &current, &peak, &limit);
+	snprintf(sendline, sizeof(sendline), "211 Chunk memory: %zu bytes in use, " \
+		"peak %zu, budget %zu", current, peak, limit);
+	reply(s, sendline);
+}
+
+
+/** Perform the necessary operations to enact the PASV (RFC 959) or EPSV
+ * (RFC 2428) FTP service command: make sure the session has a passive port,
+ * tell the client which port it is, and wait for the client's data
+ * connection on it. The session keeps its passive port until it ends, so
+ * later commands (and the extra connections of striped transfers) connect to
+ * the same port.
+ *
+ * \param '*s' the session.
+ * \param 'extended' whether the command was EPSV rather than PASV.
+ * \return 1 upon success, a negative int upon failure.
+ */
+int do_pasv(struct session *s, int extended) {
+	/* {{{ */
+	char sendline[MAXLINE+1], ip[INET_ADDRSTRLEN];
+	struct sockaddr_in peer_addr;
+	socklen_t len = sizeof(peer_addr);
+	uint16_t control_port;
+
+	drop_conns(s);
+
+	if (s->target.pasv_fd < 0) {
+		if (port_pool_listen(pasv_pool, &s->target.pasv_fd, &s->target.pasv_port) < 0) {
+			reply(s, "425 Can't open data connection");
+			return -1;
+		}
+		fcntl(s->target.pasv_fd, F_SETFL, fcntl(s->target.pasv_fd, F_GETFL) | O_NONBLOCK);
+		s->pasv.fd = s->target.pasv_fd;
+	}
+
+	/* Only the client may open the data connections */
+	if (getpeername(s->control.fd, (struct sockaddr *) &peer_addr, &len) < 0) {
+		reply(s, "425 Can't open data connection");
+		return -1;
+	}
+	inet_ntop(AF_INET, &peer_addr.sin_addr, s->target.client_ip, INET_ADDRSTRLEN);
+	s->target.passive = 1;
+
+	if (extended) {
+		sprintf(sendline, "229 Entering Extended Passive Mode (|||%d|)", s->target.pasv_port);
+	} else {
+		/* The address the client reached the server on */
+		get_ip_port(s->control.fd, ip, &control_port);
+		for (char *c = ip; *c != '\0'; c++) {
+			if (*c == '.') *c = ',';
+		}
+		sprintf(sendline, "227 Entering Passive Mode (%s,%d,%d)", ip, \
+			s->target.pasv_port >> 8, s->target.pasv_port & 0xff);
+	}
+	reply(s, sendline);
+
+	s->deadline = now_ms() + PASV_TIMEOUT_MS;
+	s->state = ST_DATA_OPEN;
+
+	return 1;
+	/* }}} */
+}
+
+
+/** Perform the necessary operations to enact the PORT FTP service command:
+ * start opening a data connection to the address the client gave. The client
+ * sends a PORT command whenever it has no data connection open, which
+ * replaces any the server still has.
+ *
+ * \param '*s' the session.
+ * \return 1 upon success, a negative int if the connection could not be
+ *     started, which ends the session.
+ */
+int do_port(struct session *s) {
+	drop_conns(s);
+	if (read_port_command(s->command, &s->target.client_ip[0], &s->target.client_port) < 0) {
+		return -1;
+	}
+	s->target.passive = 0;
+#if DEBUG_LEVEL >= 2
+	fprintf(stderr, "(%d) STATUS: client_ip: %s client_port: %d\n", \
+		s->id, s->target.client_ip, s->target.client_port);
+#endif
+
+	if (start_connect(s, 0) < 0) {
+		return -1;
+	}
+	s->deadline = now_ms() + PASV_TIMEOUT_MS;
+	s->state = ST_DATA_OPEN;
+
+	return 1;
+}
+
+
+/** Perform the necessary operations to enact the MUX command: carry the rest
+ * of the session, its commands and data connections alike, as channels over
+ * the control connection, so that a client that can open only the one
+ * connection needs no other. The reply is the last thing sent on the
+ * connection unframed. From then on data connections are the channels the
+ * client opens, which are accepted as in passive mode.
+ *
+ * \param '*s' the session.
+ * \return 1 upon success, a negative int upon failure.
+ */
+int do_mux(struct session *s) {
+	/* {{{ */
+	int fd = s->control.fd, control_fd;
+	struct mux *m;
+
+	/* Whatever follows the command on the connection is framed, so it must
+	 * not have been read (or replied to) as unframed */
+	if (s->target.mux != NULL || s->reply_len > 0 || line_buffered(&s->control_in) > 0) {
+		reply(s, "503 Bad sequence of commands");
+		return -1;
+	}
+	if ((m = mux_create(fd, 1, &control_fd)) == NULL) {
+		reply(s, "451 Requested action aborted. Local error in processing");
+		return -1;
+	}
+	reply(s, "200 Command OK");
+
+	drop_conns(s);
+	unwatch(&s->control);
+	s->control.fd = control_fd;
+	s->target.mux = m;
+	s->target.passive = 1;
+	s->mux.fd = mux_fd(m);
+#if DEBUG_LEVEL >= 2
+	fprintf(stderr, "(%d) STATUS: control connection is now multiplexed\n", s->id);
+#endif
+
+	return 1;
+	/* }}} */
+}
+
+
+/** Perform the necessary operations to start the LIST FTP service command:
+ * check the directory asked for and hand the listing to the worker pool.
+ *
+ * \param '*s' the session.
+ * \return 1 upon success, a negative int upon failure.
+ */
+int do_list(struct session *s) {
+	char filelist[1024];
+	bzero(filelist, (int)sizeof(filelist));
+
+	if (get_filename(s->command, filelist, sizeof(filelist)) > 0) {
+		fprintf(stderr, "(%d) Filelist: %s\n", s->id, filelist);
+		trim(filelist);
+		snprintf(s->list_cmd, sizeof(s->list_cmd), "ls %s", filelist);
+		// TODO: does this opendir() solution work? would stat() not be better?
+		DIR *dir = opendir(filelist);
+		if (!dir) {
+			reply(s, "550 No Such File or Directory");
+			return -1;
+		}
+		closedir(dir);
+	} else {
+		sprintf(s->list_cmd, "ls");
+	}
+
+	submit_job(s, job_list, ST_LIST_WORK);
+
+	return 1;
+}
+
+
+static int list_sent(struct session *s, int err) {
+	if (err) {
+		reply(s, "451 Requested action aborted. Local error in processing");
+		finish_command(s, -1);
+		return STEP_PROGRESS;
+	}
+	reply(s, "200 Command OK");
+	finish_command(s, 1);
+	return STEP_PROGRESS;
+}
+
+
+/** Perform the necessary operations to enact the RETI service command, a
+ * RETR of a small file whose offer for the transfer comes with the command,
+ * written in hex: "RETI <offer> <filename>". The file comes back after the
+ * reply "213 <chosen> <length>" on the control connection, compressed and
+ * encrypted like a file of one chunk, so fetching it takes one round trip
+ * and no data connection. A file too large for that is refused with 504
+ * before the offer is looked at, and the client sends a RETR instead.
+ *
+ * \param '*s' the session.
+ * \return 1 upon success, a negative int upon failure.
+ */
+int do_inline(struct session *s) {
+	/* {{{ */
+	struct stat file_stat;
+	uint8_t chosen[TRANSFER_REPLY_LEN];
+
+	bzero(s->filename, sizeof(s->filename));
+	if (strlen(s->command) < 5 + 2 * TRANSFER_OFFER_LEN + 2 \
+		|| 0 != hex_decode(&s->command[5], s->offer, TRANSFER_OFFER_LEN) \
+		|| get_filename(&s->command[5 + 2 * TRANSFER_OFFER_LEN], s->filename, \
+			sizeof(s->filename)) <= 0) {
+
+		reply(s, "501 Syntax error in parameters or arguments");
+		return -1;
+	}
+
+	if (stat(s->filename, &file_stat) != 0) {
+		reply(s, "550 No Such File or Directory");
+		return -1;
+	}
+	if (!S_ISREG(file_stat.st_mode) || file_stat.st_size > INLINE_MAX_LEN) {
+		reply(s, "504 Command not implemented for that parameter");
+		return -1;
+	}
+	if (0 != choose_transfer_params(s->offer, &s->session, &s->params, chosen)) {
+		reply(s, "451 Requested action aborted. Local error in processing");
+		return -1;
+	}
+	hex_encode(chosen, sizeof(chosen), s->inline_chosen);
+
+	submit_job(s, job_inline, ST_INLINE_WORK);
+
+	return 1;
+	/* }}} */
+}
+
+
+/** Takes a session whose client has just been told the parameters of its
+ * RETR or STOR and gets the file ready: for a RETR the file is handed to the
+ * worker pool to be compressed and encrypted, and for a STOR the server
+ * waits for the client's stripe header */
+static int negotiated(struct session *s, int err) {
+	/* {{{ */
+	struct stat file_stat;
+
+	if (err) {
+		reply(s, "451 Requested action aborted. Local error in processing");
+		finish_command(s, -1);
+		return STEP_PROGRESS;
+	}
+
+	if (!s->have_filename) {
+		printf("Filename Not Detected\n");
+		reply(s, "450 Requested file action not taken. Filename Not Detected");
+		finish_command(s, -1);
+		return STEP_PROGRESS;
+	}
+
+	if (s->cmd == CMD_GET) {
+		if (!s->bundle && access(s->filename, F_OK) != 0) {
+			reply(s, "550 No Such File or Directory");
+			finish_command(s, -1);
+			return STEP_PROGRESS;
+		}
+		/* A range has to start inside the file */
+		if ((s->offset != 0 || s->end != 0) && (stat(s->filename, &file_stat) != 0 \
+			|| s->offset > (uint64_t) file_stat.st_size \
+			|| (s->end != 0 && s->offset >= (uint64_t) file_stat.st_size))) {
+
+			reply(s, s->end != 0 ? "554 Requested action not taken: invalid RANG parameter" \
+				: "554 Requested action not taken: invalid REST parameter");
+			finish_command(s, -1);
+			return STEP_PROGRESS;
+		}
+		submit_job(s, job_prepare, ST_PREPARE);
+		return STEP_PROGRESS;
+	}
+
+	/* A delta is put together out of the file it is against */
+	if (s->delta && (stat(s->filename, &file_stat) != 0 || !S_ISREG(file_stat.st_mode))) {
+		reply(s, "550 No Such File or Directory");
+		finish_command(s, -1);
+		return STEP_PROGRESS;
+	}
+
+	/* A restarted STOR needs the part of the file kept from before */
+	if (s->offset != 0) {
+		char *part_fp = part_name(s->filename);
+		int have = (part_fp != NULL && 0 == stat(part_fp, &file_stat) \
+			&& (uint64_t) file_stat.st_size >= s->offset);
+
+		free(part_fp);
+		if (!have) {
+			reply(s, "554 Requested action not taken: invalid REST parameter");
+			finish_command(s, -1);
+			return STEP_PROGRESS;
+		}
+	}
+
+	/* CSCD58 addition - Compression */
+	/* Make temporary name for receiving file
+	 * ( '<filename>.comp.enc-XXXXXX' ) */
+	if ( (s->path = temp_recv_name(s->filename)) == NULL) {
+		fprintf(stderr, "ERROR: failed to receive file!\n");
+		return fail_transfer(s);
+	}
+	/* CSCD58 end of addition - Compression*/
+
+	/* The client says how many data connections it stripes the file over
+	 * and how long the file is, then the rest of the connections are
+	 * opened */
+	s->in_have = 0;
+	s->state = ST_HEADER;
+
+	return STEP_PROGRESS;
+	/* }}} */
+}
+
+
+/** Takes a session whose transfer knows how many data connections it uses
+ * and starts opening the ones the session does not have yet. In block mode
+ * the connections opened for earlier transfers are still open, so only as
+ * many are opened as the transfer needs on top of those */
+static int open_stripe_conns(struct session *s) {
+	if (!s->target.passive) {
+		for (int i = s->nconns; i < s->streams; i++) {
+			if (start_connect(s, i) < 0) {
+				return fail_transfer(s);
+			}
+		}
+	}
+	s->deadline = now_ms() + PASV_TIMEOUT_MS;
+	s->state = ST_STRIPE_OPEN;
+
+	return STEP_PROGRESS;
+}
+
+
+static int header_sent(struct session *s, int err) {
+	if (err) {
+		return fail_transfer(s);
+	}
+	return open_stripe_conns(s);
+}
+
+
+/** Takes a session whose transfer has all of its data connections and
+ * starts pumping the file over them */
+static int start_stripes(struct session *s) {
+	/* {{{ */
+	int sending = (s->cmd == CMD_GET);
+
+	if (sending) {
+		if (0 != stripe_xfer_open_send(&s->xfer, s->path)) {
+			return fail_transfer(s);
+		}
+	} else if (0 != stripe_xfer_open_recv(&s->xfer, s->path, s->len)) {
+		return fail_transfer(s);
+	}
+	s->xfer_open = 1;
+
+	for (int i = 0; i < s->streams; i++) {
+		uint8_t *buf = buf_get();
+		if (buf == NULL) {
+			fprintf(stderr, "(%d) ERROR: could not allocate a stripe buffer\n", s->id);
+			return fail_transfer(s);
+		}
+		stripe_conn_init(&s->sc[i], &s->conns[i], buf);
+		s->nsc = i + 1;
+	}
+	s->ndone = 0;
+	s->draining = 0;
+
+#if DEBUG_LEVEL >= 1
+	if (sending) {
+		fprintf(stderr, "DEBUG: sending %lu units over %d data connections\n", \
+			(unsigned long) s->xfer.num_units, s->streams);
+	}
+#endif
+	s->state = sending ? ST_SEND : ST_RECV;
+
+	return STEP_PROGRESS;
+	/* }}} */
+}
+
+
+/** Takes a session with a transfer that has every stripe done and tells the
+ * client how it went */
+static int transfer_done(struct session *s) {
+	/* {{{ */
+#if DEBUG_LEVEL >= 1
+	struct stripe_stats stats;
+
+	stripe_xfer_stats(&s->xfer, s->conns, s->streams, &stats);
+	fprintf(stderr, "(%d) DEBUG: %s %lu bytes in %lu socket and %lu file system calls\n", \
+		s->id, s->cmd == CMD_GET ? "sent" : "received", (unsigned long) stats.bytes, \
+		(unsigned long) stats.socket_calls, (unsigned long) stats.file_calls);
+#endif
+	int err = (0 != stripe_xfer_close(&s->xfer));
+
+	s->xfer_open = 0;
+	for (int i = 0; i < s->nsc; i++) {
+		buf_put(s->sc[i].buf);
+	}
+	s->nsc = 0;
+
+	if (err && s->cmd == CMD_PUT && !s->bundle && !s->delta) {
+		submit_job(s, job_keep, ST_KEEP_WORK);
+		return STEP_PROGRESS;
+	}
+	if (err) {
+		return fail_transfer(s);
+	}
+
+	if (s->cmd == CMD_PUT) {
+		/* CSCD58 addition - Compression + Encryption */
+		/* The reply waits for this, so that the client is only told the
+		 * file was stored once it has been */
+		submit_job(s, job_process, ST_PROCESS);
+		return STEP_PROGRESS;
+	}
+
+	/* Send success message to client */
+	reply(s, "200 Command OK");
+
+	/* CSCD58 addition - Compression */
+	/* Note that equivalent "KEEP" check for the temporary compressed file is
+	 * performed in prepare_file() */
+	transfer_cleanup(s, KEEP_TEMP_ENC_FILES != 1);
+	finish_command(s, 1);
+
+	return STEP_PROGRESS;
+	/* }}} */
+}
+
+
+/** Takes a session in TYPE I that has just read a RETR or STOR and starts
+ * the plain transfer: there is nothing to agree on, so the file is sent or
+ * received on the data connection straight away */
+static int start_raw(struct session *s) {
+	/* {{{ */
+	struct stat file_stat;
+
+	bzero(s->filename, sizeof(s->filename));
+	if (get_filename(s->command, s->filename, sizeof(s->filename)) <= 0) {
+		reply(s, "450 Requested file action not taken");
+		finish_command(s, -1);
+		return STEP_PROGRESS;
+	}
+
+	if (s->cmd == CMD_GET) {
+		if ((s->raw_fd = open(s->filename, O_RDONLY | O_CLOEXEC)) < 0 \
+			|| fstat(s->raw_fd, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+
+			transfer_cleanup(s, 0);
+			reply(s, "550 No Such File or Directory");
+			finish_command(s, -1);
+			return STEP_PROGRESS;
+		}
+		s->raw_off = 0;
+		s->raw_len = file_stat.st_size;
+		s->state = ST_RAW_SEND;
+		return STEP_PROGRESS;
+	}
+
+	/* The file is only put in place once all of it has arrived */
+	if ( (s->path = temp_recv_name(s->filename)) == NULL \
+		|| (s->raw_fd = open(s->path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644)) < 0 \
+		|| 0 != data_pipe_open(s->pipefd)) {
+
+		fprintf(stderr, "ERROR: failed to receive file!\n");
+		return fail_transfer(s);
+	}
+	s->state = ST_RAW_RECV;
+
+	return STEP_PROGRESS;
+	/* }}} */
+}
+
+
+/** Takes a session whose plain transfer has all been sent or received and
+ * tells the client how it went */
+static int raw_done(struct session *s) {
+	int err = 0;
+
+	if (s->cmd == CMD_GET) {
+		data_end(&s->conns[0]);
+	} else {
+		/* A failed close can mean the file was not all written */
+		err = (0 != close(s->raw_fd));
+		s->raw_fd = -1;
+		if (!err && 0 != rename(s->path, s->filename)) {
+			err = 1;
+		}
+	}
+	if (err) {
+		return fail_transfer(s);
+	}
+	transfer_cleanup(s, 0);
+	reply(s, "200 Command OK");
+	finish_command(s, 1);
+
+	return STEP_PROGRESS;
+}
+
+
+/** Takes a session that has just read a command and starts handling it */
+static int do_command(struct session *s) {
+	/* {{{ */
+	int fd;
+
+	/* Print received FTP command */
+	fprintf(stderr, "(%d) %s\n", s->id, s->command);
+
+	/* A REST or RANG only holds for the command right after it */
+	s->offset = s->rest;
+	s->end = s->rest_end;
+	s->rest = 0;
+	s->rest_end = 0;
+
+	if (strncmp(s->command, "REST", 4) == 0) {
+		do_rest(s);
+		return STEP_PROGRESS;
+	}
+
+	if (strncmp(s->command, "RANG", 4) == 0) {
+		do_rang(s);
+		return STEP_PROGRESS;
+	}
+
+	if (strncmp(s->command, "SIZE", 4) == 0) {
+		do_size(s);
+		return STEP_PROGRESS;
+	}
+
+	if (strncmp(s->command, "MDTM", 4) == 0) {
+		do_mdtm(s);
+		return STEP_PROGRESS;
+	}
+
+	if (strncmp(s->command, "QUIT", 4) == 0) {
+		reply(s, "221 Goodbye");
+		session_close(s);
+		return STEP_WAIT;
+	}
+
+	if (strncmp(s->command, "MODE", 4) == 0) {
+		do_mode(s);
+		return STEP_PROGRESS;
+	}
+
+	if (strncmp(s->command, "STAT", 4) == 0) {
+		do_stat(s);
+		return STEP_PROGRESS;
+	}
+
+	if (strncmp(s->command, "TYPE", 4) == 0) {
+		do_type(s);
+		return STEP_PROGRESS;
+	}
+
+	if (strncmp(s->command, "MUX", 3) == 0) {
+		do_mux(s);
+		return STEP_PROGRESS;
+	}
+
+	if (strncmp(s->command, "RETI", 4) == 0) {
+		do_inline(s);
+		return STEP_PROGRESS;
+	}
+
+	/* A multiplexed session has no other connections to set up */
+	if (s->target.mux != NULL && (strncmp(s->command, "PASV", 4) == 0 \
+		|| strncmp(s->command, "EPSV", 4) == 0 || strncmp(s->command, "PORT", 4) == 0)) {
+
+		reply(s, "503 Bad sequence of commands");
+		return STEP_PROGRESS;
+	}
+
+	/* In passive mode the client opens the data connection rather than
+	 * sending a PORT command */
+	if (strncmp(s->command, "PASV", 4) == 0 || strncmp(s->command, "EPSV", 4) == 0) {
+		do_pasv(s, s->command[0] == 'E');
+		return STEP_PROGRESS;
+	}
+
+	if (strncmp(s->command, "PORT", 4) == 0) {
+		if (do_port(s) < 0) {
+			session_close(s);
+			return STEP_WAIT;
+		}
+		return STEP_PROGRESS;
+	}
+
+	s->cmd = get_command(s->command);
+	/* MGET and MPUT are a RETR and a STOR of a bundle of files, which has
+	 * to be compressed and encrypted */
+	s->bundle = (s->cmd == CMD_MGET || s->cmd == CMD_MPUT);
+	/* SIGN and DELT are a RETR of the signatures of a file and a STOR of
+	 * a delta against them */
+	s->delta = (s->cmd == CMD_SIGN || s->cmd == CMD_DELT);
+	if (s->bundle || s->delta) {
+		s->cmd = (s->cmd == CMD_MGET || s->cmd == CMD_SIGN) ? CMD_GET : CMD_PUT;
+		if (s->raw) {
+			reply(s, "504 Command not implemented for that parameter");
+			finish_command(s, -1);
+			return STEP_PROGRESS;
+		}
+	}
+	/* Only a compressed file is cut into the chunks a REST offset counts,
+	 * and only a RETR sends a range */
+	if (((s->cmd == CMD_GET || s->cmd == CMD_PUT) && s->offset != 0 \
+			&& (s->raw || s->bundle || s->delta)) \
+		|| (s->end != 0 && (s->cmd != CMD_GET || s->raw || s->bundle || s->delta))) {
+
+		reply(s, "504 Command not implemented for that parameter");
+		finish_command(s, -1);
+		return STEP_PROGRESS;
+	}
+	/* A multiplexed client opens a channel before each command that finds
+	 * it without a data connection, and the multiplexer has taken the
+	 * channel in before the command. Like a PORT command, it replaces any
+	 * data connections the server still has */
+	if ((s->cmd == CMD_LS || s->cmd == CMD_GET || s->cmd == CMD_PUT) \
+		&& s->target.mux != NULL && (fd = mux_accept(s->target.mux)) >= 0) {
+
+		drop_conns(s);
+		add_conn(s, 0, fd);
+	}
+	if ((s->cmd == CMD_LS || s->cmd == CMD_GET || s->cmd == CMD_PUT) && s->nconns == 0) {
+		reply(s, "425 Can't open data connection");
+		return STEP_PROGRESS;
+	}
+
+	if (s->cmd == CMD_LS) {
+#if DEBUG_LEVEL >= 2
+		fprintf(stderr, "(%d) STATUS: beginning handling for client LIST request\n", s->id);
+#endif
+		if (do_list(s) < 0) {
+			finish_command(s, -1);
+		}
+	} else if ((s->cmd == CMD_GET || s->cmd == CMD_PUT) && s->raw) {
+		return start_raw(s);
+	} else if (s->cmd == CMD_GET || s->cmd == CMD_PUT) {
+#if DEBUG_LEVEL >= 2
+		fprintf(stderr, "(%d) STATUS: beginning handling for client %s request\n", \
+			s->id, s->cmd == CMD_GET ? "RETR" : "STOR");
+#endif
+		/* Agree with the client on the cipher mode, nonce and number of data
+		 * connections for this transfer, and derive its key from the
+		 * session's secret */
+		bzero(s->filename, sizeof(s->filename));
+		s->have_filename = (get_filename(s->command, s->filename, sizeof(s->filename)) > 0);
+		/* The bundle of an MGET or MPUT is named after the paths it holds
+		 * while it is being sent */
+		if (s->bundle) {
+			snprintf(s->bundle_paths, sizeof(s->bundle_paths), "%s", &s->command[4]);
+			snprintf(s->filename, sizeof(s->filename), "%s", BUNDLE_TEMP_NAME);
+		}
+		s->in_have = 0;
+		s->state = ST_NEGOTIATE;
+	// TODO: what's going on with this last 'else if'?
+	} else if (s->cmd == 4) {
+		reply(s, "550 Filename Does Not Exist");
+		finish_command(s, -1);
+	} else {
+		finish_command(s, 1);
+	}
+
+	return STEP_PROGRESS;
+	/* }}} */
+}
+
+
+/* ================================================== */
+/* The state machine */
+/* ================================================== */
+
+
+/** Takes a session and moves it as far as it can get in its current state
+ * without blocking.
+ *
+ * \param '*s' the session.
+ * \param '*h' the handle whose event woke the session, or NULL if every
+ *     descriptor the state uses should be tried.
+ * \return 'STEP_PROGRESS' if the session moved to another state, or
+ *     'STEP_WAIT' if it has to wait for an event.
+ */
+static int session_step(struct session *s, struct ev_handle *h) {
+	/* {{{ */
+	ssize_t r;
+	int ret;
+
+	switch (s->state) {
+	case ST_KEX:
+		/* The group byte, then the client's public value in that group */
+		while (1) {
+			size_t want = 1;
+			if (s->kex_have >= 1) {
+				size_t pub_len = kex_public_len(s->kex_msg[0]);
+				if (pub_len == 0) {
+					fprintf(stderr, "(%d) ERROR: client asked for unsupported key exchange group %d\n", \
+						s->id, s->kex_msg[0]);
+					session_close(s);
+					return STEP_WAIT;
+				}
+				want += pub_len;
+			}
+			if (s->kex_have == want && want > 1) break;
+
+			r = read(s->control.fd, &s->kex_msg[s->kex_have], want - s->kex_have);
+			if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+				return STEP_WAIT;
+			}
+			if (r <= 0) {
+				fprintf(stderr, "(%d) ERROR: key exchange with the client failed\n", s->id);
+				session_close(s);
+				return STEP_WAIT;
+			}
+			s->kex_have += r;
+		}
+		submit_job(s, job_kex, ST_KEX_WORK);
+		return STEP_PROGRESS;
+
+	case ST_KEX_WORK:
+		if (s->job_busy) return STEP_WAIT;
+		if (s->job_result != 0 || write(s->control.fd, s->kex_pub, s->kex_pub_len) \
+			!= (ssize_t) s->kex_pub_len) {
+
+			fprintf(stderr, "(%d) ERROR: key exchange with the client failed\n", s->id);
+			session_close(s);
+			return STEP_WAIT;
+		}
+		s->state = ST_IDLE;
+		return STEP_PROGRESS;
+
+	case ST_IDLE:
+		/* The replies to the commands before go out before the next one is
+		 * taken */
+		ret = flush_replies(s);
+		if (ret > 0) return STEP_WAIT;
+		if (ret < 0) {
+			session_close(s);
+			return STEP_WAIT;
+		}
+		/* Take the next service command from the client, which may have
+		 * been read along with the one before */
+		while ((ret = line_take(&s->control_in, s->command, sizeof(s->command))) == 0) {
+			r = line_fill(&s->control_in, s->control.fd);
+			if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+				return STEP_WAIT;
+			}
+			if (r <= 0) {
+				session_close(s);
+				return STEP_WAIT;
+			}
+		}
+		if (ret < 0) {
+			reply(s, "500 Syntax error, command unrecognized");
+			return STEP_PROGRESS;
+		}
+		return do_command(s);
+
+	case ST_DATA_OPEN:
+		ret = s->target.passive ? accept_conns(s, 1) : check_connect(s);
+		if (ret > 0) return STEP_WAIT;
+		if (ret < 0) {
+			/* The session cannot go on without a data connection to the
+			 * address it was given */
+			if (!s->target.passive) {
+				session_close(s);
+				return STEP_WAIT;
+			}
+			drop_conns(s);
+		}
+		s->state = ST_IDLE;
+		return STEP_PROGRESS;
+
+	case ST_LIST_WORK:
+		if (s->job_busy) return STEP_WAIT;
+#if DEBUG_LEVEL >= 2
+		fprintf(stderr, "(%d) STATUS: finished handling client LIST request\n", s->id);
+#endif
+		if (s->job_result != 0 || 0 != queue_data(s, s->list_buf, s->list_len) \
+			|| 0 != queue_end(s)) {
+
+			return list_sent(s, 1);
+		}
+		free(s->list_buf);
+		s->list_buf = NULL;
+		s->after_flush = list_sent;
+		s->state = ST_FLUSH;
+		return STEP_PROGRESS;
+
+	case ST_INLINE_WORK: {
+		char line[MAXLINE + 1];
+
+		if (s->job_busy) return STEP_WAIT;
+		if (s->job_result != 0) {
+			reply(s, "451 Requested action aborted. Local error in processing");
+		} else {
+			snprintf(line, sizeof(line), "213 %s %zu", s->inline_chosen, s->inline_len);
+			reply_data(s, line, s->inline_buf, s->inline_len);
+		}
+		s->state = ST_IDLE;
+		return STEP_PROGRESS;
+	}
+
+	case ST_FLUSH:
+		ret = flush_out(s);
+		if (ret > 0) return STEP_WAIT;
+		return s->after_flush(s, ret < 0);
+
+	case ST_NEGOTIATE: {
+		uint8_t chosen[TRANSFER_REPLY_LEN];
+
+		ret = read_in(s, s->offer, TRANSFER_OFFER_LEN);
+		if (ret > 0) return STEP_WAIT;
+		if (ret < 0 || 0 != choose_transfer_params(s->offer, &s->session, &s->params, chosen) \
+			|| 0 != queue_data(s, chosen, sizeof(chosen))) {
+
+			return negotiated(s, 1);
+		}
+		s->after_flush = negotiated;
+		s->state = ST_FLUSH;
+		return STEP_PROGRESS;
+	}
+
+	case ST_PREPARE: {
+		uint8_t header[STRIPE_HEADER_LEN];
+		struct stat prepared_stat;
+
+		if (s->job_busy) return STEP_WAIT;
+		if (s->job_result != 0) {
+			fprintf(stderr, "ERROR: could not prepare the file!\n");
+			s->path = NULL;
+			return fail_transfer(s);
+		}
+		/* Stripe the prepared file over as many data connections as were
+		 * agreed on, or fewer if it is too small to keep them all busy */
+		if (0 != stat(s->path, &prepared_stat)) {
+			return fail_transfer(s);
+		}
+		s->len = prepared_stat.st_size;
+		s->streams = stripe_count(s->len, s->params.streams);
+		stripe_encode_header(header, s->streams, s->len);
+		if (0 != queue_data(s, header, sizeof(header))) {
+			return fail_transfer(s);
+		}
+		s->after_flush = header_sent;
+		s->state = ST_FLUSH;
+		return STEP_PROGRESS;
+	}
+
+	case ST_HEADER:
+		ret = read_in(s, s->header, STRIPE_HEADER_LEN);
+		if (ret > 0) return STEP_WAIT;
+		if (ret < 0 || 0 != stripe_parse_header(s->header, s->params.streams, \
+			&s->streams, &s->len)) {
+
+			return fail_transfer(s);
+		}
+		return open_stripe_conns(s);
+
+	case ST_STRIPE_OPEN:
+		ret = s->target.passive ? accept_conns(s, s->streams) : check_connect(s);
+		if (ret < 0) return fail_transfer(s);
+		if (ret > 0) return STEP_WAIT;
+		return start_stripes(s);
+
+	case ST_SEND:
+	case ST_RECV:
+		for (int i = 0; i < s->streams; i++) {
+			uint32_t bit = 1u << i;
+
+			/* Only the connection that woke the session can have moved */
+			if (h != NULL && h->kind == EV_DATA && h->index != i) continue;
+
+			if (s->draining & bit) {
+				if (drain_some(&s->conns[i]) == 0) {
+					s->draining &= ~bit;
+					s->ndone++;
+				}
+				continue;
+			}
+			if (s->sc[i].done) continue;
+
+			ret = s->state == ST_SEND \
+				? stripe_send_pump(&s->xfer, &s->sc[i]) \
+				: stripe_recv_pump(&s->xfer, &s->sc[i]);
+			if (ret == STRIPE_AGAIN) continue;
+			if (ret == STRIPE_BAD_DATA) {
+				/* Keep reading until the client is done, so it is not
+				 * left blocked on a connection nobody reads */
+				s->draining |= bit;
+				if (drain_some(&s->conns[i]) != 0) continue;
+				s->draining &= ~bit;
+			}
+			s->ndone++;
+		}
+		if (s->ndone < s->streams) return STEP_WAIT;
+		return transfer_done(s);
+
+	case ST_KEEP_WORK: {
+		char line[MAXLINE + 1];
+
+		if (s->job_busy) return STEP_WAIT;
+		if (s->job_result != 0 || s->offset == 0) {
+			return fail_transfer(s);
+		}
+		transfer_cleanup(s, 1);
+		snprintf(line, sizeof(line), "451 Requested action aborted. " \
+			"%lu bytes kept to restart from", (unsigned long) s->offset);
+		reply(s, line);
+		finish_command(s, -1);
+		return STEP_PROGRESS;
+	}
+
+	case ST_PROCESS:
+		if (s->job_busy) return STEP_WAIT;
+		if (s->job_result != 0) {
+			fprintf(stderr, "ERROR: failed to process received file!\n");
+			/* Whatever is left of the received file is no longer needed */
+			return fail_transfer(s);
+		}
+		free(s->path);
+		s->path = NULL;
+		reply(s, "200 Command OK");
+		finish_command(s, 1);
+		return STEP_PROGRESS;
+
+	case ST_RAW_SEND:
+		while ((uint64_t) s->raw_off < s->raw_len) {
+			r = data_send_file(&s->conns[0], s->raw_fd, &s->raw_off, \
+				s->raw_len - s->raw_off);
+			if (r == DATA_AGAIN) return STEP_WAIT;
+			/* The file got shorter while it was being sent */
+			if (r <= 0) return fail_transfer(s);
+		}
+		return raw_done(s);
+
+	case ST_RAW_RECV:
+		while ((r = data_recv_file(&s->conns[0], s->raw_fd, s->pipefd)) > 0);
+		if (r == DATA_AGAIN) return STEP_WAIT;
+		if (r < 0) return fail_transfer(s);
+		return raw_done(s);
+	}
+
+	return STEP_WAIT;
+	/* }}} */
+}
+
+
+/** Takes a session that is waiting for events and makes epoll watch each of
+ * its descriptors for the events its state is waiting for, and no others.
+ * In particular the control connection is only read between commands, so a
+ * command that arrives early waits its turn */
+static void update_watches(struct session *s) {
+	/* {{{ */
+	uint32_t control = 0, pasv = 0, data[STRIPE_MAX_STREAMS];
+
+	memset(data, 0, sizeof(data));
+
+	switch (s->state) {
+	case ST_KEX:
+		control = EPOLLIN;
+		break;
+	case ST_IDLE:
+		control = s->reply_off < s->reply_len ? EPOLLOUT : EPOLLIN;
+		break;
+	case ST_DATA_OPEN:
+	case ST_STRIPE_OPEN:
+		if (s->target.passive) pasv = EPOLLIN;
+		for (int i = 0; i < s->nconns; i++) {
+			if (s->connecting & (1u << i)) data[i] = EPOLLOUT;
+		}
+		break;
+	case ST_NEGOTIATE:
+	case ST_HEADER:
+	case ST_RAW_RECV:
+		data[0] = EPOLLIN;
+		break;
+	case ST_FLUSH:
+	case ST_RAW_SEND:
+		data[0] = EPOLLOUT;
+		break;
+	case ST_SEND:
+	case ST_RECV:
+		for (int i = 0; i < s->streams; i++) {
+			if (s->draining & (1u << i)) {
+				data[i] = EPOLLIN;
+			} else if (!s->sc[i].done) {
+				data[i] = s->state == ST_SEND ? EPOLLOUT : EPOLLIN;
+			}
+		}
+		break;
+	}
+
+	watch(&s->control, control);
+	watch(&s->pasv, pasv);
+	/* The multiplexer moves the bytes of every channel, whatever the state */
+	watch(&s->mux, EPOLLIN);
+	for (int i = 0; i < s->nconns; i++) {
+		watch(&s->data[i], data[i]);
+	}
+	/* }}} */
+}
+
+
+/** Takes a session and runs its state machine until it has to wait */
+static void session_run(struct session *s, struct ev_handle *h) {
+	while (!s->closing && session_step(s, h) == STEP_PROGRESS) {
+		h = NULL;
+	}
+	if (!s->closing) {
+		update_watches(s);
+	}
+}
+
+
+/** Takes a session that has waited too long for the client to open a data
+ * connection and gives up on it */
+static void session_timeout(struct session *s) {
+	fprintf(stderr, "(%d) ERROR: client did not open a data connection\n", s->id);
+
+	if (s->state == ST_STRIPE_OPEN) {
+		fail_transfer(s);
+	} else if (s->target.passive) {
+		drop_conns(s);
+		s->state = ST_IDLE;
+	} else {
+		session_close(s);
+		return;
+	}
+	session_run(s, NULL);
+}
+
+
+/** Accepts every pending connection on the listening socket 'listenfd' and
+ * starts a session for each */
+static void accept_sessions(int listenfd) {
+	/* {{{ */
+	struct sockaddr_in address;
+	socklen_t addrlen;
+	struct session *s;
+	int client_fd;
+
+	while (1) {
+		addrlen = sizeof(address);
+		client_fd = accept4(listenfd, (struct sockaddr *) &address, &addrlen, \
+			SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (client_fd < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR \
+				&& errno != ECONNABORTED) {
+
+				/* New client did NOT connect successfully */
+				perror("accept error");
+			}
+			return;
+		}
+
+		if ((s = calloc(1, sizeof(struct session))) == NULL) {
+			fprintf(stderr, "ERROR: could not allocate a session\n");
+			close(client_fd);
+			continue;
+		}
+		s->id = next_session_id;
+		next_session_id += session_id_step;
+		inet_ntop(AF_INET, &address.sin_addr, s->client_addr, INET_ADDRSTRLEN);
+		s->client_port = ntohs(address.sin_port);
+		s->mode = MODE_STREAM;
+		s->target.pasv_fd = -1;
+		s->raw_fd = -1;
+		s->pipefd[0] = s->pipefd[1] = -1;
+		s->control = (struct ev_handle) { client_fd, EV_CONTROL, 0, 0, 0, s };
+		line_reader_init(&s->control_in);
+		s->pasv = (struct ev_handle) { -1, EV_PASV, 0, 0, 0, s };
+		s->mux = (struct ev_handle) { -1, EV_MUX, 0, 0, 0, s };
+		for (int i = 0; i < STRIPE_MAX_STREAMS; i++) {
+			s->data[i] = (struct ev_handle) { -1, EV_DATA, i, 0, 0, s };
+		}
+		/* Agree with the client on the session's secret, from which the key
+		 * of every transfer is derived */
+		s->state = ST_KEX;
+
+		s->next = sessions;
+		if (sessions != NULL) sessions->prev = s;
+		sessions = s;
+
+		fprintf(stderr, "(%d) ******************************\n" \
+						"(%d) STATUS: Received a new client %s:%d!\n" \
+						"(%d) ------------------------------\n",
+						s->id, s->id, s->client_addr, s->client_port, s->id);
+
+		update_watches(s);
+	}
+	/* }}} */
+}
+
+
+/** Takes the listening socket of a worker process and runs the process's
+ * event loop, which never returns */
+static void event_loop(int listenfd) {
+	/* {{{ */
+	struct ev_handle listen_handle = { listenfd, EV_LISTEN, 0, 0, 0, NULL };
+	struct ev_handle workers_handle = { work_pool_fd(workers), EV_WORKERS, 0, 0, 0, NULL };
+	struct epoll_event events[MAX_EVENTS];
+	int64_t last_check = now_ms();
+
+	watch(&listen_handle, EPOLLIN);
+	watch(&workers_handle, EPOLLIN);
+
+	while (1) {
+		int n = epoll_wait(epfd, events, MAX_EVENTS, TIMEOUT_CHECK_MS);
+		if (n < 0 && errno != EINTR) {
+			perror("epoll_wait error");
+			exit(-1);
+		}
+
+		for (int i = 0; i < n; i++) {
+			struct ev_handle *h = (struct ev_handle *) events[i].data.ptr;
+			struct session *s = h->s;
+
+			if (h->kind == EV_LISTEN) {
+				accept_sessions(listenfd);
+				continue;
+			}
+			if (h->kind == EV_WORKERS) {
+				struct work_job *job = work_pool_take_done(workers);
+				while (job != NULL) {
+					struct work_job *next = job->next;
+					s = (struct session *) job->arg;
+					s->job_busy = 0;
+					if (s->closing) {
+						s->next = dead;
+						dead = s;
+					} else {
+						session_run(s, NULL);
+					}
+					job = next;
+				}
+				continue;
+			}
+
+			/* The session may have ended earlier in this batch */
+			if (s->closing || h->fd < 0) continue;
+
+			if (h->kind == EV_MUX) {
+				if (mux_pump(s->target.mux) < 0) {
+					session_close(s);
+					continue;
+				}
+				/* The client may have opened a channel the session waits for */
+				if (s->state == ST_DATA_OPEN || s->state == ST_STRIPE_OPEN) {
+					session_run(s, NULL);
+				}
+				continue;
+			}
+
+			if (h->kind == EV_CONTROL && (events[i].events & (EPOLLERR | EPOLLHUP))) {
+				session_close(s);
+				continue;
+			}
+			/* A connection the session is not using went away. It is
+			 * dropped from epoll so it does not keep waking the loop, and the
+			 * failure shows when the session next uses it */
+			if (h->events == 0 || !(events[i].events & (h->events | EPOLLERR | EPOLLHUP))) {
+				if (h->added) {
+					epoll_ctl(epfd, EPOLL_CTL_DEL, h->fd, NULL);
+					h->added = 0;
+				}
+				continue;
+			}
+			session_run(s, h);
+		}
+
+		int64_t now = now_ms();
+		if (now - last_check >= TIMEOUT_CHECK_MS) {
+			last_check = now;
+			for (struct session *s = sessions, *next; s != NULL; s = next) {
+				next = s->next;
+				if ((s->state == ST_DATA_OPEN || s->state == ST_STRIPE_OPEN) \
+					&& now >= s->deadline) {
+
+					session_timeout(s);
+				}
+			}
+		}
+
+		while (dead != NULL) {
+			struct session *s = dead;
+			dead = s->next;
+			session_free(s);
+		}
+	}
+	/* }}} */
+}
+
+
+/** Opens a non-blocking socket listening on 'port' that other worker
+ * processes can listen on as well, each getting its share of the new
+ * connections from the kernel.
+ *
+ * \param 'port' the port to listen on.
+ * \return the socket, or a negative int upon failure.
+ */
+static int open_listener(int port) {
+	struct sockaddr_in servaddr;
+	int listenfd, one = 1;
+
+	if ( (listenfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0){
+		perror("socket error");
+		return -1;
+	}
+	if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+		perror("setsockopt error");
+		close(listenfd);
+		return -1;
+	}
+
+	bzero(&servaddr, sizeof(servaddr));
+	servaddr.sin_family = AF_INET;
+	servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+	servaddr.sin_port = htons(port);
+
+	if (bind(listenfd, (struct sockaddr*) &servaddr, sizeof(servaddr)) < 0) {
+		perror("bind error");
+		close(listenfd);
+		return -1;
+	}
+
+	if (listen(listenfd, LISTENQ) < 0) {
+		perror("listen error");
+		close(listenfd);
+		return -1;
+	}
+
+	return listenfd;
+}
+
+
+/** Runs the worker process 'index' of 'nprocs': opens its own listening
+ * socket, epoll instance and pool of 'nthreads' worker threads, then serves
+ * sessions until it is killed. Never returns.
+ *
+ * \param 'index' the number of the process, from 0.
+ * \param 'nprocs' the number of worker processes.
+ * \param 'port' the port to listen on.
+ * \param 'nthreads' the number of worker threads.
+ * \return does not return.
+ */
+static void run_worker(int index, int nprocs, int port, int nthreads) {
+	int listenfd;
+
+	/* Go down with the supervisor rather than keep serving on our own */
+	prctl(PR_SET_PDEATHSIG, SIGTERM);
+	if (getppid() == 1) exit(0);
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+
+	next_session_id = index + 1;
+	session_id_step = nprocs;
+
+	if ((listenfd = open_listener(port)) < 0) {
+		exit(WORKER_SETUP_FAILED);
+	}
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		perror("epoll_create1 error");
+		exit(WORKER_SETUP_FAILED);
+	}
+	/* Threads do not survive fork(), so each process starts its own */
+	if ((workers = work_pool_create(nthreads)) == NULL) {
+		fprintf(stderr, "ERROR: could not start the worker threads\n");
+		exit(WORKER_SETUP_FAILED);
+	}
+	buf_preallocate(stripe_get_max_streams());
+	cpu_gate_join(cpu_gate, index);
+	mem_budget_join(mem_budget, index);
+	port_pool_join(pasv_pool, index);
+
+	event_loop(listenfd);
+}
+
+
+/* Set by SIGTERM or SIGINT to tell the supervisor to stop the workers and
+ * exit */
+static volatile sig_atomic_t stopping = 0;
+
+static void stop_handler(int sig) {
+	stopping = 1;
+}
+
+
+/** Forks worker process 'index', which never returns, and returns its pid
+ * to the supervisor, or -1 upon failure */
+static pid_t spawn_worker(int index, int nprocs, int port, int nthreads) {
+	pid_t pid = fork();
+
+	if (pid < 0) {
+		perror("fork error");
+	} else if (pid == 0) {
+		run_worker(index, nprocs, port, nthreads);
+	}
+	return pid;
+}
+
+
+/** Runs the supervisor: starts 'nprocs' worker processes and waits on them,
+ * reaping each one that exits and starting another in its place, until it
+ * is told to stop, at which point it stops the workers too.
+ *
+ * \param 'nprocs' the number of worker processes.
+ * \param 'port' the port the workers listen on.
+ * \param 'nthreads' the number of worker threads in each process.
+ * \return 0 once stopped, or a negative int if the workers could not start.
+ */
+static int supervise(int nprocs, int port, int nthreads) {
+	/* {{{ */
+	pid_t pids[nprocs];
+	struct sigaction sa;
+	int status, ret = 0;
+
+	/* Without SA_RESTART, so that the signal interrupts wait() */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stop_handler;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+
+	for (int i = 0; i < nprocs; i++) {
+		pids[i] = spawn_worker(i, nprocs, port, nthreads);
+	}
+	fprintf(stderr, "STATUS: starting %d worker processes of %d threads on port %d\n", \
+		nprocs, nthreads, port);
+
+	while (!stopping) {
+		pid_t pid = wait(&status);
+		if (pid < 0) {
+			if (errno == EINTR) continue;
+			/* Every worker failed to fork */
+			ret = -1;
+			break;
+		}
+
+		for (int i = 0; i < nprocs; i++) {
+			if (pids[i] != pid) continue;
+
+			if (WIFEXITED(status) && WEXITSTATUS(status) == WORKER_SETUP_FAILED) {
+				/* Another would fail the same way */
+				fprintf(stderr, "ERROR: worker process %d could not start\n", i);
+				stopping = 1;
+				ret = -1;
+				break;
+			}
+			/* Whatever chunks it was running or waiting to run never will */
+			cpu_gate_reclaim(cpu_gate, i);
+			mem_budget_reclaim(mem_budget, i);
+			/* Nor will it give back the passive ports of its sessions */
+			port_pool_reclaim(pasv_pool, i);
+			fprintf(stderr, "WARNING: worker process %d (%d) exited, starting another\n", \
+				i, pid);
+			pids[i] = spawn_worker(i, nprocs, port, nthreads);
+		}
+	}
+
+	for (int i = 0; i < nprocs; i++) {
+		if (pids[i] > 0) kill(pids[i], SIGTERM);
+	}
+	while (wait(NULL) > 0 || errno == EINTR);
+
+	size_t current, peak, limit;
+	mem_budget_usage(mem_budget, &current, &peak, &limit);
+	fprintf(stderr, "STATUS: chunk memory peaked at %zu of %zu bytes\n", peak, limit);
+
+	return ret;
+	/* }}} */
+}
+
+
+int main(int argc, char **argv) {
+	int port;
+
+	int opt, key_bits;
+	int pasv_first = PORT_POOL_FIRST, pasv_last = PORT_POOL_LAST;
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int nprocs = ncpus < 1 ? 1 : ncpus, nthreads = 0;
+	/* By default one chunk per CPU */
+	int cpu_tokens = ncpus < 1 ? 1 : ncpus;
+	/* By default half of the machine's memory */
+	long mem_mib = (long) (sysconf(_SC_PHYS_PAGES) / 2 / (1048576 / sysconf(_SC_PAGESIZE)));
+	uint8_t pref[ENC_NUM_MODES];
+
+	/* Parse options from commandline args */
+	while ((opt = getopt(argc, argv, "c:k:m:n:p:rs:w:")) != -1) {
+		switch (opt) {
+		case 'c':
+			/* The most file chunks compressed or encrypted at once by the
+			 * whole server */
+			cpu_tokens = atoi(optarg);
+			if (cpu_tokens < 1) {
+				fprintf(stderr, "ERROR: at least 1 chunk must be able to run at once\n");
+				exit(-1);
+			}
+			break;
+		case 'k':
+			/* The shortest AES key length to accept from clients */
+			key_bits = atoi(optarg);
+			if (0 != enc_set_key_len(key_bits / 8) || key_bits % 8 != 0) {
+				fprintf(stderr, "ERROR: key length must be 128, 192 or 256 bits\n");
+				exit(-1);
+			}
+			break;
+		case 'm':
+			/* The most memory, in MiB, the whole server may hold in
+			 * buffers for compressing and encrypting files */
+			mem_mib = atol(optarg);
+			if (mem_mib < 1) {
+				fprintf(stderr, "ERROR: the memory budget must be at least 1 MiB\n");
+				exit(-1);
+			}
+			break;
+		case 'n':
+			/* The number of worker processes */
+			nprocs = atoi(optarg);
+			if (nprocs < 1) {
+				fprintf(stderr, "ERROR: there must be at least 1 worker process\n");
+				exit(-1);
+			}
+			break;
+		case 'p':
+			/* The range of ports passive data connections are accepted on */
+			if (sscanf(optarg, "%d-%d", &pasv_first, &pasv_last) != 2 \
+				|| pasv_first < 1 || pasv_last > 65535 || pasv_last < pasv_first) {
+
+				fprintf(stderr, "ERROR: passive ports must be given as <first>-<last>\n");
+				exit(-1);
+			}
+			break;
+		case 'r':
+			/* Let clients on a trusted network have files sent as they
+			 * are */
+			raw_allowed = 1;
+			break;
+		case 's':
+			/* The most data connections to stripe a transfer over */
+			if (0 != stripe_set_max_streams(atoi(optarg))) {
+				fprintf(stderr, "ERROR: data connections must be between 1 and %d\n", \
+					STRIPE_MAX_STREAMS);
+				exit(-1);
+			}
+			break;
+		case 'w':
+			/* The number of threads compressing and encrypting files in
+			 * each worker process */
+			nthreads = atoi(optarg);
+			if (nthreads < 1) {
+				fprintf(stderr, "ERROR: there must be at least 1 worker thread\n");
+				exit(-1);
+			}
+			break;
+		default:
+			exit(-1);
+		}
+	}
+
+	if (argc - optind != 1) {
+		printf("Invalid Number of Arguments...\n");
+		printf("Usage: ./ecftpserver [-c <chunks>] [-k <128|192|256>] [-m <MiB>] [-n <processes>] [-p <first>-<last>] " \
+			"[-r] [-s <streams>] [-w <workers>] <listen-port>\n");
+		exit(-1);
+	}
+
+	/* Parse server port from commandline args */
+	sscanf(argv[optind], "%d", &port);
+
+	/* By default the worker threads of all the processes add up to one per
+	 * CPU */
+	if (nthreads == 0) {
+		nthreads = ncpus / nprocs;
+		if (nthreads < 1) nthreads = 1;
+	}
+
+	/* A client that goes away mid-transfer must not take the server with it */
+	signal(SIGPIPE, SIG_IGN);
+	/* Rank the cipher modes once, before the workers are forked, rather than
+	 * in each worker in the middle of its first transfer */
+	enc_mode_preference(pref);
+
+	/* Made before the workers are forked so that every session shares it */
+	if ((pasv_pool = port_pool_create(pasv_first, pasv_last, nprocs)) == NULL) {
+		fprintf(stderr, "ERROR: could not set up the passive port range\n");
+		exit(-1);
+	}
+	if ((cpu_gate = cpu_gate_create(cpu_tokens, nprocs)) == NULL) {
+		fprintf(stderr, "ERROR: could not set up the CPU gate\n");
+		exit(-1);
+	}
+	if (mem_mib < 1) mem_mib = 1;
+	if ((mem_budget = mem_budget_create((size_t) mem_mib << 20, nprocs)) == NULL) {
+		fprintf(stderr, "ERROR: could not set up the memory budget\n");
+		exit(-1);
+	}
+
+	return supervise(nprocs, port, nthreads) == 0 ? 0 : -1;
 }
@@ -1,19 +1,28 @@
+#include <fcntl.h>
 #include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 #if DEBUG_LEVEL >= 2
 #include <sys/syscall.h>
 #endif
 
 #include "aes.h"
+#include "chacha.h"
+#include "cpugate.h"
 #include "enc.h"
+#include "gcm.h"
 #include "fileops.h"
+#include "membudget.h"
 
 
+/* The AES key length (in bytes) this end asks for */
+static int preferred_key_len = ENC_KEY_LEN_DEFAULT;
+
 /** Take a file name and returns a malloc'd string containing a temp file name
  * which has the encryption extension appended. The returned string must
  * be freed by the caller of this function.
@@ -35,7 +44,7 @@ char * temp_encryption_name(char * filename) {
 	/* GTNE2: Fill the string with the filename + the encryption extension +
 	 * the suffix characters 'mkstemp()' requires and will modify */
 	// TODO: can this construction not be done faster or more efficiently?
-	strncpy(&e_out_fp[0], filename, strlen(filename));
+	memcpy(&e_out_fp[0], filename, strlen(filename));
 	strncat(&e_out_fp[0], ENC_EXT, e_ext_len + 1);
 	strncat(&e_out_fp[0], "-XXXXXX", 8);
 
@@ -52,50 +61,483 @@ char * temp_encryption_name(char * filename) {
 }
 
 
-/* Computes a^b mod c */
-uint64_t sq_mp(uint64_t a, uint64_t b, uint64_t c) {
-    uint64_t r;
-    uint64_t y = 1;
+/** Fills '*buf' with 'len' random bytes, read from the system's random
+ * device. Nonces and keys are made from these bytes, so there is no weaker
+ * source to fall back on: if the device can not be read, the caller must
+ * give up on whatever needed them.
+ *
+ * \param '*buf' the buffer to fill.
+ * \param 'len' the number of random bytes to write to '*buf'.
+ * \return 0 upon success, -1 if the random device could not be read.
+ */
+int enc_random_bytes(uint8_t *buf, size_t len) {
+	int fd = open("/dev/urandom", O_RDONLY);
+	size_t filled = 0;
+
+	if (fd < 0) {
+		perror("open (enc_random_bytes)");
+		return -1;
+	}
+	while (filled < len) {
+		ssize_t r = read(fd, &buf[filled], len - filled);
+		if (r <= 0) break;
+		filled += r;
+	}
+	close(fd);
+
+	if (filled != len) {
+		fprintf(stderr, "ERROR: could not read the random device\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/** Sets the AES key length this end asks for (or, on the server, accepts at
+ * the least) when negotiating the cipher of a transfer. Longer keys only
+ * cost the extra rounds they need: 12 rounds instead of 10 for 192-bit keys
+ * and 14 for 256-bit keys.
+ *
+ * \param 'key_len' the key length in bytes: 16, 24 or 32.
+ * \return 0 on success, -1 if 'key_len' is not a valid AES key length.
+ */
+int enc_set_key_len(int key_len) {
+	if (key_len != 16 && key_len != 24 && key_len != 32) {
+		return -1;
+	}
+	preferred_key_len = key_len;
+
+	return 0;
+}
+
+
+/** Returns the AES key length, in bytes, set by 'enc_set_key_len()' */
+int enc_get_key_len() {
+	return preferred_key_len;
+}
+
+
+/** Takes a session and the number of one of its transfers and derives the
+ * key of that transfer from the session's secret. The key is the start of
+ * the first ChaCha20 keystream block under the session's secret, with the
+ * transfer number as the nonce, which makes every transfer's key
+ * independent of the others' without another key exchange.
+ *
+ * \param '*session' the session the transfer belongs to.
+ * \param 'counter' the number of the transfer within the session.
+ * \param 'key' will be modified to contain the key of the transfer.
+ * \return void.
+ */
+void enc_derive_transfer_key(struct enc_session *session, uint64_t counter, \
+	uint32_t key[ENC_KEY_WORDS]) {
+	/* {{{ */
+	uint8_t secret_bytes[4 * ENC_KEY_WORDS];
+	uint8_t nonce[CHACHA_NONCE_LEN];
+	uint8_t block[CHACHA_BLOCK_LEN];
+	uint32_t state[16];
+
+	for (int i = 0; i < 4 * ENC_KEY_WORDS; i++) {
+		secret_bytes[i] = (session->secret[i / 4] >> (8 * (i % 4))) & 0xff;
+	}
+	put_be(nonce, counter, CHACHA_NONCE_LEN);
+	chacha20_setup(state, secret_bytes, sizeof(secret_bytes), nonce);
+	memset(block, 0, sizeof(block));
+	chacha20_xor(state, 0, block, sizeof(block));
+
+	for (int i = 0; i < ENC_KEY_WORDS; i++) {
+		key[i] = (uint32_t) block[4 * i] | ((uint32_t) block[4 * i + 1] << 8) \
+			| ((uint32_t) block[4 * i + 2] << 16) | ((uint32_t) block[4 * i + 3] << 24);
+	}
+	/* }}} */
+}
+
+
+/** Takes the negotiated parameters of a transfer and fills in the struct
+ * enc_aes_vars shared by all the threads working on the transfer.
+ *
+ * \param '*avars' the struct enc_aes_vars to be filled in.
+ * \param '*params' the negotiated key, key length, cipher mode and nonce.
+ * \return 0 on success, a negative int if the parameters are invalid.
+ */
+int init_aes_vars(struct enc_aes_vars *avars, struct enc_params *params) {
+	/* {{{ */
+	uint8_t key_bytes[4 * ENC_KEY_WORDS];
+
+	/* The key exchange produces the key as words */
+	for (int i = 0; i < 4 * ENC_KEY_WORDS; i++) {
+		key_bytes[i] = (params->key[i / 4] >> (8 * (i % 4))) & 0xff;
+	}
+	avars->mode = params->mode;
+	memcpy(avars->nonce, params->nonce, ENC_NONCE_LEN);
+
+	/* The ChaCha20 modes always use all 256 bits of the key */
+	if (avars->mode == ENC_MODE_CHACHA20 \
+		|| avars->mode == ENC_MODE_CHACHA20_POLY1305) {
+
+		chacha20_setup(avars->chacha, key_bytes, sizeof(key_bytes), \
+			avars->nonce);
+		return 0;
+	}
+
+	/* The AES modes use the first 'key_len' bytes of the key */
+	if (0 != aes_set_key(&avars->aes, key_bytes, params->key_len)) {
+		fprintf(stderr, "ERROR: invalid AES key length %d\n", params->key_len);
+		return -1;
+	}
+
+	/* GCM mode needs the hash subkey, the encryption of the zero block */
+	if (avars->mode == ENC_MODE_GCM) {
+		uint8_t h[AES_BLOCK_LEN];
+		memset(h, 0, sizeof(h));
+		aes_encrypt_blocks(&avars->aes, h, h, 1);
+		ghash_init(&avars->ghash, h);
+	}
+
+	return 0;
+	/* }}} */
+}
+
+
+/** Takes a buffer holding 'len' bytes of a stream that begin 'offset' bytes
+ * into the stream and XORs them, in place, with the CTR mode keystream for
+ * that range. Since each keystream block depends only on the nonce and the
+ * block index, any byte range can be encrypted or decrypted independently of
+ * the rest of the stream, and encryption and decryption are the same
+ * operation.
+ *
+ * \param '*buf' the data to be encrypted/decrypted in place.
+ * \param 'len' the number of bytes at '*buf'.
+ * \param 'offset' the position of '*buf' in the stream, in bytes.
+ * \param '*avars' the AES vars, including the transfer's nonce.
+ * \return void.
+ */
+void ctr_xor(uint8_t *buf, size_t len, uint64_t offset, struct enc_aes_vars *avars) {
+	/* {{{ */
+	uint64_t block_index = offset / AES_BLOCK_LEN;
+	size_t skip = offset % AES_BLOCK_LEN;
+	uint8_t ks[ENC_CTR_BATCH * AES_BLOCK_LEN];
+	size_t i = 0;
+
+	while (i < len) {
+		/* Build the counter blocks for as much of the rest of the data as
+		 * fits in the batch: the nonce followed by the big-endian block
+		 * index */
+		size_t num_blocks = (skip + (len - i) + AES_BLOCK_LEN - 1) / AES_BLOCK_LEN;
+		if (num_blocks > ENC_CTR_BATCH) num_blocks = ENC_CTR_BATCH;
+		for (size_t b = 0; b < num_blocks; b++) {
+			uint64_t index = block_index + b;
+			memcpy(&ks[AES_BLOCK_LEN * b], avars->nonce, ENC_NONCE_LEN);
+			put_be(&ks[AES_BLOCK_LEN * b + ENC_NONCE_LEN], index, 8);
+		}
+		aes_encrypt_blocks(&avars->aes, ks, ks, num_blocks);
+
+		/* XOR the keystream with the data, skipping the part of the first
+		 * block that precedes 'offset' */
+		for (size_t j = skip; j < num_blocks * AES_BLOCK_LEN && i < len; j++, i++) {
+			buf[i] ^= ks[j];
+		}
+		skip = 0;
+		block_index += num_blocks;
+	}
+	/* }}} */
+}
+
+
+/** Fills '*ks' with the 'num_blocks' keystream blocks starting at block
+ * 'counter' of GCM chunk 'chunk_index'. The nonce followed by the 32-bit
+ * big-endian chunk index forms the chunk's 96-bit IV, so every chunk is an
+ * independent GCM message and chunks can not be reordered without failing
+ * authentication. */
+static void gcm_keystream_blocks(struct enc_aes_vars *avars, \
+	uint32_t chunk_index, uint32_t counter, size_t num_blocks, uint8_t *ks) {
+
+	for (size_t b = 0; b < num_blocks; b++) {
+		uint8_t *block = &ks[AES_BLOCK_LEN * b];
+		uint32_t ctr = counter + b;
+		memcpy(block, avars->nonce, ENC_NONCE_LEN);
+		for (int j = 0; j < 4; j++) {
+			block[ENC_NONCE_LEN + j] = (chunk_index >> (24 - 8 * j)) & 0xff;
+			block[ENC_NONCE_LEN + 4 + j] = (ctr >> (24 - 8 * j)) & 0xff;
+		}
+	}
+	aes_encrypt_blocks(&avars->aes, ks, ks, num_blocks);
+}
+
+
+/** Takes a chunk of 'len' bytes and encrypts or decrypts it in place with
+ * AES-GCM, computing the chunk's authentication tag in the same pass. The
+ * data is processed in segments small enough to stay in cache, with each
+ * segment being hashed right before (decryption) or after (encryption) it is
+ * XOR'd with the keystream. The additional authenticated data is a single
+ * byte saying whether this is the final chunk of the stream, so a stream
+ * truncated at a chunk boundary fails authentication.
+ *
+ * \param '*buf' the chunk to be encrypted/decrypted in place.
+ * \param 'len' the number of bytes at '*buf'.
+ * \param 'chunk_index' the position of the chunk in the stream.
+ * \param 'final' 1 if this is the last chunk of the stream, 0 otherwise.
+ * \param 'encrypting' 1 if '*buf' is plaintext to be encrypted, 0 if it is
+ *     ciphertext to be decrypted.
+ * \param '*avars' the AES vars, including the nonce and GHASH key.
+ * \param 'tag' will be modified to contain the authentication tag of the
+ *     chunk.
+ * \return void.
+ */
+void gcm_crypt_chunk(uint8_t *buf, size_t len, uint32_t chunk_index, \
+	char final, char encrypting, struct enc_aes_vars *avars, \
+	uint8_t tag[GCM_TAG_LEN]) {
+	/* {{{ */
+	uint8_t y[16];
+	uint8_t block[16];
+	uint8_t ks[ENC_GCM_SEGMENT];
+	uint8_t aad = final;
+	/* Counter 1 is reserved for masking the tag, data starts at counter 2 */
+	uint32_t counter = 2;
+
+	memset(y, 0, sizeof(y));
+	ghash_update(&avars->ghash, y, &aad, sizeof(aad));
+
+	for (size_t seg = 0; seg < len; seg += ENC_GCM_SEGMENT) {
+		size_t seg_len = len - seg;
+		if (seg_len > ENC_GCM_SEGMENT) seg_len = ENC_GCM_SEGMENT;
+
+		/* When decrypting, hash the ciphertext before it is overwritten */
+		if (!encrypting) {
+			ghash_update(&avars->ghash, y, &buf[seg], seg_len);
+		}
+		size_t seg_blocks = (seg_len + AES_BLOCK_LEN - 1) / AES_BLOCK_LEN;
+		gcm_keystream_blocks(avars, chunk_index, counter, seg_blocks, ks);
+		counter += seg_blocks;
+		for (size_t j = 0; j < seg_len; j++) {
+			buf[seg + j] ^= ks[j];
+		}
+		/* When encrypting, hash the ciphertext that was just produced */
+		if (encrypting) {
+			ghash_update(&avars->ghash, y, &buf[seg], seg_len);
+		}
+	}
+
+	/* Finish with the lengths (in bits) of the AAD and the ciphertext */
+	uint64_t aad_bits = 8 * sizeof(aad);
+	uint64_t len_bits = 8 * (uint64_t) len;
+	put_be(&block[0], aad_bits, 8);
+	put_be(&block[8], len_bits, 8);
+	ghash_update(&avars->ghash, y, block, 16);
+
+	/* The tag is the hash masked with the keystream block for counter 1 */
+	gcm_keystream_blocks(avars, chunk_index, 1, 1, block);
+	for (int j = 0; j < GCM_TAG_LEN; j++) {
+		tag[j] = y[j] ^ block[j];
+	}
+	/* }}} */
+}
+
+
+/** Takes a chunk of 'len' bytes and encrypts or decrypts it in place with
+ * ChaCha20-Poly1305, computing the chunk's authentication tag in the same
+ * pass. The chunk is laid out like an RFC 8439 AEAD message whose block
+ * counter starts at the chunk index shifted into the upper 32 bits, so no two
+ * chunks share keystream: block 0 gives the chunk's one-time Poly1305 key and
+ * the data starts at block 1. Like 'gcm_crypt_chunk()', the additional
+ * authenticated data is the single byte saying whether this is the final
+ * chunk, and the data is processed in cache sized segments.
+ *
+ * \param '*buf' the chunk to be encrypted/decrypted in place.
+ * \param 'len' the number of bytes at '*buf'.
+ * \param 'chunk_index' the position of the chunk in the stream.
+ * \param 'final' 1 if this is the last chunk of the stream, 0 otherwise.
+ * \param 'encrypting' 1 if '*buf' is plaintext to be encrypted, 0 if it is
+ *     ciphertext to be decrypted.
+ * \param '*avars' the cipher vars, including the ChaCha20 state.
+ * \param 'tag' will be modified to contain the authentication tag of the
+ *     chunk.
+ * \return void.
+ */
+static void chacha20_poly1305_chunk(uint8_t *buf, size_t len, \
+	uint32_t chunk_index, char final, char encrypting, \
+	struct enc_aes_vars *avars, uint8_t tag[POLY1305_TAG_LEN]) {
+	/* {{{ */
+	struct poly1305_state st;
+	uint8_t block[CHACHA_BLOCK_LEN];
+	uint8_t zeros[16];
+	uint8_t aad = final;
+	uint64_t counter = (uint64_t) chunk_index << 32;
+
+	/* The one-time Poly1305 key is the first 32 bytes of block 0 */
+	memset(block, 0, sizeof(block));
+	chacha20_xor(avars->chacha, counter, block, sizeof(block));
+	poly1305_init(&st, block);
+	counter++;
+
+	/* The AAD, padded to 16 bytes */
+	memset(zeros, 0, sizeof(zeros));
+	poly1305_update(&st, &aad, sizeof(aad));
+	poly1305_update(&st, zeros, 16 - sizeof(aad));
+
+	for (size_t seg = 0; seg < len; seg += ENC_GCM_SEGMENT) {
+		size_t seg_len = len - seg;
+		if (seg_len > ENC_GCM_SEGMENT) seg_len = ENC_GCM_SEGMENT;
+
+		/* When decrypting, authenticate the ciphertext before it is
+		 * overwritten */
+		if (!encrypting) {
+			poly1305_update(&st, &buf[seg], seg_len);
+		}
+		/* Segments are a multiple of the block length, so each one starts
+		 * on a block boundary */
+		chacha20_xor(avars->chacha, counter, &buf[seg], seg_len);
+		counter += ENC_GCM_SEGMENT / CHACHA_BLOCK_LEN;
+		if (encrypting) {
+			poly1305_update(&st, &buf[seg], seg_len);
+		}
+	}
+
+	/* Pad the ciphertext to 16 bytes and finish with the little-endian
+	 * lengths (in bytes) of the AAD and the ciphertext */
+	if (len % 16 != 0) {
+		poly1305_update(&st, zeros, 16 - (len % 16));
+	}
+	uint64_t aad_len = sizeof(aad);
+	uint64_t ct_len = len;
+	for (int j = 0; j < 8; j++) {
+		block[j] = (aad_len >> (8 * j)) & 0xff;
+		block[8 + j] = (ct_len >> (8 * j)) & 0xff;
+	}
+	poly1305_update(&st, block, 16);
+	poly1305_finish(&st, tag);
+	/* }}} */
+}
+
+
+/** Takes a buffer holding 'len' bytes of a stream that begin 'offset' bytes
+ * into the stream and XORs them, in place, with the keystream of the
+ * transfer's stream cipher mode (CTR or ChaCha20) for that range.
+ *
+ * \param '*buf' the data to be encrypted/decrypted in place.
+ * \param 'len' the number of bytes at '*buf'.
+ * \param 'offset' the position of '*buf' in the stream, in bytes.
+ * \param '*avars' the cipher vars of the transfer.
+ * \return void.
+ */
+void enc_stream_xor(uint8_t *buf, size_t len, uint64_t offset, \
+	struct enc_aes_vars *avars) {
+	/* {{{ */
+	if (avars->mode == ENC_MODE_CTR) {
+		ctr_xor(buf, len, offset, avars);
+		return;
+	}
 
-    while (b > 0) {
-        r = b % 2;
+	/* ChaCha20: the keystream block for byte 'offset' is block
+	 * 'offset / 64'. If the range doesn't start on a block boundary, finish
+	 * the partial block first so the rest can be XOR'd in whole blocks */
+	uint64_t block_index = offset / CHACHA_BLOCK_LEN;
+	size_t skip = offset % CHACHA_BLOCK_LEN;
+	if (skip != 0) {
+		uint8_t block[CHACHA_BLOCK_LEN];
+		size_t head = CHACHA_BLOCK_LEN - skip;
+		if (head > len) head = len;
+
+		memset(block, 0, sizeof(block));
+		chacha20_xor(avars->chacha, block_index, block, sizeof(block));
+		for (size_t j = 0; j < head; j++) {
+			buf[j] ^= block[skip + j];
+		}
+		buf += head;
+		len -= head;
+		block_index++;
+	}
+	chacha20_xor(avars->chacha, block_index, buf, len);
+	/* }}} */
+}
 
-        if (r == 1) {
-            y = (y * a) % c;
-        }
 
-        a = a * a % c;
-        b = b / 2;
-    }
+/** Takes a chunk and encrypts or decrypts it in place with the transfer's
+ * AEAD mode (GCM or ChaCha20-Poly1305), computing its tag. See
+ * 'gcm_crypt_chunk()' for the meaning of the parameters. */
+void enc_aead_chunk(uint8_t *buf, size_t len, uint32_t chunk_index, \
+	char final, char encrypting, struct enc_aes_vars *avars, \
+	uint8_t tag[ENC_TAG_LEN]) {
 
-    return y;
+	if (avars->mode == ENC_MODE_GCM) {
+		gcm_crypt_chunk(buf, len, chunk_index, final, encrypting, avars, tag);
+	} else {
+		chacha20_poly1305_chunk(buf, len, chunk_index, final, encrypting, \
+			avars, tag);
+	}
 }
 
-void to_column_order(uint8_t text[16]) {
-    uint8_t temp[16];
-    memcpy(temp, text, 16);
 
-    for (int i = 0; i < 4; i++) {
-        for (int j = 0; j < 4; j++) {
-            text[4*j + i] = temp[4*i + j];
-        }
-    }
+/** Returns how many nanoseconds it takes this machine to encrypt a small
+ * buffer in 'mode'. Used to rank the modes against each other. */
+static uint64_t time_mode(char mode) {
+	/* {{{ */
+	static uint8_t buf[ENC_GCM_SEGMENT * 4];
+	struct enc_params params;
+	struct enc_aes_vars avars;
+	uint8_t tag[ENC_TAG_LEN];
+	struct timespec start, end;
+
+	memset(&params, 0, sizeof(params));
+	params.mode = mode;
+	params.key_len = preferred_key_len;
+	init_aes_vars(&avars, &params);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (ENC_MODE_IS_AEAD(mode)) {
+		enc_aead_chunk(buf, sizeof(buf), 0, 1, 1, &avars, tag);
+	} else {
+		enc_stream_xor(buf, sizeof(buf), 0, &avars);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return (uint64_t) (end.tv_sec - start.tv_sec) * 1000000000ULL \
+		+ (uint64_t) end.tv_nsec - (uint64_t) start.tv_nsec;
+	/* }}} */
 }
 
-void to_row_order(uint8_t text[16]) {
-    uint8_t temp[16];
-    memcpy(temp, text, 16);
 
-    for (int i = 0; i < 4; i++) {
-        for (int j = 0; j < 4; j++) {
-            text[4*i + j] = temp[4*j + i];
-        }
-    }
+/** Fills 'order' with every supported cipher mode, most preferred first.
+ * Authenticated modes are always preferred over unauthenticated ones, and ECB
+ * mode comes last. Between the AES and ChaCha20 based modes in each class,
+ * the one that is faster on this machine (which depends on things like
+ * whether the CPU has AVX2) is preferred. The modes are timed the first time
+ * this function is called and the result is reused afterwards.
+ *
+ * \param 'order' will be modified to contain the ENC_NUM_MODES modes.
+ * \return the number of modes written to 'order'.
+ */
+int enc_mode_preference(uint8_t order[ENC_NUM_MODES]) {
+	/* {{{ */
+	static uint8_t cached[ENC_NUM_MODES];
+	static char have_cached = 0;
+
+	if (!have_cached) {
+		int chacha_aead_faster = \
+			time_mode(ENC_MODE_CHACHA20_POLY1305) < time_mode(ENC_MODE_GCM);
+		int chacha_faster = \
+			time_mode(ENC_MODE_CHACHA20) < time_mode(ENC_MODE_CTR);
+
+		cached[0] = chacha_aead_faster ? ENC_MODE_CHACHA20_POLY1305 : ENC_MODE_GCM;
+		cached[1] = chacha_aead_faster ? ENC_MODE_GCM : ENC_MODE_CHACHA20_POLY1305;
+		cached[2] = chacha_faster ? ENC_MODE_CHACHA20 : ENC_MODE_CTR;
+		cached[3] = chacha_faster ? ENC_MODE_CTR : ENC_MODE_CHACHA20;
+		cached[4] = ENC_MODE_ECB;
+		have_cached = 1;
+#if DEBUG_LEVEL >= 1
+		fprintf(stderr, "(%d) STATUS: cipher preference: %#x %#x %#x %#x %#x\n", \
+			getpid(), cached[0], cached[1], cached[2], cached[3], cached[4]);
+#endif
+	}
+	memcpy(order, cached, ENC_NUM_MODES);
+
+	return ENC_NUM_MODES;
+	/* }}} */
 }
 
 
 /** Helper function for encrypting a file through multiple threads */
-void *encrypt_chunk_of_file(void *arg) {
+static void *encrypt_chunk(void *arg) {
 	/* {{{ */
 #if DEBUG_LEVEL >= 2
 	fprintf(stderr, "(%d) STATUS: encryption: thread %ld starting...\n", \
@@ -111,19 +553,38 @@ void *encrypt_chunk_of_file(void *arg) {
 		return NULL;
 	}
 
-	/* 2. Encrypt the Data: Encrypt the data in 't->inbuf' and put in
-	 * 't->outbuf' */
+	/* 2. If the transfer uses a stream cipher mode, XOR the data with the
+	 * keystream for its position in the stream. No padding is needed and the
+	 * data can be encrypted in place */
+	if (ENC_MODE_IS_STREAM(t->aes_vars->mode)) {
+		enc_stream_xor(&t->inbuf[0], t->ir_readlen, t->offset, t->aes_vars);
+		t->out_len = t->ir_readlen;
+		t->padded = 0;
+		t->return_val = 0;
+		return NULL;
+	}
+
+	/* 2b. If the transfer uses an AEAD mode, encrypt the data in place and
+	 * append the chunk's tag, for which '*inbuf' has room */
+	if (ENC_MODE_IS_AEAD(t->aes_vars->mode)) {
+		enc_aead_chunk(&t->inbuf[0], t->ir_readlen, \
+			t->offset / ENC_THREAD_MAX_MEM, t->final, 1, t->aes_vars, \
+			&t->inbuf[t->ir_readlen]);
+		t->out_len = t->ir_readlen + ENC_TAG_LEN;
+		t->padded = 0;
+		t->return_val = 0;
+		return NULL;
+	}
+
+	/* 3. Encrypt the Data: Encrypt the data in 't->inbuf' in place */
 	int num_stranded_bytes = t->ir_readlen % 16;
-    uint8_t text[16];
 	int i;
-	/* ED1: Loop through the read bytes in 16 byte chunks, encrypting each chunk and
-	 * storing the results to a write buffer */
-	for (i = 0; (size_t) i < t->ir_readlen - num_stranded_bytes; i += 16) {
-		memcpy(text, &t->inbuf[i], 16);
-		to_column_order(text);
-		encrypt(text, t->aes_vars->rkeys, t->aes_vars->sbox);
-		memcpy(&t->outbuf[i], text, 16);
-	}
+	t->out_len = t->ir_readlen;
+	/* ED1: Encrypt all the whole 16 byte chunks of the read bytes where they
+	 * are */
+	i = t->ir_readlen - num_stranded_bytes;
+	aes_encrypt_blocks(&t->aes_vars->aes, &t->inbuf[0], &t->inbuf[0], \
+		i / AES_BLOCK_LEN);
 
 	/* ED2: Pad the encrypted data to a boundary of 16 bytes. If the data
 	 * already has a size that is a multiple of 16, note that it is not
@@ -132,21 +593,16 @@ void *encrypt_chunk_of_file(void *arg) {
 	 * the last few (stranded) bytes that don't form a 16 byte chunk and pad
 	 * them... */
 	if (num_stranded_bytes != 0) {
-		memcpy(text, &t->inbuf[i], num_stranded_bytes);
-
 		/* Pad the stranded bytes with redundant chars all representing the
 		 * number of padding bytes needed to make the current chunk 16 bytes
-		 * long */
+		 * long. '*inbuf' has room for the padding */
 		char padnum = 16 - num_stranded_bytes;
 		for (int j = num_stranded_bytes; j < 16; j++) {
-			text[j] = padnum;
+			t->inbuf[i + j] = padnum;
 		}
-		/* Extend the length of outbuf into the safety bytes of the buffer */
-		t->outbuf_len += padnum;
+		t->out_len += padnum;
 
-		to_column_order(text);
-		encrypt(text, t->aes_vars->rkeys, t->aes_vars->sbox);
-		memcpy(&t->outbuf[i], text, 16);
+		aes_encrypt_blocks(&t->aes_vars->aes, &t->inbuf[i], &t->inbuf[i], 1);
 		t->padded = 1;
 	/* ED2b: If the last 16 byte chunk did not need padding, note that
 	 * it was not padded. */
@@ -165,13 +621,181 @@ void *encrypt_chunk_of_file(void *arg) {
 }
 
 
-int enc_file(char *input_fp, char *output_fp, uint32_t key[4]) {
-	long max_bytes_per_batch = ENC_THREAD_MAX_MEM * ENC_MAX_THREADS;
-    FILE *out_stream;
+/** Thread entry point for encrypting a chunk: runs 'encrypt_chunk()' once the
+ * server's CPU gate lets the chunk through */
+void *encrypt_chunk_of_file(void *arg) {
+	cpu_gate_enter();
+	encrypt_chunk(arg);
+	cpu_gate_leave();
+	return NULL;
+}
+
+
+/** Returns the length of the buffer a chunk of 'len' bytes is encrypted in:
+ * the data is encrypted in place, so the buffer only needs room beyond the
+ * data for a tag in the AEAD modes, or for padding the final block of the
+ * stream in ECB mode */
+static size_t enc_buf_len(struct enc_aes_vars *avars, size_t len, char final) {
+	if (ENC_MODE_IS_AEAD(avars->mode)) {
+		return len + ENC_TAG_LEN;
+	}
+	if (final && avars->mode == ENC_MODE_ECB && len % 16 != 0) {
+		return len + 16 - len % 16;
+	}
+	return len;
+}
+
+
+/** Frees the buffers and closes the readers of the first 'num_threads' chunks
+ * of a batch, skipping those the batch did not get as far as setting up */
+static void free_batch(struct enc_thread_args *args, int num_threads) {
+	for (int t = 0; t < num_threads; t++) {
+		free(args[t].inbuf);
+		if (args[t].input_reader != NULL) {
+			fclose(args[t].input_reader);
+		}
+	}
+}
+
+
+/** Takes a batch of chunks of the file at 'input_fp', whose thread arguments
+ * have their read length, offset and 'final' set, encrypts each chunk on its
+ * own thread, and appends the results to the output stream.
+ *
+ * \param '*input_fp' the path to the input file.
+ * \param '*out_stream' the output file.
+ * \param '*args' the thread arguments of the chunks.
+ * \param 'num_threads' the number of chunks in the batch.
+ * \param '*avars' the AES vars of the transfer.
+ * \return 0 upon success, and a negative int upon failure.
+ */
+static int encrypt_batch(char *input_fp, FILE *out_stream, \
+	struct enc_thread_args *args, int num_threads, struct enc_aes_vars *avars) {
+	/* {{{ */
+
+	/* Once a chunk fails the batch goes no further, but every thread it
+	 * started is joined, and every buffer and reader it set up is freed,
+	 * before it returns */
+	int ret = 0;
+	for (int t = 0; t < num_threads; t++) {
+		args[t].input_reader = NULL;
+		args[t].inbuf = NULL;
+	}
+
+	/* STA: Set Thread Arguments */
+
+	/* STA1: Open up the input file with 'num_threads' readers, each at their
+	* starting location for the reading they have to do */
+	for (int thread_index = 0; thread_index < num_threads; thread_index++) {
+		args[thread_index].input_reader = fopen(input_fp, "rb");
+		if (args[thread_index].input_reader == NULL) {
+			perror("fopen (enc_file)");
+			ret = -1;
+			break;
+		}
+		/* STA2: Position the cursor of each reader such that it will
+		 * read at the part of the file it is responsible for reading,
+		 * which is where its data is in the stream */
+		fseek(args[thread_index].input_reader, args[thread_index].offset, SEEK_SET);
+		/* STA3: Set the thread's AES vars */
+		args[thread_index].aes_vars = avars;
+
+		/* STA4: Allocate memory for reading the chunk from the file */
+		size_t buf_len = enc_buf_len(avars, args[thread_index].ir_readlen, \
+			args[thread_index].final);
+		args[thread_index].inbuf = malloc(buf_len);
+		if (args[thread_index].inbuf == NULL) {
+			fprintf(stderr, "ERROR: could not allocate input buffer "\
+				"(asked for %ld bytes)\n", buf_len);
+			ret = -1;
+			break;
+		}
+	}
+
+	/* RT: Run Threads */
+	pthread_t thread_id[num_threads];
+	int created;
+	/* RT1: Create threads with their given tasks/arguments */
+	for (created = 0; ret == 0 && created < num_threads - 1; created++) {
+		if (0 != pthread_create(&thread_id[created], NULL, encrypt_chunk_of_file, \
+			&args[created])) {
+
+			fprintf(stderr, "ERROR: Could not create threads\n");
+			ret = -1;
+			break;
+		}
+	}
+	/* RT2: Have this "thread" encrypt as well since otherwise it would be
+	 * waiting idly */
+	if (ret == 0) {
+		encrypt_chunk_of_file(&args[num_threads - 1]);
+		if (args[num_threads - 1].return_val != 0) {
+			fprintf(stderr, "ERROR: thread failed to encrypt assigned chunk\n");
+			ret = -1;
+		}
+	}
+
+	/* RT3: Wait for all the threads to finish their encryption */
+	for (int t = 0; t < created; t++) {
+		pthread_join(thread_id[t], NULL);
+		if (args[t].return_val != 0) {
+			fprintf(stderr, "ERROR: thread failed to encrypt assigned chunk\n");
+			ret = -1;
+		}
+	}
+
+	/* MUTW: Make use of the Threads' Work */
+	for (int t = 0; ret == 0 && t < num_threads; t++) {
+		/* MUTW1: Write the encrypted data in 'inbuf' to the output file */
+		if (args[t].out_len != 0 && 1 != \
+			/* Write the encrypted data to the output file */
+			fwrite(args[t].inbuf, args[t].out_len, 1, out_stream)) {
+
+			fprintf(stderr, "ERROR: Could not write data content output file\n");
+			ret = -1;
+			break;
+		}
+		/* MUTW2: If this is the thread working on the data right at the
+		 * end of the input file, handle padding */
+		if (args[t].final) {
+			/* If the final chunk is not already internally padded, add a
+			 * padding chunk. Only ECB mode streams are padded */
+			if (avars->mode == ENC_MODE_ECB && args[t].padded != 1) {
+				uint8_t text[16];
+
+				for (int j = 0; j < 16; j++) {
+					text[j] = 16;
+				}
+
+				aes_encrypt_blocks(&avars->aes, text, text, 1);
+
+				if (1 != \
+					/* Write the padding chunk */
+					fwrite(&text[0], 16, 1, out_stream)) {
+
+					fprintf(stderr, "ERROR: Could not write data content output file\n");
+					ret = -1;
+					break;
+				}
+			}
+		}
+	}
+
+	free_batch(args, num_threads);
+
+	return ret;
+	/* }}} */
+}
+
+
+int enc_file(char *input_fp, char *output_fp, struct enc_params *params) {
+	FILE *out_stream;
 
 	struct stat s;
-	unsigned int num_batches = 1;
 	stat(input_fp, &s);
+	/* The file is cut into chunks of 'ENC_THREAD_MAX_MEM' bytes, followed by
+	 * a last chunk of whatever is left over (possibly nothing) */
+	uint64_t num_chunks = s.st_size / ENC_THREAD_MAX_MEM + 1;
 
 #if DEBUG_LEVEL >= 1
 	/* Print warning if the file will require more than one thread */
@@ -183,202 +807,61 @@ int enc_file(char *input_fp, char *output_fp, uint32_t key[4]) {
 	}
 #endif
 
-	/* If the size of the file is too large for all its data to be loaded into
-	 * memory and encrypted in one batch of threads */
-	if (s.st_size > max_bytes_per_batch) {
-#if DEBUG_LEVEL >= 1
-	/* Print warning if the file will require more than one batch of threads */
-	fprintf(stderr, "(%d) WARNING: encryption: File size is bigger than " \
-		"the memory limit for one threaded encryption batch " \
-		"(%ld > %ld bytes). The file will be encrypted over multiple " \
-		"multithreaded batches.\n", \
-		getpid(), s.st_size, max_bytes_per_batch);
-#endif
-		/* "Ceiled" division so that the number of jobs is always sufficient
-		 * to encrypt the whole file */
-		num_batches = (s.st_size / max_bytes_per_batch) + 1;
-	}
-
 	if ((out_stream = fopen(output_fp, "wb")) == NULL) {
 		return -1;
 	}
 
 	/* Fill in the enc_aes_vars struct which will be used for all threads */
 	struct enc_aes_vars avars;
-	initialize_aes_sbox(avars.sbox, avars.sboxinv);
-	expkey(avars.rkeys, key, avars.sbox);
-
-	char num_threads = ENC_MAX_THREADS;
-	struct enc_thread_args args[num_threads];
-	uint64_t batch_len;
-
-	/* Go through the input file in batches, breaking into threads for each
-	 * batch, each thread encrypting an assigned part of the file before
-	 * pthread_join'ing back to the main thread, which will then loop through
-	 * the encryped data, writing it (or the raw data if it takes up less
-	 * space) to the output file. This all takes place in 3 broad stages:
-	 * STA: Set Thread Arguments
-	 * RT: Run Threads
-	 * MUTW: Make use of the Threads' Work */
-	for (unsigned int batch_index = 0; batch_index < num_batches; batch_index++) {
-		/* If this is not the last batch, read a batch of maximum length with
-		 * the maximum number of threads */
-		if (batch_index != num_batches - 1) {
-			batch_len = max_bytes_per_batch;
-			num_threads = ENC_MAX_THREADS;
-		} else {
-			/* Set the number of threads to how many 'ENC_THREAD_MAX_MEM' byte
-			 * chunks of the file are left */
-			batch_len = s.st_size - (batch_index * max_bytes_per_batch);
-			num_threads = (batch_len / ENC_THREAD_MAX_MEM) + 1;
-		}
-
-#if DEBUG_LEVEL >= 1
-	fprintf(stderr, "(%d) STATUS: encryption: batch (%d/%d) has %d threads\n", \
-		getpid(), batch_index + 1, num_batches, num_threads);
-#endif
-
-		/* STA: Set Thread Arguments */
+	if (0 != init_aes_vars(&avars, params)) {
+		fclose(out_stream);
+		return -1;
+	}
 
-		/* STA1: Open up the input file with 'num_batches' readers, each at their
-		* starting location for the reading they have to do */
-		for (int thread_index = 0; thread_index < num_threads; thread_index++) {
-			args[thread_index].input_reader = fopen(input_fp, "rb");
-			if (args[thread_index].input_reader == NULL) {
-				perror("fopen (enc_file)");
-				return -1;
-			}
-			/* STA2: Position the cursor of each reader such that it will
-			 * read at the part of the file it is responsible for reading */
-			fseek(args[thread_index].input_reader, \
-				(batch_index * max_bytes_per_batch) \
-				+ (thread_index * ENC_THREAD_MAX_MEM), \
-				SEEK_SET);
-			/* STA3: Set the thread's AES vars */
-			args[thread_index].aes_vars = &avars;
-
-			/* STA4: Set the number of bytes (the read length) each input
-			 * reader must read ('ir_readlen'), allocate memory for reading
-			 * from the file, set the number of bytes in the out buffer
-			 * ('outbuf_len'), and allocate memory for the out buffer */
-			/* If this is the last thread in the last batch, do not blindly
-			 * read the maximum amount, but only what is left to read */
-			if (batch_index == num_batches - 1 && thread_index == num_threads - 1) {
-				args[thread_index].ir_readlen = \
-					s.st_size \
-					- (batch_index * max_bytes_per_batch) \
-					- (thread_index * ENC_THREAD_MAX_MEM); // If this is the last thread, read only the remaining bytes of the file
-				args[thread_index].inbuf = malloc(args[thread_index].ir_readlen);
-				if (args[thread_index].inbuf == NULL) {
-					fprintf(stderr, "ERROR: could not allocate input buffer "\
-						"(asked for %ld bytes)\n", args[thread_index].ir_readlen);
-					return -1;
-				}
-				/* Make sure outbuf length is rounded up to a multiple of 16
-				 * to ensure that there is room for internal padding */
-				int num_stranded_bytes = args[thread_index].ir_readlen % 16;
-				long alloc_len = 0;
-				args[thread_index].outbuf_len = args[thread_index].ir_readlen;
-
-				/* Allocate for 'outbuf' either 'ir_readlen' bytes
-				 * (if 'num_stranded_bytes' == 0) or 'ir_readlen + (16 -
-				 * num_stranded_bytes)' bytes (if 'num_stranded_bytes' != 0) */
-				alloc_len = args[thread_index].ir_readlen \
-					+ ((num_stranded_bytes != 0) * (16 - num_stranded_bytes));
-				args[thread_index].outbuf = malloc(alloc_len);
-				if (args[thread_index].outbuf == NULL) {
-					fprintf(stderr, "ERROR: could not allocate output buffer "\
-						"(asked for %ld bytes)\n", alloc_len);
-					return -1;
-				}
-			} else {
-				args[thread_index].ir_readlen = ENC_THREAD_MAX_MEM;
-				args[thread_index].inbuf = malloc(ENC_THREAD_MAX_MEM);
-				if (args[thread_index].inbuf == NULL) {
-					fprintf(stderr, "ERROR: could not allocate input buffer "\
-						"(asked for %d bytes)\n", ENC_THREAD_MAX_MEM);
-					return -1;
-				}
-				size_t max_outbuf_len = ENC_THREAD_MAX_MEM;
-				args[thread_index].outbuf_len = max_outbuf_len;
-				args[thread_index].outbuf = malloc(max_outbuf_len);
-				if (args[thread_index].outbuf == NULL) {
-					fprintf(stderr, "ERROR: could not allocate output buffer "\
-						"(asked for %ld bytes)\n", max_outbuf_len);
-					return -1;
-				}
+	struct enc_thread_args args[ENC_MAX_THREADS];
+	int num_threads;
+
+	/* Go through the input file in batches of up to 'ENC_MAX_THREADS'
+	 * chunks, breaking into a thread for each chunk of the batch, each thread
+	 * encrypting its chunk before pthread_join'ing back to the main thread,
+	 * which then writes the encrypted data to the output file. As in
+	 * 'comp_file()', the batch's buffers are reserved from the server's
+	 * memory budget first, which may make the batch narrower */
+	for (uint64_t chunk = 0; chunk < num_chunks; chunk += num_threads) {
+		size_t batch_mem = 0;
+
+		for (num_threads = 0; num_threads < ENC_MAX_THREADS \
+			&& chunk + num_threads < num_chunks; num_threads++) {
+
+			struct enc_thread_args *a = &args[num_threads];
+			/* The position in the stream of the data the thread is
+			 * responsible for, which is also where it is in the file */
+			a->offset = (chunk + num_threads) * ENC_THREAD_MAX_MEM;
+			a->final = (chunk + num_threads == num_chunks - 1);
+			a->ir_readlen = a->final ? s.st_size - a->offset : ENC_THREAD_MAX_MEM;
+
+			size_t mem = enc_buf_len(&avars, a->ir_readlen, a->final);
+			if (num_threads == 0) {
+				mem_budget_reserve(mem);
+			} else if (0 != mem_budget_try_reserve(mem)) {
+				break;
 			}
+			batch_mem += mem;
 		}
 
-		/* RT: Run Threads */
-		pthread_t thread_id[num_threads];
-		/* RT1: Create threads with their given tasks/arguments */
-		for (int t = 0; t < num_threads - 1; t++) {
-			if (0 != \
-				pthread_create(&thread_id[t], NULL, encrypt_chunk_of_file, &args[t])) {
+#if DEBUG_LEVEL >= 1
+	fprintf(stderr, "(%d) STATUS: encryption: batch at chunk %lu of %lu has " \
+		"%d threads\n", getpid(), chunk + 1, num_chunks, num_threads);
+#endif
 
-				fprintf(stderr, "ERROR: Could not create threads\n");
-				return -1;
-			}
-		}
-		/* RT2: Have this "thread" encrypt as well since otherwise it would be
-		 * waiting idly */
-		encrypt_chunk_of_file(&args[num_threads - 1]);
-		if (args[num_threads - 1].return_val != 0) {
-			fprintf(stderr, "ERROR: thread failed to encrypt assigned chunk\n");
+		/* The batch has joined its threads and freed its buffers by the time
+		 * it returns, so only then is their memory handed back */
+		int ret = encrypt_batch(input_fp, out_stream, args, num_threads, &avars);
+		mem_budget_release(batch_mem);
+		if (ret != 0) {
+			fclose(out_stream);
 			return -1;
 		}
-
-		/* RT3: Wait for all the threads to finish their encryption */
-		for (int t = 0; t < num_threads - 1; t++) {
-			pthread_join(thread_id[t], NULL);
-			if (args[t].return_val != 0) {
-				fprintf(stderr, "ERROR: thread failed to encrypt assigned chunk\n");
-				return -1;
-			}
-		}
-
-		/* MUTW: Make use of the Threads' Work */
-		for (int t = 0; t < num_threads; t++) {
-			/* MUTW1: Write the encrypted data in 'outbuf' to the output file */
-			if (1 != \
-				/* Write the outbuf to the output file */
-				fwrite(args[t].outbuf, args[t].outbuf_len, 1, out_stream)) {
-
-				fprintf(stderr, "ERROR: Could not write data content output file\n");
-				return -1;
-			}
-			/* MUTW2: If this is the thread working on the data right at the
-			 * end of the input file, handle padding */
-			if (batch_index == num_batches - 1 && t == num_threads - 1) {
-				/* If the final chunk is not already internally padded, add a
-				 * padding chunk */
-				if (args[t].padded != 1) {
-					uint8_t text[16];
-
-					for (int j = 0; j < 16; j++) {
-						text[j] = 16;
-					}
-
-					encrypt(text, args[t].aes_vars->rkeys, args[t].aes_vars->sbox);
-
-					if (1 != \
-						/* Write the padding chunk */
-						fwrite(&text[0], 16, 1, out_stream)) {
-
-						fprintf(stderr, "ERROR: Could not write data content output file\n");
-						return -1;
-					}
-				}
-			}
-
-			/* Free dynamically alloc'd buffers */
-			free(args[t].inbuf);
-			free(args[t].outbuf);
-			/* Close open file streams */
-			fclose(args[t].input_reader);
-		}
-	
 	}
 
 	fclose(out_stream);
@@ -393,7 +876,7 @@ int enc_file(char *input_fp, char *output_fp, uint32_t key[4]) {
 }
 
 
-void *decrypt_chunk_of_file(void *arg) {
+static void *decrypt_chunk(void *arg) {
 	/* {{{ */
 #if DEBUG_LEVEL >= 2
 	fprintf(stderr, "(%d) STATUS: decryption: thread %ld starting...\n", \
@@ -409,23 +892,55 @@ void *decrypt_chunk_of_file(void *arg) {
 		return NULL;
 	}
 
-	/* 2. DD: Decrypt the Data. Decrypt the data in 't->inbuf' and put in
-	 * 't->outbuf' */
-	int num_stranded_bytes = t->ir_readlen % 16;
-    uint8_t text[16];
-	/* DD1: Loop through the read bytes in 16 byte chunks, decrypting each chunk and
-	 * storing the results to a write buffer */
-	for (int i = 0; (size_t) i < t->ir_readlen - num_stranded_bytes; i += 16) {
-		memcpy(text, &t->inbuf[i], 16);
-		decrypt(text, t->aes_vars->rkeys, t->aes_vars->sboxinv);
-		to_row_order(text);
-		memcpy(&t->outbuf[i], text, 16);
-		/* DD2: Trim decrypted data if the data is padded and we are on
-		 * the last chunk */
-		if (t->padded == 1 && (size_t) i == t->ir_readlen - 16) {
-			unsigned char num_pad_bytes = t->outbuf[t->ir_readlen - 1];
-			t->outbuf_len = t->ir_readlen - num_pad_bytes;
+	/* 2. If the transfer uses a stream cipher mode, decrypting is the same
+	 * XOR as encrypting, and happens in place */
+	if (ENC_MODE_IS_STREAM(t->aes_vars->mode)) {
+		enc_stream_xor(&t->inbuf[0], t->ir_readlen, t->offset, t->aes_vars);
+		t->out_len = t->ir_readlen;
+		t->return_val = 0;
+		return NULL;
+	}
+
+	/* 2b. If the transfer uses an AEAD mode, the chunk ends with its tag.
+	 * Decrypt the rest in place and check the tag before accepting it */
+	if (ENC_MODE_IS_AEAD(t->aes_vars->mode)) {
+		uint8_t tag[ENC_TAG_LEN];
+		uint8_t diff = 0;
+
+		if (t->ir_readlen < ENC_TAG_LEN) {
+			fprintf(stderr, "ERROR: decryption: chunk is too short to hold a tag\n");
+			t->return_val = -1;
+			return NULL;
+		}
+		t->out_len = t->ir_readlen - ENC_TAG_LEN;
+		enc_aead_chunk(&t->inbuf[0], t->out_len, \
+			t->offset / ENC_THREAD_MAX_MEM, t->final, 0, t->aes_vars, tag);
+
+		/* Compare the tags without exiting early */
+		for (int j = 0; j < ENC_TAG_LEN; j++) {
+			diff |= tag[j] ^ t->inbuf[t->out_len + j];
+		}
+		if (diff != 0) {
+			fprintf(stderr, "ERROR: decryption: chunk failed authentication\n");
+			t->return_val = -1;
+			return NULL;
 		}
+		t->return_val = 0;
+		return NULL;
+	}
+
+	/* 3. DD: Decrypt the Data. Decrypt the data in 't->inbuf' in place */
+	int num_stranded_bytes = t->ir_readlen % 16;
+	t->out_len = t->ir_readlen - num_stranded_bytes;
+	/* DD1: Decrypt all the whole 16 byte chunks of the read bytes where they
+	 * are */
+	aes_decrypt_blocks(&t->aes_vars->aes, &t->inbuf[0], &t->inbuf[0], \
+		t->out_len / AES_BLOCK_LEN);
+	/* DD2: Trim decrypted data if the data is padded and we are on
+	 * the last chunk */
+	if (t->padded == 1 && t->out_len >= 16) {
+		unsigned char num_pad_bytes = t->inbuf[t->out_len - 1];
+		t->out_len -= num_pad_bytes;
 	}
 
 #if DEBUG_LEVEL >= 2
@@ -439,14 +954,137 @@ void *decrypt_chunk_of_file(void *arg) {
 }
 
 
-int dec_file(char *input_fp, char *output_fp, uint32_t key[4]) {
-	long max_bytes_per_batch = ENC_THREAD_MAX_MEM * ENC_MAX_THREADS;
+/** Thread entry point for decrypting a chunk: runs 'decrypt_chunk()' once the
+ * server's CPU gate lets the chunk through */
+void *decrypt_chunk_of_file(void *arg) {
+	cpu_gate_enter();
+	decrypt_chunk(arg);
+	cpu_gate_leave();
+	return NULL;
+}
+
+
+/** Takes a batch of chunks of the file at 'input_fp', whose thread arguments
+ * have their read length, offset, 'final' and 'padded' set, decrypts each
+ * chunk on its own thread, and appends the results to the output stream.
+ *
+ * \param '*input_fp' the path to the input file.
+ * \param '*out_stream' the output file.
+ * \param '*args' the thread arguments of the chunks.
+ * \param 'num_threads' the number of chunks in the batch.
+ * \param '*avars' the AES vars of the transfer.
+ * \param 'chunk_len' the number of bytes each full chunk takes up in the
+ *     input file.
+ * \return 0 upon success, and a negative int upon failure.
+ */
+static int decrypt_batch(char *input_fp, FILE *out_stream, \
+	struct enc_thread_args *args, int num_threads, struct enc_aes_vars *avars, \
+	long chunk_len) {
+	/* {{{ */
+
+	/* Once a chunk fails the batch goes no further, but every thread it
+	 * started is joined, and every buffer and reader it set up is freed,
+	 * before it returns */
+	int ret = 0;
+	for (int t = 0; t < num_threads; t++) {
+		args[t].input_reader = NULL;
+		args[t].inbuf = NULL;
+	}
+
+	/* STA: Set Thread Arguments */
+
+	/* STA1: Open up the input file with 'num_threads' readers, each at their
+	* starting location for the reading they have to do */
+	for (int thread_index = 0; thread_index < num_threads; thread_index++) {
+		args[thread_index].input_reader = fopen(input_fp, "rb");
+		if (args[thread_index].input_reader == NULL) {
+			perror("fopen (dec_file)");
+			ret = -1;
+			break;
+		}
+		/* STA2: Position the cursor of each reader such that it will
+		 * read at the part of the file it is responsible for reading */
+		fseek(args[thread_index].input_reader, \
+			args[thread_index].offset / ENC_THREAD_MAX_MEM * chunk_len, SEEK_SET);
+		/* STA3: Set the thread's AES vars */
+		args[thread_index].aes_vars = avars;
+
+		/* STA4: Allocate memory for reading the chunk from the file. The
+		 * data is decrypted in place, so the buffer is exactly as long as
+		 * the read length */
+		args[thread_index].inbuf = malloc(args[thread_index].ir_readlen);
+		if (args[thread_index].inbuf == NULL) {
+			fprintf(stderr, "ERROR: could not allocate input buffer "\
+				"(asked for %ld bytes)\n", args[thread_index].ir_readlen);
+			ret = -1;
+			break;
+		}
+	}
+
+	/* RT: Run Threads */
+	pthread_t thread_id[num_threads];
+	int created;
+	/* RT1: Create threads with their given tasks/arguments */
+	for (created = 0; ret == 0 && created < num_threads - 1; created++) {
+		if (0 != pthread_create(&thread_id[created], NULL, decrypt_chunk_of_file, \
+			&args[created])) {
+
+			fprintf(stderr, "ERROR: Could not create threads\n");
+			ret = -1;
+			break;
+		}
+	}
+	/* RT2: Have this "thread" decrypt as well since otherwise it would be
+	 * waiting idly */
+	if (ret == 0) {
+		decrypt_chunk_of_file(&args[num_threads - 1]);
+		if (args[num_threads - 1].return_val != 0) {
+			fprintf(stderr, "ERROR: thread failed to decrypt assigned chunk\n");
+			ret = -1;
+		}
+	}
+
+	/* RT3: Wait for all the threads to finish their decryption */
+	for (int t = 0; t < created; t++) {
+		pthread_join(thread_id[t], NULL);
+		if (args[t].return_val != 0) {
+			fprintf(stderr, "ERROR: thread failed to decrypt assigned chunk\n");
+			ret = -1;
+		}
+	}
+
+	/* MUTW: Make use of the Threads' Work */
+	for (int t = 0; ret == 0 && t < num_threads; t++) {
+		/* MUTW1: Write the decrypted data in 'inbuf' to the output file */
+		if (args[t].out_len != 0 && 1 != \
+			/* Write the decrypted data to the output file */
+			fwrite(args[t].inbuf, args[t].out_len, 1, out_stream)) {
+
+			fprintf(stderr, "ERROR: Could not write data content output file\n");
+			ret = -1;
+			break;
+		}
+	}
+
+	free_batch(args, num_threads);
+
+	return ret;
+	/* }}} */
+}
+
+
+int dec_file(char *input_fp, char *output_fp, struct enc_params *params) {
+	/* The number of bytes of the input each thread reads. In the AEAD modes
+	 * each chunk of ENC_THREAD_MAX_MEM bytes is followed by its tag */
+	long chunk_len = ENC_THREAD_MAX_MEM \
+		+ (ENC_MODE_IS_AEAD(params->mode) ? ENC_TAG_LEN : 0);
 	FILE *out_stream;
 
 	struct stat s;
-	unsigned int num_batches = 1;
 	stat(input_fp, &s);
-
+	/* As in 'enc_file()', the last chunk holds whatever is left over after
+	 * the full ones (possibly nothing) */
+	uint64_t num_chunks = s.st_size / chunk_len + 1;
 
 #if DEBUG_LEVEL >= 1
 	/* Print warning if the file will require more than one thread */
@@ -458,181 +1096,201 @@ int dec_file(char *input_fp, char *output_fp, uint32_t key[4]) {
 	}
 #endif
 
-	/* If the size of the file is too large for all its data to be loaded into
-	 * memory and decrypted in one batch of threads */
-	if (s.st_size > max_bytes_per_batch) {
-#if DEBUG_LEVEL >= 1
-	/* Print warning if the file will require more than one batch of threads */
-	fprintf(stderr, "(%d) WARNING: decryption: File size is bigger than " \
-		"the memory limit for one threaded decryption batch " \
-		"(%ld > %ld bytes). The file will be decrypted over multiple " \
-		"multithreaded batches.\n", \
-		getpid(), s.st_size, max_bytes_per_batch);
-#endif
-		/* "Ceiled" division so that the number of jobs is always sufficient
-		 * to decrypt the whole file */
-		num_batches = (s.st_size / max_bytes_per_batch) + 1;
-	}
-
 	if ((out_stream = fopen(output_fp, "wb")) == NULL) {
 		return -1;
 	}
 
 	/* Fill in the enc_aes_vars struct which will be used for all threads */
 	struct enc_aes_vars avars;
-	initialize_aes_sbox(avars.sbox, avars.sboxinv);
-	expkey(avars.rkeys, key, avars.sbox);
-
-	char num_threads = ENC_MAX_THREADS;
-	struct enc_thread_args args[num_threads];
-	uint64_t batch_len;
-
-	/* Read ENC_THREAD_MAX_MEM bytes from the file, decrypting in 16 byte chunks */
-	/* Go through the input file in batches, breaking into threads for each
-	 * batch, each thread decrypting an assigned part of the file before
-	 * pthread_join'ing back to the main thread, which will then loop through
-	 * the encryped data, writing it (or the raw data if it takes up less
-	 * space) to the output file. This all takes place in 3 broad stages:
-	 * STA: Set Thread Arguments
-	 * RT: Run Threads
-	 * MUTW: Make use of the Threads' Work */
-	for (unsigned int batch_index = 0; batch_index < num_batches; batch_index++) {
-		/* If this is not the last batch, read a batch of maximum length with
-		 * the maximum number of threads */
-		if (batch_index != num_batches - 1) {
-			batch_len = max_bytes_per_batch;
-			num_threads = ENC_MAX_THREADS;
-		} else {
-			/* Set the number of threads to how many 'ENC_THREAD_MAX_MEM' byte
-			 * chunks of the file are left */
-			batch_len = s.st_size - (batch_index * max_bytes_per_batch);
-			num_threads = (batch_len / ENC_THREAD_MAX_MEM) + 1;
+	if (0 != init_aes_vars(&avars, params)) {
+		fclose(out_stream);
+		return -1;
+	}
+
+	struct enc_thread_args args[ENC_MAX_THREADS];
+	int num_threads;
+
+	/* Go through the input file in batches of up to 'ENC_MAX_THREADS'
+	 * chunks, breaking into a thread for each chunk of the batch, each thread
+	 * decrypting its chunk before pthread_join'ing back to the main thread,
+	 * which then writes the decrypted data to the output file. As in
+	 * 'enc_file()', the batch's buffers are reserved from the server's
+	 * memory budget first, which may make the batch narrower */
+	for (uint64_t chunk = 0; chunk < num_chunks; chunk += num_threads) {
+		size_t batch_mem = 0;
+
+		for (num_threads = 0; num_threads < ENC_MAX_THREADS \
+			&& chunk + num_threads < num_chunks; num_threads++) {
+
+			struct enc_thread_args *a = &args[num_threads];
+			/* The position in the (decrypted) stream of the data the thread
+			 * is responsible for */
+			a->offset = (chunk + num_threads) * ENC_THREAD_MAX_MEM;
+			a->final = (chunk + num_threads == num_chunks - 1);
+			a->ir_readlen = a->final \
+				? s.st_size - (chunk + num_threads) * chunk_len : chunk_len;
+			/* Only the last chunk of the stream has padding to remove */
+			a->padded = a->final;
+
+			if (num_threads == 0) {
+				mem_budget_reserve(a->ir_readlen);
+			} else if (0 != mem_budget_try_reserve(a->ir_readlen)) {
+				break;
+			}
+			batch_mem += a->ir_readlen;
 		}
 
 #if DEBUG_LEVEL >= 1
-	fprintf(stderr, "(%d) STATUS: decryption: batch (%d/%d) has %d threads\n", \
-		getpid(), batch_index + 1, num_batches, num_threads);
+	fprintf(stderr, "(%d) STATUS: decryption: batch at chunk %lu of %lu has " \
+		"%d threads\n", getpid(), chunk + 1, num_chunks, num_threads);
 #endif
 
-		/* STA: Set Thread Arguments */
-
-		/* STA1: Open up the input file with 'num_batches' readers, each at their
-		* starting location for the reading they have to do */
-		for (int thread_index = 0; thread_index < num_threads; thread_index++) {
-			args[thread_index].input_reader = fopen(input_fp, "rb");
-			if (args[thread_index].input_reader == NULL) {
-				perror("fopen (dec_file)");
-				return -1;
-			}
-			/* STA2: Position the cursor of each reader such that it will
-			 * read at the part of the file it is responsible for reading */
-			fseek(args[thread_index].input_reader, \
-				(batch_index * max_bytes_per_batch) \
-				+ (thread_index * ENC_THREAD_MAX_MEM), \
-				SEEK_SET);
-			/* STA3: Set the thread's AES vars */
-			args[thread_index].aes_vars = &avars;
-
-			/* STA4: Set the number of bytes (the read length) each input
-			 * reader must read ('ir_readlen'), allocate memory for reading
-			 * from the file, set the number of bytes in the out buffer
-			 * ('outbuf_len'), and allocate memory for the out buffer */
-			/* If this is the last thread in the last batch, do not blindly
-			 * read the maximum amount, but only what is left to read */
-			if (batch_index == num_batches - 1 && thread_index == num_threads - 1) {
-				args[thread_index].ir_readlen = \
-					s.st_size \
-					- (batch_index * max_bytes_per_batch) \
-					- (thread_index * ENC_THREAD_MAX_MEM); // If this is the last thread, read only the remaining bytes of the file
-				args[thread_index].inbuf = malloc(args[thread_index].ir_readlen);
-				if (args[thread_index].inbuf == NULL) {
-					fprintf(stderr, "ERROR: could not allocate input buffer "\
-						"(asked for %ld bytes)\n", args[thread_index].ir_readlen);
-					return -1;
-				}
-				/* Outbuf will be >= inbuf length when decrypting, so
-				 * simply allocate inbuf length for outbuf */
-				args[thread_index].outbuf_len = args[thread_index].ir_readlen;
-				args[thread_index].outbuf = malloc(args[thread_index].outbuf_len);
-				if (args[thread_index].outbuf == NULL) {
-					fprintf(stderr, "ERROR: could not allocate output buffer "\
-						"(asked for %ld bytes)\n", args[thread_index].outbuf_len);
-					return -1;
-				}
-				/* If this is the last thread of the last batch, we need
-				 * to remove the padding */
-				args[thread_index].padded = 1;
-			} else {
-				args[thread_index].ir_readlen = ENC_THREAD_MAX_MEM;
-				args[thread_index].inbuf = malloc(ENC_THREAD_MAX_MEM);
-				if (args[thread_index].inbuf == NULL) {
-					fprintf(stderr, "ERROR: could not allocate input buffer "\
-						"(asked for %d bytes)\n", ENC_THREAD_MAX_MEM);
-					return -1;
-				}
-				size_t max_outbuf_len = ENC_THREAD_MAX_MEM;
-				args[thread_index].outbuf_len = max_outbuf_len;
-				args[thread_index].outbuf = malloc(max_outbuf_len);
-				if (args[thread_index].outbuf == NULL) {
-					fprintf(stderr, "ERROR: could not allocate output buffer "\
-						"(asked for %ld bytes)\n", max_outbuf_len);
-					return -1;
-				}
-				/* Since this is NOT the last thread of the last batch, there
-				 * is no need to remove padding */
-				args[thread_index].padded = 0;
-			}
+		/* The batch has joined its threads and freed its buffers by the time
+		 * it returns, so only then is their memory handed back */
+		int ret = decrypt_batch(input_fp, out_stream, args, num_threads, &avars, \
+			chunk_len);
+		mem_budget_release(batch_mem);
+		if (ret != 0) {
+			fclose(out_stream);
+			return -1;
 		}
+	}
+
+	fclose(out_stream);
+
+	return 0;
+}
 
-		/* RT: Run Threads */
-		pthread_t thread_id[num_threads];
-		/* RT1: Create threads with their given tasks/arguments */
-		for (int t = 0; t < num_threads - 1; t++) {
-			if (0 != \
-				pthread_create(&thread_id[t], NULL, decrypt_chunk_of_file, &args[t])) {
 
-				fprintf(stderr, "ERROR: Could not create threads\n");
-				return -1;
-			}
+/** Takes a buffer holding a whole stream of at most 'ENC_THREAD_MAX_MEM'
+ * bytes and encrypts it in place, into the same bytes 'enc_file()' writes
+ * for a file of one chunk: the chunk followed by its tag in the AEAD modes,
+ * or padded to a whole number of blocks in ECB mode.
+ *
+ * \param '*buf' the data, which will be modified to contain the encrypted
+ *     stream. It must have room for 'ENC_TAG_LEN' more bytes.
+ * \param 'len' the number of bytes at '*buf'.
+ * \param '*params' the negotiated parameters of the transfer.
+ * \param '*out_len' will be modified to contain the length of the encrypted
+ *     stream.
+ * \return 0 upon success, and a negative int upon failure.
+ */
+int enc_buf(uint8_t *buf, size_t len, struct enc_params *params, size_t *out_len) {
+	/* {{{ */
+	struct enc_aes_vars avars;
+
+	if (len > ENC_THREAD_MAX_MEM || 0 != init_aes_vars(&avars, params)) {
+		return -1;
+	}
+
+	if (ENC_MODE_IS_STREAM(avars.mode)) {
+		enc_stream_xor(buf, len, 0, &avars);
+		*out_len = len;
+	} else if (ENC_MODE_IS_AEAD(avars.mode)) {
+		enc_aead_chunk(buf, len, 0, 1, 1, &avars, &buf[len]);
+		*out_len = len + ENC_TAG_LEN;
+	} else {
+		/* Every padding byte holds the number of padding bytes, of which
+		 * there is at least one */
+		uint8_t padnum = 16 - len % 16;
+		memset(&buf[len], padnum, padnum);
+		*out_len = len + padnum;
+		aes_encrypt_blocks(&avars.aes, buf, buf, *out_len / AES_BLOCK_LEN);
+	}
+
+	return 0;
+	/* }}} */
+}
+
+
+/** Takes a buffer holding a whole stream encrypted by 'enc_buf()' and
+ * decrypts it in place, checking its tag in the AEAD modes.
+ *
+ * \param '*buf' the encrypted stream, which will be modified to contain the
+ *     data.
+ * \param 'len' the number of bytes at '*buf'.
+ * \param '*params' the negotiated parameters of the transfer.
+ * \param '*out_len' will be modified to contain the length of the data.
+ * \return 0 upon success, and a negative int if the stream is malformed or
+ *     fails authentication.
+ */
+int dec_buf(uint8_t *buf, size_t len, struct enc_params *params, size_t *out_len) {
+	/* {{{ */
+	struct enc_aes_vars avars;
+
+	if (len > ENC_THREAD_MAX_MEM + ENC_TAG_LEN || 0 != init_aes_vars(&avars, params)) {
+		return -1;
+	}
+
+	if (ENC_MODE_IS_STREAM(avars.mode)) {
+		enc_stream_xor(buf, len, 0, &avars);
+		*out_len = len;
+	} else if (ENC_MODE_IS_AEAD(avars.mode)) {
+		uint8_t tag[ENC_TAG_LEN];
+		uint8_t diff = 0;
+
+		if (len < ENC_TAG_LEN) {
+			return -2;
 		}
-		/* RT2: Have this "thread" decrypt as well since otherwise it would be
-		 * waiting idly */
-		decrypt_chunk_of_file(&args[num_threads - 1]);
-		if (args[num_threads - 1].return_val != 0) {
-			fprintf(stderr, "ERROR: thread failed to decrypt assigned chunk\n");
-			return -1;
+		*out_len = len - ENC_TAG_LEN;
+		enc_aead_chunk(buf, *out_len, 0, 1, 0, &avars, tag);
+		/* Compare the tags without exiting early */
+		for (int j = 0; j < ENC_TAG_LEN; j++) {
+			diff |= tag[j] ^ buf[*out_len + j];
 		}
-
-		/* RT3: Wait for all the threads to finish their decryption */
-		for (int t = 0; t < num_threads - 1; t++) {
-			pthread_join(thread_id[t], NULL);
-			if (args[t].return_val != 0) {
-				fprintf(stderr, "ERROR: thread failed to decrypt assigned chunk\n");
-				return -1;
-			}
+		if (diff != 0) {
+			fprintf(stderr, "ERROR: decryption: chunk failed authentication\n");
+			return -3;
+		}
+	} else {
+		if (len == 0 || len % 16 != 0) {
+			return -4;
+		}
+		aes_decrypt_blocks(&avars.aes, buf, buf, len / AES_BLOCK_LEN);
+		if (buf[len - 1] < 1 || buf[len - 1] > 16) {
+			return -5;
 		}
+		*out_len = len - buf[len - 1];
+	}
 
-		/* MUTW: Make use of the Threads' Work */
-		for (int t = 0; t < num_threads; t++) {
-			/* MUTW1: Write the decrypted data in 'outbuf' to the output file */
-			if (1 != \
-				/* Write the outbuf to the output file */
-				fwrite(args[t].outbuf, args[t].outbuf_len, 1, out_stream)) {
+	return 0;
+	/* }}} */
+}
 
-				fprintf(stderr, "ERROR: Could not write data content output file\n");
-				return -1;
-			}
 
-			/* Free dynamically alloc'd buffers */
-			free(args[t].inbuf);
-			free(args[t].outbuf);
-			/* Close open file streams */
-			fclose(args[t].input_reader);
+/** Takes the 'index'th chunk of an encrypted stream, as 'enc_file()' wrote
+ * it, and decrypts it in place, checking its tag in the AEAD modes. The
+ * chunk must be a whole one and not the last of the stream, which is how the
+ * start of a stream that was only partly received is decrypted.
+ *
+ * \param '*buf' the chunk: 'ENC_THREAD_MAX_MEM' bytes, followed by its tag
+ *     in the AEAD modes. It will be modified to contain the data.
+ * \param 'index' the number of the chunk in the stream.
+ * \param '*avars' the AES vars of the transfer.
+ * \return 0 upon success, and a negative int if the chunk fails
+ *     authentication.
+ */
+int dec_chunk(uint8_t *buf, uint64_t index, struct enc_aes_vars *avars) {
+	/* {{{ */
+	if (ENC_MODE_IS_STREAM(avars->mode)) {
+		enc_stream_xor(buf, ENC_THREAD_MAX_MEM, index * ENC_THREAD_MAX_MEM, avars);
+	} else if (ENC_MODE_IS_AEAD(avars->mode)) {
+		uint8_t tag[ENC_TAG_LEN];
+		uint8_t diff = 0;
+
+		enc_aead_chunk(buf, ENC_THREAD_MAX_MEM, index, 0, 0, avars, tag);
+		/* Compare the tags without exiting early */
+		for (int j = 0; j < ENC_TAG_LEN; j++) {
+			diff |= tag[j] ^ buf[ENC_THREAD_MAX_MEM + j];
+		}
+		if (diff != 0) {
+			fprintf(stderr, "ERROR: decryption: chunk failed authentication\n");
+			return -1;
 		}
-	
+	} else {
+		aes_decrypt_blocks(&avars->aes, buf, buf, ENC_THREAD_MAX_MEM / AES_BLOCK_LEN);
 	}
 
-	fclose(out_stream);
-
 	return 0;
+	/* }}} */
 }
@@ -3,6 +3,10 @@
 #include <stdint.h>
 #include <stdio.h>
 
+#include "aes.h"
+#include "chacha.h"
+#include "gcm.h"
+
 #define ENC_EXT ".enc"
 
 /* How many bytes each thread involved in encryption/decryption is allowed to
@@ -12,14 +16,87 @@
 /* The maximum number of threads that can be created during
  * encryption/decryption. */
 #define ENC_MAX_THREADS 4
+/* The cipher modes that can be negotiated for a transfer. The values are
+ * single bits so that a set of supported modes can be sent as a mask */
+#define ENC_MODE_ECB 0x01
+#define ENC_MODE_CTR 0x02
+#define ENC_MODE_GCM 0x04
+#define ENC_MODE_CHACHA20 0x08
+#define ENC_MODE_CHACHA20_POLY1305 0x10
+/* The number of distinct cipher modes */
+#define ENC_NUM_MODES 5
+/* The modes this build is able to encrypt and decrypt with */
+#define ENC_MODES_SUPPORTED (ENC_MODE_ECB | ENC_MODE_CTR | ENC_MODE_GCM \
+	| ENC_MODE_CHACHA20 | ENC_MODE_CHACHA20_POLY1305)
+/* Whether a mode is a stream cipher without authentication */
+#define ENC_MODE_IS_STREAM(m) ((m) == ENC_MODE_CTR || (m) == ENC_MODE_CHACHA20)
+/* Whether a mode authenticates every chunk with a tag that follows it */
+#define ENC_MODE_IS_AEAD(m) ((m) == ENC_MODE_GCM \
+	|| (m) == ENC_MODE_CHACHA20_POLY1305)
+/* The number of bytes in the tag following each chunk in an AEAD mode */
+#define ENC_TAG_LEN 16
+/* How many bytes of an AEAD chunk are encrypted before they are
+ * authenticated. Small enough that the data is still in cache when it is
+ * authenticated, and a multiple of both the AES and ChaCha20 block lengths */
+#define ENC_GCM_SEGMENT 4096
+/* The number of 32-bit words of key material produced by the key exchange.
+ * The AES modes use the first 16, 24 or 32 bytes of it, depending on the
+ * negotiated key length, and the ChaCha20 modes use all of it */
+#define ENC_KEY_WORDS 8
+/* The AES key length (in bytes) used unless another one is asked for */
+#define ENC_KEY_LEN_DEFAULT 16
+/* How many AES blocks of CTR mode keystream are generated at a time */
+#define ENC_CTR_BATCH 64
+/* The number of bytes in the per-transfer nonce used by every mode but ECB.
+ * In CTR mode the counter block is the nonce followed by the 64-bit
+ * big-endian block index. In GCM mode every ENC_THREAD_MAX_MEM byte chunk is
+ * its own GCM message, whose IV is the nonce followed by the 32-bit chunk
+ * index, and is followed in the stream by its ENC_TAG_LEN byte tag. The
+ * ChaCha20 modes use the nonce as the ChaCha20 nonce and lay chunks out the
+ * same way as CTR and GCM mode respectively */
+#define ENC_NONCE_LEN 8
+
+
+/* Define a struct for the parameters of an encrypted transfer, agreed on by
+ * both ends before any data is sent */
+struct enc_params {
+	/* The cipher mode. Should only ever be one of the ENC_MODE_* values */
+	char mode;
+	/* The key produced by the key exchange */
+	uint32_t key[ENC_KEY_WORDS];
+	/* The AES key length in bytes (16, 24 or 32) */
+	uint8_t key_len;
+	/* The per-transfer nonce (not used by ECB mode) */
+	uint8_t nonce[ENC_NONCE_LEN];
+};
+
+
+/* Define a struct for the state of an encrypted session (i.e. a control
+ * connection). The session's secret is agreed on once, when the session
+ * starts, and the key of every transfer is derived from it and the number of
+ * the transfer within the session */
+struct enc_session {
+	/* The secret agreed on by the key exchange */
+	uint32_t secret[ENC_KEY_WORDS];
+	/* The number of the latest transfer of the session. Transfers are
+	 * numbered from 1 */
+	uint64_t transfer_counter;
+};
 
 
-/* Define a struct for passing AES variables to a encryption/decryption thread */
+/* Define a struct for passing cipher variables to a encryption/decryption
+ * thread */
 struct enc_aes_vars {
-	/* Necessary encryption vars */
-	uint8_t sbox[256];
-	uint8_t sboxinv[256];
-	uint8_t rkeys[11][16];
+	/* The expanded AES key (not used by the ChaCha20 modes) */
+	struct aes_key aes;
+	/* The cipher mode and nonce of the transfer */
+	char mode;
+	uint8_t nonce[ENC_NONCE_LEN];
+	/* The GHASH subkey (only used by GCM mode) */
+	struct ghash_key ghash;
+	/* The ChaCha20 input block, less the counter (only used by the ChaCha20
+	 * modes) */
+	uint32_t chacha[16];
 };
 
 
@@ -29,17 +106,21 @@ struct enc_thread_args {
 	/* An open file stream from which will do the reading. It should be
 	 * positioned correctly before being passed to the thread */
 	FILE *input_reader;
-	/* Stores the data read from the file */
+	/* Stores the data read from the file, which the thread then encrypts or
+	 * decrypts in place */
 	unsigned char * inbuf;
-	/* Stores the length in bytes to be read by a given reader, and must also
-	 * be equal to the length of the memory represented by '*inbuf' */
+	/* Stores the length in bytes to be read by a given reader. '*inbuf' may
+	 * be slightly longer, to leave room for a tag or padding */
 	size_t ir_readlen;
-	/* Stores the compressed data produced by the thread */
-	unsigned char * outbuf;
-	/* The number of bytes in the buffer for output (compressed) data */
-	size_t outbuf_len;
+	/* The offset in bytes of the data in '*inbuf' from the start of the
+	 * stream, which positions the CTR keystream */
+	uint64_t offset;
+	/* The number of bytes at the start of '*inbuf' produced by the thread */
+	size_t out_len;
 	/* Whether the encrypted data is padded or not */
 	char padded;
+	/* Whether this thread's chunk is the last one in the stream */
+	char final;
 	/* Necessary encryption vars */
 	struct enc_aes_vars *aes_vars;
 	/* For returning a success/error code */
@@ -51,10 +132,36 @@ char * temp_encryption_name(char * filename);
 
 void init_enc();
 
-uint64_t sq_mp(uint64_t, uint64_t, uint64_t);
+int enc_random_bytes(uint8_t *, size_t);
+
+int enc_set_key_len(int);
+
+int enc_get_key_len();
+
+int init_aes_vars(struct enc_aes_vars *, struct enc_params *);
+
+void enc_derive_transfer_key(struct enc_session *, uint64_t, uint32_t[ENC_KEY_WORDS]);
+
+void ctr_xor(uint8_t *, size_t, uint64_t, struct enc_aes_vars *);
+
+void gcm_crypt_chunk(uint8_t *, size_t, uint32_t, char, char, \
+	struct enc_aes_vars *, uint8_t[GCM_TAG_LEN]);
+
+void enc_stream_xor(uint8_t *, size_t, uint64_t, struct enc_aes_vars *);
+
+void enc_aead_chunk(uint8_t *, size_t, uint32_t, char, char, \
+	struct enc_aes_vars *, uint8_t[ENC_TAG_LEN]);
+
+int enc_mode_preference(uint8_t[ENC_NUM_MODES]);
+
+int enc_file(char *, char *, struct enc_params *);
+
+int dec_file(char *, char *, struct enc_params *);
+
+int enc_buf(uint8_t *, size_t, struct enc_params *, size_t *);
 
-int enc_file(char *, char *, uint32_t[4]);
+int dec_buf(uint8_t *, size_t, struct enc_params *, size_t *);
 
-int dec_file(char *, char *, uint32_t[4]);
+int dec_chunk(uint8_t *, uint64_t, struct enc_aes_vars *);
 
 #endif
@@ -1,4 +1,8 @@
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "fileops.h"
 
@@ -41,3 +45,87 @@ int read_bytes(void * ret, size_t num_bytes, FILE * f) {
 
 	return 0;
 }
+
+
+/** Takes a file descriptor 'fd' and attempts to read exactly 'num_bytes'
+ * bytes from it into '*ret', retrying on short reads (as can happen with
+ * sockets).
+ *
+ * \param 'fd' an open file descriptor from which the bytes will be read.
+ * \param '*ret' a pointer to at least 'num_bytes' bytes which will be
+ *     modified to contain the bytes read.
+ * \param 'num_bytes' the number of bytes that should be read.
+ * \return 0 on success, or a negative int upon failure (including the
+ *     descriptor reaching EOF early).
+ */
+int read_bytes_fd(int fd, void * ret, size_t num_bytes) {
+	size_t nread = 0;
+
+	while (nread < num_bytes) {
+		ssize_t r = read(fd, (char *) ret + nread, num_bytes - nread);
+		if (r <= 0) {
+			return -1;
+		}
+		nread += r;
+	}
+
+	return 0;
+}
+
+
+/** Makes a new, empty file in the current directory whose name is 'prefix'
+ * followed by a dash and six random characters, for use as a temporary file.
+ * The file is kept, so that no one else is handed the name.
+ *
+ * \param '*prefix' what the name of the file starts with.
+ * \return a malloc'd name of the file, which the caller must free, or NULL
+ *     upon failure.
+ */
+char * make_temp_file(const char * prefix) {
+	char * fp = malloc(strlen(prefix) + 7 + 1);
+	int fd;
+
+	if (fp == NULL) {
+		return NULL;
+	}
+	sprintf(fp, "%s-XXXXXX", prefix);
+	if ((fd = mkstemp(fp)) < 0) {
+		free(fp);
+		return NULL;
+	}
+	close(fd);
+
+	return fp;
+}
+
+
+/** Stores the low 'len' bytes of 'value' at '*buf', most significant first.
+ *
+ * \param '*buf' at least 'len' bytes, which will be modified to contain the
+ *     value.
+ * \param 'value' the value to store.
+ * \param 'len' the number of bytes to store it in, at most 8.
+ * \return void
+ */
+void put_be(uint8_t * buf, uint64_t value, int len) {
+	for (int j = 0; j < len; j++) {
+		buf[j] = (value >> (8 * (len - 1 - j))) & 0xff;
+	}
+}
+
+
+/** Loads a value stored by 'put_be()'.
+ *
+ * \param '*buf' the 'len' bytes of the value, most significant first.
+ * \param 'len' the number of bytes the value is stored in, at most 8.
+ * \return the value.
+ */
+uint64_t get_be(const uint8_t * buf, int len) {
+	uint64_t value = 0;
+
+	for (int j = 0; j < len; j++) {
+		value = (value << 8) | buf[j];
+	}
+
+	return value;
+}
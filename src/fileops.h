@@ -1,5 +1,14 @@
+#include <stdint.h>
 #include <stdio.h>
 
 void clear_file(char * file);
 
 int read_bytes(void * ret, size_t num_bytes, FILE * f);
+
+int read_bytes_fd(int fd, void * ret, size_t num_bytes);
+
+char * make_temp_file(const char * prefix);
+
+void put_be(uint8_t * buf, uint64_t value, int len);
+
+uint64_t get_be(const uint8_t * buf, int len);
@@ -0,0 +1,216 @@
+#include <stdint.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GCM_HAVE_CLMUL 1
+#endif
+
+#include "gcm.h"
+
+
+/* GHASH as specified in NIST SP 800-38D. GHASH treats 16 byte blocks as
+ * elements of GF(2^128) and computes Y_i = (Y_{i-1} ^ X_i) * H, where 'H' is
+ * the encryption of the zero block under the transfer key. Two
+ * implementations are provided: a portable one following algorithm 1 of the
+ * specification bit by bit, and one using the carry-less multiply (PCLMUL)
+ * instruction, which is picked at runtime when the CPU supports it. */
+
+
+static uint64_t load_be64(const uint8_t *b) {
+	uint64_t v = 0;
+	for (int i = 0; i < 8; i++) {
+		v = (v << 8) | b[i];
+	}
+	return v;
+}
+
+
+static void store_be64(uint8_t *b, uint64_t v) {
+	for (int i = 7; i >= 0; i--) {
+		b[i] = v & 0xff;
+		v >>= 8;
+	}
+}
+
+
+/** Multiplies the block '*y' by 'H' in GF(2^128), storing the result in
+ * '*y', one bit of '*y' at a time. */
+static void gf_mul_portable(struct ghash_key *k, uint8_t y[16]) {
+	/* {{{ */
+	uint64_t x_hi = load_be64(&y[0]);
+	uint64_t x_lo = load_be64(&y[8]);
+	uint64_t z_hi = 0, z_lo = 0;
+	uint64_t v_hi = k->h_hi, v_lo = k->h_lo;
+
+	for (int i = 0; i < 128; i++) {
+		/* Bit 'i' of X, counting from the most significant bit */
+		uint64_t bit = (i < 64) ? (x_hi >> (63 - i)) & 1 : (x_lo >> (127 - i)) & 1;
+		/* Branch free: 'mask' is all ones if the bit is set */
+		uint64_t mask = 0 - bit;
+		z_hi ^= v_hi & mask;
+		z_lo ^= v_lo & mask;
+
+		/* V = V * x, reducing by the GCM polynomial if a bit falls off */
+		uint64_t carry = 0 - (v_lo & 1);
+		v_lo = (v_lo >> 1) | (v_hi << 63);
+		v_hi = (v_hi >> 1) ^ (0xe100000000000000ULL & carry);
+	}
+
+	store_be64(&y[0], z_hi);
+	store_be64(&y[8], z_lo);
+	/* }}} */
+}
+
+
+#ifdef GCM_HAVE_CLMUL
+/** Multiplies 'a' by 'b' in GF(2^128), where both operands have had their
+ * bytes reversed, using the carry-less multiply instruction. This follows
+ * the algorithm in Intel's "Carry-Less Multiplication Instruction and its
+ * Usage for Computing the GCM Mode" white paper. */
+__attribute__((target("pclmul,sse2")))
+static __m128i gf_mul_clmul(__m128i a, __m128i b) {
+	/* {{{ */
+	__m128i t2, t3, t4, t5, t6, t7, t8, t9;
+
+	/* Schoolbook 128x128 -> 256 bit carry-less multiplication */
+	t3 = _mm_clmulepi64_si128(a, b, 0x00);
+	t4 = _mm_clmulepi64_si128(a, b, 0x10);
+	t5 = _mm_clmulepi64_si128(a, b, 0x01);
+	t6 = _mm_clmulepi64_si128(a, b, 0x11);
+	t4 = _mm_xor_si128(t4, t5);
+	t5 = _mm_slli_si128(t4, 8);
+	t4 = _mm_srli_si128(t4, 8);
+	t3 = _mm_xor_si128(t3, t5);
+	t6 = _mm_xor_si128(t6, t4);
+
+	/* Shift the 256 bit product left by one since GCM's bit order is
+	 * reflected */
+	t7 = _mm_srli_epi32(t3, 31);
+	t8 = _mm_srli_epi32(t6, 31);
+	t3 = _mm_slli_epi32(t3, 1);
+	t6 = _mm_slli_epi32(t6, 1);
+	t9 = _mm_srli_si128(t7, 12);
+	t8 = _mm_slli_si128(t8, 4);
+	t7 = _mm_slli_si128(t7, 4);
+	t3 = _mm_or_si128(t3, t7);
+	t6 = _mm_or_si128(t6, t8);
+	t6 = _mm_or_si128(t6, t9);
+
+	/* Reduce modulo x^128 + x^7 + x^2 + x + 1 */
+	t7 = _mm_slli_epi32(t3, 31);
+	t8 = _mm_slli_epi32(t3, 30);
+	t9 = _mm_slli_epi32(t3, 25);
+	t7 = _mm_xor_si128(t7, t8);
+	t7 = _mm_xor_si128(t7, t9);
+	t8 = _mm_srli_si128(t7, 4);
+	t7 = _mm_slli_si128(t7, 12);
+	t3 = _mm_xor_si128(t3, t7);
+
+	t2 = _mm_srli_epi32(t3, 1);
+	t4 = _mm_srli_epi32(t3, 2);
+	t5 = _mm_srli_epi32(t3, 7);
+	t2 = _mm_xor_si128(t2, t4);
+	t2 = _mm_xor_si128(t2, t5);
+	t2 = _mm_xor_si128(t2, t8);
+	t3 = _mm_xor_si128(t3, t2);
+	t6 = _mm_xor_si128(t6, t3);
+
+	return t6;
+	/* }}} */
+}
+
+
+/** PCLMUL version of 'ghash_update()' for whole blocks. The running hash is
+ * kept byte-reversed in a register for the whole of the data. */
+__attribute__((target("pclmul,ssse3")))
+static void ghash_blocks_clmul(struct ghash_key *k, uint8_t y[16], \
+	const uint8_t *data, size_t num_blocks) {
+	/* {{{ */
+	const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, \
+		8, 9, 10, 11, 12, 13, 14, 15);
+	__m128i h = _mm_load_si128((const __m128i *) k->h_rev);
+	__m128i acc = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) y), bswap);
+
+	for (size_t i = 0; i < num_blocks; i++) {
+		__m128i x = _mm_loadu_si128((const __m128i *) &data[16 * i]);
+		acc = _mm_xor_si128(acc, _mm_shuffle_epi8(x, bswap));
+		acc = gf_mul_clmul(acc, h);
+	}
+
+	_mm_storeu_si128((__m128i *) y, _mm_shuffle_epi8(acc, bswap));
+	/* }}} */
+}
+#endif
+
+
+/** Takes the hash subkey 'H' and fills in '*k' so that it can be used with
+ * 'ghash_update()', checking whether the CPU can use the carry-less multiply
+ * implementation.
+ *
+ * \param '*k' the struct ghash_key to be filled in.
+ * \param 'h' the hash subkey, i.e. the zero block encrypted under the key.
+ * \return void.
+ */
+void ghash_init(struct ghash_key *k, const uint8_t h[16]) {
+	k->h_hi = load_be64(&h[0]);
+	k->h_lo = load_be64(&h[8]);
+	for (int i = 0; i < 16; i++) {
+		k->h_rev[i] = h[15 - i];
+	}
+#ifdef GCM_HAVE_CLMUL
+	k->use_clmul = __builtin_cpu_supports("pclmul") \
+		&& __builtin_cpu_supports("ssse3");
+#else
+	k->use_clmul = 0;
+#endif
+}
+
+
+/** Takes a running GHASH value '*y' and folds 'len' bytes of data into it. If
+ * 'len' is not a multiple of 16, the last partial block is padded with zeros,
+ * as GHASH does at the end of the additional data and of the ciphertext, so
+ * a partial block must only ever be passed at the end of either.
+ *
+ * \param '*k' the hash subkey, set up by 'ghash_init()'.
+ * \param 'y' the running GHASH value, which will be updated.
+ * \param '*data' the data to hash.
+ * \param 'len' the number of bytes at '*data'.
+ * \return void.
+ */
+void ghash_update(struct ghash_key *k, uint8_t y[16], const uint8_t *data, size_t len) {
+	/* {{{ */
+	size_t num_blocks = len / 16;
+	size_t rem = len % 16;
+
+#ifdef GCM_HAVE_CLMUL
+	if (k->use_clmul) {
+		ghash_blocks_clmul(k, y, data, num_blocks);
+	} else {
+#endif
+		for (size_t i = 0; i < num_blocks; i++) {
+			for (int j = 0; j < 16; j++) {
+				y[j] ^= data[16 * i + j];
+			}
+			gf_mul_portable(k, y);
+		}
+#ifdef GCM_HAVE_CLMUL
+	}
+#endif
+
+	if (rem != 0) {
+		uint8_t last[16];
+		memset(last, 0, sizeof(last));
+		memcpy(last, &data[16 * num_blocks], rem);
+#ifdef GCM_HAVE_CLMUL
+		if (k->use_clmul) {
+			ghash_blocks_clmul(k, y, last, 1);
+			return;
+		}
+#endif
+		for (int j = 0; j < 16; j++) {
+			y[j] ^= last[j];
+		}
+		gf_mul_portable(k, y);
+	}
+	/* }}} */
+}
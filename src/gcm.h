@@ -0,0 +1,27 @@
+#ifndef GCM_HEADER
+#define GCM_HEADER
+#include <stddef.h>
+#include <stdint.h>
+
+/* The number of bytes in a GCM authentication tag */
+#define GCM_TAG_LEN 16
+
+
+/* Define a struct holding the GHASH subkey 'H' in the forms needed by both the
+ * portable and the carry-less multiply implementations of GHASH */
+struct ghash_key {
+	/* 'H' split into two big-endian 64-bit halves (portable implementation) */
+	uint64_t h_hi;
+	uint64_t h_lo;
+	/* 'H' with its bytes reversed (PCLMUL implementation) */
+	uint8_t h_rev[16] __attribute__((aligned(16)));
+	/* Whether the CPU supports the carry-less multiply instruction */
+	char use_clmul;
+};
+
+
+void ghash_init(struct ghash_key *, const uint8_t[16]);
+
+void ghash_update(struct ghash_key *, uint8_t[16], const uint8_t *, size_t);
+
+#endif
@@ -0,0 +1,248 @@
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "membudget.h"
+
+
+/* The buffers that files are compressed, encrypted and their reverse in (and
+ * the tables of the LZMA encoder) are reserved against one budget shared by
+ * every process of the server, before they are allocated. A batch of chunks
+ * waits for room for its first chunk, and takes as many more chunks as fit
+ * without waiting, so that when memory is short batches get narrower rather
+ * than the host running out. A batch never waits while holding a
+ * reservation, so batches cannot wait on each other.
+ *
+ * Waiting is a futex on a counter of releases, which a process that dies
+ * while waiting leaves nothing behind in. The supervisor gives back whatever
+ * a dead worker process still had reserved. */
+
+
+/* Define a struct holding the state of the budget, in memory shared by the
+ * server and every worker process it forks */
+struct mem_budget {
+	/* Guards everything but 'releases'. A process that dies while holding
+	 * it does not leave it locked */
+	pthread_mutex_t lock;
+	uint64_t limit;
+	/* The number of bytes reserved now, and the most ever reserved at once */
+	uint64_t current;
+	uint64_t peak;
+	/* Bumped every time bytes are given back, to wake the waiting
+	 * reservations */
+	uint32_t releases;
+	int nslots;
+	/* The bytes each worker process has reserved and not given back */
+	uint64_t held[];
+};
+
+
+/* The budget this process reserves from, and the slot it reserves as. A
+ * process that has not joined a budget (the client) is never held back */
+static struct mem_budget *joined = NULL;
+static int joined_slot = 0;
+
+
+static void budget_lock(struct mem_budget *budget) {
+	/* The previous holder died: its reservation may be half recorded, which
+	 * only skews the numbers until restart */
+	if (pthread_mutex_lock(&budget->lock) == EOWNERDEAD) {
+		pthread_mutex_consistent(&budget->lock);
+	}
+}
+
+
+/* Takes a locked budget and reserves 'bytes' from it if they fit, or if
+ * nothing else is reserved (so that a reservation bigger than the whole
+ * budget still goes through, on its own). Returns 0 if reserved, -1 if not */
+static int take(struct mem_budget *budget, size_t bytes) {
+	if (budget->current != 0 && budget->current + bytes > budget->limit) {
+		return -1;
+	}
+
+	budget->current += bytes;
+	budget->held[joined_slot] += bytes;
+	if (budget->current > budget->peak) {
+		budget->peak = budget->current;
+	}
+	return 0;
+}
+
+
+/* Takes a locked budget and gives back 'bytes' of it */
+static void give_back(struct mem_budget *budget, uint64_t bytes) {
+	budget->current = bytes < budget->current ? budget->current - bytes : 0;
+	__atomic_store_n(&budget->releases, budget->releases + 1, __ATOMIC_RELEASE);
+}
+
+
+/** Creates a budget of 'limit' bytes shared by up to 'nslots' processes, in
+ * memory that is shared with any process forked afterwards.
+ *
+ * \param 'limit' the number of bytes that may be reserved at once.
+ * \param 'nslots' the number of processes that will join the budget.
+ * \return a pointer to the budget, or NULL upon failure.
+ */
+struct mem_budget * mem_budget_create(size_t limit, int nslots) {
+	/* {{{ */
+	pthread_mutexattr_t attr;
+	struct mem_budget *budget;
+
+	if (limit == 0 || nslots < 1) {
+		return NULL;
+	}
+
+	size_t size = sizeof(struct mem_budget) + nslots * sizeof(uint64_t);
+	budget = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (budget == MAP_FAILED) {
+		return NULL;
+	}
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&budget->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	/* 'mmap()' hands back zeroed memory */
+	budget->limit = limit;
+	budget->nslots = nslots;
+
+	return budget;
+	/* }}} */
+}
+
+
+/** Takes a budget and makes every chunk buffer this process allocates from
+ * now on be reserved from it, with the reservations counted against 'slot'.
+ *
+ * \param '*budget' the budget.
+ * \param 'slot' the number of the process, from 0 to 'nslots' - 1.
+ * \return void.
+ */
+void mem_budget_join(struct mem_budget *budget, int slot) {
+	if (slot < 0 || slot >= budget->nslots) {
+		return;
+	}
+	joined = budget;
+	joined_slot = slot;
+}
+
+
+/** Reserves 'bytes' from this process's budget, waiting for other processes
+ * and threads to give back enough if need be. The caller must not already
+ * hold a reservation, or two callers could wait on each other. Returns
+ * straight away if this process has not joined a budget */
+void mem_budget_reserve(size_t bytes) {
+	/* {{{ */
+	struct mem_budget *budget = joined;
+	uint32_t releases;
+
+	if (budget == NULL) {
+		return;
+	}
+
+	while (1) {
+		budget_lock(budget);
+		releases = budget->releases;
+		if (take(budget, bytes) == 0) {
+			pthread_mutex_unlock(&budget->lock);
+			return;
+		}
+		pthread_mutex_unlock(&budget->lock);
+
+#if DEBUG_LEVEL >= 2
+		fprintf(stderr, "(%d) STATUS: waiting for %zu bytes of the memory budget\n", \
+			getpid(), bytes);
+#endif
+		/* Returns straight away if anything was given back since the lock
+		 * was let go */
+		syscall(SYS_futex, &budget->releases, FUTEX_WAIT, releases, NULL, NULL, 0);
+	}
+	/* }}} */
+}
+
+
+/** Reserves 'bytes' from this process's budget if they fit without waiting.
+ * Returns 0 if they were reserved (or this process has not joined a budget),
+ * and -1 if not */
+int mem_budget_try_reserve(size_t bytes) {
+	struct mem_budget *budget = joined;
+	int ret;
+
+	if (budget == NULL) {
+		return 0;
+	}
+
+	budget_lock(budget);
+	ret = take(budget, bytes);
+	pthread_mutex_unlock(&budget->lock);
+
+	return ret;
+}
+
+
+/** Gives back 'bytes' reserved from this process's budget */
+void mem_budget_release(size_t bytes) {
+	struct mem_budget *budget = joined;
+
+	if (budget == NULL) {
+		return;
+	}
+
+	budget_lock(budget);
+	budget->held[joined_slot] -= bytes;
+	give_back(budget, bytes);
+	pthread_mutex_unlock(&budget->lock);
+	syscall(SYS_futex, &budget->releases, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+
+/** Takes a budget and gives back everything still reserved by the process
+ * that joined it as 'slot', which must have exited.
+ *
+ * \param '*budget' the budget.
+ * \param 'slot' the slot of the process that exited.
+ * \return void.
+ */
+void mem_budget_reclaim(struct mem_budget *budget, int slot) {
+	if (slot < 0 || slot >= budget->nslots) {
+		return;
+	}
+
+	budget_lock(budget);
+	if (budget->held[slot] > 0) {
+#if DEBUG_LEVEL >= 1
+		fprintf(stderr, "(%d) STATUS: giving back %lu bytes of memory budget of " \
+			"worker process %d\n", getpid(), budget->held[slot], slot);
+#endif
+		give_back(budget, budget->held[slot]);
+		budget->held[slot] = 0;
+	}
+	pthread_mutex_unlock(&budget->lock);
+	syscall(SYS_futex, &budget->releases, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+
+/** Takes a budget and reports how much of it is reserved.
+ *
+ * \param '*budget' the budget.
+ * \param '*current' will be modified to contain the bytes reserved now.
+ * \param '*peak' will be modified to contain the most bytes ever reserved at
+ *     once.
+ * \param '*limit' will be modified to contain the size of the budget.
+ * \return void.
+ */
+void mem_budget_usage(struct mem_budget *budget, size_t *current, size_t *peak, size_t *limit) {
+	budget_lock(budget);
+	*current = budget->current;
+	*peak = budget->peak;
+	*limit = budget->limit;
+	pthread_mutex_unlock(&budget->lock);
+}
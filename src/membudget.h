@@ -0,0 +1,23 @@
+#ifndef MEMBUDGET_HEADER
+#define MEMBUDGET_HEADER
+#include <stddef.h>
+
+
+struct mem_budget;
+
+
+struct mem_budget * mem_budget_create(size_t limit, int nslots);
+
+void mem_budget_join(struct mem_budget *budget, int slot);
+
+void mem_budget_reserve(size_t bytes);
+
+int mem_budget_try_reserve(size_t bytes);
+
+void mem_budget_release(size_t bytes);
+
+void mem_budget_reclaim(struct mem_budget *budget, int slot);
+
+void mem_budget_usage(struct mem_budget *budget, size_t *current, size_t *peak, size_t *limit);
+
+#endif
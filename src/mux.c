@@ -0,0 +1,742 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "fileops.h"
+#include "mux.h"
+
+
+/* A multiplexed session carries its commands, replies and data connections
+ * as channels of frames over the one control connection. Each channel is
+ * handed to the rest of the program as one end of a local socket pair, so
+ * that everything written for data connections (block mode, stripes, the
+ * event loop's pumps) works on a channel as it is; the multiplexer moves the
+ * bytes between the other end of each pair and the frames on the
+ * connection.
+ *
+ * Each channel has a window in either direction: an end sends no more bytes
+ * on a channel than the other end has room for, and the other end hands the
+ * room back (with 'MUX_WINDOW_ADJUST') as the bytes are delivered. A channel
+ * whose reader falls behind therefore holds up none of the others, and no
+ * end ever buffers more than 'MUX_WINDOW' bytes of a channel.
+ *
+ * All of the multiplexer's descriptors are watched by an epoll instance of
+ * its own, which the server watches from its event loop and a thread of the
+ * client waits on. */
+
+
+/* The size of the buffers frames are read into and sent from */
+#define MUX_BUF_LEN (256 * 1024)
+/* The room handed back to the other end once this many bytes of a channel
+ * have been delivered */
+#define MUX_GRANT_MIN (MUX_WINDOW / 4)
+/* What the multiplexer's epoll events point to besides the channels */
+#define MUX_TAG_CONN MUX_MAX_CHANNELS
+#define MUX_TAG_WAKE (MUX_MAX_CHANNELS + 1)
+
+
+/* Define a struct holding one channel of a multiplexed connection */
+struct mux_channel {
+	/* The channel number, or -1 while the slot is free */
+	int id;
+	/* The multiplexer's end of the socket pair, and the other end until it
+	 * is handed out */
+	int fd;
+	int local_fd;
+	/* The bytes this end may still send on the channel, and the bytes
+	 * delivered from it whose room has not been handed back yet */
+	uint32_t credit;
+	uint32_t grant;
+	/* Bytes that arrived for the channel and did not fit in its socket yet,
+	 * of which the first 'pend_off' have been delivered since */
+	uint8_t *pend;
+	size_t pend_off, pend_len;
+	/* Set while the socket may have something to read */
+	int readable;
+	/* Frames still to be sent, and what has been sent and received */
+	int send_open;
+	int send_close;
+	int sent_close;
+	int got_close;
+	/* Set once the socket has ended its bytes, or has been closed by its
+	 * reader so that what arrives for it is thrown away */
+	int eof_local;
+	int local_gone;
+	/* The events the socket is watched for */
+	uint32_t events;
+};
+
+/* Define a struct holding a multiplexed connection */
+struct mux {
+	/* Taken by every function, since the client opens channels from one
+	 * thread while another pumps them */
+	pthread_mutex_t lock;
+	/* The connection, and whether it may have something to read */
+	int fd;
+	int conn_readable;
+	uint32_t conn_events;
+	int epfd;
+	/* Woken to have the pump take in a newly opened channel */
+	int wakefd;
+	/* Whether this is the server's end, which accepts the channels the
+	 * client opens and hands out non-blocking ends of them */
+	int server;
+	/* Set once the connection has failed or been closed */
+	int failed;
+	/* Frames read from the connection, and frames to be sent on it of which
+	 * the first 'out_off' bytes have been */
+	uint8_t *in;
+	size_t in_len;
+	uint8_t *out;
+	size_t out_off, out_len;
+	struct mux_channel ch[MUX_MAX_CHANNELS];
+	/* The channel whose bytes are sent first next time, so that every
+	 * channel gets its turn */
+	int rr;
+	/* The number the client gives the next channel it opens */
+	uint16_t next_id;
+	/* The channels the client opened that have not been accepted yet, in
+	 * the order they were opened */
+	int accept_q[MUX_MAX_CHANNELS];
+	int accept_head, accept_count;
+};
+
+
+/** Takes a descriptor of the multiplexer and has its epoll instance watch it
+ * for 'events', or not at all if 'events' is 0 (so that a socket whose other
+ * end hung up does not keep waking the pump while it cannot be read) */
+static void set_events(struct mux *m, int fd, uint32_t *cur, uint32_t events, int tag) {
+	struct epoll_event ev;
+
+	if (*cur == events) {
+		return;
+	}
+	ev.events = events;
+	ev.data.u32 = tag;
+	if (events == 0) {
+		epoll_ctl(m->epfd, EPOLL_CTL_DEL, fd, NULL);
+	} else if (epoll_ctl(m->epfd, *cur == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &ev) < 0) {
+		perror("epoll_ctl error");
+		return;
+	}
+	*cur = events;
+}
+
+
+/** Takes a multiplexer and has it stop: every channel's socket is shut down,
+ * so whatever reads from the other end of it sees the connection end */
+static void fail(struct mux *m) {
+	if (m->failed) {
+		return;
+	}
+	m->failed = 1;
+	for (int i = 0; i < MUX_MAX_CHANNELS; i++) {
+		if (m->ch[i].id >= 0) {
+			shutdown(m->ch[i].fd, SHUT_RDWR);
+		}
+	}
+}
+
+
+/** Takes a multiplexer and sets up channel 'id' in a free slot, with a new
+ * socket pair. Returns the slot, or -1 if there is no free slot or no socket
+ * pair to be had */
+static int channel_new(struct mux *m, int id) {
+	/* {{{ */
+	int pair[2], slot = -1;
+
+	for (int i = 0; i < MUX_MAX_CHANNELS && slot < 0; i++) {
+		if (m->ch[i].id < 0) slot = i;
+	}
+	if (slot < 0) {
+		return -1;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0) {
+		perror("socketpair error");
+		return -1;
+	}
+	fcntl(pair[0], F_SETFL, fcntl(pair[0], F_GETFL) | O_NONBLOCK);
+	if (m->server) {
+		fcntl(pair[1], F_SETFL, fcntl(pair[1], F_GETFL) | O_NONBLOCK);
+	}
+
+	struct mux_channel *ch = &m->ch[slot];
+	memset(ch, 0, sizeof(*ch));
+	ch->id = id;
+	ch->fd = pair[0];
+	ch->local_fd = pair[1];
+	ch->credit = MUX_WINDOW;
+
+	return slot;
+	/* }}} */
+}
+
+
+/** Takes a slot of a multiplexer and returns it to the free slots, once the
+ * channel has ended both ways and whatever arrived for it is delivered */
+static void channel_maybe_free(struct mux *m, int slot) {
+	struct mux_channel *ch = &m->ch[slot];
+
+	if (!ch->sent_close || !ch->got_close || ch->pend_len != 0) {
+		return;
+	}
+	set_events(m, ch->fd, &ch->events, 0, slot);
+	close(ch->fd);
+	if (ch->local_fd >= 0) close(ch->local_fd);
+	free(ch->pend);
+	ch->pend = NULL;
+	ch->id = -1;
+}
+
+
+/** Returns the slot of channel 'id' of a multiplexer, or -1 if it is not
+ * open */
+static int channel_find(const struct mux *m, int id) {
+	for (int i = 0; i < MUX_MAX_CHANNELS; i++) {
+		if (m->ch[i].id == id) return i;
+	}
+	return -1;
+}
+
+
+/** Takes a channel that arrived bytes are waiting for and writes as many of
+ * them to its socket as fit. Returns 1 if any were, 0 if not */
+static int deliver(struct mux_channel *ch) {
+	/* {{{ */
+	int progress = 0;
+
+	while (ch->pend_len > 0) {
+		ssize_t w = write(ch->fd, &ch->pend[ch->pend_off], ch->pend_len);
+		if (w < 0 && errno == EINTR) continue;
+		if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+		if (w <= 0) {
+			/* The reader is gone, and the rest is thrown away */
+			ch->local_gone = 1;
+			w = ch->pend_len;
+		}
+		ch->pend_off += w;
+		ch->pend_len -= w;
+		ch->grant += w;
+		progress = 1;
+	}
+
+	if (ch->pend_len == 0) {
+		ch->pend_off = 0;
+		if (ch->got_close) {
+			shutdown(ch->fd, SHUT_WR);
+		}
+	}
+
+	return progress;
+	/* }}} */
+}
+
+
+/** Takes a channel and the payload of a data frame that arrived for it, and
+ * writes what fits to its socket and keeps the rest. Returns 0 on success, a
+ * negative int if the other end sent more than its window allowed */
+static int channel_data(struct mux_channel *ch, const uint8_t *p, size_t len) {
+	/* {{{ */
+	if (ch->local_gone) {
+		ch->grant += len;
+		return 0;
+	}
+
+	while (ch->pend_len == 0 && len > 0) {
+		ssize_t w = write(ch->fd, p, len);
+		if (w < 0 && errno == EINTR) continue;
+		if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+		if (w <= 0) {
+			ch->local_gone = 1;
+			ch->grant += len;
+			return 0;
+		}
+		p += w;
+		len -= w;
+		ch->grant += w;
+	}
+	if (len == 0) {
+		return 0;
+	}
+
+	if (ch->pend == NULL && (ch->pend = malloc(MUX_WINDOW)) == NULL) {
+		return -1;
+	}
+	if (ch->pend_off + ch->pend_len + len > MUX_WINDOW) {
+		memmove(ch->pend, &ch->pend[ch->pend_off], ch->pend_len);
+		ch->pend_off = 0;
+	}
+	if (ch->pend_len + len > MUX_WINDOW) {
+		return -1;
+	}
+	memcpy(&ch->pend[ch->pend_off + ch->pend_len], p, len);
+	ch->pend_len += len;
+
+	return 0;
+	/* }}} */
+}
+
+
+/** Takes a multiplexer and a frame that arrived on its connection, and acts
+ * on it. Returns 0 on success, a negative int if the frame breaks the
+ * protocol */
+static int handle_frame(struct mux *m, int type, int id, const uint8_t *p, size_t len) {
+	/* {{{ */
+	int slot = channel_find(m, id);
+
+	if (type == MUX_OPEN) {
+		/* Only the server accepts channels, and a number is not reused
+		 * before the channel it was given to has ended both ways */
+		if (!m->server || slot >= 0 || (slot = channel_new(m, id)) < 0) {
+			return -1;
+		}
+		m->accept_q[(m->accept_head + m->accept_count++) % MUX_MAX_CHANNELS] = slot;
+		return 0;
+	}
+
+	if (slot < 0) {
+		/* The other end hands back room for bytes it received until it
+		 * learns the channel has ended, which may be after it has */
+		return type == MUX_WINDOW_ADJUST ? 0 : -1;
+	}
+	struct mux_channel *ch = &m->ch[slot];
+
+	switch (type) {
+	case MUX_DATA:
+		if (ch->got_close) return -1;
+		return channel_data(ch, p, len);
+	case MUX_CLOSE:
+		ch->got_close = 1;
+		if (ch->pend_len == 0) {
+			shutdown(ch->fd, SHUT_WR);
+		}
+		channel_maybe_free(m, slot);
+		return 0;
+	case MUX_WINDOW_ADJUST:
+		if (len != 4 || (uint64_t) ch->credit + get_be(p, 4) > MUX_WINDOW) return -1;
+		ch->credit += get_be(p, 4);
+		return 0;
+	}
+
+	return -1;
+	/* }}} */
+}
+
+
+/** Takes a multiplexer and reads what has arrived on its connection, acting
+ * on every whole frame. Returns 1 if anything was read, 0 if not */
+static int read_conn(struct mux *m) {
+	/* {{{ */
+	size_t pos = 0;
+
+	if (!m->conn_readable) {
+		return 0;
+	}
+
+	ssize_t r = read(m->fd, &m->in[m->in_len], MUX_BUF_LEN - m->in_len);
+	if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		m->conn_readable = (errno == EINTR);
+		return 0;
+	}
+	if (r <= 0) {
+		fail(m);
+		return 0;
+	}
+	m->in_len += r;
+
+	while (m->in_len - pos >= MUX_HEADER_LEN) {
+		const uint8_t *h = &m->in[pos];
+		size_t len = get_be(&h[3], 2);
+
+		if (m->in_len - pos < MUX_HEADER_LEN + len) break;
+		if (0 != handle_frame(m, h[0], get_be(&h[1], 2), &h[MUX_HEADER_LEN], len)) {
+			fprintf(stderr, "ERROR: peer broke the multiplexing protocol\n");
+			fail(m);
+			return 0;
+		}
+		pos += MUX_HEADER_LEN + len;
+	}
+	/* Keep the start of the next frame */
+	memmove(m->in, &m->in[pos], m->in_len - pos);
+	m->in_len -= pos;
+
+	return 1;
+	/* }}} */
+}
+
+
+/** Takes a multiplexer and appends a frame header to what is to be sent, if
+ * there is room for it and 'extra' bytes of payload. Returns a pointer to
+ * where the payload goes, or NULL if there is no room */
+static uint8_t * queue_header(struct mux *m, int type, int id, size_t len, size_t extra) {
+	uint8_t *h;
+
+	if (m->out_off > 0 && m->out_len + MUX_HEADER_LEN + extra > MUX_BUF_LEN) {
+		memmove(m->out, &m->out[m->out_off], m->out_len - m->out_off);
+		m->out_len -= m->out_off;
+		m->out_off = 0;
+	}
+	if (m->out_len + MUX_HEADER_LEN + extra > MUX_BUF_LEN) {
+		return NULL;
+	}
+
+	h = &m->out[m->out_len];
+	h[0] = type;
+	put_be(&h[1], id, 2);
+	put_be(&h[3], len, 2);
+
+	return &h[MUX_HEADER_LEN];
+}
+
+
+/** Takes a multiplexer and queues the frames that are due: first the ones
+ * that open and close channels and hand back room, then a frame of bytes
+ * from each channel that has some and may send them. Returns 1 if anything
+ * was queued, 0 if not */
+static int fill_out(struct mux *m) {
+	/* {{{ */
+	int progress = 0;
+	uint8_t *p;
+
+	for (int i = 0; i < MUX_MAX_CHANNELS; i++) {
+		struct mux_channel *ch = &m->ch[i];
+
+		if (ch->id < 0) continue;
+		/* A channel's frames go out in order, so nothing more is queued once
+		 * one does not fit */
+		if (ch->send_open) {
+			if (queue_header(m, MUX_OPEN, ch->id, 0, 0) == NULL) return progress;
+			m->out_len += MUX_HEADER_LEN;
+			ch->send_open = 0;
+			progress = 1;
+		}
+		if (ch->grant >= MUX_GRANT_MIN && !ch->got_close) {
+			if ((p = queue_header(m, MUX_WINDOW_ADJUST, ch->id, 4, 4)) == NULL) return progress;
+			put_be(p, ch->grant, 4);
+			m->out_len += MUX_HEADER_LEN + 4;
+			ch->grant = 0;
+			progress = 1;
+		}
+		if (ch->send_close) {
+			if (queue_header(m, MUX_CLOSE, ch->id, 0, 0) == NULL) return progress;
+			m->out_len += MUX_HEADER_LEN;
+			ch->send_close = 0;
+			ch->sent_close = 1;
+			progress = 1;
+			channel_maybe_free(m, i);
+		}
+	}
+
+	for (int k = 0; k < MUX_MAX_CHANNELS; k++) {
+		int i = (m->rr + k) % MUX_MAX_CHANNELS;
+		struct mux_channel *ch = &m->ch[i];
+
+		if (ch->id < 0 || !ch->readable || ch->eof_local || ch->credit == 0) continue;
+
+		size_t want = ch->credit < MUX_FRAME_MAX ? ch->credit : MUX_FRAME_MAX;
+		if ((p = queue_header(m, MUX_DATA, ch->id, 0, 1)) == NULL) break;
+		if (want > MUX_BUF_LEN - m->out_len - MUX_HEADER_LEN) {
+			want = MUX_BUF_LEN - m->out_len - MUX_HEADER_LEN;
+		}
+
+		ssize_t r = read(ch->fd, p, want);
+		if (r < 0 && errno == EINTR) continue;
+		if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			ch->readable = 0;
+			continue;
+		}
+		if (r <= 0) {
+			/* The bytes of the channel have ended this way */
+			ch->readable = 0;
+			ch->eof_local = 1;
+			ch->send_close = 1;
+			progress = 1;
+			continue;
+		}
+		put_be(&m->out[m->out_len + 3], r, 2);
+		m->out_len += MUX_HEADER_LEN + r;
+		ch->credit -= r;
+		progress = 1;
+	}
+	m->rr = (m->rr + 1) % MUX_MAX_CHANNELS;
+
+	return progress;
+	/* }}} */
+}
+
+
+/** Takes a multiplexer and sends what is queued until its connection is
+ * full. Returns 1 if anything was sent, 0 if not */
+static int flush_out(struct mux *m) {
+	int progress = 0;
+
+	while (m->out_off < m->out_len) {
+		ssize_t w = send(m->fd, &m->out[m->out_off], m->out_len - m->out_off, MSG_NOSIGNAL);
+		if (w < 0 && errno == EINTR) continue;
+		if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+		if (w <= 0) {
+			fail(m);
+			return 0;
+		}
+		m->out_off += w;
+		progress = 1;
+	}
+	if (m->out_off == m->out_len) {
+		m->out_off = m->out_len = 0;
+	}
+
+	return progress;
+}
+
+
+/** Takes a multiplexer that has done all it can and has its epoll instance
+ * watch each descriptor for what would let it do more */
+static void update_events(struct mux *m) {
+	/* {{{ */
+	int room = (m->out_len - m->out_off) + MUX_HEADER_LEN < MUX_BUF_LEN;
+
+	set_events(m, m->fd, &m->conn_events, \
+		EPOLLIN | (m->out_len > m->out_off ? EPOLLOUT : 0), MUX_TAG_CONN);
+
+	for (int i = 0; i < MUX_MAX_CHANNELS; i++) {
+		struct mux_channel *ch = &m->ch[i];
+		uint32_t events = 0;
+
+		if (ch->id < 0) continue;
+		if (!ch->eof_local && ch->credit > 0 && room) events |= EPOLLIN;
+		if (ch->pend_len > 0) events |= EPOLLOUT;
+		set_events(m, ch->fd, &ch->events, events, i);
+	}
+	/* }}} */
+}
+
+
+/** Takes a connection whose peer has just agreed to multiplex it and sets
+ * up the multiplexer that carries the commands and data of the session over
+ * it from now on.
+ *
+ * \param 'fd' the connection, which the multiplexer takes over.
+ * \param 'server' whether this is the server's end, which accepts the
+ *     channels the client opens and hands out non-blocking ends of them for
+ *     its event loop.
+ * \param '*control_fd' will be modified to contain the end of the channel
+ *     the commands and replies now go over, which the caller closes.
+ * \return a pointer to the multiplexer, or NULL upon failure.
+ */
+struct mux * mux_create(int fd, int server, int *control_fd) {
+	/* {{{ */
+	struct mux *m;
+	int one = 1, slot;
+
+	if ((m = calloc(1, sizeof(struct mux))) == NULL) {
+		return NULL;
+	}
+	pthread_mutex_init(&m->lock, NULL);
+	m->fd = fd;
+	m->server = server;
+	m->next_id = MUX_CONTROL_CHANNEL + 1;
+	m->wakefd = -1;
+	for (int i = 0; i < MUX_MAX_CHANNELS; i++) {
+		m->ch[i].id = -1;
+	}
+
+	if ((m->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0 \
+		|| (m->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 \
+		|| (m->in = malloc(MUX_BUF_LEN)) == NULL || (m->out = malloc(MUX_BUF_LEN)) == NULL \
+		|| (slot = channel_new(m, MUX_CONTROL_CHANNEL)) < 0) {
+
+		if (m->epfd >= 0) close(m->epfd);
+		if (m->wakefd >= 0) close(m->wakefd);
+		free(m->in);
+		free(m->out);
+		free(m);
+		return NULL;
+	}
+
+	/* A command must not wait behind Nagle for the data sent before it */
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	uint32_t wake_events = 0;
+	set_events(m, m->wakefd, &wake_events, EPOLLIN, MUX_TAG_WAKE);
+	update_events(m);
+
+	*control_fd = m->ch[slot].local_fd;
+	m->ch[slot].local_fd = -1;
+
+	return m;
+	/* }}} */
+}
+
+
+/** Returns the descriptor that is readable whenever the multiplexer 'm' has
+ * something to do, for the caller to call 'mux_pump()' */
+int mux_fd(const struct mux *m) {
+	return m->epfd;
+}
+
+
+/** Takes the client's multiplexer and opens a new channel, which stands in
+ * for a data connection to the server. The server is told of it before
+ * anything written to any channel after this returns.
+ *
+ * \param '*m' the multiplexer.
+ * \return the client's end of the channel, which the caller closes, or a
+ *     negative int upon failure.
+ */
+int mux_open(struct mux *m) {
+	/* {{{ */
+	uint64_t one = 1;
+	int fd = -1, slot;
+
+	pthread_mutex_lock(&m->lock);
+	/* Skip the numbers of channels that have not ended yet */
+	for (int i = 0; i < 0x10000 && channel_find(m, m->next_id) >= 0; i++) {
+		m->next_id = m->next_id == 0xffff ? MUX_CONTROL_CHANNEL + 1 : m->next_id + 1;
+	}
+	if (!m->failed && (slot = channel_new(m, m->next_id)) >= 0) {
+		m->ch[slot].send_open = 1;
+		fd = m->ch[slot].local_fd;
+		m->ch[slot].local_fd = -1;
+		m->next_id = m->next_id == 0xffff ? MUX_CONTROL_CHANNEL + 1 : m->next_id + 1;
+	}
+	pthread_mutex_unlock(&m->lock);
+
+	if (fd >= 0 && write(m->wakefd, &one, sizeof(one)) < 0) {
+		perror("eventfd write error");
+	}
+
+	return fd;
+	/* }}} */
+}
+
+
+/** Takes the server's multiplexer and hands out the next channel the client
+ * opened, in the order they were opened.
+ *
+ * \param '*m' the multiplexer.
+ * \return the server's end of the channel, which the caller closes, or -1
+ *     if no channel is waiting.
+ */
+int mux_accept(struct mux *m) {
+	int fd = -1;
+
+	pthread_mutex_lock(&m->lock);
+	if (m->accept_count > 0) {
+		struct mux_channel *ch = &m->ch[m->accept_q[m->accept_head]];
+
+		m->accept_head = (m->accept_head + 1) % MUX_MAX_CHANNELS;
+		m->accept_count--;
+		fd = ch->local_fd;
+		ch->local_fd = -1;
+	}
+	pthread_mutex_unlock(&m->lock);
+
+	return fd;
+}
+
+
+/** Takes a multiplexer and moves everything it can between its connection
+ * and its channels without blocking.
+ *
+ * \param '*m' the multiplexer.
+ * \return 0 on success, a negative int once the connection has failed or
+ *     been closed by the other end.
+ */
+int mux_pump(struct mux *m) {
+	/* {{{ */
+	struct epoll_event events[MUX_MAX_CHANNELS + 2];
+	uint64_t wakes;
+	int progress;
+
+	pthread_mutex_lock(&m->lock);
+
+	int n = m->failed ? 0 : epoll_wait(m->epfd, events, MUX_MAX_CHANNELS + 2, 0);
+	for (int i = 0; i < n; i++) {
+		uint32_t tag = events[i].data.u32;
+
+		if (tag == MUX_TAG_WAKE) {
+			if (read(m->wakefd, &wakes, sizeof(wakes)) < 0) continue;
+		} else if (tag == MUX_TAG_CONN) {
+			m->conn_readable |= (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0;
+		} else if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+			m->ch[tag].readable = 1;
+		}
+	}
+
+	do {
+		progress = read_conn(m);
+		for (int i = 0; i < MUX_MAX_CHANNELS; i++) {
+			if (m->ch[i].id >= 0 && m->ch[i].pend_len > 0) {
+				progress |= deliver(&m->ch[i]);
+				channel_maybe_free(m, i);
+			}
+		}
+		progress |= fill_out(m);
+		progress |= flush_out(m);
+	} while (progress && !m->failed);
+
+	if (!m->failed) {
+		update_events(m);
+	}
+	int ret = m->failed ? -1 : 0;
+
+	pthread_mutex_unlock(&m->lock);
+
+	return ret;
+	/* }}} */
+}
+
+
+/** Takes the client's multiplexer and pumps it whenever it has something to
+ * do, until its connection fails or is closed. Meant to be the body of a
+ * thread of its own.
+ *
+ * \param '*arg' the multiplexer.
+ * \return NULL.
+ */
+void *mux_run(void *arg) {
+	struct mux *m = (struct mux *) arg;
+	struct pollfd pfd = { .fd = m->epfd, .events = POLLIN };
+
+	while (mux_pump(m) == 0) {
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+
+/** Takes a multiplexer and closes its connection and every channel, then
+ * frees it. The ends of channels that were handed out are left to their
+ * owners */
+void mux_destroy(struct mux *m) {
+	for (int i = 0; i < MUX_MAX_CHANNELS; i++) {
+		struct mux_channel *ch = &m->ch[i];
+
+		if (ch->id < 0) continue;
+		close(ch->fd);
+		if (ch->local_fd >= 0) close(ch->local_fd);
+		free(ch->pend);
+	}
+	close(m->fd);
+	close(m->epfd);
+	close(m->wakefd);
+	pthread_mutex_destroy(&m->lock);
+	free(m->in);
+	free(m->out);
+	free(m);
+}
@@ -0,0 +1,46 @@
+#ifndef MUX_HEADER
+#define MUX_HEADER
+#include <stdint.h>
+
+/* Once a session is multiplexed, everything on its control connection is a
+ * frame: a 1-byte type, the big-endian 2-byte channel number and the
+ * big-endian 2-byte length of the payload that follows */
+#define MUX_HEADER_LEN 5
+#define MUX_FRAME_MAX 0xffff
+/* Carries bytes of a channel */
+#define MUX_DATA 0
+/* Opens a channel (sent by the client only) */
+#define MUX_OPEN 1
+/* Ends the bytes of a channel in one direction, as closing a connection for
+ * writing would */
+#define MUX_CLOSE 2
+/* Lets the other end send 4-byte big-endian payload's worth more bytes on a
+ * channel */
+#define MUX_WINDOW_ADJUST 3
+/* Channel 0 carries the commands and replies, and is open from the start */
+#define MUX_CONTROL_CHANNEL 0
+/* The bytes either end may send on a channel before the other end has
+ * delivered any of them */
+#define MUX_WINDOW (256 * 1024)
+/* The most channels open (or closing) at once */
+#define MUX_MAX_CHANNELS 64
+
+
+struct mux;
+
+
+struct mux * mux_create(int fd, int server, int *control_fd);
+
+int mux_fd(const struct mux *m);
+
+int mux_open(struct mux *m);
+
+int mux_accept(struct mux *m);
+
+int mux_pump(struct mux *m);
+
+void *mux_run(void *arg);
+
+void mux_destroy(struct mux *m);
+
+#endif
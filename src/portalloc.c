@@ -0,0 +1,260 @@
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "ecftp.h"
+#include "portalloc.h"
+
+
+/* Passive data ports are handed out from a queue of the free ports in the
+ * configured range, so allocating and releasing a port costs the same no
+ * matter how many sessions hold one. The queue lives in memory shared by the
+ * server and every child it forks, and a port that turns out to be in use by
+ * another program is put back at the end of the queue rather than probed
+ * again straight away.
+ *
+ * Each port handed out is marked with the worker process that holds it, so
+ * that the supervisor can put back the ports of a worker that died without
+ * releasing them. */
+
+
+/* Define a struct holding the free ports of the range, in the order they
+ * will be handed out */
+struct port_pool {
+	/* Shared by every process of the server. A child that dies while
+	 * holding it does not leave it locked */
+	pthread_mutex_t lock;
+	uint16_t first;
+	/* The number of ports in the range */
+	uint32_t count;
+	/* The number of ports ever handed out and ever released. The next port
+	 * to hand out is at 'ring[head % count]', and 'tail - head' ports are
+	 * free */
+	uint64_t head;
+	uint64_t tail;
+	int nslots;
+	/* The 'count' ports of the queue, followed by the holder of each port
+	 * of the range ( 'owners()' ) */
+	uint16_t ring[];
+};
+
+
+/* The slot this process holds ports as, or -1 if it has not joined the pool
+ * (its ports are then not reclaimed) */
+static int joined_slot = -1;
+
+
+/* Takes a pool and returns the holders of its ports, by port from 'first':
+ * the slot of the worker process that holds the port plus one, or 0 if the
+ * port is free or its holder never joined the pool */
+static uint16_t * owners(struct port_pool *pool) {
+	return &pool->ring[pool->count];
+}
+
+
+static void pool_lock(struct port_pool *pool) {
+	/* The previous holder died: every change to the queue takes effect with
+	 * a single store to 'head' or 'tail', so it is still consistent */
+	if (pthread_mutex_lock(&pool->lock) == EOWNERDEAD) {
+		pthread_mutex_consistent(&pool->lock);
+	}
+}
+
+
+/** Creates a pool of the ports from 'first' to 'last' inclusive, for up to
+ * 'nslots' processes, in memory that is shared with any process forked
+ * afterwards.
+ *
+ * \param 'first' the first port of the range.
+ * \param 'last' the last port of the range.
+ * \param 'nslots' the number of processes that will join the pool.
+ * \return a pointer to the pool, or NULL upon failure.
+ */
+struct port_pool * port_pool_create(uint16_t first, uint16_t last, int nslots) {
+	/* {{{ */
+	pthread_mutexattr_t attr;
+	struct port_pool *pool;
+
+	if (first == 0 || last < first || nslots < 1 || nslots >= UINT16_MAX) {
+		return NULL;
+	}
+
+	uint32_t count = (uint32_t) last - first + 1;
+	/* The queue and the holders, which 'mmap()' hands back zeroed */
+	size_t size = sizeof(struct port_pool) + 2 * count * sizeof(uint16_t);
+	pool = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (pool == MAP_FAILED) {
+		return NULL;
+	}
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&pool->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	pool->first = first;
+	pool->count = count;
+	pool->head = 0;
+	pool->tail = count;
+	pool->nslots = nslots;
+	for (uint32_t i = 0; i < count; i++) {
+		pool->ring[i] = first + i;
+	}
+
+	return pool;
+	/* }}} */
+}
+
+
+/** Takes a port pool and marks every port this process allocates from it
+ * from now on as held by 'slot', for the ports to be reclaimed should the
+ * process die holding them.
+ *
+ * \param '*pool' the port pool.
+ * \param 'slot' the number of the process, from 0 to 'nslots' - 1.
+ * \return void.
+ */
+void port_pool_join(struct port_pool *pool, int slot) {
+	if (slot < 0 || slot >= pool->nslots) {
+		return;
+	}
+	joined_slot = slot;
+}
+
+
+/** Takes a port pool and hands out the port that has been free the longest.
+ *
+ * \param '*pool' the port pool.
+ * \return the port, or -1 if every port of the pool is in use.
+ */
+int port_pool_alloc(struct port_pool *pool) {
+	int port = -1;
+
+	pool_lock(pool);
+	if (pool->tail != pool->head) {
+		port = pool->ring[pool->head % pool->count];
+		pool->head++;
+		owners(pool)[port - pool->first] = joined_slot + 1;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return port;
+}
+
+
+/** Takes a port pool and a port handed out by 'port_pool_alloc()' and puts
+ * the port at the end of the queue of free ports.
+ *
+ * \param '*pool' the port pool.
+ * \param 'port' the port to release.
+ * \return void.
+ */
+void port_pool_release(struct port_pool *pool, uint16_t port) {
+	if (port < pool->first || port - pool->first >= pool->count) {
+		return;
+	}
+
+	pool_lock(pool);
+	if (pool->tail - pool->head < pool->count) {
+		pool->ring[pool->tail % pool->count] = port;
+		pool->tail++;
+		owners(pool)[port - pool->first] = 0;
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+
+/** Takes a port pool and puts back every port still held by the process that
+ * joined it as 'slot', which must have exited: its listening sockets are
+ * closed, so the ports are free again.
+ *
+ * \param '*pool' the port pool.
+ * \param 'slot' the slot of the process that exited.
+ * \return void.
+ */
+void port_pool_reclaim(struct port_pool *pool, int slot) {
+	/* {{{ */
+	uint16_t *owner = owners(pool);
+	int reclaimed = 0;
+
+	if (slot < 0 || slot >= pool->nslots) {
+		return;
+	}
+
+	pool_lock(pool);
+	for (uint32_t i = 0; i < pool->count; i++) {
+		if (owner[i] != slot + 1 || pool->tail - pool->head >= pool->count) {
+			continue;
+		}
+		pool->ring[pool->tail % pool->count] = pool->first + i;
+		pool->tail++;
+		owner[i] = 0;
+		reclaimed++;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+#if DEBUG_LEVEL >= 1
+	if (reclaimed > 0) {
+		fprintf(stderr, "(%d) STATUS: putting back %d passive ports of worker " \
+			"process %d\n", getpid(), reclaimed, slot);
+	}
+#endif
+	/* }}} */
+}
+
+
+/** Takes a port pool, allocates a port from it and opens a socket listening
+ * for data connections on that port.
+ *
+ * \param '*pool' the port pool.
+ * \param '*listenfd' will be modified to contain the listening socket.
+ * \param '*port' will be modified to contain the port, which must be given
+ *     back with 'port_pool_release()' once the socket is closed.
+ * \return 0 upon success, a negative int upon failure.
+ */
+int port_pool_listen(struct port_pool *pool, int *listenfd, uint16_t *port) {
+	/* {{{ */
+	struct sockaddr_in addr;
+	int one = 1;
+
+	for (int tries = 0; tries < PORT_POOL_BIND_TRIES; tries++) {
+		int p = port_pool_alloc(pool);
+		if (p < 0) {
+			return -1;
+		}
+
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd < 0) {
+			port_pool_release(pool, p);
+			return -2;
+		}
+		/* The port's last data connections may still be in TIME_WAIT */
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_ANY);
+		addr.sin_port = htons(p);
+		if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0 \
+			&& listen(fd, LISTENQ) == 0) {
+
+			*listenfd = fd;
+			*port = p;
+			return 0;
+		}
+
+		/* Some other program has the port: let the others be tried first */
+		close(fd);
+		port_pool_release(pool, p);
+	}
+
+	return -3;
+	/* }}} */
+}
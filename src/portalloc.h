@@ -0,0 +1,29 @@
+#ifndef PORTALLOC_HEADER
+#define PORTALLOC_HEADER
+#include <stdint.h>
+
+/* The range passive data ports are allocated from by default: the dynamic
+ * ports of RFC 6335 */
+#define PORT_POOL_FIRST 49152
+#define PORT_POOL_LAST 65535
+/* The most ports 'port_pool_listen()' tries before giving up, should the
+ * ports it is given be in use by some other program */
+#define PORT_POOL_BIND_TRIES 8
+
+
+struct port_pool;
+
+
+struct port_pool * port_pool_create(uint16_t first, uint16_t last, int nslots);
+
+void port_pool_join(struct port_pool *pool, int slot);
+
+int port_pool_alloc(struct port_pool *pool);
+
+void port_pool_release(struct port_pool *pool, uint16_t port);
+
+void port_pool_reclaim(struct port_pool *pool, int slot);
+
+int port_pool_listen(struct port_pool *pool, int *listenfd, uint16_t *port);
+
+#endif
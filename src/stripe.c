@@ -0,0 +1,1152 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "dataconn.h"
+#include "ecftp.h"
+#include "fileops.h"
+#include "stripe.h"
+#include "uring.h"
+
+
+/* Striped transfers: the prepared (compressed and encrypted) file is cut into
+ * 'STRIPE_UNIT_LEN' byte units, and each unit is sent as a frame tagged with
+ * its sequence number over one of several data connections. Every
+ * connection takes the next unsent unit as soon as it has taken the last one,
+ * so a connection with a larger congestion window carries more of the file. The receiver writes each unit at the offset its sequence number
+ * gives, so the file is reassembled in order no matter which connection a
+ * unit came over or when it arrived. In block mode the data connections
+ * stay open after the transfer, so the next one starts on warm connections.
+ * Each connection is driven by a pump that stops whenever its socket would
+ * block and picks up from the same byte on the next call, so the client runs
+ * one blocking thread per connection while the server pumps the connections
+ * of all of its sessions from its event loop. A thread that gets an io_uring
+ * from the kernel reads (or writes) the file through it into a second buffer
+ * while the frame in the first one goes over the socket, so that the file
+ * and the network are busy at the same time. */
+
+
+/* The most data connections this end agrees to stripe a transfer over */
+static int max_streams = NDATAFD;
+/* Whether the threads of 'stripe_send_file()' and 'stripe_recv_file()' do
+ * their I/O through an io_uring when the kernel gives them one */
+static int use_uring = 1;
+
+/* The 'user_data' of a send a thread puts in its io_uring. A read or write
+ * of the file is tagged with the number of the buffer it is in */
+#define RING_SEND 2
+
+
+/* Define a struct holding the arguments of one sending or receiving thread */
+struct stripe_thread_args {
+	struct stripe_xfer *xfer;
+	struct stripe_conn *sc;
+};
+
+
+/* Define a struct holding the io_uring of one sending or receiving thread,
+ * and the two buffers its data connection takes turns with: the file is read
+ * into (or written from) one while the other is sent (or received) */
+struct stripe_ring {
+	struct uring ring;
+	uint8_t *bufs[2];
+	/* Set if the buffers are registered with the io_uring, so that it reads
+	 * and writes them without pinning them every time */
+	int fixed;
+	/* The read or write of the file in flight in each buffer, if any */
+	struct ring_file_op {
+		int pending;
+		int write;
+		size_t len;
+		uint64_t off;
+		/* Set once it has completed, with what it returned */
+		int complete;
+		int32_t res;
+		/* What it points the kernel at, which must stay put until then */
+		struct iovec iov;
+	} file[2];
+	/* Likewise for the send in flight */
+	struct iovec send_iov[2 * STRIPE_MAX_SEGMENTS];
+	struct msghdr send_msg;
+};
+
+
+/** Sets the most data connections this end agrees to stripe a transfer
+ * over.
+ *
+ * \param 'streams' between 1 and 'STRIPE_MAX_STREAMS'.
+ * \return 0 on success, -1 if 'streams' is out of range.
+ */
+int stripe_set_max_streams(int streams) {
+	if (streams < 1 || streams > STRIPE_MAX_STREAMS) {
+		return -1;
+	}
+	max_streams = streams;
+	return 0;
+}
+
+
+/** Returns the most data connections this end agrees to stripe a transfer
+ * over */
+int stripe_get_max_streams() {
+	return max_streams;
+}
+
+
+/** Sets whether the data connections of 'stripe_send_file()' and
+ * 'stripe_recv_file()' read and write through an io_uring (if the kernel
+ * gives them one) rather than with a system call for every read and write.
+ *
+ * \param 'on' 1 to use io_uring, 0 not to.
+ * \return void.
+ */
+void stripe_set_uring(int on) {
+	use_uring = on;
+}
+
+
+/** Takes the length of a prepared file and the most data connections the two
+ * ends agreed on, and returns the number of data connections to stripe it
+ * over: no more than there are units to send, and at least one.
+ */
+int stripe_count(uint64_t len, int streams) {
+	uint64_t units = (len + STRIPE_UNIT_LEN - 1) / STRIPE_UNIT_LEN;
+
+	if ((uint64_t) streams > units) streams = (int) units;
+	if (streams < 1) streams = 1;
+
+	return streams;
+}
+
+
+/** Lays out the header that tells the receiver of a transfer how many data
+ * connections it is striped over and how long the prepared file is.
+ *
+ * \param 'header' will be modified to contain the 'STRIPE_HEADER_LEN' bytes
+ *     of the header.
+ * \param 'streams' the number of data connections.
+ * \param 'len' the length of the prepared file.
+ * \return void.
+ */
+void stripe_encode_header(uint8_t header[STRIPE_HEADER_LEN], int streams, uint64_t len) {
+	header[0] = streams;
+	put_be(&header[1], len, 8);
+}
+
+
+/** Takes the first data connection of a transfer and tells the receiver how
+ * many data connections the transfer is striped over and how long the
+ * prepared file is.
+ *
+ * \param '*conn' the first data connection of the transfer.
+ * \param 'streams' the number of data connections.
+ * \param 'len' the length of the prepared file.
+ * \return 0 on success, a negative int upon failure.
+ */
+int stripe_write_header(struct data_conn *conn, int streams, uint64_t len) {
+	uint8_t header[STRIPE_HEADER_LEN];
+
+	stripe_encode_header(header, streams, len);
+
+	return data_write(conn, header, sizeof(header));
+}
+
+
+/** Takes the header written by 'stripe_write_header()', as read from the
+ * first data connection of a transfer, and checks and decodes it.
+ *
+ * \param 'header' the 'STRIPE_HEADER_LEN' bytes of the header.
+ * \param 'max' the most data connections agreed on for the transfer.
+ * \param '*streams' will be modified to contain the number of data
+ *     connections.
+ * \param '*len' will be modified to contain the length of the prepared file.
+ * \return 0 on success, a negative int if the header asks for more data
+ *     connections than were agreed on.
+ */
+int stripe_parse_header(const uint8_t header[STRIPE_HEADER_LEN], int max, \
+	int *streams, uint64_t *len) {
+
+	if (header[0] < 1 || header[0] > max) {
+		fprintf(stderr, "ERROR: peer striped the transfer over %d data connections, " \
+			"but at most %d were agreed on\n", header[0], max);
+		return -2;
+	}
+
+	*streams = header[0];
+	*len = get_be(&header[1], 8);
+
+	return 0;
+}
+
+
+/** Takes the first data connection of a transfer and reads the header
+ * written by 'stripe_write_header()'.
+ *
+ * \param '*conn' the first data connection of the transfer.
+ * \param 'max' the most data connections agreed on for the transfer.
+ * \param '*streams' will be modified to contain the number of data
+ *     connections.
+ * \param '*len' will be modified to contain the length of the prepared file.
+ * \return 0 on success, a negative int if the header could not be read or
+ *     asks for more data connections than were agreed on.
+ */
+int stripe_read_header(struct data_conn *conn, int max, int *streams, uint64_t *len) {
+	uint8_t header[STRIPE_HEADER_LEN];
+
+	if (0 != data_read_full(conn, header, sizeof(header))) {
+		return -1;
+	}
+
+	return stripe_parse_header(header, max, streams, len);
+}
+
+
+
+
+static void stripe_fail(struct stripe_xfer *x) {
+	pthread_mutex_lock(&x->lock);
+	x->err = 1;
+	pthread_mutex_unlock(&x->lock);
+}
+
+
+/** Takes one end of a striped transfer and opens the prepared file at 'path'
+ * to send it.
+ *
+ * \param '*x' the transfer, which will be set up.
+ * \param '*path' the path to the prepared file.
+ * \return 0 on success, a negative int if the file could not be opened.
+ */
+int stripe_xfer_open_send(struct stripe_xfer *x, const char *path) {
+	struct stat st;
+
+	if ((x->file_fd = open(path, O_RDONLY)) < 0) {
+		return -1;
+	}
+	if (0 != fstat(x->file_fd, &st)) {
+		close(x->file_fd);
+		return -1;
+	}
+	x->len = st.st_size;
+	x->num_units = (x->len + STRIPE_UNIT_LEN - 1) / STRIPE_UNIT_LEN;
+	x->units_done = 0;
+	x->received = NULL;
+	x->written = NULL;
+	x->kept = 0;
+	x->err = 0;
+	x->file_calls = 0;
+	pthread_mutex_init(&x->lock, NULL);
+
+	return 0;
+}
+
+
+/** Takes one end of a striped transfer and creates the file at 'path' that
+ * the 'len' byte prepared file will be reassembled in.
+ *
+ * \param '*x' the transfer, which will be set up.
+ * \param '*path' the path the prepared file will be written to.
+ * \param 'len' the length of the prepared file, as read from the transfer's
+ *     header.
+ * \return 0 on success, a negative int if the file could not be created.
+ */
+int stripe_xfer_open_recv(struct stripe_xfer *x, const char *path, uint64_t len) {
+	if ((x->file_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+		return -1;
+	}
+	x->len = len;
+	x->num_units = (len + STRIPE_UNIT_LEN - 1) / STRIPE_UNIT_LEN;
+	x->units_done = 0;
+	x->kept = 0;
+	x->err = 0;
+	x->file_calls = 0;
+	x->received = calloc(x->num_units / 8 + 1, 1);
+	x->written = calloc(x->num_units / 8 + 1, 1);
+	if (x->received == NULL || x->written == NULL) {
+		free(x->received);
+		free(x->written);
+		x->received = NULL;
+		close(x->file_fd);
+		return -1;
+	}
+	pthread_mutex_init(&x->lock, NULL);
+
+	return 0;
+}
+
+
+/** Takes one end of a striped transfer whose data connections are all done
+ * and closes its file. The receiving end sets 'kept' to how much of the
+ * start of the file was written, whether or not the rest was.
+ *
+ * \param '*x' the transfer.
+ * \return 0 if every unit was sent or received, a negative int otherwise.
+ */
+int stripe_xfer_close(struct stripe_xfer *x) {
+	/* {{{ */
+	int ret = x->err ? -2 : 0;
+
+	if (x->received != NULL) {
+		if (x->err || x->units_done != x->num_units) {
+			fprintf(stderr, "ERROR: received %lu of %lu units of the file\n", \
+				(unsigned long) x->units_done, (unsigned long) x->num_units);
+			ret = -2;
+		}
+		uint64_t seq = 0;
+		while (seq < x->num_units && ((x->written[seq / 8] >> (seq % 8)) & 1)) {
+			seq++;
+		}
+		x->kept = seq == x->num_units ? x->len : seq * STRIPE_UNIT_LEN;
+		free(x->received);
+		free(x->written);
+		x->received = NULL;
+		x->written = NULL;
+	}
+	pthread_mutex_destroy(&x->lock);
+	close(x->file_fd);
+
+	return ret;
+	/* }}} */
+}
+
+
+/** Returns a stripe buffer of 'STRIPE_BUF_LEN' bytes starting on a page
+ * boundary, which is freed with 'free()', or NULL upon failure */
+uint8_t * stripe_buf_alloc() {
+	void *buf;
+
+	if (0 != posix_memalign(&buf, STRIPE_BUF_ALIGN, STRIPE_BUF_LEN)) {
+		return NULL;
+	}
+	return buf;
+}
+
+
+/** Takes a data connection of a striped transfer and sets up the state
+ * 'stripe_send_pump()' or 'stripe_recv_pump()' keeps for it. A sender keeps
+ * the frame being sent in the buffer, and a receiver the unit being
+ * received.
+ *
+ * \param '*sc' the state, which will be set up.
+ * \param '*conn' the data connection.
+ * \param '*buf' a buffer of 'STRIPE_BUF_LEN' bytes, which the caller frees
+ *     (or reuses) once the transfer is over.
+ * \return void.
+ */
+void stripe_conn_init(struct stripe_conn *sc, struct data_conn *conn, uint8_t *buf) {
+	/* The connection's system calls are counted from the transfer's start */
+	conn->calls = 0;
+	sc->conn = conn;
+	sc->buf = buf;
+	sc->len = 0;
+	sc->off = 0;
+	sc->frame_len = 0;
+	sc->nseg = 0;
+	sc->hdr_have = 0;
+	sc->ending = 0;
+	sc->done = 0;
+	sc->ring = NULL;
+}
+
+
+/** Takes one end of a striped transfer and sums up what it cost so far over
+ * its 'n' data connections.
+ *
+ * \param '*x' the transfer.
+ * \param '*conns' the data connections of the transfer.
+ * \param 'n' the number of data connections.
+ * \param '*stats' will be modified to contain the transfer's statistics.
+ * \return void.
+ */
+void stripe_xfer_stats(const struct stripe_xfer *x, const struct data_conn *conns, int n, \
+	struct stripe_stats *stats) {
+
+	stats->bytes = x->len;
+	stats->socket_calls = 0;
+	stats->file_calls = __atomic_load_n(&x->file_calls, __ATOMIC_RELAXED);
+	for (int i = 0; i < n; i++) {
+		stats->socket_calls += conns[i].calls;
+	}
+}
+
+
+/** Reads exactly 'len' bytes at 'offset' of the file of 'x' into 'buf' */
+static int pread_full(struct stripe_xfer *x, uint8_t *buf, size_t len, uint64_t offset) {
+	size_t nread = 0;
+
+	while (nread < len) {
+		__atomic_add_fetch(&x->file_calls, 1, __ATOMIC_RELAXED);
+		ssize_t r = pread(x->file_fd, &buf[nread], len - nread, offset + nread);
+		if (r <= 0) return -1;
+		nread += r;
+	}
+
+	return 0;
+}
+
+
+/** Writes exactly 'len' bytes from 'buf' at 'offset' of the file of 'x' */
+static int pwrite_full(struct stripe_xfer *x, const uint8_t *buf, size_t len, uint64_t offset) {
+	size_t written = 0;
+
+	while (written < len) {
+		__atomic_add_fetch(&x->file_calls, 1, __ATOMIC_RELAXED);
+		ssize_t w = pwrite(x->file_fd, &buf[written], len - written, offset + written);
+		if (w <= 0) return -1;
+		written += w;
+	}
+
+	return 0;
+}
+
+
+/** Notes that the unit at 'offset' of the file of the receiving end 'x' has
+ * been written */
+static void mark_written(struct stripe_xfer *x, uint64_t offset) {
+	uint64_t seq = offset / STRIPE_UNIT_LEN;
+
+	pthread_mutex_lock(&x->lock);
+	x->written[seq / 8] |= 1 << (seq % 8);
+	pthread_mutex_unlock(&x->lock);
+}
+
+
+/** Returns the length of the unit 'seq' of the file of 'x' */
+static size_t unit_len(const struct stripe_xfer *x, uint64_t seq) {
+	uint64_t left = x->len - seq * STRIPE_UNIT_LEN;
+
+	return left < STRIPE_UNIT_LEN ? left : STRIPE_UNIT_LEN;
+}
+
+
+/** Takes the sending end of a striped transfer and hands out the next unit
+ * to send. Returns 1 with the unit in '*seq', or 0 if there are none left
+ * or the transfer has failed */
+static int take_unit(struct stripe_xfer *x, uint64_t *seq) {
+	pthread_mutex_lock(&x->lock);
+	*seq = x->units_done++;
+	int failed = x->err;
+	pthread_mutex_unlock(&x->lock);
+
+	return *seq < x->num_units && !failed;
+}
+
+
+/** Takes the stripe state of a data connection whose buffer holds the unit
+ * 'seq' and puts the header of the frame that carries it just before it,
+ * then works out the segments the frame is sent in: in block mode a frame is
+ * cut into blocks, whose headers are sent from 'seg_hdr' in between the
+ * pieces of the frame rather than being copied in amongst them */
+static void layout_frame(struct stripe_conn *sc, uint64_t seq, size_t unit_len) {
+	/* {{{ */
+	uint8_t *frame = &sc->buf[STRIPE_UNIT_OFF - STRIPE_FRAME_HEADER_LEN];
+
+	put_be(&frame[0], seq, 8);
+	put_be(&frame[8], unit_len, 4);
+
+	size_t max = data_segment_max(sc->conn);
+	size_t done = 0;
+
+	sc->frame_len = STRIPE_FRAME_HEADER_LEN + unit_len;
+	sc->nseg = 0;
+	while (done < sc->frame_len) {
+		size_t count = sc->frame_len - done < max ? sc->frame_len - done : max;
+
+		sc->seg_hdr_len = data_segment_header(sc->conn, sc->seg_hdr[sc->nseg++], count);
+		done += count;
+	}
+	sc->len = data_encoded_len(sc->conn, sc->frame_len);
+	sc->off = 0;
+	/* }}} */
+}
+
+
+/** Reads the unit 'seq' into the buffer of 'sc', with a single read of the
+ * file, and lays out the frame that carries it */
+static int build_frame(struct stripe_xfer *x, struct stripe_conn *sc, uint64_t seq) {
+	size_t len = unit_len(x, seq);
+
+	if (0 != pread_full(x, &sc->buf[STRIPE_UNIT_OFF], len, seq * STRIPE_UNIT_LEN)) {
+		return -1;
+	}
+	layout_frame(sc, seq, len);
+
+	return 0;
+}
+
+
+/** Takes the stripe state of a data connection and describes in 'iov' the
+ * bytes of its frame that are still to be sent, segment headers included, in
+ * the order they go on the wire. Returns the number of entries of 'iov'
+ * used, at most '2 * STRIPE_MAX_SEGMENTS' */
+static int frame_iov(const struct stripe_conn *sc, struct iovec *iov) {
+	/* {{{ */
+	const uint8_t *frame = &sc->buf[STRIPE_UNIT_OFF - STRIPE_FRAME_HEADER_LEN];
+	size_t max = data_segment_max(sc->conn);
+	size_t skip = sc->off;
+	int n = 0;
+
+	for (int k = 0; k < sc->nseg; k++) {
+		size_t start = k * max;
+		size_t count = sc->frame_len - start < max ? sc->frame_len - start : max;
+		const uint8_t *piece[2] = { sc->seg_hdr[k], &frame[start] };
+		size_t piece_len[2] = { sc->seg_hdr_len, count };
+
+		for (int j = 0; j < 2; j++) {
+			/* Skip what has been sent already */
+			if (skip >= piece_len[j]) {
+				skip -= piece_len[j];
+				continue;
+			}
+			iov[n].iov_base = (void *) (piece[j] + skip);
+			iov[n++].iov_len = piece_len[j] - skip;
+			skip = 0;
+		}
+	}
+
+	return n;
+	/* }}} */
+}
+
+
+/** Takes the stripe state of a data connection driven by its own thread and
+ * gives it an io_uring, and a second buffer to take turns with the one it
+ * has.
+ *
+ * \param '*r' the io_uring state, which will be set up.
+ * \param '*sc' the stripe state of the data connection.
+ * \return 0 on success, a negative int if the kernel gives this process no
+ *     io_uring (or too old a one), in which case the connection does its I/O
+ *     with plain system calls.
+ */
+static int ring_init(struct stripe_ring *r, struct stripe_conn *sc) {
+	/* {{{ */
+	struct iovec iov[2];
+
+	if (0 != uring_init(&r->ring, 4)) {
+		return -1;
+	}
+	/* Sending messages through an io_uring came in 5.3, and rings mapped as
+	 * one in 5.4 */
+	if (!(r->ring.features & IORING_FEAT_SINGLE_MMAP) \
+		|| (r->bufs[1] = stripe_buf_alloc()) == NULL) {
+
+		uring_exit(&r->ring);
+		return -1;
+	}
+	r->bufs[0] = sc->buf;
+	memset(r->file, 0, sizeof(r->file));
+
+	/* Pinning the buffers for good counts against the limit on locked
+	 * memory, and when that is too low they are pinned for each read and
+	 * write instead */
+	for (int i = 0; i < 2; i++) {
+		iov[i].iov_base = r->bufs[i];
+		iov[i].iov_len = STRIPE_BUF_LEN;
+	}
+	r->fixed = (0 == uring_register_buffers(&r->ring, iov, 2));
+#if DEBUG_LEVEL >= 2
+	fprintf(stderr, "STATUS: data connection uses an io_uring with %s buffers\n", \
+		r->fixed ? "registered" : "unregistered");
+#endif
+	sc->ring = r;
+
+	return 0;
+	/* }}} */
+}
+
+
+/** Takes the stripe state of a data connection with nothing left in flight
+ * in its io_uring, and frees the io_uring and the second buffer. The calls
+ * made to the io_uring are counted as calls on the socket when sending (where
+ * each one sends a frame) and on the file when receiving (where each one
+ * writes a unit) */
+static void ring_exit(struct stripe_ring *r, struct stripe_xfer *x, struct stripe_conn *sc, \
+	int sending) {
+
+	if (sending) {
+		sc->conn->calls += r->ring.enters;
+	} else {
+		__atomic_add_fetch(&x->file_calls, r->ring.enters, __ATOMIC_RELAXED);
+	}
+	sc->buf = r->bufs[0];
+	sc->ring = NULL;
+	uring_exit(&r->ring);
+	free(r->bufs[1]);
+}
+
+
+/** Queues a read of 'len' bytes at 'offset' of the file of 'x' into the unit
+ * of buffer 'b', or a write of them from it, for the next submission */
+static int ring_queue_file(struct stripe_ring *r, struct stripe_xfer *x, int write, int b, \
+	size_t len, uint64_t offset) {
+
+	/* {{{ */
+	struct io_uring_sqe *sqe = uring_get_sqe(&r->ring);
+	struct ring_file_op *op = &r->file[b];
+	uint8_t *unit = &r->bufs[b][STRIPE_UNIT_OFF];
+
+	if (sqe == NULL) {
+		return -1;
+	}
+	sqe->fd = x->file_fd;
+	sqe->off = offset;
+	sqe->user_data = b;
+	if (r->fixed) {
+		sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+		sqe->addr = (uintptr_t) unit;
+		sqe->len = len;
+		sqe->buf_index = b;
+	} else {
+		op->iov.iov_base = unit;
+		op->iov.iov_len = len;
+		sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+		sqe->addr = (uintptr_t) &op->iov;
+		sqe->len = 1;
+	}
+
+	op->pending = 1;
+	op->write = write;
+	op->len = len;
+	op->off = offset;
+	op->complete = 0;
+
+	return 0;
+	/* }}} */
+}
+
+
+/** Waits for the operation tagged 'tag' to complete and puts what it
+ * returned in '*res'. A read or write of the file that completes while
+ * something else is waited for is kept for when it is waited for itself */
+static int ring_reap(struct stripe_ring *r, uint64_t tag, int32_t *res) {
+	uint64_t user_data;
+	int32_t got;
+
+	if (tag != RING_SEND && r->file[tag].complete) {
+		*res = r->file[tag].res;
+		return 0;
+	}
+	while (1) {
+		if (0 != uring_wait(&r->ring, &user_data, &got)) {
+			return -1;
+		}
+		if (user_data == tag) {
+			*res = got;
+			return 0;
+		}
+		if (user_data != RING_SEND) {
+			r->file[user_data].complete = 1;
+			r->file[user_data].res = got;
+		}
+	}
+}
+
+
+/** Waits for the read or write of the file in flight in buffer 'b', if any,
+ * to complete (handing the kernel anything queued), and finishes it with
+ * plain system calls if it came up short. Returns 0 on success, -1 if the
+ * read or write failed */
+static int ring_file_finish(struct stripe_ring *r, struct stripe_xfer *x, int b) {
+	/* {{{ */
+	struct ring_file_op *op = &r->file[b];
+	int32_t res;
+
+	if (!op->pending) {
+		return 0;
+	}
+	op->pending = 0;
+	if (0 != ring_reap(r, b, &res) || res < 0) {
+		return -1;
+	}
+
+	size_t done = res;
+	uint8_t *unit = &r->bufs[b][STRIPE_UNIT_OFF];
+	if (done < op->len) {
+		if (!op->write) {
+			return pread_full(x, &unit[done], op->len - done, op->off + done);
+		}
+		if (0 != pwrite_full(x, &unit[done], op->len - done, op->off + done)) {
+			return -1;
+		}
+	}
+	if (op->write) {
+		mark_written(x, op->off);
+	}
+
+	return 0;
+	/* }}} */
+}
+
+
+/** Takes the stripe state of a receiving data connection whose buffer holds
+ * a whole unit, and starts writing the unit to the file through the
+ * connection's io_uring. The connection goes on receiving into the other
+ * buffer once the write from it (the last unit's) is done, which is waited
+ * for in the same call that hands the kernel this write */
+static int ring_write_unit(struct stripe_ring *r, struct stripe_xfer *x, \
+	struct stripe_conn *sc) {
+
+	/* {{{ */
+	int b = (sc->buf == r->bufs[0]) ? 0 : 1;
+
+	if (0 != ring_queue_file(r, x, 1, b, sc->len, sc->seq * STRIPE_UNIT_LEN)) {
+		return -1;
+	}
+	if (r->file[1 - b].pending) {
+		if (0 != ring_file_finish(r, x, 1 - b)) {
+			return -1;
+		}
+	} else if (0 != uring_submit(&r->ring, 0)) {
+		r->file[b].pending = 0;
+		return -1;
+	}
+	sc->buf = r->bufs[1 - b];
+
+	return 0;
+	/* }}} */
+}
+
+
+/** Takes the sending end of a striped transfer and one of its data
+ * connections, and sends units over the connection until there are none
+ * left, then ends the transfer's data on it. Every connection takes the next
+ * unsent unit as soon as it has sent its last one. On a non-blocking
+ * connection this stops as soon as the socket is full, and carries on from
+ * the same byte on the next call.
+ *
+ * \param '*x' the sending end of the transfer.
+ * \param '*sc' the stripe state of the data connection.
+ * \return 'STRIPE_DONE' once the connection has nothing left to send,
+ *     'STRIPE_AGAIN' if the socket is full, or 'STRIPE_FAILED' if the
+ *     connection failed.
+ */
+int stripe_send_pump(struct stripe_xfer *x, struct stripe_conn *sc) {
+	/* {{{ */
+	if (sc->done) {
+		return STRIPE_DONE;
+	}
+
+	while (1) {
+		while (sc->off < sc->len) {
+			struct iovec iov[2 * STRIPE_MAX_SEGMENTS];
+			struct msghdr msg;
+
+			/* The whole rest of the frame, however many blocks it is cut
+			 * into, goes to the kernel in one call */
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = iov;
+			msg.msg_iovlen = frame_iov(sc, iov);
+			ssize_t w = sendmsg(sc->conn->fd, &msg, MSG_NOSIGNAL);
+			sc->conn->calls++;
+			if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				return STRIPE_AGAIN;
+			}
+			if (w < 0 && errno == EINTR) continue;
+			if (w <= 0) {
+				stripe_fail(x);
+				sc->done = 1;
+				return STRIPE_FAILED;
+			}
+			sc->off += w;
+		}
+
+		if (sc->ending) {
+			if (sc->conn->mode == MODE_STREAM) {
+				shutdown(sc->conn->fd, SHUT_WR);
+				sc->conn->calls++;
+			}
+			sc->done = 1;
+			return STRIPE_DONE;
+		}
+
+		uint64_t seq;
+		if (take_unit(x, &seq)) {
+			if (0 == build_frame(x, sc, seq)) continue;
+			stripe_fail(x);
+		}
+
+		/* Tell the receiver this connection carries no more frames: with an
+		 * empty EOF block in block mode, or by closing it for writing once
+		 * the last frame is out in stream mode */
+		sc->frame_len = 0;
+		sc->nseg = 0;
+		sc->len = 0;
+		sc->off = 0;
+		if (sc->conn->mode == MODE_BLOCK) {
+			sc->seg_hdr[0][0] = BLOCK_DESC_EOF;
+			sc->seg_hdr[0][1] = 0;
+			sc->seg_hdr[0][2] = 0;
+			sc->seg_hdr_len = BLOCK_HEADER_LEN;
+			sc->nseg = 1;
+			sc->len = BLOCK_HEADER_LEN;
+		}
+		sc->ending = 1;
+	}
+	/* }}} */
+}
+
+
+/** Takes the receiving end of a striped transfer and one of its data
+ * connections, and receives frames from the connection until the sender ends
+ * the transfer's data on it, writing each unit at the offset its sequence
+ * number gives. On a non-blocking connection this stops as soon as there is
+ * nothing to read, and carries on from the same byte on the next call.
+ *
+ * \param '*x' the receiving end of the transfer.
+ * \param '*sc' the stripe state of the data connection.
+ * \return 'STRIPE_DONE' once the sender has ended the transfer's data on the
+ *     connection, 'STRIPE_AGAIN' if there is nothing to read yet,
+ *     'STRIPE_FAILED' if the connection failed or ended in the middle of a
+ *     frame, or 'STRIPE_BAD_DATA' if a frame could not be used, in which
+ *     case the rest of the transfer's data is still to be read from the
+ *     connection.
+ */
+int stripe_recv_pump(struct stripe_xfer *x, struct stripe_conn *sc) {
+	/* {{{ */
+	ssize_t r;
+
+	if (sc->done) {
+		return STRIPE_DONE;
+	}
+
+	while (1) {
+		if (sc->len == 0) {
+			if (sc->hdr_have < STRIPE_FRAME_HEADER_LEN) {
+				r = data_read(sc->conn, &sc->hdr[sc->hdr_have], \
+					STRIPE_FRAME_HEADER_LEN - sc->hdr_have);
+				if (r == DATA_AGAIN) {
+					return STRIPE_AGAIN;
+				}
+				/* The sender ending the transfer's data between frames ends
+				 * the stripe */
+				if (r == 0 && sc->hdr_have == 0) {
+					sc->done = 1;
+					return STRIPE_DONE;
+				}
+				if (r <= 0) {
+					stripe_fail(x);
+					sc->done = 1;
+					return STRIPE_FAILED;
+				}
+				sc->hdr_have += r;
+				if (sc->hdr_have < STRIPE_FRAME_HEADER_LEN) continue;
+			}
+
+			uint64_t seq = get_be(&sc->hdr[0], 8);
+			size_t len = get_be(&sc->hdr[8], 4);
+			int bad = (seq >= x->num_units || len != unit_len(x, seq));
+			if (!bad) {
+				pthread_mutex_lock(&x->lock);
+				bad = (x->received[seq / 8] >> (seq % 8)) & 1;
+				x->received[seq / 8] |= 1 << (seq % 8);
+				x->units_done++;
+				pthread_mutex_unlock(&x->lock);
+			}
+			if (bad) {
+				stripe_fail(x);
+				sc->done = 1;
+				return STRIPE_BAD_DATA;
+			}
+			sc->seq = seq;
+			sc->len = len;
+			sc->off = 0;
+		}
+
+		while (sc->off < sc->len) {
+			/* The header of the next frame is read along with the rest of
+			 * this one. Whatever follows a frame on its data connection is
+			 * another frame or the end of the transfer's data, so this never
+			 * reads too far */
+			r = data_read(sc->conn, &sc->buf[STRIPE_UNIT_OFF + sc->off], \
+				sc->len - sc->off + STRIPE_FRAME_HEADER_LEN);
+			if (r == DATA_AGAIN) {
+				return STRIPE_AGAIN;
+			}
+			if (r <= 0) {
+				stripe_fail(x);
+				sc->done = 1;
+				return STRIPE_FAILED;
+			}
+			sc->off += r;
+		}
+
+		/* Whatever was read past the unit is the start of the next frame */
+		sc->hdr_have = sc->off - sc->len;
+		memcpy(sc->hdr, &sc->buf[STRIPE_UNIT_OFF + sc->len], sc->hdr_have);
+		int w = sc->ring != NULL ? ring_write_unit(sc->ring, x, sc) \
+			: pwrite_full(x, &sc->buf[STRIPE_UNIT_OFF], sc->len, sc->seq * STRIPE_UNIT_LEN);
+		if (w != 0) {
+			stripe_fail(x);
+			sc->done = 1;
+			return STRIPE_BAD_DATA;
+		}
+		/* A unit written through the io_uring is marked once the write is
+		 * done */
+		if (sc->ring == NULL) {
+			mark_written(x, sc->seq * STRIPE_UNIT_LEN);
+		}
+		sc->len = 0;
+	}
+	/* }}} */
+}
+
+
+/** Takes the sending end of a striped transfer and one of its data
+ * connections, driven by its own thread and given an io_uring, and sends
+ * units over the connection until there are none left, then ends the
+ * transfer's data on it. The next unit is read into one buffer while the
+ * frame in the other is sent, and both go to the kernel in the call that
+ * waits for the send.
+ *
+ * \param '*x' the sending end of the transfer.
+ * \param '*sc' the stripe state of the data connection.
+ * \return void.
+ */
+static void ring_send_stripe(struct stripe_xfer *x, struct stripe_conn *sc) {
+	/* {{{ */
+	struct stripe_ring *r = sc->ring;
+	uint64_t seq, next;
+	int cur = 0;
+	int32_t res;
+
+	int have = take_unit(x, &seq);
+	if (have && 0 != ring_queue_file(r, x, 0, cur, unit_len(x, seq), seq * STRIPE_UNIT_LEN)) {
+		stripe_fail(x);
+		have = 0;
+	}
+
+	while (have && !sc->done) {
+		if (0 != ring_file_finish(r, x, cur)) {
+			stripe_fail(x);
+			break;
+		}
+		sc->buf = r->bufs[cur];
+		layout_frame(sc, seq, unit_len(x, seq));
+
+		have = take_unit(x, &next);
+		if (have && 0 != ring_queue_file(r, x, 0, 1 - cur, unit_len(x, next), \
+			next * STRIPE_UNIT_LEN)) {
+
+			stripe_fail(x);
+			have = 0;
+		}
+
+		while (sc->off < sc->len) {
+			struct io_uring_sqe *sqe = uring_get_sqe(&r->ring);
+
+			if (sqe != NULL) {
+				memset(&r->send_msg, 0, sizeof(r->send_msg));
+				r->send_msg.msg_iov = r->send_iov;
+				r->send_msg.msg_iovlen = frame_iov(sc, r->send_iov);
+				sqe->opcode = IORING_OP_SENDMSG;
+				sqe->fd = sc->conn->fd;
+				sqe->addr = (uintptr_t) &r->send_msg;
+				sqe->len = 1;
+				sqe->msg_flags = MSG_NOSIGNAL;
+				sqe->user_data = RING_SEND;
+			}
+			if (sqe == NULL || 0 != ring_reap(r, RING_SEND, &res)) {
+				res = -EIO;
+			}
+			if (res == -EINTR || res == -EAGAIN) continue;
+			if (res <= 0) {
+				stripe_fail(x);
+				sc->done = 1;
+				break;
+			}
+			sc->off += res;
+		}
+
+		cur = 1 - cur;
+		seq = next;
+	}
+
+	/* The buffers are freed once this returns, so nothing may still be read
+	 * into them */
+	ring_file_finish(r, x, 0);
+	ring_file_finish(r, x, 1);
+
+	/* With no frame left, the pump only ends the transfer's data */
+	sc->buf = r->bufs[cur];
+	sc->len = 0;
+	sc->off = 0;
+	stripe_send_pump(x, sc);
+	/* }}} */
+}
+
+
+static void *send_stripe(void *arg) {
+	struct stripe_thread_args *t = (struct stripe_thread_args *) arg;
+	struct stripe_ring r;
+
+	if (use_uring && 0 == ring_init(&r, t->sc)) {
+		ring_send_stripe(t->xfer, t->sc);
+		ring_exit(&r, t->xfer, t->sc, 1);
+	} else {
+		stripe_send_pump(t->xfer, t->sc);
+	}
+
+	return NULL;
+}
+
+
+static void *recv_stripe(void *arg) {
+	struct stripe_thread_args *t = (struct stripe_thread_args *) arg;
+	struct stripe_ring r;
+	int ringed = use_uring && 0 == ring_init(&r, t->sc);
+
+	int ret = stripe_recv_pump(t->xfer, t->sc);
+	if (ringed) {
+		/* The last unit may still be being written, and if the write of the
+		 * one before it failed it is still to be reaped */
+		int failed = ring_file_finish(&r, t->xfer, 0);
+		if (0 != ring_file_finish(&r, t->xfer, 1) || failed) {
+			stripe_fail(t->xfer);
+		}
+		ring_exit(&r, t->xfer, t->sc, 0);
+	}
+	/* Keep reading until the sender is done, so it is not left blocked on a
+	 * connection nobody reads */
+	if (ret == STRIPE_BAD_DATA) {
+		data_drain(t->sc->conn);
+	}
+
+	return NULL;
+}
+
+
+/** Runs 'fn' in one thread per data connection of the blocking transfer 'x'
+ * and waits for all of them */
+static void run_stripes(void *(*fn)(void *), struct stripe_xfer *x, \
+	struct data_conn *conns, int nconns, int sending) {
+
+	/* {{{ */
+	pthread_t threads[STRIPE_MAX_STREAMS];
+	struct stripe_thread_args args[STRIPE_MAX_STREAMS];
+	struct stripe_conn sc[STRIPE_MAX_STREAMS];
+	int started[STRIPE_MAX_STREAMS];
+
+	for (int i = 0; i < nconns; i++) {
+		uint8_t *buf = stripe_buf_alloc();
+
+		started[i] = 0;
+		if (buf == NULL) {
+			fprintf(stderr, "ERROR: could not allocate a stripe buffer\n");
+			/* The other end still waits for this connection's data to end */
+			stripe_fail(x);
+			conns[i].calls = 0;
+			if (sending) {
+				data_end(&conns[i]);
+			} else {
+				data_drain(&conns[i]);
+			}
+			continue;
+		}
+		stripe_conn_init(&sc[i], &conns[i], buf);
+		args[i].xfer = x;
+		args[i].sc = &sc[i];
+		if (0 == pthread_create(&threads[i], NULL, fn, &args[i])) {
+			started[i] = 1;
+		} else {
+			/* Serve the connection from this thread rather than leave the
+			 * other end waiting on it */
+			fn(&args[i]);
+			free(buf);
+		}
+	}
+	for (int i = 0; i < nconns; i++) {
+		if (started[i]) {
+			pthread_join(threads[i], NULL);
+			free(sc[i].buf);
+		}
+	}
+
+#if DEBUG_LEVEL >= 1
+	struct stripe_stats stats;
+
+	stripe_xfer_stats(x, conns, nconns, &stats);
+	fprintf(stderr, "DEBUG: %s %lu bytes in %lu socket and %lu file system calls\n", \
+		sending ? "sent" : "received", (unsigned long) stats.bytes, \
+		(unsigned long) stats.socket_calls, (unsigned long) stats.file_calls);
+#endif
+	/* }}} */
+}
+
+
+/** Takes the data connections of a transfer and the path to a prepared file
+ * and sends the file striped over all of the connections, ending the
+ * transfer's data on each connection once there is nothing left for it to
+ * send.
+ *
+ * \param '*conns' the data connections of the transfer.
+ * \param 'nconns' the number of data connections, as sent in the transfer's
+ *     header.
+ * \param '*path' the path to the prepared file.
+ * \return 0 on success, a negative int upon failure.
+ */
+int stripe_send_file(struct data_conn *conns, int nconns, const char *path) {
+	struct stripe_xfer x;
+
+	if (0 != stripe_xfer_open_send(&x, path)) {
+		/* Still end the transfer's data, so the receiver is not left
+		 * waiting for it */
+		for (int i = 0; i < nconns; i++) {
+			data_end(&conns[i]);
+		}
+		return -1;
+	}
+
+#if DEBUG_LEVEL >= 1
+	fprintf(stderr, "DEBUG: sending %lu units over %d data connections\n", \
+		(unsigned long) x.num_units, nconns);
+#endif
+	run_stripes(send_stripe, &x, conns, nconns, 1);
+
+	return stripe_xfer_close(&x);
+}
+
+
+/** Takes the data connections of a transfer and receives the prepared file
+ * striped over them, reassembling it in order at 'path'.
+ *
+ * \param '*conns' the data connections of the transfer.
+ * \param 'nconns' the number of data connections, as read from the transfer's
+ *     header.
+ * \param '*path' the path the prepared file will be written to.
+ * \param 'len' the length of the prepared file, as read from the transfer's
+ *     header.
+ * \param '*kept' if not NULL, will be modified to contain the number of
+ *     bytes at the start of the file that were all written, even if the
+ *     rest were not.
+ * \return 0 on success, a negative int if the file could not be written or
+ *     was not received in full.
+ */
+int stripe_recv_file(struct data_conn *conns, int nconns, const char *path, uint64_t len, \
+	uint64_t *kept) {
+
+	struct stripe_xfer x;
+
+	if (kept != NULL) *kept = 0;
+	if (0 != stripe_xfer_open_recv(&x, path, len)) {
+		for (int i = 0; i < nconns; i++) {
+			data_drain(&conns[i]);
+		}
+		return -1;
+	}
+
+	run_stripes(recv_stripe, &x, conns, nconns, 0);
+
+	int ret = stripe_xfer_close(&x);
+	if (kept != NULL) *kept = x.kept;
+
+	return ret;
+}
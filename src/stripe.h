@@ -0,0 +1,151 @@
+#ifndef STRIPE_HEADER
+#define STRIPE_HEADER
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dataconn.h"
+
+/* The number of bytes of the prepared file carried by each frame */
+#define STRIPE_UNIT_LEN (1 << 20)
+/* The most data connections a transfer can be striped over */
+#define STRIPE_MAX_STREAMS 16
+/* A frame starts with its big-endian 8-byte sequence number followed by the
+ * big-endian 4-byte length of its payload */
+#define STRIPE_FRAME_HEADER_LEN 12
+/* A transfer starts with the number of data connections it is striped over
+ * (1 byte) followed by the big-endian 8-byte length of the prepared file */
+#define STRIPE_HEADER_LEN 9
+/* Stripe buffers start on a page boundary, and the unit in a buffer starts
+ * on the page after that, so that it is read from and written to the file
+ * whole pages at a time. A frame's header goes just before its unit */
+#define STRIPE_BUF_ALIGN 4096
+#define STRIPE_UNIT_OFF STRIPE_BUF_ALIGN
+/* The size of the buffer each data connection of a transfer needs: a whole
+ * frame, and room for a receiver to read the header of the next frame along
+ * with it */
+#define STRIPE_BUF_LEN (STRIPE_UNIT_OFF + STRIPE_UNIT_LEN + STRIPE_FRAME_HEADER_LEN)
+/* The most segments (blocks, in block mode) a frame is sent in */
+#define STRIPE_MAX_SEGMENTS ((STRIPE_FRAME_HEADER_LEN + STRIPE_UNIT_LEN \
+	+ BLOCK_MAX_COUNT - 1) / BLOCK_MAX_COUNT)
+/* What 'stripe_send_pump()' and 'stripe_recv_pump()' return */
+#define STRIPE_DONE 0
+#define STRIPE_AGAIN 1
+#define STRIPE_FAILED -1
+#define STRIPE_BAD_DATA -2
+
+
+struct stripe_ring;
+
+
+/* Define a struct holding what the data connections of one end of a striped
+ * transfer share */
+struct stripe_xfer {
+	/* The file being sent or received */
+	int file_fd;
+	/* The length of the prepared file */
+	uint64_t len;
+	/* The number of units the file is cut into */
+	uint64_t num_units;
+	/* Sending: the next unit to send. Receiving: the number of units
+	 * received */
+	uint64_t units_done;
+	/* Receiving: one bit per unit, set once the unit's frame has started to
+	 * arrive, and one set once the unit has been written to the file */
+	uint8_t *received;
+	uint8_t *written;
+	/* Receiving: set by 'stripe_xfer_close()' to the number of bytes at the
+	 * start of the file that were all written, which a failed transfer can
+	 * be restarted after */
+	uint64_t kept;
+	/* Taken by each connection's pump when it is driven by its own thread */
+	pthread_mutex_t lock;
+	/* Set by any connection that fails */
+	int err;
+	/* The system calls made on the file, for the transfer's statistics */
+	uint64_t file_calls;
+};
+
+/* Define a struct holding what a striped transfer cost */
+struct stripe_stats {
+	/* The length of the prepared file */
+	uint64_t bytes;
+	/* The system calls made on the data connections and on the file */
+	uint64_t socket_calls;
+	uint64_t file_calls;
+};
+
+/* Define a struct holding how far one data connection of a striped transfer
+ * has got, so that the connection can be pumped until its socket would
+ * block and then picked up again from the same byte */
+struct stripe_conn {
+	struct data_conn *conn;
+	/* Sending: the frame being sent, its header at 'STRIPE_UNIT_OFF' -
+	 * 'STRIPE_FRAME_HEADER_LEN' and its unit at 'STRIPE_UNIT_OFF'.
+	 * Receiving: the unit being received, at 'STRIPE_UNIT_OFF' */
+	uint8_t *buf;
+	/* Sending: the bytes the frame takes on the wire, segment headers
+	 * included. Receiving: the length of the unit. Of either, the first
+	 * 'off' bytes have been sent or received */
+	size_t len;
+	size_t off;
+	/* Sending: the length of the frame, and the headers of the segments it
+	 * is sent in, each 'seg_hdr_len' bytes long (none in stream mode) */
+	size_t frame_len;
+	uint8_t seg_hdr[STRIPE_MAX_SEGMENTS][BLOCK_HEADER_LEN];
+	int nseg;
+	size_t seg_hdr_len;
+	/* Receiving: the header of the frame being received, of which
+	 * 'hdr_have' bytes have been read, and the unit it carries. 'len' is 0
+	 * until the header has been read */
+	uint8_t hdr[STRIPE_FRAME_HEADER_LEN];
+	size_t hdr_have;
+	uint64_t seq;
+	/* Sending: set once the end of the transfer's data has been queued */
+	int ending;
+	/* Set once the connection has nothing more to do for the transfer */
+	int done;
+	/* The io_uring of a connection driven by its own thread, if it got one
+	 * (NULL on the server, whose event loop does the connection's I/O) */
+	struct stripe_ring *ring;
+};
+
+
+int stripe_set_max_streams(int);
+
+int stripe_get_max_streams();
+
+void stripe_set_uring(int);
+
+int stripe_count(uint64_t, int);
+
+void stripe_encode_header(uint8_t[STRIPE_HEADER_LEN], int, uint64_t);
+
+int stripe_write_header(struct data_conn *, int, uint64_t);
+
+int stripe_parse_header(const uint8_t[STRIPE_HEADER_LEN], int, int *, uint64_t *);
+
+int stripe_read_header(struct data_conn *, int, int *, uint64_t *);
+
+int stripe_xfer_open_send(struct stripe_xfer *, const char *);
+
+int stripe_xfer_open_recv(struct stripe_xfer *, const char *, uint64_t);
+
+int stripe_xfer_close(struct stripe_xfer *);
+
+uint8_t * stripe_buf_alloc();
+
+void stripe_conn_init(struct stripe_conn *, struct data_conn *, uint8_t *);
+
+void stripe_xfer_stats(const struct stripe_xfer *, const struct data_conn *, int, \
+	struct stripe_stats *);
+
+int stripe_send_pump(struct stripe_xfer *, struct stripe_conn *);
+
+int stripe_recv_pump(struct stripe_xfer *, struct stripe_conn *);
+
+int stripe_send_file(struct data_conn *, int, const char *);
+
+int stripe_recv_file(struct data_conn *, int, const char *, uint64_t, uint64_t *);
+
+#endif
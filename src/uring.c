@@ -0,0 +1,205 @@
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+
+/* A minimal io_uring, driven with the raw system calls so that nothing more
+ * than the kernel's headers is needed. It is meant for one thread that
+ * queues a few operations, submits them with the same system call that waits
+ * for the next completion, and reaps the completions one at a time. Anything
+ * that cannot be set up (an old kernel, io_uring turned off, a seccomp
+ * filter) makes 'uring_init()' fail, and the caller does its I/O the usual
+ * way. */
+
+
+/** Takes an io_uring and sets it up with room for 'entries' operations in
+ * flight.
+ *
+ * \param '*ring' the io_uring, which will be set up.
+ * \param 'entries' the number of submission queue entries, a power of 2.
+ * \return 0 on success, a negative int if the kernel cannot give this
+ *     process an io_uring.
+ */
+int uring_init(struct uring *ring, unsigned entries) {
+	/* {{{ */
+	struct io_uring_params p;
+	uint8_t *sq, *cq;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&p, 0, sizeof(p));
+	if ((ring->fd = syscall(SYS_io_uring_setup, entries, &p)) < 0) {
+		return -1;
+	}
+
+	ring->features = p.features;
+	ring->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	/* Since 5.4 both rings are in one mapping */
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_len > ring->sq_ring_len) {
+			ring->sq_ring_len = ring->cq_ring_len;
+		}
+		ring->cq_ring_len = 0;
+	}
+
+	sq = mmap(NULL, ring->sq_ring_len, PROT_READ | PROT_WRITE, \
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED) {
+		close(ring->fd);
+		return -1;
+	}
+	ring->sq_ring = sq;
+	cq = sq;
+	if (ring->cq_ring_len != 0) {
+		cq = mmap(NULL, ring->cq_ring_len, PROT_READ | PROT_WRITE, \
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED) {
+			munmap(sq, ring->sq_ring_len);
+			close(ring->fd);
+			return -1;
+		}
+		ring->cq_ring = cq;
+	}
+
+	ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, \
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		if (ring->cq_ring != NULL) munmap(ring->cq_ring, ring->cq_ring_len);
+		munmap(sq, ring->sq_ring_len);
+		close(ring->fd);
+		return -1;
+	}
+
+	ring->sq_head = (unsigned *) (sq + p.sq_off.head);
+	ring->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+	ring->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned *) (sq + p.sq_off.array);
+	ring->sq_entries = p.sq_entries;
+	ring->tail = *ring->sq_tail;
+	ring->cq_head = (unsigned *) (cq + p.cq_off.head);
+	ring->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+	ring->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+	return 0;
+	/* }}} */
+}
+
+
+/** Takes an io_uring and registers the 'n' buffers described by 'iovs' with
+ * it, so that the kernel pins them once rather than on every fixed read and
+ * write.
+ *
+ * \param '*ring' the io_uring.
+ * \param '*iovs' the buffers.
+ * \param 'n' the number of buffers.
+ * \return 0 on success, a negative int upon failure (for instance when the
+ *     buffers are more memory than the process may lock).
+ */
+int uring_register_buffers(struct uring *ring, const struct iovec *iovs, unsigned n) {
+	if (syscall(SYS_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iovs, n) < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+
+/** Takes an io_uring and returns a cleared submission queue entry for the
+ * caller to fill in, which goes to the kernel with the next
+ * 'uring_submit()', or NULL if the submission queue is full */
+struct io_uring_sqe * uring_get_sqe(struct uring *ring) {
+	unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	struct io_uring_sqe *sqe;
+
+	if (ring->tail - head >= ring->sq_entries) {
+		return NULL;
+	}
+
+	unsigned index = ring->tail & *ring->sq_mask;
+	sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_array[index] = index;
+	ring->tail++;
+
+	return sqe;
+}
+
+
+/** Takes an io_uring and hands the kernel every entry queued since the last
+ * call, then waits until at least 'wait_nr' operations have completed.
+ *
+ * \param '*ring' the io_uring.
+ * \param 'wait_nr' the number of completions to wait for, which may be 0.
+ * \return 0 on success, a negative int upon failure.
+ */
+int uring_submit(struct uring *ring, unsigned wait_nr) {
+	/* {{{ */
+	unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+
+	/* The entries must be filled in before the kernel can see them */
+	__atomic_store_n(ring->sq_tail, ring->tail, __ATOMIC_RELEASE);
+
+	while (1) {
+		unsigned pending = ring->tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+		int ret = syscall(SYS_io_uring_enter, ring->fd, pending, wait_nr, flags, NULL, 0);
+		ring->enters++;
+
+		/* The kernel may stop short of the last entry when it is short of
+		 * memory, and is handed the rest by the next call */
+		if (ret >= 0 && ((unsigned) ret >= pending || wait_nr == 0)) {
+			return 0;
+		}
+		if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+			return -1;
+		}
+	}
+	/* }}} */
+}
+
+
+/** Takes an io_uring and waits for the next operation to complete, handing
+ * the kernel anything still queued first.
+ *
+ * \param '*ring' the io_uring.
+ * \param '*user_data' will be modified to contain the 'user_data' of the
+ *     operation's submission queue entry.
+ * \param '*res' will be modified to contain what the operation returned:
+ *     what the system call it stands for would have, or the negated 'errno'.
+ * \return 0 on success, a negative int upon failure.
+ */
+int uring_wait(struct uring *ring, uint64_t *user_data, int32_t *res) {
+	/* {{{ */
+	while (1) {
+		unsigned head = *ring->cq_head;
+
+		if (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+			struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+
+			*user_data = cqe->user_data;
+			*res = cqe->res;
+			/* The kernel may reuse the entry once the head moves past it */
+			__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+			return 0;
+		}
+		if (0 != uring_submit(ring, 1)) {
+			return -1;
+		}
+	}
+	/* }}} */
+}
+
+
+/** Takes an io_uring with nothing in flight and frees it */
+void uring_exit(struct uring *ring) {
+	munmap(ring->sqes, ring->sqes_len);
+	if (ring->cq_ring != NULL) munmap(ring->cq_ring, ring->cq_ring_len);
+	munmap(ring->sq_ring, ring->sq_ring_len);
+	close(ring->fd);
+}
@@ -0,0 +1,46 @@
+#ifndef URING_HEADER
+#define URING_HEADER
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+
+/* Define a struct holding an io_uring instance set up with the raw system
+ * calls, and the parts of its shared rings this end reads and writes */
+struct uring {
+	int fd;
+	/* The kernel's 'IORING_FEAT_*' flags */
+	unsigned features;
+	/* The number of 'io_uring_enter()' calls made, for statistics */
+	uint64_t enters;
+	/* The submission queue: the kernel's head, and the tail, mask and index
+	 * array this end fills in */
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned sq_entries;
+	struct io_uring_sqe *sqes;
+	/* The tail of the submission queue, counting the entries taken with
+	 * 'uring_get_sqe()' that the kernel has not been shown yet */
+	unsigned tail;
+	/* The completion queue */
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	/* The mappings of the rings, to unmap them */
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_len, cq_ring_len, sqes_len;
+};
+
+
+int uring_init(struct uring *ring, unsigned entries);
+
+int uring_register_buffers(struct uring *ring, const struct iovec *iovs, unsigned n);
+
+struct io_uring_sqe * uring_get_sqe(struct uring *ring);
+
+int uring_submit(struct uring *ring, unsigned wait_nr);
+
+int uring_wait(struct uring *ring, uint64_t *user_data, int32_t *res);
+
+void uring_exit(struct uring *ring);
+
+#endif
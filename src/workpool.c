@@ -0,0 +1,159 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "workpool.h"
+
+
+/* A fixed set of threads that run the CPU-bound parts of commands
+ * (compression, encryption, key exchange) for an event loop, so that no
+ * session's work holds up the sockets of the others and no more threads are
+ * busy than there are cores. Finished jobs are handed back through an
+ * eventfd, which the event loop polls along with its sockets. */
+
+
+/* Define a struct representing a worker pool */
+struct work_pool {
+	pthread_mutex_t lock;
+	/* Signalled when a job is queued */
+	pthread_cond_t queued;
+	/* The jobs waiting for a thread, oldest first */
+	struct work_job *head;
+	struct work_job *tail;
+	/* The finished jobs not yet taken, most recent first */
+	struct work_job *done;
+	/* Readable while there are finished jobs to take */
+	int eventfd;
+};
+
+
+static void *worker(void *arg) {
+	struct work_pool *pool = (struct work_pool *) arg;
+	uint64_t one = 1;
+
+	while (1) {
+		pthread_mutex_lock(&pool->lock);
+		while (pool->head == NULL) {
+			pthread_cond_wait(&pool->queued, &pool->lock);
+		}
+		struct work_job *job = pool->head;
+		pool->head = job->next;
+		if (pool->head == NULL) pool->tail = NULL;
+		pthread_mutex_unlock(&pool->lock);
+
+		job->run(job);
+
+		pthread_mutex_lock(&pool->lock);
+		job->next = pool->done;
+		pool->done = job;
+		pthread_mutex_unlock(&pool->lock);
+		if (write(pool->eventfd, &one, sizeof(one)) != sizeof(one)) {
+			fprintf(stderr, "ERROR: could not signal a finished job\n");
+		}
+	}
+
+	return NULL;
+}
+
+
+/** Creates a worker pool of 'nthreads' threads, which run until the process
+ * exits.
+ *
+ * \param 'nthreads' the number of threads, at least 1.
+ * \return a pointer to the pool, or NULL upon failure.
+ */
+struct work_pool * work_pool_create(int nthreads) {
+	/* {{{ */
+	struct work_pool *pool;
+	pthread_t thread;
+
+	if (nthreads < 1 || (pool = calloc(1, sizeof(struct work_pool))) == NULL) {
+		return NULL;
+	}
+	if ((pool->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+		free(pool);
+		return NULL;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->queued, NULL);
+
+	for (int i = 0; i < nthreads; i++) {
+		if (0 != pthread_create(&thread, NULL, worker, pool)) {
+			/* Threads that did start keep waiting on the pool, so it is not
+			 * freed */
+			fprintf(stderr, "ERROR: could not start worker thread %d\n", i);
+			return i > 0 ? pool : NULL;
+		}
+		pthread_detach(thread);
+	}
+
+	return pool;
+	/* }}} */
+}
+
+
+/** Takes a worker pool and queues a job to be run by the first of its threads
+ * that is free. The job must stay valid until it is handed back by
+ * 'work_pool_take_done()'.
+ *
+ * \param '*pool' the worker pool.
+ * \param '*job' the job.
+ * \return void.
+ */
+void work_pool_submit(struct work_pool *pool, struct work_job *job) {
+	job->next = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->tail != NULL) {
+		pool->tail->next = job;
+	} else {
+		pool->head = job;
+	}
+	pool->tail = job;
+	pthread_cond_signal(&pool->queued);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+
+/** Returns a file descriptor that polls readable while the worker pool
+ * 'pool' has finished jobs to be taken with 'work_pool_take_done()' */
+int work_pool_fd(struct work_pool *pool) {
+	return pool->eventfd;
+}
+
+
+/** Takes a worker pool and hands back every job it has finished since the
+ * last call, in the order they finished.
+ *
+ * \param '*pool' the worker pool.
+ * \return the first finished job, linked to the rest through 'next', or NULL
+ *     if there are none.
+ */
+struct work_job * work_pool_take_done(struct work_pool *pool) {
+	uint64_t count;
+	struct work_job *done, *ordered = NULL;
+
+	/* Reset the eventfd before taking the list, so that a job finishing in
+	 * between is either taken now or signals again */
+	if (read(pool->eventfd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+		fprintf(stderr, "WARNING: could not reset the worker pool's eventfd\n");
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	done = pool->done;
+	pool->done = NULL;
+	pthread_mutex_unlock(&pool->lock);
+
+	while (done != NULL) {
+		struct work_job *next = done->next;
+		done->next = ordered;
+		ordered = done;
+		done = next;
+	}
+
+	return ordered;
+}
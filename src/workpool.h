@@ -0,0 +1,27 @@
+#ifndef WORKPOOL_HEADER
+#define WORKPOOL_HEADER
+
+
+/* Define a struct representing a job for the worker pool. 'run' is called
+ * with the job on one of the pool's threads, and once it returns the job is
+ * handed back to the thread that polls the pool's file descriptor */
+struct work_job {
+	void (*run)(struct work_job *);
+	/* Whatever the submitter needs to pick up where it left off */
+	void *arg;
+	/* Used by the pool to queue the job */
+	struct work_job *next;
+};
+
+struct work_pool;
+
+
+struct work_pool * work_pool_create(int nthreads);
+
+void work_pool_submit(struct work_pool *pool, struct work_job *job);
+
+int work_pool_fd(struct work_pool *pool);
+
+struct work_job * work_pool_take_done(struct work_pool *pool);
+
+#endif
@@ -0,0 +1,304 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "x25519.h"
+
+
+/* X25519 (RFC 7748): Diffie-Hellman on the Montgomery form of Curve25519.
+ * Field elements of GF(2^255 - 19) are kept in 5 limbs of 51 bits, so that
+ * a product of two limbs (plus the sums of several such products) fits in
+ * 128 bits. The Montgomery ladder does the same operations for every bit of
+ * the scalar, and conditional swaps are done with masks, so the time taken
+ * does not depend on the private key. */
+
+
+typedef uint64_t fe[5];
+typedef unsigned __int128 uint128_t;
+
+#define MASK51 0x7ffffffffffffULL
+
+
+static uint64_t load64_le(const uint8_t *b) {
+	uint64_t v = 0;
+	for (int i = 7; i >= 0; i--) {
+		v = (v << 8) | b[i];
+	}
+	return v;
+}
+
+
+static void store64_le(uint8_t *b, uint64_t v) {
+	for (int i = 0; i < 8; i++) {
+		b[i] = v & 0xff;
+		v >>= 8;
+	}
+}
+
+
+/** Unpacks 32 little-endian bytes into a field element, ignoring the top
+ * bit as RFC 7748 requires */
+static void fe_frombytes(fe h, const uint8_t s[32]) {
+	h[0] = load64_le(&s[0]) & MASK51;
+	h[1] = (load64_le(&s[6]) >> 3) & MASK51;
+	h[2] = (load64_le(&s[12]) >> 6) & MASK51;
+	h[3] = (load64_le(&s[19]) >> 1) & MASK51;
+	h[4] = (load64_le(&s[24]) >> 12) & MASK51;
+}
+
+
+/** Packs a field element into 32 little-endian bytes, fully reduced modulo
+ * p = 2^255 - 19 */
+static void fe_tobytes(uint8_t s[32], const fe f) {
+	/* {{{ */
+	uint64_t t[5];
+	memcpy(t, f, sizeof(t));
+
+	/* Carry twice, leaving every limb below 2^51, so t < 2^255 */
+	for (int pass = 0; pass < 2; pass++) {
+		t[1] += t[0] >> 51; t[0] &= MASK51;
+		t[2] += t[1] >> 51; t[1] &= MASK51;
+		t[3] += t[2] >> 51; t[2] &= MASK51;
+		t[4] += t[3] >> 51; t[3] &= MASK51;
+		t[0] += 19 * (t[4] >> 51); t[4] &= MASK51;
+	}
+
+	/* Add 19: if t >= p, this carries out of bit 255 and the result (with
+	 * the carry dropped) is t - p. Otherwise, take the 19 back off by adding
+	 * 2^255 - 19 and dropping the carry */
+	t[0] += 19;
+	t[1] += t[0] >> 51; t[0] &= MASK51;
+	t[2] += t[1] >> 51; t[1] &= MASK51;
+	t[3] += t[2] >> 51; t[2] &= MASK51;
+	t[4] += t[3] >> 51; t[3] &= MASK51;
+	t[0] += 19 * (t[4] >> 51); t[4] &= MASK51;
+
+	t[0] += 0x8000000000000ULL - 19;
+	t[1] += 0x8000000000000ULL - 1;
+	t[2] += 0x8000000000000ULL - 1;
+	t[3] += 0x8000000000000ULL - 1;
+	t[4] += 0x8000000000000ULL - 1;
+	t[1] += t[0] >> 51; t[0] &= MASK51;
+	t[2] += t[1] >> 51; t[1] &= MASK51;
+	t[3] += t[2] >> 51; t[2] &= MASK51;
+	t[4] += t[3] >> 51; t[3] &= MASK51;
+	t[4] &= MASK51;
+
+	store64_le(&s[0], t[0] | (t[1] << 51));
+	store64_le(&s[8], (t[1] >> 13) | (t[2] << 38));
+	store64_le(&s[16], (t[2] >> 26) | (t[3] << 25));
+	store64_le(&s[24], (t[3] >> 39) | (t[4] << 12));
+	/* }}} */
+}
+
+
+static void fe_add(fe h, const fe f, const fe g) {
+	for (int i = 0; i < 5; i++) {
+		h[i] = f[i] + g[i];
+	}
+}
+
+
+/** h = f - g. Adds 2p first so that no limb goes negative, which holds as
+ * long as the limbs of 'g' come from a multiplication (and so are just over
+ * 51 bits at most) */
+static void fe_sub(fe h, const fe f, const fe g) {
+	h[0] = f[0] + 0xfffffffffffdaULL - g[0];
+	h[1] = f[1] + 0xffffffffffffeULL - g[1];
+	h[2] = f[2] + 0xffffffffffffeULL - g[2];
+	h[3] = f[3] + 0xffffffffffffeULL - g[3];
+	h[4] = f[4] + 0xffffffffffffeULL - g[4];
+}
+
+
+/** Carries the 128-bit limb products 'r' down into the limbs of 'h' */
+static void fe_carry(fe h, uint128_t r[5]) {
+	uint64_t c;
+
+	c = (uint64_t) (r[0] >> 51); r[1] += c; h[0] = (uint64_t) r[0] & MASK51;
+	c = (uint64_t) (r[1] >> 51); r[2] += c; h[1] = (uint64_t) r[1] & MASK51;
+	c = (uint64_t) (r[2] >> 51); r[3] += c; h[2] = (uint64_t) r[2] & MASK51;
+	c = (uint64_t) (r[3] >> 51); r[4] += c; h[3] = (uint64_t) r[3] & MASK51;
+	c = (uint64_t) (r[4] >> 51); h[4] = (uint64_t) r[4] & MASK51;
+	h[0] += c * 19;
+	h[1] += h[0] >> 51;
+	h[0] &= MASK51;
+}
+
+
+/** h = f * g. The limbs above 2^255 wrap around multiplied by 19, since
+ * 2^255 = 19 (mod p) */
+static void fe_mul(fe h, const fe f, const fe g) {
+	/* {{{ */
+	uint64_t g1_19 = 19 * g[1], g2_19 = 19 * g[2], g3_19 = 19 * g[3], g4_19 = 19 * g[4];
+	uint128_t r[5];
+
+	r[0] = (uint128_t) f[0] * g[0] + (uint128_t) f[1] * g4_19 + (uint128_t) f[2] * g3_19 \
+		+ (uint128_t) f[3] * g2_19 + (uint128_t) f[4] * g1_19;
+	r[1] = (uint128_t) f[0] * g[1] + (uint128_t) f[1] * g[0] + (uint128_t) f[2] * g4_19 \
+		+ (uint128_t) f[3] * g3_19 + (uint128_t) f[4] * g2_19;
+	r[2] = (uint128_t) f[0] * g[2] + (uint128_t) f[1] * g[1] + (uint128_t) f[2] * g[0] \
+		+ (uint128_t) f[3] * g4_19 + (uint128_t) f[4] * g3_19;
+	r[3] = (uint128_t) f[0] * g[3] + (uint128_t) f[1] * g[2] + (uint128_t) f[2] * g[1] \
+		+ (uint128_t) f[3] * g[0] + (uint128_t) f[4] * g4_19;
+	r[4] = (uint128_t) f[0] * g[4] + (uint128_t) f[1] * g[3] + (uint128_t) f[2] * g[2] \
+		+ (uint128_t) f[3] * g[1] + (uint128_t) f[4] * g[0];
+
+	fe_carry(h, r);
+	/* }}} */
+}
+
+
+static void fe_sq(fe h, const fe f) {
+	fe_mul(h, f, f);
+}
+
+
+/** h = f * 121665, the curve constant (A - 2) / 4 */
+static void fe_mul_a24(fe h, const fe f) {
+	uint128_t r[5];
+	for (int i = 0; i < 5; i++) {
+		r[i] = (uint128_t) f[i] * 121665;
+	}
+	fe_carry(h, r);
+}
+
+
+/** out = z^(p - 2) = 1 / z, using the addition chain from the reference
+ * implementation: 254 squarings and 11 multiplications */
+static void fe_invert(fe out, const fe z) {
+	/* {{{ */
+	fe z2, z9, z11, z2_5_0, z2_10_0, z2_20_0, z2_50_0, z2_100_0, t;
+	int i;
+
+	fe_sq(z2, z);
+	fe_sq(t, z2);
+	fe_sq(t, t);
+	fe_mul(z9, t, z);
+	fe_mul(z11, z9, z2);
+	fe_sq(t, z11);
+	fe_mul(z2_5_0, t, z9);
+
+	fe_sq(t, z2_5_0);
+	for (i = 1; i < 5; i++) fe_sq(t, t);
+	fe_mul(z2_10_0, t, z2_5_0);
+
+	fe_sq(t, z2_10_0);
+	for (i = 1; i < 10; i++) fe_sq(t, t);
+	fe_mul(z2_20_0, t, z2_10_0);
+
+	fe_sq(t, z2_20_0);
+	for (i = 1; i < 20; i++) fe_sq(t, t);
+	fe_mul(t, t, z2_20_0);
+
+	fe_sq(t, t);
+	for (i = 1; i < 10; i++) fe_sq(t, t);
+	fe_mul(z2_50_0, t, z2_10_0);
+
+	fe_sq(t, z2_50_0);
+	for (i = 1; i < 50; i++) fe_sq(t, t);
+	fe_mul(z2_100_0, t, z2_50_0);
+
+	fe_sq(t, z2_100_0);
+	for (i = 1; i < 100; i++) fe_sq(t, t);
+	fe_mul(t, t, z2_100_0);
+
+	fe_sq(t, t);
+	for (i = 1; i < 50; i++) fe_sq(t, t);
+	fe_mul(t, t, z2_50_0);
+
+	fe_sq(t, t);
+	for (i = 1; i < 5; i++) fe_sq(t, t);
+	fe_mul(out, t, z11);
+	/* }}} */
+}
+
+
+/** Swaps 'f' and 'g' if 'swap' is 1 and leaves them if it is 0, without
+ * branching on 'swap' */
+static void fe_cswap(fe f, fe g, uint64_t swap) {
+	uint64_t mask = 0 - swap;
+	for (int i = 0; i < 5; i++) {
+		uint64_t x = mask & (f[i] ^ g[i]);
+		f[i] ^= x;
+		g[i] ^= x;
+	}
+}
+
+
+/** Takes a private key (scalar) and a public key (u-coordinate) and computes
+ * their X25519 product, as in section 5 of RFC 7748.
+ *
+ * \param 'out' will be modified to contain the result.
+ * \param 'scalar' the private key. It is clamped as RFC 7748 requires, so any
+ *     32 random bytes can be used.
+ * \param 'point' the peer's public key, or the base point.
+ * \return void.
+ */
+void x25519(uint8_t out[X25519_KEY_LEN], const uint8_t scalar[X25519_KEY_LEN], \
+	const uint8_t point[X25519_KEY_LEN]) {
+	/* {{{ */
+	uint8_t e[32];
+	fe x1, x2, z2, x3, z3, a, aa, b, bb, ee, c, d, da, cb, t;
+	uint64_t swap = 0;
+
+	memcpy(e, scalar, sizeof(e));
+	e[0] &= 248;
+	e[31] &= 127;
+	e[31] |= 64;
+
+	fe_frombytes(x1, point);
+	memset(x2, 0, sizeof(fe)); x2[0] = 1;
+	memset(z2, 0, sizeof(fe));
+	memcpy(x3, x1, sizeof(fe));
+	memset(z3, 0, sizeof(fe)); z3[0] = 1;
+
+	for (int pos = 254; pos >= 0; pos--) {
+		uint64_t bit = (e[pos / 8] >> (pos & 7)) & 1;
+		swap ^= bit;
+		fe_cswap(x2, x3, swap);
+		fe_cswap(z2, z3, swap);
+		swap = bit;
+
+		fe_add(a, x2, z2);
+		fe_sq(aa, a);
+		fe_sub(b, x2, z2);
+		fe_sq(bb, b);
+		fe_sub(ee, aa, bb);
+		fe_add(c, x3, z3);
+		fe_sub(d, x3, z3);
+		fe_mul(da, d, a);
+		fe_mul(cb, c, b);
+		fe_add(t, da, cb);
+		fe_sq(x3, t);
+		fe_sub(t, da, cb);
+		fe_sq(t, t);
+		fe_mul(z3, x1, t);
+		fe_mul(x2, aa, bb);
+		fe_mul_a24(t, ee);
+		fe_add(t, aa, t);
+		fe_mul(z2, ee, t);
+	}
+	fe_cswap(x2, x3, swap);
+	fe_cswap(z2, z3, swap);
+
+	fe_invert(z2, z2);
+	fe_mul(x2, x2, z2);
+	fe_tobytes(out, x2);
+	/* }}} */
+}
+
+
+/** Takes a private key and computes the matching public key, its product
+ * with the base point u = 9.
+ *
+ * \param 'pub' will be modified to contain the public key.
+ * \param 'priv' the private key.
+ * \return void.
+ */
+void x25519_public_key(uint8_t pub[X25519_KEY_LEN], const uint8_t priv[X25519_KEY_LEN]) {
+	uint8_t base[X25519_KEY_LEN];
+
+	memset(base, 0, sizeof(base));
+	base[0] = 9;
+	x25519(pub, priv, base);
+}
@@ -0,0 +1,15 @@
+#ifndef X25519_HEADER
+#define X25519_HEADER
+#include <stdint.h>
+
+/* The number of bytes in an X25519 private key, public key and shared
+ * secret */
+#define X25519_KEY_LEN 32
+
+
+void x25519(uint8_t[X25519_KEY_LEN], const uint8_t[X25519_KEY_LEN], \
+	const uint8_t[X25519_KEY_LEN]);
+
+void x25519_public_key(uint8_t[X25519_KEY_LEN], const uint8_t[X25519_KEY_LEN]);
+
+#endif